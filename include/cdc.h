@@ -0,0 +1,117 @@
+#ifndef CDC_H
+#define CDC_H
+
+// Content-defined chunking (FastCDC with normalized chunking), shared by the client
+// and the server so both cut a file at the same places: an edit only changes the
+// chunks around it, every other chunk keeps its hash and is stored once.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CDC_MIN_SIZE (2 * 1024)
+#define CDC_AVG_SIZE (8 * 1024)
+#define CDC_MAX_SIZE (64 * 1024)    // must not exceed PROTO_MAX_BLOB
+
+// Harder to match below the average size, easier above it (15 and 11 bits, from the FastCDC paper)
+#define CDC_MASK_S 0x0003590703530000ULL
+#define CDC_MASK_L 0x0000d90003530000ULL
+
+typedef struct {
+    uint64_t fp;      // rolling gear fingerprint
+    size_t len;       // bytes of the current chunk seen so far
+} cdc_t;
+
+// Gear table: splitmix64 from the fixed seed 0x4d58434443 ("MXCDC"), client and server must agree
+static const uint64_t cdc_gear[256] = {
+    0x24501a6802f346a3ULL, 0xfe0f6b8e897af34fULL, 0xfd6715e4b73f9013ULL, 0x64ec96912e1059ecULL,
+    0x46cd239370dde1b1ULL, 0xbd157770618b8578ULL, 0x6014a2e928ecc675ULL, 0xcb69e35c24963c43ULL,
+    0x97eb1f1b42416057ULL, 0x5055a353b1990b97ULL, 0x5c9625ba1b26518eULL, 0xaabd5d33d081f87bULL,
+    0x15dd28c8fd6ef50bULL, 0x3b3d56b24d57a056ULL, 0x23694a84b1aa3b86ULL, 0xd1efc45e97d9116dULL,
+    0x29d2cbae98bc030aULL, 0x2460aee60bb64196ULL, 0x8374294e8ea47e02ULL, 0xdc509a1edbfb3788ULL,
+    0x9015ac0dc757b746ULL, 0x4a62bf9a9f7f0b00ULL, 0x9052ed222e514addULL, 0xfd8ebefd7afb27b0ULL,
+    0x3970599f1da4ee7aULL, 0x205ed6c63995a5e5ULL, 0xfef565bca255e138ULL, 0x53fd9eb8178538a7ULL,
+    0x8b577aa42d78c583ULL, 0x8f246b9565eef233ULL, 0xe3f0c66aaa4a2f1dULL, 0x6bf4cd9575497f43ULL,
+    0x8fbb27e820969188ULL, 0xe67ba7f851de52d4ULL, 0x98fb6c3a9ee7d4abULL, 0x4b09ac32e260b0baULL,
+    0xdaade8b000fd674dULL, 0x6f5e3f2765937805ULL, 0x1ef30d44714bf811ULL, 0x6e917f7c9a2b6b49ULL,
+    0xda9776d71bceba75ULL, 0x7e84c5348cec9230ULL, 0xcada70a1901b2497ULL, 0xb5efbb8bc71c6bb6ULL,
+    0x5c04081cc63ae035ULL, 0x6fb8ebe76ad1983eULL, 0x6a1de03e6df28eb7ULL, 0xdb964d996c8d7edcULL,
+    0x09658ef3727999bfULL, 0x9a612826423bb9eeULL, 0x2643fb41d2d2cc90ULL, 0x79e4b2502190dc0bULL,
+    0x7cfc99df375f316dULL, 0x67a314768883f32aULL, 0x0352444824623184ULL, 0x843c5a945caef04cULL,
+    0xa0b8bbd9c4011e2aULL, 0x701c2370632df9bdULL, 0xef8299492ddd4b0dULL, 0x0ddbb7b0278e5d6fULL,
+    0xc5458ac28e07124eULL, 0x2f80b03a1bc55771ULL, 0x639a2e86c7602092ULL, 0x7ff52b5f54e365daULL,
+    0x1b170ed71c4b5697ULL, 0xdfda5885e149379fULL, 0x99dc7f33968f8a9bULL, 0xea4f569ddf788012ULL,
+    0xab789d78914b1246ULL, 0x194fc60025fab4b6ULL, 0xf454cde3d4d8828aULL, 0x93665d838043ef7fULL,
+    0x286e974dae7fbea9ULL, 0x2347e179d03bf4fbULL, 0x9e3ec93c074f1c52ULL, 0xaa3de9f8ea826cb6ULL,
+    0xfe049f4aafa77d17ULL, 0x9182249119f383d2ULL, 0xf0580f30133afc72ULL, 0x38e7d077b7534427ULL,
+    0x83675bcb8474ac61ULL, 0x12b78140a75921d4ULL, 0x5f06af447acec2a6ULL, 0x63cfaebf01151e57ULL,
+    0xe730f1bed35d144dULL, 0x7bb54f657d5de8faULL, 0x6dd34020135aa727ULL, 0x73a83fc2d927e721ULL,
+    0xd7c7b5a47952d6c5ULL, 0x0cf0d0b653829111ULL, 0x79e54994bfccffdfULL, 0x29282189bfc488efULL,
+    0xda33b71523cabf34ULL, 0x5f93db816c00183dULL, 0xe7329b359934e64dULL, 0xd6f7d4c015ee95eeULL,
+    0x289a38c3a50df4efULL, 0x4356f91869fe52e7ULL, 0x0ee46e39dc81b2b4ULL, 0xecd7082fd5ab1295ULL,
+    0xcbfc7dc30041c235ULL, 0x38941ae70b11d4f4ULL, 0x3c8398963c691bd8ULL, 0xcc2a03e03095f945ULL,
+    0xe0b94abbf4e66eefULL, 0x01c7d095cad379c8ULL, 0xc09db94e52457d07ULL, 0x4021081b07339800ULL,
+    0x34ff80cd3ccd2d81ULL, 0xba8ca545d1c3d271ULL, 0x61791630b7027485ULL, 0x2763b846483b52ddULL,
+    0x4253d3f08b239de4ULL, 0x40e323f38c07cb77ULL, 0x48d798b88b90a315ULL, 0x9d48681cf850d13aULL,
+    0xc05a791493d3ea20ULL, 0x95640c27a9fc7540ULL, 0xca57ff60a50aae9aULL, 0x2ba8cdea10dfbc83ULL,
+    0x104bf11ab435cf76ULL, 0xdcf539d5bc385907ULL, 0x2e9a72747c584879ULL, 0xa7647fbd986d9ab3ULL,
+    0x88e4d59f26c76340ULL, 0xbbcc084cb742617bULL, 0x32b9ed0a45924135ULL, 0xf6967975f2b41e3dULL,
+    0xd2ffa2289ed7d919ULL, 0x1c9371b01a97a581ULL, 0xb3acc4663828e568ULL, 0x4bac17422e5668c3ULL,
+    0x376d90fbe1ff2973ULL, 0x63ae82713563d400ULL, 0x1aaa2b1c9455761fULL, 0xc0be7b902c7dc9ceULL,
+    0xdb87749ae28df807ULL, 0x3b70eecc526f0156ULL, 0xfd3a872818370429ULL, 0x5dfa7104f902147aULL,
+    0x1edf47c99bfda0deULL, 0x81ef5a52f9260ba4ULL, 0xa68851b3d184b5a8ULL, 0xed39ee3bf94dffb1ULL,
+    0xa5f3ca6cc25ed7b4ULL, 0xaaf448451992110eULL, 0x123c37556165a340ULL, 0x7969a7c6a49abb27ULL,
+    0xb22a7a8266441022ULL, 0xe84fcf2c7d5420b5ULL, 0x65ace63d96da714dULL, 0xbe122f02bd2389f5ULL,
+    0x8d5290e7239cba9cULL, 0x34cf08522d5dd697ULL, 0xd014a132a0badd50ULL, 0x22873e3a337e4575ULL,
+    0x9bb2d8ee35c7c6a2ULL, 0xe827cfaa9abd1ee3ULL, 0x6663b79c20bdd7e7ULL, 0x3e6aadbff9a395fcULL,
+    0x74b8ac252405ed86ULL, 0x183604e82dcffc76ULL, 0x649b645e6f2a2ce4ULL, 0x05e7deb5a2024455ULL,
+    0xa7ffa95441d5bd73ULL, 0x9d1b2c08299026c9ULL, 0x4c3542aaf25b8646ULL, 0xe2898d8b075e0734ULL,
+    0x10e59cbf76ac258cULL, 0xf51a29d092652d98ULL, 0xb03ec4eff0110f75ULL, 0x6c06afec7af9b62dULL,
+    0x091b3365922b987cULL, 0xda70b0e1279e5497ULL, 0xd54d0928cbc040e9ULL, 0x39b485b6756f583bULL,
+    0x3a28c08be8e95158ULL, 0x14edb1bc4864bda5ULL, 0x643cb18125521dafULL, 0x17a9c383afa1d53aULL,
+    0x5c60732694dd33c2ULL, 0x49994a12abeb4603ULL, 0xba3d3e9d3935ddb1ULL, 0x2324a44580d7f85aULL,
+    0x0d4209da65ec9a0fULL, 0xe6a208836a62530eULL, 0xa6905534635f36a2ULL, 0x2e38c9419c91ed44ULL,
+    0x1aa3ff5e5ad0c0edULL, 0x81767115bbf621b6ULL, 0x01f51300800d4b7eULL, 0xd1784a01b7161d3fULL,
+    0x6a0f68f1c9cf7ae8ULL, 0xc62de64b88d3b441ULL, 0x98530e8f6c5db06dULL, 0xd64039748850080eULL,
+    0xeee7a02a17fc6287ULL, 0xd2314322dda409d5ULL, 0x4b48e156a2e9445fULL, 0xd06019d5e439658dULL,
+    0xcd9eb1caaaa779b8ULL, 0x449bb0c620ea6ec2ULL, 0x9a74092e6201e30cULL, 0xa0ff3d61dce2c8dcULL,
+    0x786a5d6c09dd935fULL, 0x8dbff8c6cae23dc6ULL, 0xbab1d40fe2d85760ULL, 0x29d46c74938f31dbULL,
+    0x285f3e818d34ceb7ULL, 0x0363f3d6f87983a9ULL, 0x064ef4a61537ea66ULL, 0xdb896888baa79c41ULL,
+    0x9e385d52e61c7f07ULL, 0x7d6f543aa34ad2e5ULL, 0xdf55be5c1ace429bULL, 0xa21c1fd90a8b71a6ULL,
+    0x11e1f4117f3a37f8ULL, 0xa8c4ac0ab1361234ULL, 0xf63ec5b53fc44c87ULL, 0xd39827575083ea96ULL,
+    0x5010703b5fdd83e6ULL, 0xaf9747b010c44526ULL, 0x6ceec7824f59fd72ULL, 0x4c7325d861ffde9fULL,
+    0xc4440a0fd9e6476fULL, 0x48fa3ced75de036cULL, 0xc928ab0557cb5a84ULL, 0xdd478077eddb5986ULL,
+    0x7b26ca7e3012ead3ULL, 0x054bf788cffc51bbULL, 0xb971953e3e235ae7ULL, 0xd34cdca90ce6a959ULL,
+    0x6c3da42bdfff298aULL, 0x0c5a4ac142f14060ULL, 0xcd7c3e6a53e81bb8ULL, 0x79b122e407f84eabULL,
+    0xd809d6880578ff06ULL, 0xc3384f838f0eef60ULL, 0x3db6f846907be603ULL, 0x674c41e331cf5d07ULL,
+    0xaf09fb2c581753a3ULL, 0xd07d6acfebbcff68ULL, 0x49c4307c938ea5cfULL, 0xe9699397af0a0d3eULL,
+    0x32aec114fcccdf80ULL, 0x2f6d1a36fa97dc4dULL, 0x63185be5b997320fULL, 0x02042b7c682cae07ULL,
+    0x4e5d4a628dc24ecdULL, 0xd0a4b4a0efa5720dULL, 0x81c1075860ca0e81ULL, 0x1a8c558b56fe2920ULL,
+    0x9b50c8a09d4d67afULL, 0xba694e654be3c35aULL, 0xedcf88dac568d283ULL, 0x61e768b887f170fbULL,
+};
+
+// Feed the next bytes of a stream. Returns how many of them belong to the current
+// chunk; *cut is set when the chunk ends there (the state is then reset for the next).
+static inline size_t cdc_feed(cdc_t *cdc, const uint8_t *data, size_t len, int *cut) {
+    size_t i = 0;
+
+    // Nothing can be cut below the minimum, skip the fingerprint there
+    if (cdc->len < CDC_MIN_SIZE) {
+        size_t skip = CDC_MIN_SIZE - cdc->len < len ? CDC_MIN_SIZE - cdc->len : len;
+        cdc->len += skip;
+        i = skip;
+    }
+    for (; i < len; i++) {
+        cdc->fp = (cdc->fp << 1) + cdc_gear[data[i]];
+        size_t n = ++cdc->len;
+        if (!(cdc->fp & (n < CDC_AVG_SIZE ? CDC_MASK_S : CDC_MASK_L)) || n >= CDC_MAX_SIZE) {
+            cdc->fp = 0;
+            cdc->len = 0;
+            *cut = 1;
+            return i + 1;
+        }
+    }
+    *cut = 0;
+    return len;
+}
+
+#endif
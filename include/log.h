@@ -0,0 +1,25 @@
+#ifndef LOG_H
+#define LOG_H
+
+// Asynchronous log output, shared by the client and the server (src/common/log.c).
+// Every thread writes its lines into a ring buffer of its own (single producer, single
+// consumer, no lock) and one flusher thread empties all rings with a write() per batch.
+// The flusher sleeps on an eventfd while the rings are empty and the first line queued
+// after that wakes it. The timestamp is formatted at most once per second per thread.
+// A thread never waits for stdout or stderr: when its ring is full the line is dropped
+// and counted. Before log_start() and after log_stop() lines are written directly.
+
+#define LOG_RING_SIZE (64 * 1024)  // bytes of pending lines per thread
+#define LOG_MAX_RINGS 512          // threads logging at the same time; later ones write directly
+#define LOG_LINE_MAX (10 * 1024)   // longer lines are cut
+
+// Queue one line for fd (1 or 2); stamped lines get "[time] " in front and a newline
+void log_put(int fd, int stamped, const char *prefix, const char *message);
+
+// Start the flusher; until then, or if it cannot start, lines are written directly
+int log_start(void);
+
+// Flush what is queued and write directly from now on; registered with atexit()
+void log_stop(void);
+
+#endif
@@ -0,0 +1,303 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// MeshExchange wire protocol, shared by the client and the server.
+//
+// Every message is a frame: a fixed 16-byte header followed by `length` payload bytes.
+// All integers are big-endian.
+//
+//   0      2         3        4           8                16
+//   +------+---------+--------+-----------+----------------+
+//   | "MX" | version | opcode | stream_id |     length     |
+//   +------+---------+--------+-----------+----------------+
+//
+// The client picks a stream id per request and the server tags every reply with it,
+// so a client may send any number of requests back to back without waiting.
+// Requests on one connection are processed in the order they were sent.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define PROTO_MAGIC_0 'M'
+#define PROTO_MAGIC_1 'X'
+#define PROTO_VERSION 1
+
+#define PROTO_HEADER_SIZE 16
+#define PROTO_MAX_CONTROL (64 * 1024)  // largest payload of a frame that is not a file upload
+#define PROTO_MAX_NAME 255             // longest file name an UPLOAD may carry
+#define PROTO_MAX_CHUNK (1024 * 1024)  // largest content of one resumable upload CHUNK
+#define PROTO_MAX_STRIPES 65536        // most stripes one striped upload may be cut into
+#define PROTO_MAX_BLOB (64 * 1024)     // largest chunk a BLOB may carry
+#define PROTO_MAX_BATCH (4 * 1024 * 1024) // largest payload of a BATCH frame
+#define PROTO_MAX_BATCH_FILES 1024     // most files one BATCH may carry
+#define PROTO_MAX_DELTA (1024 * 1024)  // largest payload of a DELTA frame
+
+typedef enum {
+    // Client -> server
+    PROTO_OP_MESSAGE = 0x01,   // payload: UTF-8 text
+    PROTO_OP_UPLOAD  = 0x02,   // payload: upload meta, file name, the file bytes, optionally their SHA-256
+    PROTO_OP_RESUME  = 0x03,   // payload: resume meta, file name; answered with OFFSET
+    PROTO_OP_CHUNK   = 0x04,   // payload: chunk meta, then one chunk of a resumable upload
+    PROTO_OP_STRIPE  = 0x05,   // payload: stripe meta, file name, then the stripe content
+    PROTO_OP_DOWNLOAD = 0x06,  // payload: download meta, file name; answered with DATA
+    PROTO_OP_HAVE    = 0x07,   // payload: chunk hashes; answered with PRESENT
+    PROTO_OP_BLOB    = 0x08,   // payload: chunk hash, then the chunk itself
+    PROTO_OP_MANIFEST = 0x09,  // payload: manifest meta, file name, then one entry per chunk
+    PROTO_OP_KEY     = 0x0A,   // stream 0, payload: client X25519 public key; answered with SERVER_KEY
+    PROTO_OP_BATCH   = 0x0B,   // payload: batch meta, then one entry per file; answered with RESULTS
+    PROTO_OP_TEXT    = 0x0C,   // payload: UTF-8 text; acknowledged by ACK, no answer of its own
+    PROTO_OP_SIGNATURE = 0x0D, // payload: signature meta, file name; answered with SUMS
+    PROTO_OP_DELTA   = 0x0E,   // payload: delta meta, file name, then instructions rebuilding the file
+
+    // Server -> client
+    PROTO_OP_HELLO   = 0x80,   // stream 0, payload: greeting text
+    PROTO_OP_STATUS  = 0x81,   // payload: u16 status, then human readable text
+    PROTO_OP_OFFSET  = 0x82,   // payload: u64 bytes of a resumable upload already committed
+    PROTO_OP_DATA    = 0x83,   // payload: data meta, then the requested bytes of a file
+    PROTO_OP_PRESENT = 0x84,   // payload: one bit per HAVE hash (MSB first), set if the server stores it
+    PROTO_OP_SERVER_KEY = 0x85, // stream 0, payload: server X25519 public key
+    PROTO_OP_RESULTS = 0x86,   // payload: u32 count, then the u16 status of every BATCH entry
+    PROTO_OP_ACK     = 0x87,   // no payload: every TEXT up to its stream id was received
+    PROTO_OP_SUMS    = 0x88,   // payload: sums meta, then the checksums of a run of blocks
+} proto_opcode_t;
+
+typedef enum {
+    PROTO_STATUS_OK          = 0,
+    PROTO_STATUS_BAD_REQUEST = 1,  // malformed frame or unknown opcode, the connection is closed
+    PROTO_STATUS_BAD_VERSION = 2,  // the connection is closed
+    PROTO_STATUS_IO_ERROR    = 3,  // the server could not store the data
+    PROTO_STATUS_REJECTED    = 4,  // stream 0: turned away by admission control, the connection is closed
+    PROTO_STATUS_BAD_CHECKSUM = 5, // CHUNK content did not match its CRC or UPLOAD content its SHA-256, send it again
+    PROTO_STATUS_BUSY        = 6,  // the resumable upload is bound to another connection
+    PROTO_STATUS_NO_UPLOAD   = 7,  // CHUNK for an upload this connection did not RESUME
+    PROTO_STATUS_NOT_FOUND   = 8,  // DOWNLOAD of a file the server does not have
+    PROTO_STATUS_BAD_RANGE   = 9,  // DOWNLOAD offset lies past the end of the file
+    PROTO_STATUS_UNSUPPORTED = 10, // HAVE, BLOB or MANIFEST to a server without the dedup store
+    PROTO_STATUS_MISSING_CHUNK = 11, // MANIFEST names a chunk the server does not store
+    PROTO_STATUS_ENCRYPTION_REQUIRED = 12, // request before KEY to a server that only takes sealed sessions, the connection is closed
+} proto_status_t;
+
+typedef struct {
+    uint8_t version;
+    uint8_t opcode;
+    uint32_t stream_id;
+    uint64_t length;
+} proto_header_t;
+
+// UPLOAD payload starts with this, followed by name_len bytes of file name
+// and file_size bytes of content: length == PROTO_UPLOAD_META_SIZE + name_len + file_size.
+// The sender may close it with the SHA-256 of the content, hashed as it was sent:
+// length == PROTO_UPLOAD_META_SIZE + name_len + file_size + PROTO_HASH_SIZE. The server
+// then stores the file only if its own digest of what arrived matches.
+#define PROTO_UPLOAD_META_SIZE 10   // u64 file_size, u16 name_len
+
+// Resumable uploads are identified by a client chosen 64-bit id and cut into
+// chunk_size pieces (the last one may be shorter). RESUME binds the upload to the
+// connection and the server answers with the committed offset; the client sends
+// every chunk from there, each with its CRC-32C, and only resends rejected ones.
+#define PROTO_RESUME_META_SIZE 22   // u64 upload_id, u64 file_size, u32 chunk_size, u16 name_len
+#define PROTO_CHUNK_META_SIZE 20    // u64 upload_id, u64 offset, u32 crc32c
+
+// A striped upload sends one file as stripe_size pieces over several connections at
+// once. Stripe i covers [i * stripe_size, min((i + 1) * stripe_size, file_size)) and
+// is streamed like an UPLOAD: length == PROTO_STRIPE_META_SIZE + name_len + stripe length.
+// Every stripe is answered; the one that completes the file gets UPLOAD_SUCCESS.
+#define PROTO_STRIPE_META_SIZE 30   // u64 upload_id, u64 file_size, u64 stripe_size, u32 stripe_index, u16 name_len
+
+// DOWNLOAD asks for `length` bytes of a stored file from `offset` on; the range is cut
+// at the end of the file, so PROTO_DOWNLOAD_TO_END fetches the rest and a length of 0
+// only asks for the size. The answer is a DATA frame carrying the file size, the offset
+// and the bytes: length == PROTO_DATA_META_SIZE + bytes in range.
+#define PROTO_DOWNLOAD_META_SIZE 18  // u64 offset, u64 length, u16 name_len
+#define PROTO_DATA_META_SIZE 16      // u64 file_size, u64 offset
+#define PROTO_DOWNLOAD_TO_END UINT64_MAX
+
+// A server running the deduplicating store keeps files as lists of content-defined
+// chunks named by their SHA-256. The client cuts a file the same way (include/cdc.h),
+// asks with HAVE which chunks the server already stores, sends the others as BLOBs
+// and finally the MANIFEST listing every chunk of the file in order:
+// length == PROTO_MANIFEST_META_SIZE + name_len + chunk_count * PROTO_MANIFEST_ENTRY_SIZE.
+// A plain UPLOAD to such a server is cut and deduplicated on the server side.
+#define PROTO_HASH_SIZE 32
+#define PROTO_MANIFEST_META_SIZE 14   // u64 file_size, u32 chunk_count, u16 name_len
+#define PROTO_MANIFEST_ENTRY_SIZE 36  // chunk hash, u32 chunk length
+
+// BATCH carries many small files in one request, so a small-file workload pays for one
+// frame and one answer per batch instead of per file. Every entry is its meta, the name,
+// the content and the SHA-256 of the content; the entries fill the frame exactly:
+// length == PROTO_BATCH_META_SIZE + sum of (PROTO_BATCH_ENTRY_META_SIZE + name_len + file_size
+// + PROTO_HASH_SIZE), at most PROTO_MAX_BATCH. Each file is stored as if it had been
+// UPLOADed; the RESULTS answer lists a status per entry in the order they were sent.
+#define PROTO_BATCH_META_SIZE 4       // u32 entry_count
+#define PROTO_BATCH_ENTRY_META_SIZE 6 // u32 file_size, u16 name_len
+#define PROTO_RESULTS_META_SIZE 4     // u32 entry_count
+
+// Encrypted sessions: after the HELLO the client sends KEY with a fresh X25519 public key
+// as its only request and waits; the server answers SERVER_KEY with its own. Both derive
+// the session keys from the shared secret (include/record.h) and from then on every byte,
+// in both directions, travels in sealed records instead of bare frames:
+//
+//   0          4                 4 + len      4 + len + 16
+//   +----------+-----------------+------------+
+//   | u32 len  | AES-256-GCM     | GCM tag    |
+//   |          | ciphertext      |            |
+//   +----------+-----------------+------------+
+//
+// The plaintext of consecutive records is the usual frame stream, a frame may span records.
+// Senders fill records up to PROTO_RECORD_MAX and only send a shorter one when they have
+// nothing more queued. The nonce is the direction's IV xor the record sequence number, the
+// length field is authenticated as additional data. Keys are ephemeral and the peers are not
+// authenticated: this keeps transfers private from passive observers, not from a relay.
+#define PROTO_KEY_SIZE 32             // X25519 public key
+#define PROTO_RECORD_MAX (16 * 1024)  // plaintext bytes per record
+#define PROTO_RECORD_HEAD 4           // u32 len
+#define PROTO_RECORD_TAG 16
+
+// A delta upload resends only what changed in a file the server already stores, the way
+// rsync does. SIGNATURE asks for the checksums of the server's copy cut into block_size
+// blocks (the last one may be shorter). The server may raise the block size to keep the
+// file under PROTO_MAX_DELTA_BLOCKS blocks and answers with SUMS frames on the stream,
+// in order, until all of them are covered; an empty file gets one SUMS without blocks.
+// Every block has its rolling checksum (proto_rolling_sum) and its SHA-256.
+//
+// The client rolls a block-sized window over its file to find those blocks and sends the
+// new file as DELTA frames of instructions: copy a run of the server's blocks, or take
+// literal bytes. Every frame of one upload carries its stream id and the same meta, the
+// last (PROTO_DELTA_LAST) closes with the SHA-256 of the whole new file. The server
+// rebuilds the file aside and stores it like an UPLOAD. The upload is answered once: at
+// its first failure (the frames after it are skipped) or after the last frame. A copy of
+// the server's file that changed in between fails with PROTO_STATUS_BAD_CHECKSUM.
+#define PROTO_SIGNATURE_META_SIZE 6   // u32 block_size, u16 name_len
+#define PROTO_SUMS_META_SIZE 20       // u64 file_size, u32 block_size, u32 first_block, u32 block_count
+#define PROTO_SUMS_ENTRY_SIZE 36      // u32 rolling checksum, SHA-256
+#define PROTO_DELTA_META_SIZE 15      // u64 file_size, u32 block_size, u16 name_len, u8 flags
+#define PROTO_DELTA_LAST 0x01         // flags: the final frame of the upload
+#define PROTO_DELTA_COPY 0            // instruction: u8 op, u32 first_block, u32 block_count
+#define PROTO_DELTA_DATA 1            // instruction: u8 op, u32 len, then len literal bytes
+#define PROTO_MAX_DELTA_BLOCK (1024 * 1024) // largest block size
+#define PROTO_MAX_DELTA_BLOCKS (256 * 1024) // most blocks the server cuts its copy into
+
+// TEXT is a MESSAGE without a reply of its own, for senders that stream many of them.
+// The server answers a run of TEXTs with one ACK tagged with the stream id of the last
+// one it took: it acknowledges every TEXT sent before it too, as stream ids only grow.
+// A sender keeps a window of TEXTs in flight and slides it on each ACK instead of
+// waiting a round trip per message.
+
+// STATUS payload starts with a u16 status code
+#define PROTO_STATUS_META_SIZE 2
+
+static inline void proto_put_u16(uint8_t *out, uint16_t value) {
+    out[0] = (uint8_t)(value >> 8);
+    out[1] = (uint8_t)value;
+}
+
+static inline void proto_put_u32(uint8_t *out, uint32_t value) {
+    for (int i = 3; i >= 0; i--, value >>= 8) out[i] = (uint8_t)value;
+}
+
+static inline void proto_put_u64(uint8_t *out, uint64_t value) {
+    for (int i = 7; i >= 0; i--, value >>= 8) out[i] = (uint8_t)value;
+}
+
+static inline uint16_t proto_get_u16(const uint8_t *in) {
+    return (uint16_t)((in[0] << 8) | in[1]);
+}
+
+static inline uint32_t proto_get_u32(const uint8_t *in) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value = (value << 8) | in[i];
+    return value;
+}
+
+static inline uint64_t proto_get_u64(const uint8_t *in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value = (value << 8) | in[i];
+    return value;
+}
+
+// Serialize a frame header for `opcode` into out[PROTO_HEADER_SIZE]
+static inline void proto_header_encode(uint8_t *out, uint8_t opcode, uint32_t stream_id, uint64_t length) {
+    out[0] = PROTO_MAGIC_0;
+    out[1] = PROTO_MAGIC_1;
+    out[2] = PROTO_VERSION;
+    out[3] = opcode;
+    proto_put_u32(out + 4, stream_id);
+    proto_put_u64(out + 8, length);
+}
+
+// Parse in[PROTO_HEADER_SIZE]; -1 if it is not a MeshExchange frame.
+// The version is returned as sent, callers decide what they accept.
+static inline int proto_header_decode(const uint8_t *in, proto_header_t *header) {
+    if (in[0] != PROTO_MAGIC_0 || in[1] != PROTO_MAGIC_1) {
+        return -1;
+    }
+    header->version = in[2];
+    header->opcode = in[3];
+    header->stream_id = proto_get_u32(in + 4);
+    header->length = proto_get_u64(in + 8);
+    return 0;
+}
+
+// Build the header and meta of an UPLOAD frame into out; returns the bytes written
+// (the name follows them, then the file content and, if hashed, its SHA-256)
+static inline size_t proto_upload_encode(uint8_t *out, uint32_t stream_id, const char *name, uint64_t file_size, int hashed) {
+    size_t name_len = strlen(name);
+    proto_header_encode(out, PROTO_OP_UPLOAD, stream_id,
+                        PROTO_UPLOAD_META_SIZE + name_len + file_size + (hashed ? PROTO_HASH_SIZE : 0));
+    proto_put_u64(out + PROTO_HEADER_SIZE, file_size);
+    proto_put_u16(out + PROTO_HEADER_SIZE + 8, (uint16_t)name_len);
+    memcpy(out + PROTO_HEADER_SIZE + PROTO_UPLOAD_META_SIZE, name, name_len);
+    return PROTO_HEADER_SIZE + PROTO_UPLOAD_META_SIZE + name_len;
+}
+
+// Rolling checksum of a delta block (rsync's): the byte sum and the position-weighted
+// byte sum, each mod 2^16, in the low and high half
+static inline uint32_t proto_rolling_sum(const uint8_t *p, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += p[i];
+        b += (uint32_t)(len - i) * p[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+// Slide the window of a len-byte block by one byte: `out` leaves it, `in` enters
+static inline uint32_t proto_rolling_roll(uint32_t sum, size_t len, uint8_t out, uint8_t in) {
+    uint32_t a = ((sum & 0xFFFF) - out + in) & 0xFFFF;
+    uint32_t b = ((sum >> 16) - (uint32_t)len * out + a) & 0xFFFF;
+    return a | (b << 16);
+}
+
+// CRC-32C (Castagnoli) of a buffer, as carried by CHUNK frames
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static inline uint32_t proto_crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    while (len--) crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+#endif
+
+static inline uint32_t proto_crc32c(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t crc = 0xFFFFFFFFu;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~proto_crc32c_sse42(crc, p, len);
+    }
+#endif
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1u)));
+    }
+    return ~crc;
+}
+
+#endif
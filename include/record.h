@@ -0,0 +1,166 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+// Sealed record layer of encrypted sessions (see the KEY handshake in protocol.h), shared by
+// the client and the server. AES-256-GCM through OpenSSL EVP, which uses AES-NI and
+// carry-less multiply where the CPU has them. Link with -lcrypto.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+
+#include "protocol.h"
+
+#define RECORD_IV_SIZE 12
+#define RECORD_KEY_SIZE 32
+#define RECORD_SIZE(len) (PROTO_RECORD_HEAD + (len) + PROTO_RECORD_TAG)
+
+// One direction of a session: the cipher keeps its key schedule, only the nonce changes per record
+typedef struct {
+    EVP_CIPHER_CTX *ctx;
+    uint8_t iv[RECORD_IV_SIZE];
+    uint64_t seq;         // records sealed or opened so far
+} record_dir_t;
+
+typedef struct {
+    record_dir_t tx;
+    record_dir_t rx;
+} record_keys_t;
+
+// Fresh X25519 key pair for one handshake; pub receives the public half. NULL on failure.
+static inline EVP_PKEY *record_keygen(uint8_t pub[PROTO_KEY_SIZE]) {
+    EVP_PKEY *key = NULL;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL);
+    size_t pub_len = PROTO_KEY_SIZE;
+
+    if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0 || EVP_PKEY_keygen(ctx, &key) <= 0
+        || EVP_PKEY_get_raw_public_key(key, pub, &pub_len) <= 0 || pub_len != PROTO_KEY_SIZE) {
+        EVP_PKEY_free(key);
+        key = NULL;
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+}
+
+static inline int record_dir_init(record_dir_t *dir, const uint8_t *key, const uint8_t *iv, int encrypt) {
+    dir->seq = 0;
+    memcpy(dir->iv, iv, RECORD_IV_SIZE);
+    dir->ctx = EVP_CIPHER_CTX_new();
+    if (!dir->ctx) {
+        return -1;
+    }
+    int ok = encrypt ? EVP_EncryptInit_ex(dir->ctx, EVP_aes_256_gcm(), NULL, key, NULL)
+                     : EVP_DecryptInit_ex(dir->ctx, EVP_aes_256_gcm(), NULL, key, NULL);
+    return ok ? 0 : -1;
+}
+
+static inline void record_keys_free(record_keys_t *keys) {
+    EVP_CIPHER_CTX_free(keys->tx.ctx);
+    EVP_CIPHER_CTX_free(keys->rx.ctx);
+    keys->tx.ctx = keys->rx.ctx = NULL;
+}
+
+// Derive the session keys from our key pair and the peer's public key. Both sides feed the
+// same client/server public keys; is_server picks which derived direction is ours to send.
+static inline int record_keys_derive(record_keys_t *keys, EVP_PKEY *own, const uint8_t *peer_pub,
+                                     const uint8_t *client_pub, const uint8_t *server_pub, int is_server) {
+    static const char salt[] = "MeshExchange record v1";
+    uint8_t secret[32];
+    size_t secret_len = sizeof(secret);
+    uint8_t info[PROTO_KEY_SIZE * 2];
+    // client->server key and IV, then server->client key and IV
+    uint8_t okm[(RECORD_KEY_SIZE + RECORD_IV_SIZE) * 2];
+    size_t okm_len = sizeof(okm);
+    int rc = -1;
+
+    memset(keys, 0, sizeof(*keys));
+    EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, peer_pub, PROTO_KEY_SIZE);
+    EVP_PKEY_CTX *dh = peer ? EVP_PKEY_CTX_new(own, NULL) : NULL;
+    EVP_PKEY_CTX *kdf = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    memcpy(info, client_pub, PROTO_KEY_SIZE);
+    memcpy(info + PROTO_KEY_SIZE, server_pub, PROTO_KEY_SIZE);
+
+    // OpenSSL refuses peer keys that would give an all-zero secret
+    if (dh && kdf && EVP_PKEY_derive_init(dh) > 0 && EVP_PKEY_derive_set_peer(dh, peer) > 0
+        && EVP_PKEY_derive(dh, secret, &secret_len) > 0
+        && EVP_PKEY_derive_init(kdf) > 0 && EVP_PKEY_CTX_set_hkdf_md(kdf, EVP_sha256()) > 0
+        && EVP_PKEY_CTX_set1_hkdf_salt(kdf, (const unsigned char *)salt, sizeof(salt) - 1) > 0
+        && EVP_PKEY_CTX_set1_hkdf_key(kdf, secret, (int)secret_len) > 0
+        && EVP_PKEY_CTX_add1_hkdf_info(kdf, info, sizeof(info)) > 0
+        && EVP_PKEY_derive(kdf, okm, &okm_len) > 0 && okm_len == sizeof(okm)) {
+        const uint8_t *c2s = okm;
+        const uint8_t *s2c = okm + RECORD_KEY_SIZE + RECORD_IV_SIZE;
+        const uint8_t *tx = is_server ? s2c : c2s;
+        const uint8_t *rx = is_server ? c2s : s2c;
+        rc = record_dir_init(&keys->tx, tx, tx + RECORD_KEY_SIZE, 1) == 0
+          && record_dir_init(&keys->rx, rx, rx + RECORD_KEY_SIZE, 0) == 0 ? 0 : -1;
+    }
+    if (rc == -1) {
+        record_keys_free(keys);
+    }
+    memset(secret, 0, sizeof(secret));
+    memset(okm, 0, sizeof(okm));
+    EVP_PKEY_CTX_free(kdf);
+    EVP_PKEY_CTX_free(dh);
+    EVP_PKEY_free(peer);
+    return rc;
+}
+
+static inline void record_nonce(const record_dir_t *dir, uint8_t nonce[RECORD_IV_SIZE]) {
+    memcpy(nonce, dir->iv, RECORD_IV_SIZE);
+    for (int i = 0; i < 8; i++) {
+        nonce[RECORD_IV_SIZE - 1 - i] ^= (uint8_t)(dir->seq >> (8 * i));
+    }
+}
+
+// Seal len (at most PROTO_RECORD_MAX) plaintext bytes into the record at out, which must hold
+// RECORD_SIZE(len) bytes. `in` may be out + PROTO_RECORD_HEAD to seal in place. 0 on success.
+static inline int record_seal(record_dir_t *dir, uint8_t *out, const uint8_t *in, size_t len) {
+    uint8_t nonce[RECORD_IV_SIZE];
+    int n;
+
+    proto_put_u32(out, (uint32_t)len);
+    record_nonce(dir, nonce);
+    uint8_t *body = out + PROTO_RECORD_HEAD;
+    if (!EVP_EncryptInit_ex(dir->ctx, NULL, NULL, NULL, nonce)
+        || !EVP_EncryptUpdate(dir->ctx, NULL, &n, out, PROTO_RECORD_HEAD)
+        || !EVP_EncryptUpdate(dir->ctx, body, &n, in, (int)len)
+        || !EVP_EncryptFinal_ex(dir->ctx, body + len, &n)
+        || !EVP_CIPHER_CTX_ctrl(dir->ctx, EVP_CTRL_GCM_GET_TAG, PROTO_RECORD_TAG, body + len)) {
+        return -1;
+    }
+    dir->seq++;
+    return 0;
+}
+
+// Plaintext length announced by a record head; larger than PROTO_RECORD_MAX means a broken stream
+static inline size_t record_length(const uint8_t *head) {
+    return proto_get_u32(head);
+}
+
+// Open the complete record at rec in place, its plaintext is then at rec + PROTO_RECORD_HEAD.
+// -1 if it was forged, damaged or replayed out of order.
+static inline int record_open(record_dir_t *dir, uint8_t *rec) {
+    uint8_t nonce[RECORD_IV_SIZE];
+    size_t len = record_length(rec);
+    uint8_t *body = rec + PROTO_RECORD_HEAD;
+    int n;
+
+    if (len > PROTO_RECORD_MAX) {
+        return -1;
+    }
+    record_nonce(dir, nonce);
+    if (!EVP_DecryptInit_ex(dir->ctx, NULL, NULL, NULL, nonce)
+        || !EVP_DecryptUpdate(dir->ctx, NULL, &n, rec, PROTO_RECORD_HEAD)
+        || !EVP_DecryptUpdate(dir->ctx, body, &n, body, (int)len)
+        || !EVP_CIPHER_CTX_ctrl(dir->ctx, EVP_CTRL_GCM_SET_TAG, PROTO_RECORD_TAG, body + len)
+        || EVP_DecryptFinal_ex(dir->ctx, body + len, &n) <= 0) {
+        return -1;
+    }
+    dir->seq++;
+    return 0;
+}
+
+#endif
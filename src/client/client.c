@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,88 +9,668 @@
 #include <errno.h>
 #include <sys/stat.h> // For stat
 #include <fcntl.h>    // For file operations
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <dirent.h>
+#include <search.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "../../include/protocol.h"
+#include "../../include/cdc.h"
+#include "../../include/record.h"
+#include "../../include/log.h"
 
 #define BUFFER_SIZE 4096       // Increased buffer size for file transfer efficiency
 #define SMALL_BUF_SIZE 256     // For regular messages and log_buf
 #define MAX_RETRY_ATTEMPTS 10
 #define RETRY_DELAY_SEC 3
+#define PIPELINE_WINDOW 64     // requests sent ahead of their replies, the most --window allows
+#define TEXT_WINDOW 4096       // messages sent ahead of their acknowledgement
+#define RESUME_CHUNK_SIZE (256 * 1024) // checksummed unit of a resumable upload
+#define DEFAULT_STRIPE_CONNECTIONS 4
+#define MAX_STRIPE_CONNECTIONS 64
+#define DOWNLOAD_MIN_RANGE (1024 * 1024) // smaller downloads are not split over connections
+#define HAVE_BATCH (PROTO_MAX_CONTROL / PROTO_HASH_SIZE) // hashes asked about per HAVE frame
+#define SECURE_MAX_SOCKETS 1024 // descriptors below this can carry an encrypted session
+#define SECURE_RX_RECORDS 4     // sealed records one read can take in
+#define SEND_READ_WINDOW (1024 * 1024) // file bytes read at a time when they are hashed or sealed
+#define PIPE_CHUNK_RECORDS 16  // records in one chunk of the upload pipeline
+#define PIPE_CHUNK_BYTES (PIPE_CHUNK_RECORDS * PROTO_RECORD_MAX)
+#define PIPE_CHUNKS_PER_WORKER 4 // chunks in flight for each seal worker
+#define PIPE_MAX_WORKERS 16
+#define PIPE_RING_SIZE (PIPE_MAX_WORKERS * PIPE_CHUNKS_PER_WORKER + 1) // every chunk and an end marker fit
+#define PIPE_MIN_SIZE (4 * 1024 * 1024) // smaller encrypted uploads are sealed inline
+#define DELTA_MIN_BLOCK 2048  // block sizes a delta upload asks for, by the size of the file
+#define DELTA_MAX_BLOCK (128 * 1024)
+#define DELTA_BUCKET(sum) (((sum) ^ ((sum) >> 16)) * 2654435761u) // index of a rolling checksum
+#define EXIT_PUT_PARTIAL 2      // --put: some files were not stored
+#define EXIT_PUT_SESSION 3      // --put: no session with the server, or it broke off
 
 // Function to print timestamped messages
 void log_info(const char *message) {
-    time_t now = time(NULL);
-    char time_buf[64];
-    strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    fprintf(stdout, "[%s] %s\n", time_buf, message);
-    fflush(stdout);
+    log_put(1, 1, "", message);
 }
 
 // Function to print timestamped errors
 void log_error(const char *message) {
-    time_t now = time(NULL);
-    char time_buf[64];
-    strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    fprintf(stderr, "[%s] Error: %s\n", time_buf, message);
-    fflush(stderr);
-}
-
-// Helper to send a message and wait for a single line response
-char* send_command_and_get_response(int sock_fd, const char* command, char* response_buffer, size_t buffer_size) {
-    if (send(sock_fd, command, strlen(command), 0) == -1) {
-        log_error("Failed to send command to server.");
-        perror("send");
-        return NULL;
+    log_put(2, 1, "Error: ", message);
+}
+
+// perror() through the log, so transfer threads never wait on the terminal
+static void log_perror(const char *message) {
+    char err_buf[SMALL_BUF_SIZE];
+    char line[SMALL_BUF_SIZE * 2];
+    snprintf(line, sizeof(line), "%s: %s\n", message, strerror_r(errno, err_buf, sizeof(err_buf)));
+    log_put(2, 0, "", line);
+}
+
+// Write the whole buffer to the socket as it is, retrying short writes
+static int send_raw(int sock_fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t sent = send(sock_fd, p, len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += sent;
+        len -= (size_t)sent;
     }
-    memset(response_buffer, 0, buffer_size);
-    ssize_t bytes_read = recv(sock_fd, response_buffer, buffer_size - 1, 0);
-    if (bytes_read <= 0) {
-        if (bytes_read == -1) {
-            log_error("Error receiving response from server.");
-            perror("recv");
+    return 0;
+}
+
+static int g_encrypt = 0;           // --encrypt: every connection runs the KEY handshake first
+static int g_verify = 1;            // UPLOADs close with the SHA-256 of their content (--no-verify: not)
+static int g_seal_workers = 0;      // --seal-workers: threads sealing large uploads, 0 picks by CPU count
+
+// Sealed state of an encrypted connection. A socket is only ever used by one thread.
+typedef struct {
+    record_keys_t keys;
+    uint8_t tx[RECORD_SIZE(PROTO_RECORD_MAX)];   // record being filled, plaintext after its head
+    size_t tx_len;
+    uint8_t rx[SECURE_RX_RECORDS * RECORD_SIZE(PROTO_RECORD_MAX)]; // sealed input
+    size_t rx_len;
+    size_t rx_off;                  // first record not opened yet
+    size_t plain_off;               // plaintext of the last opened record not handed out yet
+    size_t plain_end;
+} secure_t;
+
+static secure_t *g_secure[SECURE_MAX_SOCKETS]; // by socket, NULL for plain connections
+
+static secure_t *secure_of(int sock_fd) {
+    return sock_fd >= 0 && sock_fd < SECURE_MAX_SOCKETS ? g_secure[sock_fd] : NULL;
+}
+
+// Seal the partly filled record and send it
+static int secure_flush(int sock_fd) {
+    secure_t *sec = secure_of(sock_fd);
+    if (!sec || sec->tx_len == 0) {
+        return 0;
+    }
+    size_t len = sec->tx_len;
+    sec->tx_len = 0;
+    if (record_seal(&sec->keys.tx, sec->tx, sec->tx + PROTO_RECORD_HEAD, len) == -1) {
+        log_error("Failed to seal record.");
+        return -1;
+    }
+    return send_raw(sock_fd, sec->tx, RECORD_SIZE(len));
+}
+
+// Send the whole buffer. On an encrypted connection it is cut into full records, each sent
+// as soon as it is sealed so the kernel transmits it while the next one is sealed; the last
+// partial record goes out with secure_flush() before the next wait for an answer.
+static int send_all(int sock_fd, const void *data, size_t len) {
+    secure_t *sec = secure_of(sock_fd);
+    if (!sec) {
+        return send_raw(sock_fd, data, len);
+    }
+    const uint8_t *p = data;
+    while (len > 0) {
+        if (sec->tx_len == 0 && len >= PROTO_RECORD_MAX) {
+            // A whole record sealed straight from the caller's buffer
+            if (record_seal(&sec->keys.tx, sec->tx, p, PROTO_RECORD_MAX) == -1
+                || send_raw(sock_fd, sec->tx, RECORD_SIZE(PROTO_RECORD_MAX)) == -1) {
+                return -1;
+            }
+            p += PROTO_RECORD_MAX;
+            len -= PROTO_RECORD_MAX;
+            continue;
+        }
+        size_t n = PROTO_RECORD_MAX - sec->tx_len;
+        if (n > len) n = len;
+        memcpy(sec->tx + PROTO_RECORD_HEAD + sec->tx_len, p, n);
+        sec->tx_len += n;
+        p += n;
+        len -= n;
+        if (sec->tx_len == PROTO_RECORD_MAX && secure_flush(sock_fd) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// recv() for every connection. On an encrypted one records are opened and their plaintext
+// handed out; what is still queued for sending is flushed first, an answer is awaited.
+static ssize_t sock_recv(int sock_fd, void *buf, size_t len, int flags) {
+    secure_t *sec = secure_of(sock_fd);
+    if (!sec) {
+        return recv(sock_fd, buf, len, flags);
+    }
+    if (secure_flush(sock_fd) == -1) {
+        return -1;
+    }
+
+    while (sec->plain_off == sec->plain_end) {
+        size_t avail = sec->rx_len - sec->rx_off;
+        if (avail >= PROTO_RECORD_HEAD) {
+            size_t rec_len = record_length(sec->rx + sec->rx_off);
+            if (rec_len > PROTO_RECORD_MAX) {
+                log_error("Malformed record from server.");
+                errno = EPROTO;
+                return -1;
+            }
+            if (avail >= RECORD_SIZE(rec_len)) {
+                if (record_open(&sec->keys.rx, sec->rx + sec->rx_off) == -1) {
+                    log_error("Record from server failed authentication.");
+                    errno = EPROTO;
+                    return -1;
+                }
+                sec->plain_off = sec->rx_off + PROTO_RECORD_HEAD;
+                sec->plain_end = sec->plain_off + rec_len;
+                sec->rx_off += RECORD_SIZE(rec_len);
+                continue;
+            }
+        }
+        // Keep the incomplete record at the front so a whole one always fits
+        memmove(sec->rx, sec->rx + sec->rx_off, avail);
+        sec->rx_len = avail;
+        sec->rx_off = 0;
+        sec->plain_off = sec->plain_end = 0;
+        ssize_t got = recv(sock_fd, sec->rx + sec->rx_len, sizeof(sec->rx) - sec->rx_len, flags);
+        if (got <= 0) {
+            return got;
+        }
+        sec->rx_len += (size_t)got;
+    }
+
+    size_t n = sec->plain_end - sec->plain_off;
+    if (n > len) n = len;
+    memcpy(buf, sec->rx + sec->plain_off, n);
+    sec->plain_off += n;
+    return (ssize_t)n;
+}
+
+// Input already read off an encrypted connection and not handed out yet; poll() cannot see it
+static int sock_pending(int sock_fd) {
+    secure_t *sec = secure_of(sock_fd);
+    if (!sec) {
+        return 0;
+    }
+    size_t avail = sec->rx_len - sec->rx_off;
+    return sec->plain_off < sec->plain_end
+        || (avail >= PROTO_RECORD_HEAD && avail >= RECORD_SIZE(record_length(sec->rx + sec->rx_off)));
+}
+
+static void sock_close(int sock_fd) {
+    secure_t *sec = secure_of(sock_fd);
+    if (sec) {
+        record_keys_free(&sec->keys);
+        free(sec);
+        g_secure[sock_fd] = NULL;
+    }
+    close(sock_fd);
+}
+
+// Receive exactly len bytes; -1 on error or EOF
+static int recv_all(int sock_fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t got = sock_recv(sock_fd, p, len, 0);
+        if (got == -1 && errno == EINTR) continue;
+        if (got <= 0) return -1;
+        p += got;
+        len -= (size_t)got;
+    }
+    return 0;
+}
+
+// Read one reply frame on a stripe connection. Stripe workers run on their own
+// threads and sockets, so they do not share g_rx_buf with the session.
+static int recv_frame(int sock_fd, proto_header_t *header, uint8_t *payload, size_t cap) {
+    uint8_t head[PROTO_HEADER_SIZE];
+    if (recv_all(sock_fd, head, sizeof(head)) == -1 || proto_header_decode(head, header) == -1 || header->length > cap) {
+        return -1;
+    }
+    return recv_all(sock_fd, payload, (size_t)header->length);
+}
+
+// Run the KEY handshake on a connection that has just been greeted; from then on
+// everything on it is sealed. -1 if the server cannot or will not encrypt.
+static int secure_handshake(int sock_fd) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    uint8_t frame[PROTO_HEADER_SIZE + PROTO_KEY_SIZE];
+    uint8_t reply[PROTO_STATUS_META_SIZE + SMALL_BUF_SIZE]; // SERVER_KEY, or the status refusing it
+    uint8_t *client_pub = frame + PROTO_HEADER_SIZE;
+    proto_header_t header;
+
+    if (sock_fd >= SECURE_MAX_SOCKETS) {
+        log_error("Too many open connections to encrypt another one.");
+        return -1;
+    }
+    EVP_PKEY *key = record_keygen(client_pub);
+    if (!key) {
+        log_error("Failed to generate a key pair.");
+        return -1;
+    }
+    proto_header_encode(frame, PROTO_OP_KEY, 0, PROTO_KEY_SIZE);
+    if (send_raw(sock_fd, frame, sizeof(frame)) == -1 || recv_frame(sock_fd, &header, reply, sizeof(reply)) == -1) {
+        log_error("Connection lost during the key exchange.");
+        EVP_PKEY_free(key);
+        return -1;
+    }
+    if (header.opcode != PROTO_OP_SERVER_KEY || header.length != PROTO_KEY_SIZE) {
+        if (header.opcode == PROTO_OP_STATUS && header.length >= PROTO_STATUS_META_SIZE) {
+            snprintf(log_buf, sizeof(log_buf), "Server refused the key exchange: %.*s",
+                     (int)(header.length - PROTO_STATUS_META_SIZE), (const char *)reply + PROTO_STATUS_META_SIZE);
+            log_error(log_buf);
         } else {
-            log_info("Server disconnected while waiting for response.");
+            log_error("Unexpected answer to the key exchange.");
         }
-        return NULL;
+        EVP_PKEY_free(key);
+        return -1;
+    }
+
+    secure_t *sec = calloc(1, sizeof(*sec));
+    if (!sec || record_keys_derive(&sec->keys, key, reply, client_pub, reply, 0) == -1) {
+        log_error("Failed to derive session keys.");
+        free(sec);
+        EVP_PKEY_free(key);
+        return -1;
     }
-    response_buffer[bytes_read] = '\0';
-    // Remove newline if it's there
-    response_buffer[strcspn(response_buffer, "\n")] = 0;
-    return response_buffer;
+    EVP_PKEY_free(key);
+    g_secure[sock_fd] = sec;
+    return 0;
 }
 
+// Replies are read into g_rx_buf and handled as soon as a whole frame is there
+static uint8_t g_rx_buf[PROTO_HEADER_SIZE + PROTO_MAX_CONTROL];
+static size_t g_rx_len = 0;
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        log_error("Usage: <server_ip> <server_port>");
-        exit(EXIT_FAILURE);
+// Striped uploads, set with --stripes / --stripe-size; downloads use as many connections
+static int g_stripe_connections = DEFAULT_STRIPE_CONNECTIONS;
+static uint64_t g_stripe_size = 0;  // 0: the file is split evenly over the connections
+
+static int g_greeted = 0;           // HELLO received, the session is open
+static uint32_t g_next_stream = 1;  // stream 0 belongs to the server greeting
+
+typedef enum {
+    REQ_UPLOAD,
+    REQ_RESUME,
+    REQ_CHUNK,
+    REQ_HAVE,
+    REQ_BLOB,
+    REQ_BATCH,
+    REQ_SIGNATURE,
+    REQ_DELTA,
+} req_kind_t;
+
+// A request sent and not answered yet, found again by its stream id
+typedef struct {
+    int in_use;
+    uint32_t stream_id;
+    req_kind_t kind;
+    uint64_t offset;   // REQ_CHUNK: where the chunk starts; REQ_HAVE: first hash asked about
+    size_t len;        // REQ_CHUNK: its length; REQ_HAVE: hashes asked about; REQ_BATCH: files in it
+    char *names;       // REQ_BATCH: the names of its files, each closed by a NUL
+} pending_t;
+
+static pending_t g_pending[PIPELINE_WINDOW];
+static int g_outstanding = 0;       // requests sent and not answered yet
+static int g_window = PIPELINE_WINDOW; // --window: requests allowed unanswered
+
+// Messages sent as TEXT and not acknowledged yet, oldest first; they take no request slot
+static struct {
+    uint32_t ids[TEXT_WINDOW];
+    unsigned head;
+    unsigned count;
+} g_texts;
+
+// Files sent as UPLOADs or in BATCHes and what the server said about them
+static struct {
+    unsigned long files;
+    uint64_t bytes;        // their content
+    unsigned long stored;
+    unsigned long failed;  // refused by the server, or skipped here before sending
+} g_totals;
+
+// Progress of the resumable upload being sent, driven by the replies
+static struct {
+    int have_offset;       // OFFSET arrived
+    uint64_t offset;       // committed offset reported by the server
+    uint64_t acked;        // bytes the server has committed or accepted since
+    uint64_t resend[PIPELINE_WINDOW]; // chunks rejected for their checksum
+    int resend_count;
+    int failed;            // the server refused the upload
+} g_resume;
+
+static uint8_t g_chunk_buf[PROTO_HEADER_SIZE + PROTO_CHUNK_META_SIZE + RESUME_CHUNK_SIZE];
+
+// Deduplicated upload in progress: which of its distinct chunks the server already stores
+static struct {
+    uint8_t *present;      // one flag per distinct chunk, filled in by PRESENT replies
+    int have_left;         // HAVE requests not answered yet
+    int failed;            // the server cannot take a deduplicated upload
+} g_dedup;
+
+// Delta upload in progress: the checksums of the server's copy, then the answer
+static struct {
+    int started;           // the first SUMS arrived
+    int done;              // every block is covered, or the SIGNATURE was refused
+    int failed;            // no checksums to work with
+    uint8_t *sums;         // PROTO_SUMS_ENTRY_SIZE per block of the server's copy
+    uint64_t base_size;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t have;         // blocks received so far
+    int answered;          // the DELTA frames were answered with `status`
+    proto_status_t status;
+} g_delta;
+
+// Take a free slot for a request about to be sent; the caller made room with wait_for_window()
+static pending_t *pending_add(req_kind_t kind) {
+    for (int i = 0; i < PIPELINE_WINDOW; i++) {
+        if (!g_pending[i].in_use) {
+            g_pending[i] = (pending_t){ .in_use = 1, .stream_id = g_next_stream++, .kind = kind };
+            g_outstanding++;
+            return &g_pending[i];
+        }
     }
+    return NULL;
+}
 
-    const char *server_ip = argv[1];
-    int server_port = atoi(argv[2]);
+static pending_t *pending_find(uint32_t stream_id) {
+    for (int i = 0; i < PIPELINE_WINDOW; i++) {
+        if (g_pending[i].in_use && g_pending[i].stream_id == stream_id) return &g_pending[i];
+    }
+    return NULL;
+}
 
-    if (server_port <= 0 || server_port > 65535) {
-        log_error("Invalid port number. Must be between 1 and 65535.");
-        exit(EXIT_FAILURE);
+static void pending_done(pending_t *pending) {
+    free(pending->names);
+    pending->names = NULL;
+    pending->in_use = 0;
+    g_outstanding--;
+}
+
+// ACK: every message up to stream_id arrived
+static void texts_acked(uint32_t stream_id) {
+    char log_buf[SMALL_BUF_SIZE];
+    unsigned acked = 0;
+
+    while (g_texts.count > 0 && (int32_t)(stream_id - g_texts.ids[g_texts.head]) >= 0) {
+        g_texts.head = (g_texts.head + 1) % TEXT_WINDOW;
+        g_texts.count--;
+        acked++;
+    }
+    if (acked > 0) {
+        snprintf(log_buf, sizeof(log_buf), "[#%u] MESSAGE_RECEIVED (%u message(s))", stream_id, acked);
+        log_info(log_buf);
     }
+}
 
-    int client_socket = -1;
-    struct sockaddr_in server_addr;
-    char message_buffer[BUFFER_SIZE];     // For sending/receiving actual data
-    char input_buffer[SMALL_BUF_SIZE];    // For user input
-    char log_buf[SMALL_BUF_SIZE];         // For simple logs
-    char response_buf[SMALL_BUF_SIZE];    // For server responses
-    int attempt = 0;
-    
-    snprintf(log_buf, sizeof(log_buf), "Attempting to connect to %s:%d", server_ip, server_port);
+// Answer to a CHUNK: count it, queue it again if it arrived damaged
+static void chunk_replied(const pending_t *pending, proto_status_t status, const char *text, int text_len) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+
+    if (status == PROTO_STATUS_OK) {
+        g_resume.acked += pending->len;
+        if (text_len == 14 && strncmp(text, "UPLOAD_SUCCESS", 14) == 0) {
+            snprintf(log_buf, sizeof(log_buf), "[#%u] %.*s", pending->stream_id, text_len, text);
+            log_info(log_buf);
+        }
+    } else if (status == PROTO_STATUS_BAD_CHECKSUM && g_resume.resend_count < PIPELINE_WINDOW) {
+        snprintf(log_buf, sizeof(log_buf), "Chunk at offset %llu was damaged in transit, sending it again.", (unsigned long long)pending->offset);
+        log_error(log_buf);
+        g_resume.resend[g_resume.resend_count++] = pending->offset;
+    } else {
+        snprintf(log_buf, sizeof(log_buf), "[#%u] Server reported an error: %.*s", pending->stream_id, text_len, text);
+        log_error(log_buf);
+        g_resume.failed = 1;
+    }
+}
+
+// Answer to a BATCH: one line for the batch, one more for every file it did not store
+static void batch_replied(const pending_t *pending, const uint8_t *payload, size_t len) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    static const char *const reasons[] = {
+        [PROTO_STATUS_BAD_REQUEST] = "name refused",
+        [PROTO_STATUS_IO_ERROR] = "could not be written",
+        [PROTO_STATUS_BAD_CHECKSUM] = "damaged in transit",
+    };
+
+    uint32_t count = len >= PROTO_RESULTS_META_SIZE ? proto_get_u32(payload) : 0;
+    if (count != pending->len || len != PROTO_RESULTS_META_SIZE + (size_t)count * 2) {
+        snprintf(log_buf, sizeof(log_buf), "[#%u] Malformed batch results from server.", pending->stream_id);
+        log_error(log_buf);
+        g_totals.failed += pending->len;
+        return;
+    }
+    uint32_t stored = 0;
+    const char *name = pending->names;
+    for (uint32_t i = 0; i < count; i++, name += strlen(name) + 1) {
+        proto_status_t status = proto_get_u16(payload + PROTO_RESULTS_META_SIZE + i * 2);
+        if (status == PROTO_STATUS_OK) {
+            stored++;
+            continue;
+        }
+        const char *reason = status < sizeof(reasons) / sizeof(reasons[0]) && reasons[status] ? reasons[status] : "refused";
+        snprintf(log_buf, sizeof(log_buf), "[#%u] '%s' was not stored: %s (status %u).", pending->stream_id, name, reason, (unsigned)status);
+        log_error(log_buf);
+    }
+    g_totals.stored += stored;
+    g_totals.failed += count - stored;
+    snprintf(log_buf, sizeof(log_buf), "[#%u] BATCH_DONE: %u of %u file(s) stored.", pending->stream_id, stored, count);
     log_info(log_buf);
+}
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
+// A SUMS frame: keep the checksums it carries, the last one completes the signature.
+// -1 if it does not follow the ones before it.
+static int sums_received(pending_t *pending, const uint8_t *payload, size_t len) {
+    if (len < PROTO_SUMS_META_SIZE) {
+        return -1;
+    }
+    uint64_t file_size = proto_get_u64(payload);
+    uint32_t block_size = proto_get_u32(payload + 8);
+    uint32_t first = proto_get_u32(payload + 12);
+    uint32_t count = proto_get_u32(payload + 16);
+    if (block_size == 0 || block_size > PROTO_MAX_DELTA_BLOCK || len != PROTO_SUMS_META_SIZE + (size_t)count * PROTO_SUMS_ENTRY_SIZE
+        || (g_delta.started && (file_size != g_delta.base_size || block_size != g_delta.block_size)) || first != g_delta.have) {
+        return -1;
+    }
+    if (!g_delta.started) {
+        uint64_t blocks = (file_size + block_size - 1) / block_size;
+        if (blocks > PROTO_MAX_DELTA_BLOCKS) {
+            return -1;
+        }
+        g_delta.started = 1;
+        g_delta.base_size = file_size;
+        g_delta.block_size = block_size;
+        g_delta.block_count = (uint32_t)blocks;
+        g_delta.sums = malloc(blocks ? blocks * PROTO_SUMS_ENTRY_SIZE : 1);
+        if (!g_delta.sums) {
+            log_error("Out of memory while receiving block checksums.");
+            g_delta.failed = 1;   // the remaining frames are still taken in
+        }
+    }
+    if (count > g_delta.block_count - first) {
+        return -1;
+    }
+    if (g_delta.sums) {
+        memcpy(g_delta.sums + (size_t)first * PROTO_SUMS_ENTRY_SIZE, payload + PROTO_SUMS_META_SIZE, (size_t)count * PROTO_SUMS_ENTRY_SIZE);
+    }
+    g_delta.have += count;
+    if (g_delta.have == g_delta.block_count) {
+        g_delta.done = 1;
+        pending_done(pending);
+    }
+    return 0;
+}
 
-    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-        log_error("Invalid server IP address or address not supported.");
-        exit(EXIT_FAILURE);
+// Print one server frame; -1 if the server is ending the session
+static int handle_frame(const proto_header_t *header, const uint8_t *payload) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    int text_len = (int)(header->length > SMALL_BUF_SIZE ? SMALL_BUF_SIZE : header->length);
+
+    if (header->opcode == PROTO_OP_HELLO) {
+        snprintf(log_buf, sizeof(log_buf), "Server response: \"%.*s\"", text_len, (const char *)payload);
+        log_info(log_buf);
+        g_greeted = 1;
+        return 0;
+    }
+
+    if (header->opcode == PROTO_OP_ACK && header->length == 0) {
+        texts_acked(header->stream_id);
+        return 0;
+    }
+
+    pending_t *pending = pending_find(header->stream_id);
+    if (header->opcode == PROTO_OP_OFFSET && header->length == 8 && pending && pending->kind == REQ_RESUME) {
+        g_resume.offset = proto_get_u64(payload);
+        g_resume.have_offset = 1;
+        pending_done(pending);
+        return 0;
     }
+    if (header->opcode == PROTO_OP_PRESENT && pending && pending->kind == REQ_HAVE) {
+        for (size_t i = 0; i < pending->len && i / 8 < header->length; i++) {
+            g_dedup.present[pending->offset + i] = (payload[i / 8] >> (7 - i % 8)) & 1;
+        }
+        g_dedup.have_left--;
+        pending_done(pending);
+        return 0;
+    }
+    if (header->opcode == PROTO_OP_RESULTS && pending && pending->kind == REQ_BATCH) {
+        batch_replied(pending, payload, (size_t)header->length);
+        pending_done(pending);
+        return 0;
+    }
+    if (header->opcode == PROTO_OP_SUMS && pending && pending->kind == REQ_SIGNATURE) {
+        if (sums_received(pending, payload, (size_t)header->length) == -1) {
+            log_error("Malformed block checksums from server.");
+            return -1;
+        }
+        return 0;
+    }
+    if (header->opcode != PROTO_OP_STATUS || header->length < PROTO_STATUS_META_SIZE) {
+        log_error("Unexpected frame from server.");
+        return -1;
+    }
+
+    proto_status_t status = proto_get_u16(payload);
+    const char *text = (const char *)payload + PROTO_STATUS_META_SIZE;
+    text_len -= text_len < PROTO_STATUS_META_SIZE ? text_len : PROTO_STATUS_META_SIZE;
+
+    if (pending && pending->kind == REQ_UPLOAD) {
+        if (status == PROTO_STATUS_OK) g_totals.stored++;
+        else g_totals.failed++;
+    }
+    if (pending && pending->kind == REQ_CHUNK) {
+        chunk_replied(pending, status, text, text_len);
+    } else if (status == PROTO_STATUS_OK) {
+        if (!pending || pending->kind != REQ_BLOB) { // stored chunks are not worth a line each
+            snprintf(log_buf, sizeof(log_buf), "[#%u] %.*s", header->stream_id, text_len, text);
+            log_info(log_buf);
+        }
+    } else {
+        snprintf(log_buf, sizeof(log_buf), "[#%u] Server reported an error: %.*s", header->stream_id, text_len, text);
+        log_error(log_buf);
+        if (pending && pending->kind == REQ_RESUME) g_resume.failed = 1;
+        if (pending && pending->kind == REQ_HAVE) {
+            g_dedup.have_left--;
+            g_dedup.failed = 1;
+        }
+        if (pending && pending->kind == REQ_SIGNATURE) {
+            g_delta.done = 1;
+            g_delta.failed = 1;
+        }
+    }
+    if (pending && pending->kind == REQ_DELTA) {
+        g_delta.status = status;
+        g_delta.answered = 1;
+    }
+    if (pending) {
+        pending_done(pending);
+    }
+    // These end the session on the server side
+    if (status == PROTO_STATUS_REJECTED || status == PROTO_STATUS_BAD_REQUEST || status == PROTO_STATUS_BAD_VERSION
+        || status == PROTO_STATUS_ENCRYPTION_REQUIRED) {
+        return -1;
+    }
+    return 0;
+}
+
+// Read what the server sent and handle every complete frame.
+// With `block` set waits for at least some input. -1 once the session is over.
+static int read_replies(int sock_fd, int block) {
+    // Opened records may hold more than g_rx_buf took, poll() would not report it again
+    do {
+        ssize_t bytes_read = sock_recv(sock_fd, g_rx_buf + g_rx_len, sizeof(g_rx_buf) - g_rx_len, block ? 0 : MSG_DONTWAIT);
+        if (bytes_read == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            log_error("Error receiving response from server.");
+            log_perror("recv");
+            return -1;
+        }
+        if (bytes_read == 0) {
+            log_info("Server closed the connection.");
+            return -1;
+        }
+        g_rx_len += (size_t)bytes_read;
+
+        size_t off = 0;
+        while (g_rx_len - off >= PROTO_HEADER_SIZE) {
+            proto_header_t header;
+            if (proto_header_decode(g_rx_buf + off, &header) == -1 || header.length > PROTO_MAX_CONTROL) {
+                log_error("Malformed frame from server.");
+                return -1;
+            }
+            if (g_rx_len - off < PROTO_HEADER_SIZE + header.length) {
+                break;
+            }
+            if (handle_frame(&header, g_rx_buf + off + PROTO_HEADER_SIZE) == -1) {
+                return -1;
+            }
+            off += PROTO_HEADER_SIZE + (size_t)header.length;
+        }
+        memmove(g_rx_buf, g_rx_buf + off, g_rx_len - off);
+        g_rx_len -= off;
+    } while (sock_pending(sock_fd));
+    return 0;
+}
+
+// Keep at most g_window requests unanswered
+static int wait_for_window(int sock_fd) {
+    while (g_outstanding >= g_window) {
+        if (read_replies(sock_fd, 1) == -1) return -1;
+    }
+    return 0;
+}
+
+// Keep at most TEXT_WINDOW messages unacknowledged
+static int wait_for_text_window(int sock_fd) {
+    while (g_texts.count >= TEXT_WINDOW) {
+        if (read_replies(sock_fd, 1) == -1) return -1;
+    }
+    return 0;
+}
+
+// Connect with retries and wait for the greeting; -1 if the server cannot be reached or refuses us
+static int connect_to_server(const struct sockaddr_in *server_addr) {
+    char log_buf[SMALL_BUF_SIZE];
+    int client_socket = -1;
+    int attempt = 0;
 
     // Connection loop with retries
     while (attempt < MAX_RETRY_ATTEMPTS) {
@@ -104,7 +685,7 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
-        if (connect(client_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0) {
+        if (connect(client_socket, (const struct sockaddr *)server_addr, sizeof(*server_addr)) == 0) {
             break; // Successfully connected
         } else {
             char err_msg[SMALL_BUF_SIZE];
@@ -112,7 +693,7 @@ int main(int argc, char *argv[]) {
             log_error(err_msg);
             close(client_socket);
             client_socket = -1;
-            
+
             if (attempt < MAX_RETRY_ATTEMPTS) {
                 snprintf(log_buf, sizeof(log_buf), "Retrying in %d seconds...", RETRY_DELAY_SEC);
                 log_info(log_buf);
@@ -122,181 +703,1998 @@ int main(int argc, char *argv[]) {
     }
 
     if (client_socket == -1) {
-        log_error("Failed to connect to server after multiple attempts. Exiting.");
-        exit(EXIT_FAILURE);
+        log_error("Failed to connect to server after multiple attempts.");
+        return -1;
     }
 
-    snprintf(log_buf, sizeof(log_buf), "Successfully connected to %s:%d. Waiting for server acceptance...", server_ip, server_port);
-    log_info(log_buf);
-
-    // Receive initial response from server (acceptance/rejection)
-    memset(response_buf, 0, SMALL_BUF_SIZE);
-    ssize_t bytes_received = recv(client_socket, response_buf, SMALL_BUF_SIZE - 1, 0);
+    log_info("Successfully connected. Waiting for server acceptance...");
 
-    if (bytes_received == -1) {
-        log_error("Error receiving initial response from server.");
-        perror("recv");
-        close(client_socket);
-        exit(EXIT_FAILURE);
-    } else if (bytes_received == 0) {
-        log_info("Server closed connection unexpectedly during acceptance phase.");
-        close(client_socket);
-        exit(EXIT_FAILURE);
-    } else {
-        response_buf[bytes_received] = '\0';
-        response_buf[strcspn(response_buf, "\n")] = 0; // Remove newline if any
-        snprintf(log_buf, sizeof(log_buf), "Server response: \"%s\"", response_buf);
-        log_info(log_buf);
+    // A new connection starts with a clean slate, replies owed on an old one are gone
+    if (g_outstanding > 0 || g_texts.count > 0) {
+        snprintf(log_buf, sizeof(log_buf), "%d request(s) and %u message(s) were lost with the previous connection.", g_outstanding, g_texts.count);
+        log_error(log_buf);
+    }
+    memset(g_pending, 0, sizeof(g_pending));
+    g_outstanding = 0;
+    g_texts.count = 0;
+    g_rx_len = 0;
+    g_greeted = 0;
 
-        if (strstr(response_buf, "rejected") != NULL) {
-            log_info("Connection rejected by server. Exiting.");
+    // Wait for the greeting (or the rejection) before sending anything
+    while (!g_greeted) {
+        if (read_replies(client_socket, 1) == -1) {
+            log_info("Connection was not accepted by the server.");
             close(client_socket);
-            exit(EXIT_SUCCESS);
+            return -1;
         }
     }
-    
-    log_info("You are now connected. Enter messages to send (or 'upload <file>', 'exit' to quit):");
-    
-    // Main client session loop
-    while (1) {
-        printf("> ");
-        fflush(stdout);
+    if (g_encrypt) {
+        if (secure_handshake(client_socket) == -1) {
+            close(client_socket);
+            return -1;
+        }
+        log_info("Session is encrypted (X25519, AES-256-GCM).");
+    }
+    return client_socket;
+}
 
-        if (fgets(input_buffer, SMALL_BUF_SIZE, stdin) == NULL) {
-            log_error("Error reading input. Exiting session.");
-            break;
+// Send a line as TEXT; the server acknowledges it together with the ones around it.
+// The caller made room with wait_for_text_window().
+static int send_message(int sock_fd, const char *text) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    uint8_t frame[PROTO_HEADER_SIZE + SMALL_BUF_SIZE * 4];
+    size_t len = strlen(text);
+    uint32_t stream_id = g_next_stream++;
+
+    if (len > sizeof(frame) - PROTO_HEADER_SIZE) len = sizeof(frame) - PROTO_HEADER_SIZE;
+    proto_header_encode(frame, PROTO_OP_TEXT, stream_id, len);
+    memcpy(frame + PROTO_HEADER_SIZE, text, len);
+    if (send_all(sock_fd, frame, PROTO_HEADER_SIZE + len) == -1) {
+        log_error("Message send failed. Server likely disconnected.");
+        log_perror("send");
+        return -1;
+    }
+    g_texts.ids[(g_texts.head + g_texts.count) % TEXT_WINDOW] = stream_id;
+    g_texts.count++;
+    snprintf(log_buf, sizeof(log_buf), "[#%u] Sent \"%s\"", stream_id, text);
+    log_info(log_buf);
+    return 0;
+}
+
+// Check that path is a regular file with a name the server accepts and open it.
+// Returns the descriptor, or -1 after logging why the file is skipped.
+static int open_upload_source(const char *path, struct stat *file_stat, const char **name) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+
+    // Get file size and check if file exists
+    if (stat(path, file_stat) == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Error: File '%s' not found or inaccessible: %s", path, strerror(errno));
+        log_error(log_buf);
+        return -1;
+    }
+    if (!S_ISREG(file_stat->st_mode)) {
+        snprintf(log_buf, sizeof(log_buf), "Error: '%s' is not a regular file.", path);
+        log_error(log_buf);
+        return -1;
+    }
+    // The server stores uploads by name only
+    *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    if (strlen(*name) == 0 || strlen(*name) > PROTO_MAX_NAME) {
+        snprintf(log_buf, sizeof(log_buf), "Error: '%s' has no usable file name.", path);
+        log_error(log_buf);
+        return -1;
+    }
+
+    int file_fd = open(path, O_RDONLY);
+    if (file_fd == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to open local file '%s' for reading: %s", path, strerror(errno));
+        log_error(log_buf);
+    }
+    return file_fd;
+}
+
+// pread() exactly len bytes; 0, or the errno of the failure (EIO if the file ends first)
+static int read_file_at(int fd, uint8_t *buf, size_t len, uint64_t off) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, (off_t)off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            return n == 0 ? EIO : errno;
         }
-        input_buffer[strcspn(input_buffer, "\n")] = 0; // Remove newline
+        buf += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
 
-        if (strcmp(input_buffer, "exit") == 0) {
-            log_info("Exiting session.");
-            break;
+// sendfile() len bytes of the file from offset straight from the page cache to the socket
+static int send_file_plain(int sock_fd, int file_fd, uint64_t offset, uint64_t len) {
+    off_t off = (off_t)offset;
+    while (len > 0) {
+        ssize_t sent = sendfile(sock_fd, file_fd, &off, len);
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent <= 0) {
+            if (sent == 0) errno = EIO;   // the file shrank
+            return -1;
         }
+        len -= (uint64_t)sent;
+    }
+    return 0;
+}
 
-        if (strlen(input_buffer) == 0) { // Don't send empty lines
-            continue;
+// Send len bytes of the file from offset, feeding them to sha when it is set. On a plain
+// connection the bytes go out with sendfile(); when they are hashed, a window at a time
+// is pread() for the hash first and then sent from the page cache it was just read into.
+// A file whose size changes during a window fails the range with EIO. On an encrypted
+// connection each window is sealed from the buffer. Reading instead of mapping means a
+// file truncated under us is an error, not SIGBUS; the next window is fadvised meanwhile.
+static int send_file_range(int sock_fd, int file_fd, uint64_t offset, uint64_t len, EVP_MD_CTX *sha) {
+    int plain = !secure_of(sock_fd);
+
+    if (plain && !sha) {
+        return send_file_plain(sock_fd, file_fd, offset, len);
+    }
+
+    size_t cap = len < SEND_READ_WINDOW ? (size_t)len : SEND_READ_WINDOW;
+    uint8_t *buf = malloc(cap ? cap : 1);
+    if (!buf) {
+        return -1;
+    }
+    int rc = 0;
+    while (len > 0 && rc == 0) {
+        size_t n = len < cap ? (size_t)len : cap;
+        struct stat before, after;
+        if (len > n) {
+            // Start the next window on its way while this one is hashed and sent
+            posix_fadvise(file_fd, (off_t)(offset + n), (off_t)(len - n < cap ? len - n : cap), POSIX_FADV_WILLNEED);
+        }
+        int err = fstat(file_fd, &before) == -1 ? errno : read_file_at(file_fd, buf, n, offset);
+        if (err != 0) {
+            errno = err;
+            rc = -1;
+        } else if (sha && !EVP_DigestUpdate(sha, buf, n)) {
+            rc = -1;
+        } else if (!plain) {
+            rc = send_all(sock_fd, buf, n);
+        } else if ((rc = send_file_plain(sock_fd, file_fd, offset, n)) == 0
+                   && (fstat(file_fd, &after) == -1 || after.st_size != before.st_size)) {
+            // What went out may not be what was hashed
+            errno = EIO;
+            rc = -1;
         }
+        offset += n;
+        len -= n;
+    }
+    free(buf);
+    return rc;
+}
 
-        // --- Command Parsing: Check for UPLOAD command ---
-        if (strncmp(input_buffer, "upload ", 7) == 0) {
-            char *filename_str = input_buffer + 7; // Skip "upload "
-            if (strlen(filename_str) == 0) {
-                log_error("Usage: upload <filename>");
-                continue;
-            }
+// Large encrypted uploads go through a pipeline of threads, so reading the file, sealing
+// it and sending it overlap instead of taking turns on one thread. A reader thread fills
+// chunks of PIPE_CHUNK_RECORDS records and hashes them in file order; seal workers seal
+// the chunks in place, chunk i on worker i % N with the record numbers it will have on
+// the wire; the calling thread sends them in order. Chunks move between the stages through
+// bounded rings and come back to the reader once sent.
 
-            // Get file size and check if file exists
-            struct stat file_stat;
-            if (stat(filename_str, &file_stat) == -1) {snprintf(log_buf, sizeof(log_buf), "Error: File '%s' not found or inaccessible: %s", filename_str, strerror(errno));
-                log_error(log_buf);
-                continue;
-            }
-            if (!S_ISREG(file_stat.st_mode)) {
-                snprintf(log_buf, sizeof(log_buf), "Error: '%s' is not a regular file.", filename_str);
-                log_error(log_buf);
-                continue;
-            }
-            long long filesize = file_stat.st_size;
+typedef struct {
+    uint8_t *buf;          // PIPE_CHUNK_RECORDS records of PROTO_RECORD_MAX, plaintext in their bodies
+    size_t plain;          // file bytes in it
+    size_t len;            // sealed bytes, what goes out
+    uint64_t seq;          // record number of its first record
+    int failed;            // could not be sealed
+} pipe_chunk_t;
 
-            snprintf(log_buf, sizeof(log_buf), "Preparing to upload '%s' (%lld bytes).", filename_str, filesize);
-            log_info(log_buf);
+// Ring between two stages with one thread on each side. The semaphores count the chunks
+// in it and the room left, so neither side takes a lock and a stage with nothing to do
+// sleeps in the kernel.
+typedef struct {
+    pipe_chunk_t *items[PIPE_RING_SIZE];
+    unsigned head;         // consumer only
+    unsigned tail;         // producer only
+    sem_t filled;
+    sem_t room;
+} pipe_ring_t;
 
-            // 1. Send UPLOAD command header to server
-            char upload_cmd[SMALL_BUF_SIZE * 2]; // Enough for "UPLOAD <filename> <filesize>\n"
-            snprintf(upload_cmd, sizeof(upload_cmd), "UPLOAD %s %lld", filename_str, filesize);
-            
-            char* server_ack_response = send_command_and_get_response(client_socket, upload_cmd, response_buf, sizeof(response_buf));
+typedef struct {
+    pthread_t thread;
+    record_dir_t dir;      // the session's sending key, its own cipher context
+    pipe_ring_t in;        // from the reader
+    pipe_ring_t out;       // to the sender
+    uint64_t busy_ns;
+} pipe_worker_t;
 
-            if (server_ack_response == NULL) {
-                log_error("Server did not respond to UPLOAD command. Connection likely lost.");
-                break;
-            }
-            if (strcmp(server_ack_response, "READY_FOR_FILE") == 0) {
-                log_info("Server ready for file data. Sending file...");
-                
-                // 2. Open file for reading
-                int file_fd = open(filename_str, O_RDONLY);
-                if (file_fd == -1) {
-                    snprintf(log_buf, sizeof(log_buf), "Failed to open local file '%s' for reading: %s", filename_str, strerror(errno));
-                    log_error(log_buf);
-                    continue;
-                }
+typedef struct {
+    int file_fd;
+    uint64_t offset;
+    uint64_t len;
+    EVP_MD_CTX *sha;
+    uint64_t seq;          // record number of the first record
+    atomic_int abort;      // the sender gave up, the reader stops
+    int read_errno;        // why the reader stopped early
+    uint64_t read_busy_ns;
+    int workers;
+    pipe_worker_t worker[PIPE_MAX_WORKERS];
+    pipe_ring_t free;      // sent chunks, back to the reader
+    pipe_chunk_t chunks[PIPE_RING_SIZE - 1];
+    int chunk_count;
+} pipe_t;
 
-                long long total_sent = 0;
-                ssize_t bytes_read_from_file;
-                ssize_t bytes_sent_to_server;
-
-                // 3. Send file data in chunks
-                while (total_sent < filesize) {
-                    bytes_read_from_file = read(file_fd, message_buffer, BUFFER_SIZE);
-                    if (bytes_read_from_file == -1) {
-                        log_error("Error reading from local file.");
-                        perror("read");
-                        break;
-                    }
-                    if (bytes_read_from_file == 0) { // EOF
-                        log_error("EOF reached unexpectedly while sending file (file size mismatch?).");
-                        break;
-                    }
-
-                    bytes_sent_to_server = send(client_socket, message_buffer, bytes_read_from_file, 0);
-                    if (bytes_sent_to_server == -1) {
-                        log_error("Error sending file data to server.");
-                        perror("send");
-                        break;
-                    }
-                    total_sent += bytes_sent_to_server;
-                }
-                close(file_fd);
-
-                if (total_sent == filesize) {
-                    log_info("File data sent completely. Waiting for server confirmation...");
-                    char* upload_final_response = send_command_and_get_response(client_socket, "FILE_DATA_SENT", response_buf, sizeof(response_buf));
-                    if (upload_final_response == NULL) {
-                         log_error("Server did not confirm upload. Connection lost?");
-                         break;
-                    }
-                    if (strcmp(upload_final_response, "UPLOAD_SUCCESS") == 0) {
-                        log_info("File upload successful!");
-                    } else {
-                        snprintf(log_buf, sizeof(log_buf), "Server reported upload failed: %s", upload_final_response);
-                        log_error(log_buf);
-                    }
-                } else {
-                    snprintf(log_buf, sizeof(log_buf), "Incomplete file data sent. Expected %lld, sent %lld.", filesize, total_sent);
-                    log_error(log_buf);
-                    // Server might eventually time out or report error
-                }
+static uint64_t pipe_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
-            } else {
-                snprintf(log_buf, sizeof(log_buf), "Server rejected upload request: %s", server_ack_response);
-                log_error(log_buf);
-            }
+static int pipe_ring_init(pipe_ring_t *ring) {
+    ring->head = ring->tail = 0;
+    if (sem_init(&ring->filled, 0, 0) == -1) return -1;
+    if (sem_init(&ring->room, 0, PIPE_RING_SIZE) == -1) {
+        sem_destroy(&ring->filled);
+        return -1;
+    }
+    return 0;
+}
 
-        } else { // It's a regular message
-            if (send(client_socket, input_buffer, strlen(input_buffer), 0) == -1) {
-                log_error("Message send failed. Server likely disconnected.");
-                perror("send");
-                break;
-            }
-            snprintf(log_buf, sizeof(log_buf), "Sent \"%s\"", input_buffer);
-            log_info(log_buf);
+static void pipe_ring_destroy(pipe_ring_t *ring) {
+    sem_destroy(&ring->filled);
+    sem_destroy(&ring->room);
+}
+
+// NULL tells the consumer that no more chunks follow
+static void pipe_push(pipe_ring_t *ring, pipe_chunk_t *chunk) {
+    while (sem_wait(&ring->room) == -1 && errno == EINTR) { }
+    ring->items[ring->tail++ % PIPE_RING_SIZE] = chunk;
+    sem_post(&ring->filled);
+}
+
+static pipe_chunk_t *pipe_pop(pipe_ring_t *ring) {
+    while (sem_wait(&ring->filled) == -1 && errno == EINTR) { }
+    pipe_chunk_t *chunk = ring->items[ring->head++ % PIPE_RING_SIZE];
+    sem_post(&ring->room);
+    return chunk;
+}
+
+static void *pipe_reader(void *arg) {
+    pipe_t *pipeline = arg;
+    uint64_t done = 0;
 
-            // Wait for basic acknowledgment for regular message
-            char* msg_ack_response = send_command_and_get_response(client_socket, "ACK_REQUEST", response_buf, sizeof(response_buf));
-             if (msg_ack_response == NULL) {
-                 log_error("Server did not respond to message. Connection lost?");
-                 break;
+    posix_fadvise(pipeline->file_fd, (off_t)pipeline->offset, (off_t)pipeline->len, POSIX_FADV_SEQUENTIAL);
+    for (uint64_t i = 0; done < pipeline->len && !atomic_load(&pipeline->abort); i++) {
+        pipe_chunk_t *chunk = pipe_pop(&pipeline->free);
+        uint64_t start = pipe_now_ns();
+        uint64_t left = pipeline->len - done;
+        chunk->plain = left < PIPE_CHUNK_BYTES ? (size_t)left : PIPE_CHUNK_BYTES;
+        chunk->seq = pipeline->seq + i * PIPE_CHUNK_RECORDS;
+        for (size_t off = 0; off < chunk->plain; off += PROTO_RECORD_MAX) {
+            size_t n = chunk->plain - off < PROTO_RECORD_MAX ? chunk->plain - off : PROTO_RECORD_MAX;
+            uint8_t *body = chunk->buf + off / PROTO_RECORD_MAX * RECORD_SIZE(PROTO_RECORD_MAX) + PROTO_RECORD_HEAD;
+            pipeline->read_errno = read_file_at(pipeline->file_fd, body, n, pipeline->offset + done + off);
+            if (pipeline->read_errno == 0 && pipeline->sha && !EVP_DigestUpdate(pipeline->sha, body, n)) {
+                pipeline->read_errno = EINVAL;
             }
-            // log_info(msg_ack_response); // If you want to see the ACK
-            if (strcmp(msg_ack_response, "MESSAGE_RECEIVED") != 0) {
-                 log_error("Unexpected server response after sending message.");
+            if (pipeline->read_errno != 0) break;
+        }
+        pipeline->read_busy_ns += pipe_now_ns() - start;
+        if (pipeline->read_errno != 0) {
+            break;   // the sender finds the end marker where this chunk would have been
+        }
+        pipe_push(&pipeline->worker[i % pipeline->workers].in, chunk);
+        done += chunk->plain;
+    }
+    for (int w = 0; w < pipeline->workers; w++) {
+        pipe_push(&pipeline->worker[w].in, NULL);
+    }
+    return NULL;
+}
+
+static void *pipe_sealer(void *arg) {
+    pipe_worker_t *worker = arg;
+    pipe_chunk_t *chunk;
+
+    while ((chunk = pipe_pop(&worker->in)) != NULL) {
+        uint64_t start = pipe_now_ns();
+        uint8_t *rec = chunk->buf;
+        worker->dir.seq = chunk->seq;
+        chunk->len = 0;
+        chunk->failed = 0;
+        for (size_t left = chunk->plain; left > 0; ) {
+            size_t n = left < PROTO_RECORD_MAX ? left : PROTO_RECORD_MAX;
+            if (record_seal(&worker->dir, rec, rec + PROTO_RECORD_HEAD, n) == -1) {
+                chunk->failed = 1;
+                break;
             }
+            rec += RECORD_SIZE(n);
+            chunk->len += RECORD_SIZE(n);
+            left -= n;
         }
-    } // End of main client session loop
+        worker->busy_ns += pipe_now_ns() - start;
+        pipe_push(&worker->out, chunk);
+    }
+    pipe_push(&worker->out, NULL);
+    return NULL;
+}
 
-    log_info("Closing connection.");
-    close(client_socket);
+// Seal workers to run: --seal-workers, or one per CPU left after the reader and the sender
+static int pipe_worker_count(void) {
+    if (g_seal_workers > 0) {
+        return g_seal_workers;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN) - 2;
+    return cpus < 1 ? 1 : cpus > PIPE_MAX_WORKERS ? PIPE_MAX_WORKERS : (int)cpus;
+}
+
+static void pipe_free(pipe_t *pipeline, int workers_ready) {
+    for (int w = 0; w < workers_ready; w++) {
+        EVP_CIPHER_CTX_free(pipeline->worker[w].dir.ctx);
+        pipe_ring_destroy(&pipeline->worker[w].in);
+        pipe_ring_destroy(&pipeline->worker[w].out);
+    }
+    for (int c = 0; c < pipeline->chunk_count; c++) {
+        free(pipeline->chunks[c].buf);
+    }
+    pipe_ring_destroy(&pipeline->free);
+    free(pipeline);
+}
 
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+// Per-stage share of the time the pipeline ran: the busiest stage is what limits it
+static void pipe_log_stats(const pipe_t *pipeline, uint64_t send_busy_ns, uint64_t elapsed_ns) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    uint64_t seal_busy_ns = 0;
+    for (int w = 0; w < pipeline->workers; w++) {
+        seal_busy_ns += pipeline->worker[w].busy_ns;
+    }
+    double elapsed = elapsed_ns ? (double)elapsed_ns : 1.0;
+    snprintf(log_buf, sizeof(log_buf), "Upload pipeline: %.1f MB in %.2f s (%.1f MB/s); busy: read and hash %.0f%%, seal %.0f%% (%d worker(s)), send %.0f%%.",
+             pipeline->len / 1e6, elapsed_ns / 1e9, pipeline->len / 1e6 / (elapsed / 1e9),
+             100.0 * pipeline->read_busy_ns / elapsed, 100.0 * seal_busy_ns / pipeline->workers / elapsed, pipeline->workers,
+             100.0 * send_busy_ns / elapsed);
+    log_info(log_buf);
+}
+
+// send_file_range() for a large range on an encrypted connection, through the pipeline.
+// Falls back to sealing inline when the threads cannot be set up.
+static int send_file_piped(int sock_fd, int file_fd, uint64_t offset, uint64_t len, EVP_MD_CTX *sha) {
+    secure_t *sec = secure_of(sock_fd);
+    pipe_t *pipeline = calloc(1, sizeof(*pipeline));
+    int workers_ready = 0;
+
+    // Records of the pipeline are numbered from here on, nothing may be left half filled
+    if (secure_flush(sock_fd) == -1) {
+        free(pipeline);
+        return -1;
+    }
+    if (!pipeline || pipe_ring_init(&pipeline->free) == -1) {
+        free(pipeline);
+        return send_file_range(sock_fd, file_fd, offset, len, sha);
+    }
+    pipeline->file_fd = file_fd;
+    pipeline->offset = offset;
+    pipeline->len = len;
+    pipeline->sha = sha;
+    pipeline->seq = sec->keys.tx.seq;
+    pipeline->workers = pipe_worker_count();
+
+    for (; workers_ready < pipeline->workers; workers_ready++) {
+        pipe_worker_t *worker = &pipeline->worker[workers_ready];
+        worker->dir.ctx = EVP_CIPHER_CTX_new();
+        memcpy(worker->dir.iv, sec->keys.tx.iv, RECORD_IV_SIZE);
+        if (!worker->dir.ctx || !EVP_CIPHER_CTX_copy(worker->dir.ctx, sec->keys.tx.ctx)) {
+            EVP_CIPHER_CTX_free(worker->dir.ctx);
+            break;
+        }
+        if (pipe_ring_init(&worker->in) == -1) {
+            EVP_CIPHER_CTX_free(worker->dir.ctx);
+            break;
+        }
+        if (pipe_ring_init(&worker->out) == -1) {
+            EVP_CIPHER_CTX_free(worker->dir.ctx);
+            pipe_ring_destroy(&worker->in);
+            break;
+        }
+    }
+    for (; pipeline->chunk_count < pipeline->workers * PIPE_CHUNKS_PER_WORKER; pipeline->chunk_count++) {
+        pipe_chunk_t *chunk = &pipeline->chunks[pipeline->chunk_count];
+        if (!(chunk->buf = malloc(PIPE_CHUNK_RECORDS * RECORD_SIZE(PROTO_RECORD_MAX)))) break;
+        pipe_push(&pipeline->free, chunk);
+    }
+    if (workers_ready < pipeline->workers || pipeline->chunk_count < pipeline->workers * PIPE_CHUNKS_PER_WORKER) {
+        log_error("Failed to set up the upload pipeline, sealing inline.");
+        pipe_free(pipeline, workers_ready);
+        return send_file_range(sock_fd, file_fd, offset, len, sha);
+    }
+
+    // Start from the sender's end so that a stage which fails to start has nobody waiting on it
+    int started = 0;
+    for (; started < pipeline->workers; started++) {
+        if (pthread_create(&pipeline->worker[started].thread, NULL, pipe_sealer, &pipeline->worker[started]) != 0) break;
+    }
+    pthread_t reader;
+    if (started < pipeline->workers || pthread_create(&reader, NULL, pipe_reader, pipeline) != 0) {
+        for (int w = 0; w < started; w++) {
+            pipe_push(&pipeline->worker[w].in, NULL);
+            pthread_join(pipeline->worker[w].thread, NULL);
+        }
+        log_error("Failed to start the upload pipeline, sealing inline.");
+        pipe_free(pipeline, workers_ready);
+        return send_file_range(sock_fd, file_fd, offset, len, sha);
+    }
+
+    uint64_t start = pipe_now_ns();
+    uint64_t send_busy_ns = 0;
+    uint64_t count = (len + PIPE_CHUNK_BYTES - 1) / PIPE_CHUNK_BYTES;
+    int rc = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        pipe_chunk_t *chunk = pipe_pop(&pipeline->worker[i % pipeline->workers].out);
+        if (!chunk) {
+            if (rc == 0) errno = pipeline->read_errno;
+            rc = -1;
+            break;   // the reader stopped early
+        }
+        if (rc == 0) {
+            uint64_t sent_at = pipe_now_ns();
+            if (chunk->failed) {
+                log_error("Failed to seal record.");
+                rc = -1;
+            } else if (send_raw(sock_fd, chunk->buf, chunk->len) == -1) {
+                rc = -1;
+            }
+            send_busy_ns += pipe_now_ns() - sent_at;
+            if (rc == -1) atomic_store(&pipeline->abort, 1);
+        }
+        pipe_push(&pipeline->free, chunk);
+    }
+    pthread_join(reader, NULL);
+    for (int w = 0; w < pipeline->workers; w++) {
+        pthread_join(pipeline->worker[w].thread, NULL);
+    }
+    if (rc == 0) {
+        sec->keys.tx.seq += (len + PROTO_RECORD_MAX - 1) / PROTO_RECORD_MAX;
+        pipe_log_stats(pipeline, send_busy_ns, pipe_now_ns() - start);
+    }
+    pipe_free(pipeline, workers_ready);
+    return rc;
+}
+
+// Send one UPLOAD frame without waiting for the answer. The content is hashed as it
+// is sent and the frame closes with its SHA-256, the server stores it only if they agree.
+// With --no-verify there is no trailer and a plain connection sends the file with sendfile() alone.
+// 1: file skipped locally; 0: sent; -1: the connection is unusable
+static int send_upload(int sock_fd, const char *path) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    uint8_t head[PROTO_HEADER_SIZE + PROTO_UPLOAD_META_SIZE + PROTO_MAX_NAME];
+    uint8_t digest[PROTO_HASH_SIZE];
+    struct stat file_stat;
+    const char *name;
+
+    EVP_MD_CTX *sha = g_verify ? EVP_MD_CTX_new() : NULL;
+    if (g_verify && (!sha || !EVP_DigestInit_ex(sha, EVP_sha256(), NULL))) {
+        log_error("Failed to set up SHA-256.");
+        EVP_MD_CTX_free(sha);
+        return 1;
+    }
+    int file_fd = open_upload_source(path, &file_stat, &name);
+    if (file_fd == -1) {
+        EVP_MD_CTX_free(sha);
+        return 1;
+    }
+    long long filesize = file_stat.st_size;
+    pending_t *pending = pending_add(REQ_UPLOAD);
+
+    snprintf(log_buf, sizeof(log_buf), "[#%u] Uploading '%s' (%lld bytes).", pending->stream_id, path, filesize);
+    log_info(log_buf);
+
+    size_t head_len = proto_upload_encode(head, pending->stream_id, name, (uint64_t)filesize, sha != NULL);
+    if (send_all(sock_fd, head, head_len) == -1) {
+        log_error("Error sending UPLOAD request to server.");
+        log_perror("send");
+        close(file_fd);
+        EVP_MD_CTX_free(sha);
+        return -1;
+    }
+
+    // Once the header is out the frame must be completed
+    posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    int sent = secure_of(sock_fd) && filesize >= PIPE_MIN_SIZE ? send_file_piped(sock_fd, file_fd, 0, (uint64_t)filesize, sha)
+                                                              : send_file_range(sock_fd, file_fd, 0, (uint64_t)filesize, sha);
+    close(file_fd);
+    if (sent == -1) {
+        log_error("Error sending file data to server (file shrank while sending?).");
+        log_perror("send");
+        EVP_MD_CTX_free(sha);
+        return -1;
+    }
+    if (sha) {
+        int sealed = EVP_DigestFinal_ex(sha, digest, NULL);
+        EVP_MD_CTX_free(sha);
+        if (!sealed || send_all(sock_fd, digest, sizeof(digest)) == -1) {
+            log_error("Error sending file digest to server.");
+            return -1;
+        }
+    }
+    g_totals.files++;
+    g_totals.bytes += (uint64_t)filesize;
+    return 0;
+}
+
+// Small files waiting to go out together in one BATCH frame
+static uint8_t g_batch_buf[PROTO_HEADER_SIZE + PROTO_MAX_BATCH];
+static struct {
+    size_t len;            // payload bytes packed behind the header
+    uint32_t count;
+    char *names;           // handed to the pending request once the frame is sent
+    size_t names_len;
+} g_batch;
+
+// Send the packed BATCH frame, if any, without waiting for the answer.
+// 0: sent or nothing to send; -1: the connection is unusable
+static int batch_flush(int sock_fd) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+
+    if (g_batch.count == 0) {
+        return 0;
+    }
+    if (wait_for_window(sock_fd) == -1) {
+        return -1;
+    }
+    pending_t *pending = pending_add(REQ_BATCH);
+    pending->len = g_batch.count;
+    pending->names = g_batch.names;
+
+    proto_put_u32(g_batch_buf + PROTO_HEADER_SIZE, g_batch.count);
+    proto_header_encode(g_batch_buf, PROTO_OP_BATCH, pending->stream_id, g_batch.len);
+    snprintf(log_buf, sizeof(log_buf), "[#%u] Uploading a batch of %u file(s) (%zu bytes).", pending->stream_id, g_batch.count, g_batch.len);
+    log_info(log_buf);
+
+    int sent = send_all(sock_fd, g_batch_buf, PROTO_HEADER_SIZE + g_batch.len);
+    memset(&g_batch, 0, sizeof(g_batch));   // the names now belong to the pending request
+    if (sent == -1) {
+        log_error("Error sending BATCH request to server.");
+        log_perror("send");
+        return -1;
+    }
+    return 0;
+}
+
+// Pack one file into the batch, sending the batch first when the file does not fit.
+// A file too large for any batch travels as its own UPLOAD.
+// 1: file skipped locally; 0: packed or sent; -1: the connection is unusable
+static int batch_add(int sock_fd, const char *path) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    struct stat file_stat;
+    const char *name;
+
+    int file_fd = open_upload_source(path, &file_stat, &name);
+    if (file_fd == -1) {
+        return 1;
+    }
+    size_t name_len = strlen(name);
+    uint64_t entry_len = PROTO_BATCH_ENTRY_META_SIZE + name_len + (uint64_t)file_stat.st_size + PROTO_HASH_SIZE;
+    if (entry_len > PROTO_MAX_BATCH - PROTO_BATCH_META_SIZE) {
+        close(file_fd);
+        if (wait_for_window(sock_fd) == -1) return -1;
+        return send_upload(sock_fd, path);
+    }
+    if (g_batch.count == PROTO_MAX_BATCH_FILES || g_batch.len + entry_len > PROTO_MAX_BATCH) {
+        if (batch_flush(sock_fd) == -1) {
+            close(file_fd);
+            return -1;
+        }
+    }
+
+    char *names = realloc(g_batch.names, g_batch.names_len + name_len + 1);
+    if (!names) {
+        log_error("Out of memory while packing a batch.");
+        close(file_fd);
+        return 1;
+    }
+    g_batch.names = names;
+    if (g_batch.count == 0) {
+        g_batch.len = PROTO_BATCH_META_SIZE;
+    }
+
+    uint8_t *entry = g_batch_buf + PROTO_HEADER_SIZE + g_batch.len;
+    uint8_t *data = entry + PROTO_BATCH_ENTRY_META_SIZE + name_len;
+    size_t size = (size_t)file_stat.st_size;
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(file_fd, data + got, size - got);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    close(file_fd);
+    if (got != size) {
+        snprintf(log_buf, sizeof(log_buf), "Error: could not read all of '%s', left out of the batch.", path);
+        log_error(log_buf);
+        return 1;
+    }
+    if (!EVP_Digest(data, size, data + size, NULL, EVP_sha256(), NULL)) {
+        log_error("Failed to hash a batched file.");
+        return 1;
+    }
+    proto_put_u32(entry, (uint32_t)size);
+    proto_put_u16(entry + 4, (uint16_t)name_len);
+    memcpy(entry + PROTO_BATCH_ENTRY_META_SIZE, name, name_len);
+    memcpy(g_batch.names + g_batch.names_len, name, name_len + 1);
+    g_batch.names_len += name_len + 1;
+    g_batch.len += (size_t)entry_len;
+    g_batch.count++;
+    g_totals.files++;
+    g_totals.bytes += size;
+    return 0;
+}
+
+// Resumable uploads are keyed by name, size and modification time, so a rerun
+// after a crash finds its partial file while a changed file starts over
+static uint64_t upload_id(const char *name, const struct stat *file_stat) {
+    uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+    uint64_t fields[3] = { (uint64_t)file_stat->st_size, (uint64_t)file_stat->st_mtim.tv_sec, (uint64_t)file_stat->st_mtim.tv_nsec };
+
+    for (const char *p = name; *p; p++) {
+        hash = (hash ^ (uint8_t)*p) * 0x100000001b3ULL;
+    }
+    for (size_t i = 0; i < sizeof(fields); i++) {
+        hash = (hash ^ ((const uint8_t *)fields)[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Read one chunk from the file and send it as a CHUNK frame
+static int send_chunk(int sock_fd, int file_fd, uint64_t id, uint64_t offset, size_t len) {
+    uint8_t *meta = g_chunk_buf + PROTO_HEADER_SIZE;
+    uint8_t *data = meta + PROTO_CHUNK_META_SIZE;
+
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = pread(file_fd, data + done, len - done, (off_t)(offset + done));
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            log_error("Error reading from local file (did it shrink?).");
+            return -2;
+        }
+        done += (size_t)n;
+    }
+
+    pending_t *pending = pending_add(REQ_CHUNK);
+    pending->offset = offset;
+    pending->len = len;
+
+    proto_header_encode(g_chunk_buf, PROTO_OP_CHUNK, pending->stream_id, PROTO_CHUNK_META_SIZE + len);
+    proto_put_u64(meta, id);
+    proto_put_u64(meta + 8, offset);
+    proto_put_u32(meta + 16, proto_crc32c(data, len));
+    if (send_all(sock_fd, g_chunk_buf, PROTO_HEADER_SIZE + PROTO_CHUNK_META_SIZE + len) == -1) {
+        log_error("Error sending file data to server.");
+        return -1;
+    }
+    return 0;
+}
+
+// One attempt at a resumable upload over an open connection.
+// 0: complete; -1: connection lost, try again; -2: give up on this file
+static int resume_pass(int sock_fd, int file_fd, uint64_t id, const char *name, uint64_t size) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    uint8_t request[PROTO_HEADER_SIZE + PROTO_RESUME_META_SIZE + PROTO_MAX_NAME];
+    size_t name_len = strlen(name);
+
+    memset(&g_resume, 0, sizeof(g_resume));
+    if (wait_for_window(sock_fd) == -1) return -1;
+    pending_t *pending = pending_add(REQ_RESUME);
+
+    proto_header_encode(request, PROTO_OP_RESUME, pending->stream_id, PROTO_RESUME_META_SIZE + name_len);
+    proto_put_u64(request + PROTO_HEADER_SIZE, id);
+    proto_put_u64(request + PROTO_HEADER_SIZE + 8, size);
+    proto_put_u32(request + PROTO_HEADER_SIZE + 16, RESUME_CHUNK_SIZE);
+    proto_put_u16(request + PROTO_HEADER_SIZE + 20, (uint16_t)name_len);
+    memcpy(request + PROTO_HEADER_SIZE + PROTO_RESUME_META_SIZE, name, name_len);
+    if (send_all(sock_fd, request, PROTO_HEADER_SIZE + PROTO_RESUME_META_SIZE + name_len) == -1) {
+        return -1;
+    }
+    while (!g_resume.have_offset && !g_resume.failed) {
+        if (read_replies(sock_fd, 1) == -1) return -1;
+    }
+    if (g_resume.failed || g_resume.offset > size) {
+        return -2;
+    }
+    if (size == 0) {
+        log_info("File upload successful!");
+        return 0;
+    }
+
+    snprintf(log_buf, sizeof(log_buf), "Server has %llu of %llu bytes of '%s', sending the rest.",
+             (unsigned long long)g_resume.offset, (unsigned long long)size, name);
+    log_info(log_buf);
+
+    // Chunks are pipelined; the ones the server rejects are sent again
+    uint64_t next = g_resume.offset;
+    g_resume.acked = g_resume.offset;
+    while (g_resume.acked < size && !g_resume.failed) {
+        while (g_outstanding < PIPELINE_WINDOW && (g_resume.resend_count > 0 || next < size)) {
+            uint64_t offset = g_resume.resend_count > 0 ? g_resume.resend[--g_resume.resend_count] : next;
+            size_t len = size - offset < RESUME_CHUNK_SIZE ? (size_t)(size - offset) : RESUME_CHUNK_SIZE;
+            if (offset == next) next += len;
+
+            int rc = send_chunk(sock_fd, file_fd, id, offset, len);
+            if (rc != 0) return rc;
+        }
+        if (read_replies(sock_fd, 1) == -1) return -1;
+    }
+    return g_resume.failed ? -2 : 0;
+}
+
+// Upload a file in checksummed chunks, reconnecting and continuing from the
+// server's checkpoint if the connection drops. -1 if no connection is left.
+static int upload_resumable(int *sock_fd, const struct sockaddr_in *server_addr, const char *path) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    struct stat file_stat;
+    const char *name;
+
+    int file_fd = open_upload_source(path, &file_stat, &name);
+    if (file_fd == -1) {
+        return 0;
+    }
+    uint64_t id = upload_id(name, &file_stat);
+
+    snprintf(log_buf, sizeof(log_buf), "Resumable upload of '%s' (%lld bytes), id %016llx.", path, (long long)file_stat.st_size, (unsigned long long)id);
+    log_info(log_buf);
+
+    for (int attempt = 1; attempt <= MAX_RETRY_ATTEMPTS; attempt++) {
+        if (*sock_fd == -1) {
+            *sock_fd = connect_to_server(server_addr);
+            if (*sock_fd == -1) break;
+        }
+        int rc = resume_pass(*sock_fd, file_fd, id, name, (uint64_t)file_stat.st_size);
+        if (rc != -1) {
+            if (rc == -2) {
+                snprintf(log_buf, sizeof(log_buf), "Resumable upload of '%s' failed.", path);
+                log_error(log_buf);
+            }
+            close(file_fd);
+            return 0;
+        }
+        snprintf(log_buf, sizeof(log_buf), "Connection lost while uploading '%s', reconnecting to resume (%d/%d)...", path, attempt, MAX_RETRY_ATTEMPTS);
+        log_error(log_buf);
+        sock_close(*sock_fd);
+        *sock_fd = -1;
+        sleep(1);
+    }
+    close(file_fd);
+    return -1;
+}
+
+typedef struct {
+    uint64_t offset;
+    uint32_t len;
+    uint8_t hash[PROTO_HASH_SIZE];
+} dedup_chunk_t;
+
+static int compare_chunk_hash(const void *a, const void *b) {
+    return memcmp((*(const dedup_chunk_t *const *)a)->hash, (*(const dedup_chunk_t *const *)b)->hash, PROTO_HASH_SIZE);
+}
+
+// Cut the file into content-defined chunks, ask the server which it stores already,
+// send only the others and then the manifest listing them all.
+// 1: file skipped locally; 0: sent; -1: the connection is unusable
+static int upload_dedup(int sock_fd, const char *path) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    uint8_t frame[PROTO_HEADER_SIZE + PROTO_MANIFEST_META_SIZE + PROTO_MAX_NAME];
+    uint8_t entries[PROTO_MANIFEST_ENTRY_SIZE * 128];
+    struct stat file_stat;
+    const char *name;
+
+    int file_fd = open_upload_source(path, &file_stat, &name);
+    if (file_fd == -1) {
+        return 1;
+    }
+    size_t size = (size_t)file_stat.st_size;
+    if (size == 0) {
+        close(file_fd);
+        return send_upload(sock_fd, path); // nothing to cut
+    }
+    const uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+    close(file_fd);
+    if (data == MAP_FAILED) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to map '%s': %s", path, strerror(errno));
+        log_error(log_buf);
+        return 1;
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    // Chunk and hash the whole file up front, both sides cut at the same places
+    size_t cap = size / CDC_AVG_SIZE + 16;
+    size_t count = 0;
+    dedup_chunk_t *chunks = malloc(cap * sizeof(*chunks));
+    dedup_chunk_t **distinct = NULL;
+    int rc = 1;
+    cdc_t cdc = { 0 };
+    for (size_t pos = 0, start = 0; pos < size && chunks; ) {
+        int cut;
+        pos += cdc_feed(&cdc, data + pos, size - pos, &cut);
+        if (!cut && pos < size) continue;
+        if (count == cap) {
+            dedup_chunk_t *grown = realloc(chunks, cap * 2 * sizeof(*chunks));
+            if (!grown) {
+                free(chunks);
+                chunks = NULL;
+                break;
+            }
+            chunks = grown;
+            cap *= 2;
+        }
+        chunks[count] = (dedup_chunk_t){ .offset = start, .len = (uint32_t)(pos - start) };
+        if (!EVP_Digest(data + start, pos - start, chunks[count].hash, NULL, EVP_sha256(), NULL)) {
+            free(chunks);
+            chunks = NULL;
+            break;
+        }
+        count++;
+        start = pos;
+    }
+    if (chunks) {
+        distinct = malloc(count * sizeof(*distinct));
+        g_dedup.present = calloc(count, 1);
+    }
+    if (!chunks || !distinct || !g_dedup.present) {
+        log_error("Out of memory while chunking the file.");
+        goto out;
+    }
+
+    // A chunk repeated inside the file is asked about and sent once
+    for (size_t i = 0; i < count; i++) distinct[i] = &chunks[i];
+    qsort(distinct, count, sizeof(*distinct), compare_chunk_hash);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique == 0 || memcmp(distinct[unique - 1]->hash, distinct[i]->hash, PROTO_HASH_SIZE) != 0) {
+            distinct[unique++] = distinct[i];
+        }
+    }
+
+    rc = -1;
+    g_dedup.have_left = 0;
+    g_dedup.failed = 0;
+    for (size_t first = 0; first < unique; first += HAVE_BATCH) {
+        size_t batch = unique - first < HAVE_BATCH ? unique - first : HAVE_BATCH;
+        if (wait_for_window(sock_fd) == -1) goto out;
+        pending_t *pending = pending_add(REQ_HAVE);
+        pending->offset = first;
+        pending->len = batch;
+        g_dedup.have_left++;
+
+        proto_header_encode(frame, PROTO_OP_HAVE, pending->stream_id, batch * PROTO_HASH_SIZE);
+        if (send_all(sock_fd, frame, PROTO_HEADER_SIZE) == -1) goto out;
+        for (size_t i = 0; i < batch; i++) {
+            if (send_all(sock_fd, distinct[first + i]->hash, PROTO_HASH_SIZE) == -1) goto out;
+        }
+    }
+    while (g_dedup.have_left > 0) {
+        if (read_replies(sock_fd, 1) == -1) goto out;
+    }
+    if (g_dedup.failed) {
+        rc = 0;
+        goto out;
+    }
+
+    // Requests run in order on the server, every BLOB is stored before the MANIFEST is read
+    size_t sent = 0;
+    uint64_t sent_bytes = 0;
+    for (size_t i = 0; i < unique; i++) {
+        if (g_dedup.present[i]) continue;
+        if (wait_for_window(sock_fd) == -1) goto out;
+        pending_t *pending = pending_add(REQ_BLOB);
+        proto_header_encode(frame, PROTO_OP_BLOB, pending->stream_id, PROTO_HASH_SIZE + distinct[i]->len);
+        memcpy(frame + PROTO_HEADER_SIZE, distinct[i]->hash, PROTO_HASH_SIZE);
+        if (send_all(sock_fd, frame, PROTO_HEADER_SIZE + PROTO_HASH_SIZE) == -1
+            || send_all(sock_fd, data + distinct[i]->offset, distinct[i]->len) == -1) {
+            goto out;
+        }
+        sent++;
+        sent_bytes += distinct[i]->len;
+    }
+
+    if (wait_for_window(sock_fd) == -1) goto out;
+    pending_t *pending = pending_add(REQ_UPLOAD);
+    size_t name_len = strlen(name);
+    proto_header_encode(frame, PROTO_OP_MANIFEST, pending->stream_id,
+                        PROTO_MANIFEST_META_SIZE + name_len + (uint64_t)count * PROTO_MANIFEST_ENTRY_SIZE);
+    proto_put_u64(frame + PROTO_HEADER_SIZE, size);
+    proto_put_u32(frame + PROTO_HEADER_SIZE + 8, (uint32_t)count);
+    proto_put_u16(frame + PROTO_HEADER_SIZE + 12, (uint16_t)name_len);
+    memcpy(frame + PROTO_HEADER_SIZE + PROTO_MANIFEST_META_SIZE, name, name_len);
+    if (send_all(sock_fd, frame, PROTO_HEADER_SIZE + PROTO_MANIFEST_META_SIZE + name_len) == -1) goto out;
+    for (size_t i = 0; i < count; ) {
+        size_t n = 0;
+        for (; i < count && n < sizeof(entries); i++, n += PROTO_MANIFEST_ENTRY_SIZE) {
+            memcpy(entries + n, chunks[i].hash, PROTO_HASH_SIZE);
+            proto_put_u32(entries + n + PROTO_HASH_SIZE, chunks[i].len);
+        }
+        if (send_all(sock_fd, entries, n) == -1) goto out;
+    }
+
+    snprintf(log_buf, sizeof(log_buf), "[#%u] Deduplicated upload of '%s' (%zu bytes): %zu chunks, %zu distinct, %zu sent (%llu bytes).",
+             pending->stream_id, path, size, count, unique, sent, (unsigned long long)sent_bytes);
+    log_info(log_buf);
+    rc = 0;
+
+out:
+    if (rc == -1) {
+        log_error("Error sending deduplicated upload to server.");
+    }
+    free(g_dedup.present);
+    g_dedup.present = NULL;
+    free(distinct);
+    free(chunks);
+    munmap((void *)data, size);
+    return rc;
+}
+
+// DELTA frames of an upload being filled: instructions go behind the meta and the name,
+// a run of copied blocks is held back until it stops growing
+typedef struct {
+    int sock_fd;
+    uint8_t *frame;        // PROTO_HEADER_SIZE + PROTO_MAX_DELTA
+    size_t len;            // payload bytes in it
+    size_t start;          // where its instructions begin
+    uint32_t stream_id;
+    uint32_t run_first;
+    uint32_t run_count;
+    uint64_t literal;      // bytes sent as DATA
+    uint64_t blocks;       // blocks copied
+} delta_out_t;
+
+// Send the frame filled so far; the last one closes with the SHA-256 of the file
+static int delta_flush(delta_out_t *out, const uint8_t *digest) {
+    uint8_t *payload = out->frame + PROTO_HEADER_SIZE;
+    payload[14] = digest ? PROTO_DELTA_LAST : 0;
+    if (digest) {
+        memcpy(payload + out->len, digest, PROTO_HASH_SIZE);
+        out->len += PROTO_HASH_SIZE;
+    }
+    proto_header_encode(out->frame, PROTO_OP_DELTA, out->stream_id, out->len);
+    if (send_all(out->sock_fd, out->frame, PROTO_HEADER_SIZE + out->len) == -1) {
+        return -1;
+    }
+    out->len = out->start;
+    return 0;
+}
+
+// Room left in the frame; the digest of the last one always fits behind it
+static size_t delta_room(const delta_out_t *out) {
+    return PROTO_MAX_DELTA - PROTO_HASH_SIZE - out->len;
+}
+
+static int delta_put_run(delta_out_t *out) {
+    if (out->run_count == 0) {
+        return 0;
+    }
+    if (delta_room(out) < 9 && delta_flush(out, NULL) == -1) {
+        return -1;
+    }
+    uint8_t *p = out->frame + PROTO_HEADER_SIZE + out->len;
+    p[0] = PROTO_DELTA_COPY;
+    proto_put_u32(p + 1, out->run_first);
+    proto_put_u32(p + 5, out->run_count);
+    out->len += 9;
+    out->blocks += out->run_count;
+    out->run_count = 0;
+    return 0;
+}
+
+static int delta_put_copy(delta_out_t *out, uint32_t block) {
+    if (out->run_count > 0 && out->run_first + out->run_count == block) {
+        out->run_count++;
+        return 0;
+    }
+    if (delta_put_run(out) == -1) {
+        return -1;
+    }
+    out->run_first = block;
+    out->run_count = 1;
+    return 0;
+}
+
+static int delta_put_data(delta_out_t *out, const uint8_t *data, size_t len) {
+    if (len > 0 && delta_put_run(out) == -1) {
+        return -1;
+    }
+    while (len > 0) {
+        if (delta_room(out) < 5 + 1 && delta_flush(out, NULL) == -1) {
+            return -1;
+        }
+        size_t n = len < delta_room(out) - 5 ? len : delta_room(out) - 5;
+        uint8_t *p = out->frame + PROTO_HEADER_SIZE + out->len;
+        p[0] = PROTO_DELTA_DATA;
+        proto_put_u32(p + 1, (uint32_t)n);
+        memcpy(p + 5, data, n);
+        out->len += 5 + n;
+        out->literal += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Block of the server's copy whose content is data[0..len), or -1. Its rolling checksum
+// is `sum`; `likely` is tried first, the block following the last one copied.
+static int64_t delta_find(const uint32_t *heads, const uint32_t *next, uint32_t mask, uint32_t likely,
+                          uint32_t sum, const uint8_t *data, size_t len) {
+    uint8_t hash[PROTO_HASH_SIZE];
+    int hashed = 0;
+
+    if (likely < g_delta.block_count && proto_get_u32(g_delta.sums + (size_t)likely * PROTO_SUMS_ENTRY_SIZE) == sum) {
+        if (!EVP_Digest(data, len, hash, NULL, EVP_sha256(), NULL)) return -1;
+        hashed = 1;
+        if (memcmp(g_delta.sums + (size_t)likely * PROTO_SUMS_ENTRY_SIZE + 4, hash, PROTO_HASH_SIZE) == 0) return likely;
+    }
+    for (uint32_t b = heads[DELTA_BUCKET(sum) & mask]; b != UINT32_MAX; b = next[b]) {
+        const uint8_t *entry = g_delta.sums + (size_t)b * PROTO_SUMS_ENTRY_SIZE;
+        if (proto_get_u32(entry) != sum) continue;
+        if (!hashed && !EVP_Digest(data, len, hash, NULL, EVP_sha256(), NULL)) return -1;
+        hashed = 1;
+        if (memcmp(entry + 4, hash, PROTO_HASH_SIZE) == 0) return b;
+    }
+    return -1;
+}
+
+// Find the blocks of the server's copy in the file, rsync-style: a block-sized window
+// rolls over it a byte at a time until its checksums match a block, and jumps a whole
+// block when one does. What lies between matches goes out as literal bytes.
+static int delta_encode(delta_out_t *out, const uint8_t *data, size_t size) {
+    size_t bs = g_delta.block_size;
+    uint32_t full = (uint32_t)(g_delta.base_size / bs);   // the short last block is matched at the end only
+    uint32_t buckets = 1;
+    while (buckets < full) buckets <<= 1;
+    uint32_t *heads = malloc(buckets * sizeof(*heads));
+    uint32_t *next = malloc((full ? full : 1) * sizeof(*next));
+    if (!heads || !next) {
+        free(heads);
+        free(next);
+        log_error("Out of memory while indexing block checksums.");
+        return -1;
+    }
+    memset(heads, 0xFF, buckets * sizeof(*heads));
+    for (uint32_t b = full; b-- > 0; ) {
+        uint32_t *head = &heads[DELTA_BUCKET(proto_get_u32(g_delta.sums + (size_t)b * PROTO_SUMS_ENTRY_SIZE)) & (buckets - 1)];
+        next[b] = *head;
+        *head = b;
+    }
+
+    int rc = 0;
+    size_t literal = 0;   // start of the bytes no block was found for
+    size_t pos = 0;
+    uint32_t likely = UINT32_MAX;
+    if (full > 0 && size >= bs) {
+        uint32_t sum = proto_rolling_sum(data, bs);
+        for (;;) {
+            int64_t block = delta_find(heads, next, buckets - 1, likely, sum, data + pos, bs);
+            if (block >= 0) {
+                if (delta_put_data(out, data + literal, pos - literal) == -1 || delta_put_copy(out, (uint32_t)block) == -1) {
+                    rc = -1;
+                    break;
+                }
+                pos += bs;
+                literal = pos;
+                likely = (uint32_t)block + 1;
+                if (size - pos < bs) break;
+                sum = proto_rolling_sum(data + pos, bs);
+                continue;
+            }
+            if (size - pos == bs) break;
+            sum = proto_rolling_roll(sum, bs, data[pos], data[pos + bs]);
+            pos++;
+            // No block can start before pos any more: the bytes behind it can go
+            if (pos - literal >= PROTO_MAX_DELTA) {
+                if (delta_put_data(out, data + literal, pos - literal) == -1) {
+                    rc = -1;
+                    break;
+                }
+                literal = pos;
+            }
+        }
+    }
+
+    // The file may still end like the server's copy does, with its short last block
+    size_t tail = (size_t)(g_delta.base_size % bs);
+    if (rc == 0 && tail > 0 && size - literal >= tail
+        && delta_find(heads, next, buckets - 1, full, proto_rolling_sum(data + size - tail, tail), data + size - tail, tail) == full) {
+        if (delta_put_data(out, data + literal, size - tail - literal) == -1 || delta_put_copy(out, full) == -1) {
+            rc = -1;
+        }
+        literal = size;
+    }
+    if (rc == 0 && (delta_put_data(out, data + literal, size - literal) == -1 || delta_put_run(out) == -1)) {
+        rc = -1;
+    }
+    free(heads);
+    free(next);
+    return rc;
+}
+
+// Block size asked for: about the square root of the file size, as rsync picks it
+static uint32_t delta_block_size(uint64_t size) {
+    uint32_t bs = DELTA_MIN_BLOCK;
+    while (bs < DELTA_MAX_BLOCK && (uint64_t)bs * bs < size) bs <<= 1;
+    return bs;
+}
+
+// Send the file as its changes against the copy the server stores under the same name:
+// ask for the checksums of that copy's blocks, find them in the file and send DELTA
+// frames copying them and carrying the bytes in between. Without a usable copy on the
+// server the file is uploaded whole.
+// 1: file skipped locally; 0: sent; -1: the connection is unusable
+static int upload_delta(int sock_fd, const char *path) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    uint8_t frame[PROTO_HEADER_SIZE + PROTO_SIGNATURE_META_SIZE + PROTO_MAX_NAME];
+    uint8_t digest[PROTO_HASH_SIZE];
+    struct stat file_stat;
+    const char *name;
+
+    int file_fd = open_upload_source(path, &file_stat, &name);
+    if (file_fd == -1) {
+        return 1;
+    }
+    size_t size = (size_t)file_stat.st_size;
+    size_t name_len = strlen(name);
+    const uint8_t *data = NULL;
+    delta_out_t out = { .sock_fd = sock_fd };
+    int rc = -1;
+
+    free(g_delta.sums);
+    memset(&g_delta, 0, sizeof(g_delta));
+    if (wait_for_window(sock_fd) == -1) goto out;
+    pending_t *pending = pending_add(REQ_SIGNATURE);
+    uint32_t stream_id = pending->stream_id;
+    proto_header_encode(frame, PROTO_OP_SIGNATURE, stream_id, PROTO_SIGNATURE_META_SIZE + name_len);
+    proto_put_u32(frame + PROTO_HEADER_SIZE, delta_block_size(size));
+    proto_put_u16(frame + PROTO_HEADER_SIZE + 4, (uint16_t)name_len);
+    memcpy(frame + PROTO_HEADER_SIZE + PROTO_SIGNATURE_META_SIZE, name, name_len);
+    if (send_all(sock_fd, frame, PROTO_HEADER_SIZE + PROTO_SIGNATURE_META_SIZE + name_len) == -1) goto out;
+    while (!g_delta.done) {
+        if (read_replies(sock_fd, 1) == -1) goto out;
+    }
+    if (g_delta.failed) {
+        snprintf(log_buf, sizeof(log_buf), "[#%u] No checksums of '%s' from the server, uploading it whole.", stream_id, name);
+        log_info(log_buf);
+        close(file_fd);
+        file_fd = -1;
+        rc = send_upload(sock_fd, path);
+        goto out;
+    }
+
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+            snprintf(log_buf, sizeof(log_buf), "Failed to map '%s': %s", path, strerror(errno));
+            log_error(log_buf);
+            rc = 1;
+            goto out;
+        }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+    out.frame = malloc(PROTO_HEADER_SIZE + PROTO_MAX_DELTA);
+    if (!out.frame || !EVP_Digest(data, size, digest, NULL, EVP_sha256(), NULL)) {
+        log_error("Out of memory while preparing a delta upload.");
+        rc = 1;
+        goto out;
+    }
+
+    if (wait_for_window(sock_fd) == -1) goto out;
+    pending = pending_add(REQ_DELTA);
+    out.stream_id = pending->stream_id;
+    uint8_t *meta = out.frame + PROTO_HEADER_SIZE;
+    proto_put_u64(meta, size);
+    proto_put_u32(meta + 8, g_delta.block_size);
+    proto_put_u16(meta + 12, (uint16_t)name_len);
+    memcpy(meta + PROTO_DELTA_META_SIZE, name, name_len);
+    out.start = out.len = PROTO_DELTA_META_SIZE + name_len;
+    if (delta_encode(&out, data, size) == -1 || delta_flush(&out, digest) == -1) goto out;
+
+    snprintf(log_buf, sizeof(log_buf), "[#%u] Delta upload of '%s' (%zu bytes): %llu block(s) of %u bytes reused, %llu bytes sent.",
+             out.stream_id, path, size, (unsigned long long)out.blocks, g_delta.block_size, (unsigned long long)out.literal);
+    log_info(log_buf);
+    while (!g_delta.answered) {
+        if (read_replies(sock_fd, 1) == -1) goto out;
+    }
+    // The server's copy changed or went away since it sent the checksums
+    if (g_delta.status == PROTO_STATUS_BAD_CHECKSUM || g_delta.status == PROTO_STATUS_NOT_FOUND) {
+        snprintf(log_buf, sizeof(log_buf), "[#%u] Uploading '%s' whole instead.", out.stream_id, name);
+        log_info(log_buf);
+        close(file_fd);
+        file_fd = -1;
+        rc = send_upload(sock_fd, path);
+        goto out;
+    }
+    g_totals.files++;
+    g_totals.bytes += size;
+    if (g_delta.status == PROTO_STATUS_OK) g_totals.stored++;
+    else g_totals.failed++;
+    rc = 0;
+
+out:
+    if (rc == -1) {
+        log_error("Error sending delta upload to server.");
+    }
+    if (file_fd != -1) close(file_fd);
+    if (data) munmap((void *)data, size);
+    free(out.frame);
+    free(g_delta.sums);
+    g_delta.sums = NULL;
+    return rc;
+}
+
+// One more connection for a worker thread: connect once and wait for the greeting, no retries
+static int open_worker_connection(const struct sockaddr_in *server_addr) {
+    char log_buf[SMALL_BUF_SIZE];
+    uint8_t payload[PROTO_MAX_CONTROL];
+    proto_header_t header;
+
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd == -1 || connect(sock_fd, (const struct sockaddr *)server_addr, sizeof(*server_addr)) == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Worker connection failed: %s", strerror(errno));
+        log_error(log_buf);
+        if (sock_fd != -1) close(sock_fd);
+        return -1;
+    }
+    if (recv_frame(sock_fd, &header, payload, sizeof(payload)) == -1 || header.opcode != PROTO_OP_HELLO) {
+        log_error("Worker connection was not accepted by the server.");
+        close(sock_fd);
+        return -1;
+    }
+    if (g_encrypt && secure_handshake(sock_fd) == -1) {
+        close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+typedef struct {
+    const struct sockaddr_in *server_addr;
+    int file_fd;
+    const char *name;
+    uint64_t id;
+    uint64_t size;
+    uint64_t stripe_size;
+    uint32_t stripe_count;
+    uint32_t first;          // this worker sends stripes first, first + stride, ...
+    uint32_t stride;
+    uint64_t bytes_sent;     // results, read by the main thread after join
+    int failed;
+    int completed;           // this worker's stripe finished the file
+} stripe_job_t;
+
+// Send one STRIPE frame: head, name, then the stripe read straight from the file
+static int send_stripe(int sock_fd, const stripe_job_t *job, uint32_t stream_id, uint32_t index) {
+    uint8_t head[PROTO_HEADER_SIZE + PROTO_STRIPE_META_SIZE + PROTO_MAX_NAME];
+    size_t name_len = strlen(job->name);
+    uint64_t offset = (uint64_t)index * job->stripe_size;
+    uint64_t len = job->size - offset < job->stripe_size ? job->size - offset : job->stripe_size;
+
+    proto_header_encode(head, PROTO_OP_STRIPE, stream_id, PROTO_STRIPE_META_SIZE + name_len + len);
+    uint8_t *meta = head + PROTO_HEADER_SIZE;
+    proto_put_u64(meta, job->id);
+    proto_put_u64(meta + 8, job->size);
+    proto_put_u64(meta + 16, job->stripe_size);
+    proto_put_u32(meta + 24, index);
+    proto_put_u16(meta + 28, (uint16_t)name_len);
+    memcpy(meta + PROTO_STRIPE_META_SIZE, job->name, name_len);
+    if (send_all(sock_fd, head, PROTO_HEADER_SIZE + PROTO_STRIPE_META_SIZE + name_len) == -1) {
+        return -1;
+    }
+
+    return send_file_range(sock_fd, job->file_fd, offset, len, NULL);
+}
+
+// One connection of a striped upload: send every stripe assigned to it, then collect the answers
+static void *stripe_worker(void *arg) {
+    stripe_job_t *job = arg;
+    char log_buf[SMALL_BUF_SIZE * 2];
+    uint8_t payload[PROTO_MAX_CONTROL];
+    proto_header_t header;
+    uint32_t sent = 0;
+
+    job->failed = 1;
+    int sock_fd = open_worker_connection(job->server_addr);
+    if (sock_fd == -1) {
+        return NULL;
+    }
+
+    for (uint32_t index = job->first; index < job->stripe_count; index += job->stride) {
+        if (send_stripe(sock_fd, job, sent + 1, index) == -1) {
+            snprintf(log_buf, sizeof(log_buf), "Sending stripe %u failed: %s", index, strerror(errno));
+            log_error(log_buf);
+            sock_close(sock_fd);
+            return NULL;
+        }
+        uint64_t offset = (uint64_t)index * job->stripe_size;
+        job->bytes_sent += job->size - offset < job->stripe_size ? job->size - offset : job->stripe_size;
+        sent++;
+    }
+
+    // Every stripe gets one STATUS; the one that completed the file says so
+    int ok = 1;
+    for (uint32_t i = 0; i < sent; i++) {
+        if (recv_frame(sock_fd, &header, payload, sizeof(payload)) == -1
+            || header.opcode != PROTO_OP_STATUS || header.length < PROTO_STATUS_META_SIZE) {
+            log_error("Stripe connection lost before all stripes were answered.");
+            ok = 0;
+            break;
+        }
+        int text_len = (int)(header.length - PROTO_STATUS_META_SIZE);
+        if (text_len > SMALL_BUF_SIZE) text_len = SMALL_BUF_SIZE;
+        const char *text = (const char *)payload + PROTO_STATUS_META_SIZE;
+        if (proto_get_u16(payload) != PROTO_STATUS_OK) {
+            snprintf(log_buf, sizeof(log_buf), "[stripe #%u] Server reported an error: %.*s", header.stream_id, text_len, text);
+            log_error(log_buf);
+            ok = 0;
+        } else if (strncmp(text, "UPLOAD_SUCCESS", 14) == 0) {
+            snprintf(log_buf, sizeof(log_buf), "[stripe #%u] %.*s", header.stream_id, text_len, text);
+            log_info(log_buf);
+            job->completed = 1;
+        }
+    }
+    sock_close(sock_fd);
+    job->failed = !ok;
+    return NULL;
+}
+
+// Upload one file as stripes over several connections at once, each its own thread.
+// Uses fresh connections, so the interactive session is not involved.
+// 1: the file is empty and should go as a plain upload; 0: done; -1: failed
+static int upload_striped(const struct sockaddr_in *server_addr, const char *path) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    stripe_job_t jobs[MAX_STRIPE_CONNECTIONS];
+    pthread_t threads[MAX_STRIPE_CONNECTIONS];
+    struct stat file_stat;
+    struct timespec start, end;
+    const char *name;
+
+    int file_fd = open_upload_source(path, &file_stat, &name);
+    if (file_fd == -1) {
+        return -1;
+    }
+    uint64_t size = (uint64_t)file_stat.st_size;
+    if (size == 0) {
+        close(file_fd);
+        return 1;
+    }
+    uint64_t stripe_size = g_stripe_size ? g_stripe_size : (size + (uint64_t)g_stripe_connections - 1) / (uint64_t)g_stripe_connections;
+    if ((size - 1) / stripe_size >= PROTO_MAX_STRIPES) {
+        stripe_size = (size + PROTO_MAX_STRIPES - 1) / PROTO_MAX_STRIPES;
+    }
+    uint32_t stripe_count = (uint32_t)((size + stripe_size - 1) / stripe_size);
+    uint32_t workers = stripe_count < (uint32_t)g_stripe_connections ? stripe_count : (uint32_t)g_stripe_connections;
+
+    // Fresh per run: a stripe left over from an earlier, failed attempt must not match
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t id = upload_id(name, &file_stat) ^ ((uint64_t)getpid() << 32) ^ (uint64_t)start.tv_nsec ^ (uint64_t)time(NULL);
+
+    snprintf(log_buf, sizeof(log_buf), "Striped upload of '%s' (%llu bytes): %u stripe(s) of %llu bytes over %u connection(s).",
+             path, (unsigned long long)size, stripe_count, (unsigned long long)stripe_size, workers);
+    log_info(log_buf);
+
+    uint32_t started = 0;
+    for (; started < workers; started++) {
+        jobs[started] = (stripe_job_t){
+            .server_addr = server_addr, .file_fd = file_fd, .name = name, .id = id, .size = size,
+            .stripe_size = stripe_size, .stripe_count = stripe_count, .first = started, .stride = workers,
+        };
+        if (pthread_create(&threads[started], NULL, stripe_worker, &jobs[started]) != 0) {
+            log_error("Could not start a stripe thread.");
+            break;
+        }
+    }
+
+    uint64_t bytes_sent = 0;
+    int failed = started < workers;
+    int completed = 0;
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        bytes_sent += jobs[i].bytes_sent;
+        failed |= jobs[i].failed;
+        completed |= jobs[i].completed;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(file_fd);
+
+    double secs = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    if (failed || !completed) {
+        snprintf(log_buf, sizeof(log_buf), "Striped upload of '%s' failed.", path);
+        log_error(log_buf);
+        return -1;
+    }
+    snprintf(log_buf, sizeof(log_buf), "Striped upload of '%s' done: %llu bytes in %.2f s (%.1f MiB/s).",
+             path, (unsigned long long)bytes_sent, secs, secs > 0 ? (double)bytes_sent / (1024.0 * 1024.0) / secs : 0.0);
+    log_info(log_buf);
+    return 0;
+}
+
+typedef struct {
+    const struct sockaddr_in *server_addr;
+    int sock_fd;             // connection to use, -1 to open one
+    int file_fd;             // the local .part file
+    const char *name;
+    uint64_t offset;         // range this worker fetches
+    uint64_t length;
+    uint64_t received;       // results, read by the main thread after join
+    int failed;
+} fetch_job_t;
+
+// Ask for one range of a stored file and read the head of the DATA answer;
+// its content_len bytes are left on the socket. -1 after logging why not.
+static int request_range(int sock_fd, const char *name, uint64_t offset, uint64_t length, uint64_t *file_size, uint64_t *content_len) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    uint8_t request[PROTO_HEADER_SIZE + PROTO_DOWNLOAD_META_SIZE + PROTO_MAX_NAME];
+    uint8_t reply[PROTO_HEADER_SIZE + PROTO_STATUS_META_SIZE + SMALL_BUF_SIZE];
+    proto_header_t header;
+    size_t name_len = strlen(name);
+
+    proto_header_encode(request, PROTO_OP_DOWNLOAD, 1, PROTO_DOWNLOAD_META_SIZE + name_len);
+    proto_put_u64(request + PROTO_HEADER_SIZE, offset);
+    proto_put_u64(request + PROTO_HEADER_SIZE + 8, length);
+    proto_put_u16(request + PROTO_HEADER_SIZE + 16, (uint16_t)name_len);
+    memcpy(request + PROTO_HEADER_SIZE + PROTO_DOWNLOAD_META_SIZE, name, name_len);
+    if (send_all(sock_fd, request, PROTO_HEADER_SIZE + PROTO_DOWNLOAD_META_SIZE + name_len) == -1
+        || recv_all(sock_fd, reply, PROTO_HEADER_SIZE) == -1 || proto_header_decode(reply, &header) == -1) {
+        log_error("Download connection lost.");
+        return -1;
+    }
+    if (header.opcode == PROTO_OP_STATUS && header.length >= PROTO_STATUS_META_SIZE && header.length <= PROTO_STATUS_META_SIZE + SMALL_BUF_SIZE) {
+        int text_len = (int)header.length - PROTO_STATUS_META_SIZE;
+        if (recv_all(sock_fd, reply, (size_t)header.length) == 0) {
+            snprintf(log_buf, sizeof(log_buf), "Download of '%s': server reported an error: %.*s", name, text_len, (const char *)reply + PROTO_STATUS_META_SIZE);
+            log_error(log_buf);
+        }
+        return -1;
+    }
+    if (header.opcode != PROTO_OP_DATA || header.length < PROTO_DATA_META_SIZE
+        || recv_all(sock_fd, reply, PROTO_DATA_META_SIZE) == -1) {
+        log_error("Unexpected answer to DOWNLOAD.");
+        return -1;
+    }
+    *file_size = proto_get_u64(reply);
+    *content_len = header.length - PROTO_DATA_META_SIZE;
+    return 0;
+}
+
+// One connection of a download: fetch its range and store it at the same offset locally
+static void *fetch_worker(void *arg) {
+    fetch_job_t *job = arg;
+    char log_buf[SMALL_BUF_SIZE * 2];
+    char data_buf[BUFFER_SIZE * 16];
+    uint64_t file_size, content_len;
+
+    if (job->sock_fd == -1) {
+        job->sock_fd = open_worker_connection(job->server_addr);
+    }
+    if (job->sock_fd == -1 || request_range(job->sock_fd, job->name, job->offset, job->length, &file_size, &content_len) == -1) {
+        goto out;
+    }
+    if (content_len != job->length) {
+        snprintf(log_buf, sizeof(log_buf), "'%s' changed on the server during the download.", job->name);
+        log_error(log_buf);
+        goto out;
+    }
+
+    while (job->received < job->length) {
+        uint64_t left = job->length - job->received;
+        ssize_t got = sock_recv(job->sock_fd, data_buf, left < sizeof(data_buf) ? (size_t)left : sizeof(data_buf), 0);
+        if (got == -1 && errno == EINTR) continue;
+        if (got <= 0) {
+            log_error("Download connection lost.");
+            goto out;
+        }
+        for (ssize_t off = 0; off < got; ) {
+            ssize_t written = pwrite(job->file_fd, data_buf + off, (size_t)(got - off), (off_t)(job->offset + job->received + (uint64_t)off));
+            if (written == -1) {
+                if (errno == EINTR) continue;
+                snprintf(log_buf, sizeof(log_buf), "Error writing downloaded data: %s", strerror(errno));
+                log_error(log_buf);
+                goto out;
+            }
+            off += written;
+        }
+        job->received += (uint64_t)got;
+    }
+    job->failed = 0;
+
+out:
+    if (job->sock_fd != -1) sock_close(job->sock_fd);
+    return NULL;
+}
+
+// Fetch a stored file into the current directory, in ranges over several connections
+// when it is large. Content lands in <name>.part first: a rerun continues an interrupted
+// download from what that file holds, and it becomes <name> once complete.
+static int download_file(const struct sockaddr_in *server_addr, const char *name) {
+    char log_buf[SMALL_BUF_SIZE * 3];
+    char part_path[PROTO_MAX_NAME + 8];
+    fetch_job_t jobs[MAX_STRIPE_CONNECTIONS];
+    pthread_t threads[MAX_STRIPE_CONNECTIONS];
+    struct timespec start, end;
+    struct stat part_stat;
+    uint64_t size, content_len;
+
+    if (strchr(name, '/') || strlen(name) == 0 || strlen(name) > PROTO_MAX_NAME) {
+        snprintf(log_buf, sizeof(log_buf), "Error: '%s' is not a file name the server stores.", name);
+        log_error(log_buf);
+        return -1;
+    }
+
+    // An empty range only asks for the size; the connection then serves the first range
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int sock_fd = open_worker_connection(server_addr);
+    if (sock_fd == -1 || request_range(sock_fd, name, 0, 0, &size, &content_len) == -1) {
+        if (sock_fd != -1) sock_close(sock_fd);
+        return -1;
+    }
+
+    snprintf(part_path, sizeof(part_path), "%s.part", name);
+    int file_fd = open(part_path, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+    if (file_fd == -1 || fstat(file_fd, &part_stat) == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to open '%s' for writing: %s", part_path, strerror(errno));
+        log_error(log_buf);
+        if (file_fd != -1) close(file_fd);
+        sock_close(sock_fd);
+        return -1;
+    }
+
+    uint64_t have = (uint64_t)part_stat.st_size;
+    if (have > size) {
+        snprintf(log_buf, sizeof(log_buf), "'%s' is larger than the file on the server, starting over.", part_path);
+        log_info(log_buf);
+        have = 0;
+        if (ftruncate(file_fd, 0) == -1) {
+            log_error("Could not truncate the partial download.");
+        }
+    } else if (have > 0) {
+        snprintf(log_buf, sizeof(log_buf), "Resuming download of '%s' at byte %llu.", name, (unsigned long long)have);
+        log_info(log_buf);
+    }
+
+    uint64_t remaining = size - have;
+    uint64_t piece = (remaining + (uint64_t)g_stripe_connections - 1) / (uint64_t)g_stripe_connections;
+    if (piece < DOWNLOAD_MIN_RANGE) piece = DOWNLOAD_MIN_RANGE;
+    uint32_t workers = (uint32_t)((remaining + piece - 1) / piece);
+
+    snprintf(log_buf, sizeof(log_buf), "Downloading '%s' (%llu bytes, %llu to fetch) over %u connection(s).",
+             name, (unsigned long long)size, (unsigned long long)remaining, workers);
+    log_info(log_buf);
+
+    uint32_t started = 0;
+    for (; started < workers; started++) {
+        uint64_t offset = have + (uint64_t)started * piece;
+        jobs[started] = (fetch_job_t){
+            .server_addr = server_addr, .sock_fd = started == 0 ? sock_fd : -1, .file_fd = file_fd, .name = name,
+            .offset = offset, .length = size - offset < piece ? size - offset : piece, .failed = 1,
+        };
+        if (pthread_create(&threads[started], NULL, fetch_worker, &jobs[started]) != 0) {
+            log_error("Could not start a download thread.");
+            break;
+        }
+    }
+    if (started == 0) {
+        sock_close(sock_fd);
+    }
+
+    // Only the contiguous prefix is kept, so that a rerun resumes from the right place
+    uint64_t complete = have;
+    int gap = started < workers;
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (!gap) complete += jobs[i].received;
+        gap |= jobs[i].received < jobs[i].length;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (complete < size) {
+        if (ftruncate(file_fd, (off_t)complete) == -1) {
+            log_error("Could not truncate the partial download.");
+        }
+        close(file_fd);
+        snprintf(log_buf, sizeof(log_buf), "Download of '%s' interrupted at %llu of %llu bytes, run it again to resume.",
+                 name, (unsigned long long)complete, (unsigned long long)size);
+        log_error(log_buf);
+        return -1;
+    }
+    close(file_fd);
+    if (rename(part_path, name) == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Could not rename '%s' to '%s': %s", part_path, name, strerror(errno));
+        log_error(log_buf);
+        return -1;
+    }
+
+    double secs = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    snprintf(log_buf, sizeof(log_buf), "Downloaded '%s': %llu bytes in %.2f s (%.1f MiB/s).",
+             name, (unsigned long long)remaining, secs, secs > 0 ? (double)remaining / (1024.0 * 1024.0) / secs : 0.0);
+    log_info(log_buf);
+    return 0;
+}
+
+static int g_recursive = 0;         // --recursive: --put descends into directories
+static void *g_put_names = NULL;    // tsearch() tree of the names --put has sent
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+static const char *put_name(const char *path) {
+    return strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+}
+
+// The server keeps uploads in one directory by name: a second file with a name already
+// sent in this run would replace the first, it is skipped instead. 1 if it was seen.
+static int put_name_seen(const char *path) {
+    return tfind(put_name(path), &g_put_names, compare_names) != NULL;
+}
+
+// Remember the name of a file that was queued; one that failed can come again
+static void put_name_record(const char *path) {
+    char *copy = strdup(put_name(path));
+    if (copy && !tsearch(copy, &g_put_names, compare_names)) {
+        free(copy);
+    }
+}
+
+// --put: send the file at path, or with --recursive every file below the directory,
+// packed into BATCH frames (large files as UPLOADs) with up to g_window unanswered.
+// 0: done, files that could not be sent are counted; -1: the connection is unusable
+static int put_path(int sock_fd, const char *path) {
+    char log_buf[SMALL_BUF_SIZE + PATH_MAX];
+    struct stat st;
+
+    if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        if (!g_recursive) {
+            snprintf(log_buf, sizeof(log_buf), "'%s' is a directory, add --recursive to upload what it holds.", path);
+            log_error(log_buf);
+            g_totals.failed++;
+            return 0;
+        }
+        DIR *dir = opendir(path);
+        if (!dir) {
+            snprintf(log_buf, sizeof(log_buf), "Cannot read directory '%s': %s", path, strerror(errno));
+            log_error(log_buf);
+            g_totals.failed++;
+            return 0;
+        }
+        struct dirent *ent;
+        int rc = 0;
+        while (rc == 0 && (ent = readdir(dir)) != NULL) {
+            char child[PATH_MAX];
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+            size_t len = strlen(path);
+            int n = snprintf(child, sizeof(child), "%s%s%s", path, len > 0 && path[len - 1] == '/' ? "" : "/", ent->d_name);
+            if (n < 0 || (size_t)n >= sizeof(child)) {
+                snprintf(log_buf, sizeof(log_buf), "Path below '%s' is too long, skipped.", path);
+                log_error(log_buf);
+                g_totals.failed++;
+                continue;
+            }
+            rc = put_path(sock_fd, child);   // symbolic links to directories are not followed
+        }
+        closedir(dir);
+        return rc;
+    }
+
+    if (put_name_seen(path)) {
+        snprintf(log_buf, sizeof(log_buf), "'%s' has the name of a file already sent, skipped.", path);
+        log_error(log_buf);
+        g_totals.failed++;
+        return 0;
+    }
+    int rc = batch_add(sock_fd, path);
+    if (rc == 1) {
+        g_totals.failed++;
+        return 0;
+    }
+    if (rc == 0) {
+        put_name_record(path);
+    }
+    // Take in the replies that arrived meanwhile so the socket buffers never fill up
+    return rc == -1 ? -1 : read_replies(sock_fd, 0);
+}
+
+// Upload every --put path over one session and report the totals; the exit code
+static int put_all(int sock_fd, char **paths, int count) {
+    char log_buf[SMALL_BUF_SIZE];
+    struct timespec start, end;
+    int session_ok = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count && session_ok; i++) {
+        session_ok = put_path(sock_fd, paths[i]) == 0;
+    }
+    if (session_ok) {
+        session_ok = batch_flush(sock_fd) == 0 && secure_flush(sock_fd) == 0;
+    }
+    while (session_ok && g_outstanding > 0) {
+        session_ok = read_replies(sock_fd, 1) == 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    snprintf(log_buf, sizeof(log_buf), "Put %lu file(s), %llu bytes in %.2f s (%.1f MiB/s): %lu stored, %lu failed%s.",
+             g_totals.files, (unsigned long long)g_totals.bytes, secs,
+             secs > 0 ? (double)g_totals.bytes / (1024.0 * 1024.0) / secs : 0.0,
+             g_totals.stored, g_totals.failed, session_ok ? "" : ", the session broke off");
+    if (session_ok && g_totals.failed == 0) {
+        log_info(log_buf);
+        return EXIT_SUCCESS;
+    }
+    log_error(log_buf);
+    return session_ok ? EXIT_PUT_PARTIAL : EXIT_PUT_SESSION;
+}
+
+// Run one line typed by the user; -1 ends the session
+static int run_command(int *sock_fd, const struct sockaddr_in *server_addr, char *line) {
+    // --- Command Parsing: Check for UPLOAD command ---
+    if (strncmp(line, "upload ", 7) == 0 || strncmp(line, "resume ", 7) == 0) {
+        // Several files may be given, they are all sent without waiting for replies
+        int resumable = line[0] == 'r';
+        char *save = NULL;
+        int count = 0;
+        for (char *path = strtok_r(line + 7, " ", &save); path; path = strtok_r(NULL, " ", &save)) {
+            if (resumable) {
+                if (upload_resumable(sock_fd, server_addr, path) == -1) return -1;
+            } else if (wait_for_window(*sock_fd) == -1 || send_upload(*sock_fd, path) == -1) {
+                return -1;
+            }
+            count++;
+        }
+        if (count == 0) {
+            log_error("Usage: upload|resume <filename> [filename ...]");
+        }
+        return 0;
+    }
+    if (strncmp(line, "batch ", 6) == 0) {
+        // Small files are packed into as few BATCH frames as they fit in
+        char *save = NULL;
+        int count = 0;
+        for (char *path = strtok_r(line + 6, " ", &save); path; path = strtok_r(NULL, " ", &save)) {
+            if (batch_add(*sock_fd, path) == -1) return -1;
+            count++;
+        }
+        if (count == 0) {
+            log_error("Usage: batch <filename> [filename ...]");
+        }
+        return batch_flush(*sock_fd);
+    }
+    if (strncmp(line, "download ", 9) == 0) {
+        char *save = NULL;
+        int count = 0;
+        for (char *name = strtok_r(line + 9, " ", &save); name; name = strtok_r(NULL, " ", &save)) {
+            download_file(server_addr, name);
+            count++;
+        }
+        if (count == 0) {
+            log_error("Usage: download <filename> [filename ...]");
+        }
+        return 0;
+    }
+    if (strncmp(line, "dedup ", 6) == 0) {
+        char *save = NULL;
+        int count = 0;
+        for (char *path = strtok_r(line + 6, " ", &save); path; path = strtok_r(NULL, " ", &save)) {
+            if (upload_dedup(*sock_fd, path) == -1) return -1;
+            count++;
+        }
+        if (count == 0) {
+            log_error("Usage: dedup <filename> [filename ...]");
+        }
+        return 0;
+    }
+
+    if (strncmp(line, "delta ", 6) == 0) {
+        char *save = NULL;
+        int count = 0;
+        for (char *path = strtok_r(line + 6, " ", &save); path; path = strtok_r(NULL, " ", &save)) {
+            if (upload_delta(*sock_fd, path) == -1) return -1;
+            count++;
+        }
+        if (count == 0) {
+            log_error("Usage: delta <filename> [filename ...]");
+        }
+        return 0;
+    }
+    if (strncmp(line, "stripe ", 7) == 0) {
+        // One file after the other, each spread over its own set of connections
+        char *save = NULL;
+        int count = 0;
+        for (char *path = strtok_r(line + 7, " ", &save); path; path = strtok_r(NULL, " ", &save)) {
+            if (upload_striped(server_addr, path) == 1
+                && (wait_for_window(*sock_fd) == -1 || send_upload(*sock_fd, path) == -1)) {
+                return -1;
+            }
+            count++;
+        }
+        if (count == 0) {
+            log_error("Usage: stripe <filename> [filename ...]");
+        }
+        return 0;
+    }
+    // It's a regular message
+    if (wait_for_text_window(*sock_fd) == -1) return -1;
+    return send_message(*sock_fd, line);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        log_error("Usage: <server_ip> <server_port> [--stripes N] [--stripe-size BYTES] [--encrypt] [--put PATH ...] [--recursive] [--window N] [--no-verify] [--seal-workers N]");
+        exit(EXIT_FAILURE);
+    }
+    // Batch mode: upload these and exit, no prompt
+    char **put_paths = calloc((size_t)argc, sizeof(char *));
+    int put_count = 0;
+    if (!put_paths) {
+        log_error("Out of memory.");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--stripes") == 0 && i + 1 < argc) {
+            g_stripe_connections = atoi(argv[++i]);
+            if (g_stripe_connections < 1 || g_stripe_connections > MAX_STRIPE_CONNECTIONS) {
+                log_error("--stripes must be between 1 and 64.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--stripe-size") == 0 && i + 1 < argc) {
+            g_stripe_size = strtoull(argv[++i], NULL, 10);
+            if (g_stripe_size == 0) {
+                log_error("--stripe-size must be a positive number of bytes.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--encrypt") == 0) {
+            g_encrypt = 1;
+        } else if (strcmp(argv[i], "--put") == 0 && i + 1 < argc) {
+            put_paths[put_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--no-verify") == 0) {
+            g_verify = 0;
+        } else if (strcmp(argv[i], "--recursive") == 0) {
+            g_recursive = 1;
+        } else if (strcmp(argv[i], "--seal-workers") == 0 && i + 1 < argc) {
+            g_seal_workers = atoi(argv[++i]);
+            if (g_seal_workers < 1 || g_seal_workers > PIPE_MAX_WORKERS) {
+                log_error("--seal-workers must be between 1 and 16.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            g_window = atoi(argv[++i]);
+            if (g_window < 1 || g_window > PIPELINE_WINDOW) {
+                log_error("--window must be between 1 and 64.");
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            log_error("Usage: <server_ip> <server_port> [--stripes N] [--stripe-size BYTES] [--encrypt] [--put PATH ...] [--recursive] [--window N] [--no-verify] [--seal-workers N]");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Stripe and fetch threads log through per-thread queues from here on
+    if (log_start() == -1) {
+        log_error("Failed to start the log flusher, writing log lines directly.");
+    }
+
+    const char *server_ip = argv[1];
+    int server_port = atoi(argv[2]);
+
+    if (server_port <= 0 || server_port > 65535) {
+        log_error("Invalid port number. Must be between 1 and 65535.");
+        exit(EXIT_FAILURE);
+    }
+
+    int client_socket = -1;
+    struct sockaddr_in server_addr;
+    char input_buffer[SMALL_BUF_SIZE * 4]; // For user input, several pipelined lines at a time
+    char log_buf[SMALL_BUF_SIZE];         // For simple logs
+    
+    snprintf(log_buf, sizeof(log_buf), "Attempting to connect to %s:%d", server_ip, server_port);
+    log_info(log_buf);
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+
+    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
+        log_error("Invalid server IP address or address not supported.");
+        exit(EXIT_FAILURE);
+    }
+
+    client_socket = connect_to_server(&server_addr);
+    if (client_socket == -1) {
+        log_error("Could not open a session with the server. Exiting.");
+        exit(put_count > 0 ? EXIT_PUT_SESSION : EXIT_FAILURE);
+    }
+
+    if (put_count > 0) {
+        int rc = put_all(client_socket, put_paths, put_count);
+        log_info("Closing connection.");
+        sock_close(client_socket);
+        return rc;
+    }
+
+    log_info("You are now connected. Enter messages to send (or 'upload <file> [file ...]', 'batch <file> [file ...]', 'resume <file> [file ...]', 'stripe <file> [file ...]', 'dedup <file> [file ...]', 'delta <file> [file ...]', 'download <file> [file ...]', 'exit' to quit):");
+
+    // Main client session loop: input lines and server replies are handled as they come,
+    // so requests are pipelined instead of waiting out a round trip each
+    int session_ok = 1;
+    int input_open = 1;
+    size_t input_len = 0;
+    int interactive = isatty(STDIN_FILENO);
+
+    if (interactive) {
+        log_put(1, 0, "", "> ");
+    }
+    while (session_ok && input_open) {
+        struct pollfd fds[2] = {
+            { .fd = STDIN_FILENO, .events = POLLIN },
+            { .fd = client_socket, .events = POLLIN },
+        };
+        // Requests still waiting in a partly filled record go out before the wait
+        if (secure_flush(client_socket) == -1) {
+            log_error("Failed to send request to server.");
+            break;
+        }
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            log_error("poll failed.");
+            log_perror("poll");
+            break;
+        }
+
+        if (fds[1].revents) {
+            if (read_replies(client_socket, 0) == -1) {
+                session_ok = 0;
+                break;
+            }
+        }
+        if (!fds[0].revents) {
+            continue;
+        }
+
+        ssize_t bytes_read = read(STDIN_FILENO, input_buffer + input_len, sizeof(input_buffer) - 1 - input_len);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            input_open = 0; // EOF: finish what was sent, then leave
+            break;
+        }
+        input_len += (size_t)bytes_read;
+        input_buffer[input_len] = '\0';
+
+        // Run every complete line; an overlong line is cut at the buffer size
+        char *line = input_buffer;
+        char *newline;
+        while (session_ok && input_open
+               && ((newline = strchr(line, '\n')) != NULL || input_len == sizeof(input_buffer) - 1)) {
+            if (newline) *newline = '\0';
+            size_t consumed = newline ? (size_t)(newline - line) + 1 : strlen(line);
+
+            if (strcmp(line, "exit") == 0) {
+                log_info("Exiting session.");
+                input_open = 0;
+            } else if (strlen(line) > 0 && run_command(&client_socket, &server_addr, line) == -1) { // Don't send empty lines
+                session_ok = 0;
+            }
+            line += consumed;
+            input_len -= consumed;
+        }
+        memmove(input_buffer, line, input_len);
+
+        if (interactive && session_ok && input_open) {
+            log_put(1, 0, "", "> ");
+        }
+    } // End of main client session loop
+
+    // Collect the answers to everything still in flight
+    if (session_ok && (g_outstanding > 0 || g_texts.count > 0)) {
+        snprintf(log_buf, sizeof(log_buf), "Waiting for %d outstanding replies and %u message acknowledgement(s)...", g_outstanding, g_texts.count);
+        log_info(log_buf);
+        while ((g_outstanding > 0 || g_texts.count > 0) && read_replies(client_socket, 1) == 0);
+    }
+
+    log_info("Closing connection.");
+    if (client_socket != -1) {
+        sock_close(client_socket);
+    }
+
+    return session_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include "../../include/log.h"
+
+#define LOG_ENTRY_HEAD 5           // u32 length and the target descriptor before each line
+
+enum { LOG_RING_FREE, LOG_RING_OWNED, LOG_RING_RETIRED };
+
+typedef struct {
+    atomic_int state;
+    atomic_size_t head;   // advanced by the flusher
+    atomic_size_t tail;   // advanced by the owning thread
+    char *buf;
+} log_ring_t;
+
+static log_ring_t g_log_rings[LOG_MAX_RINGS];
+static atomic_int g_log_running;
+static atomic_ulong g_log_dropped;
+static pthread_t g_log_thread;
+static pthread_key_t g_log_key;
+static char g_log_out[LOG_RING_SIZE];      // flusher staging, lines for one descriptor
+
+// The flusher sets g_log_idle before it sleeps on g_log_wake_fd; the first writer to
+// clear it afterwards wakes it, so a busy log costs no system call per line
+static int g_log_wake_fd = -1;
+static atomic_int g_log_idle;
+
+static __thread log_ring_t *t_log_ring;
+static __thread time_t t_log_sec = -1;
+static __thread char t_log_stamp[32];
+
+static void log_write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// "YYYY-mm-dd HH:MM:SS" of now, reformatted when the second changes
+static const char *log_stamp(void) {
+    time_t now = time(NULL);
+    if (now != t_log_sec) {
+        struct tm tm;
+        strftime(t_log_stamp, sizeof(t_log_stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm));
+        t_log_sec = now;
+    }
+    return t_log_stamp;
+}
+
+static void log_wake(void) {
+    // Pairs with the fence in log_main(): either it sees the new tail or we see it idle
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&g_log_idle, memory_order_relaxed) && atomic_exchange(&g_log_idle, 0)) {
+        uint64_t one = 1;
+        if (write(g_log_wake_fd, &one, sizeof(one)) == -1) {
+            // the counter is already non-zero, the flusher wakes anyway
+        }
+    }
+}
+
+static void log_ring_copy_in(log_ring_t *ring, size_t pos, const void *data, size_t len) {
+    size_t off = pos % LOG_RING_SIZE;
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+    memcpy(ring->buf + off, data, first);
+    memcpy(ring->buf, (const char *)data + first, len - first);
+}
+
+static void log_ring_copy_out(const log_ring_t *ring, size_t pos, void *data, size_t len) {
+    size_t off = pos % LOG_RING_SIZE;
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+    memcpy(data, ring->buf + off, first);
+    memcpy((char *)data + first, ring->buf, len - first);
+}
+
+// Ring of the calling thread, claimed on its first line; NULL when none is left
+static log_ring_t *log_thread_ring(void) {
+    if (t_log_ring) {
+        return t_log_ring;
+    }
+    for (int i = 0; i < LOG_MAX_RINGS; i++) {
+        log_ring_t *ring = &g_log_rings[i];
+        int expected = LOG_RING_FREE;
+        if (!atomic_compare_exchange_strong(&ring->state, &expected, LOG_RING_OWNED)) {
+            continue;
+        }
+        if (!ring->buf && !(ring->buf = malloc(LOG_RING_SIZE))) {
+            atomic_store(&ring->state, LOG_RING_FREE);
+            return NULL;
+        }
+        t_log_ring = ring;
+        pthread_setspecific(g_log_key, ring);   // retired when the thread exits
+        return ring;
+    }
+    return NULL;
+}
+
+// Thread exit: the flusher frees the ring once it has written what is left in it
+static void log_ring_retire(void *arg) {
+    log_ring_t *ring = arg;
+    atomic_store(&ring->state, LOG_RING_RETIRED);
+    log_wake();
+}
+
+void log_put(int fd, int stamped, const char *prefix, const char *message) {
+    char line[LOG_LINE_MAX];
+    int len = stamped ? snprintf(line, sizeof(line), "[%s] %s%s\n", log_stamp(), prefix, message)
+                      : snprintf(line, sizeof(line), "%s%s", prefix, message);
+    if (len < 0) {
+        return;
+    }
+    if ((size_t)len >= sizeof(line)) {
+        len = (int)sizeof(line) - 1;
+        if (stamped) line[len - 1] = '\n';
+    }
+
+    log_ring_t *ring = atomic_load_explicit(&g_log_running, memory_order_acquire) ? log_thread_ring() : NULL;
+    if (!ring) {
+        log_write_all(fd, line, (size_t)len);
+        return;
+    }
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (LOG_RING_SIZE - (tail - head) < LOG_ENTRY_HEAD + (size_t)len) {
+        atomic_fetch_add_explicit(&g_log_dropped, 1, memory_order_relaxed);
+        return;
+    }
+    uint8_t head_bytes[LOG_ENTRY_HEAD];
+    uint32_t n = (uint32_t)len;
+    memcpy(head_bytes, &n, sizeof(n));
+    head_bytes[4] = (uint8_t)fd;
+    log_ring_copy_in(ring, tail, head_bytes, LOG_ENTRY_HEAD);
+    log_ring_copy_in(ring, tail + LOG_ENTRY_HEAD, line, (size_t)len);
+    atomic_store_explicit(&ring->tail, tail + LOG_ENTRY_HEAD + (size_t)len, memory_order_release);
+    log_wake();
+}
+
+// Move every queued line to its descriptor; bytes taken from the rings. Lines go out in
+// the order each thread logged them, also when stdout and stderr share a file.
+static size_t log_drain(void) {
+    size_t out_len = 0;
+    int out_fd = 1;
+    size_t taken = 0;
+
+    for (int i = 0; i < LOG_MAX_RINGS; i++) {
+        log_ring_t *ring = &g_log_rings[i];
+        int state = atomic_load_explicit(&ring->state, memory_order_acquire);
+        if (state == LOG_RING_FREE) {
+            continue;
+        }
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        while (head != tail) {
+            uint8_t head_bytes[LOG_ENTRY_HEAD];
+            uint32_t n;
+            log_ring_copy_out(ring, head, head_bytes, LOG_ENTRY_HEAD);
+            memcpy(&n, head_bytes, sizeof(n));
+            if (head_bytes[4] != out_fd || out_len + n > sizeof(g_log_out)) {
+                log_write_all(out_fd, g_log_out, out_len);
+                out_len = 0;
+                out_fd = head_bytes[4];
+            }
+            log_ring_copy_out(ring, head + LOG_ENTRY_HEAD, g_log_out + out_len, n);
+            out_len += n;
+            head += LOG_ENTRY_HEAD + n;
+            taken += LOG_ENTRY_HEAD + n;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+        // Its thread is gone and everything it wrote is out: the slot can be claimed again
+        if (state == LOG_RING_RETIRED) {
+            atomic_store(&ring->state, LOG_RING_FREE);
+        }
+    }
+    log_write_all(out_fd, g_log_out, out_len);
+
+    unsigned long dropped = atomic_exchange(&g_log_dropped, 0);
+    if (dropped) {
+        char line[128];
+        int len = snprintf(line, sizeof(line), "[%s] Error: %lu log line(s) dropped, the log buffer was full.\n", log_stamp(), dropped);
+        log_write_all(2, line, (size_t)len);
+    }
+    return taken;
+}
+
+static void *log_main(void *arg) {
+    (void)arg;
+    while (atomic_load(&g_log_running)) {
+        if (log_drain() > 0) {
+            continue;
+        }
+        // Announce the sleep, then look once more: a line queued in between is caught
+        // here or its writer saw the flag and wakes us
+        atomic_store(&g_log_idle, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (log_drain() > 0 || !atomic_load(&g_log_running)) {
+            atomic_store(&g_log_idle, 0);
+            continue;
+        }
+        uint64_t count;
+        while (read(g_log_wake_fd, &count, sizeof(count)) == -1 && errno == EINTR) { }
+        atomic_store(&g_log_idle, 0);
+    }
+    log_drain();
+    return NULL;
+}
+
+void log_stop(void) {
+    if (!atomic_exchange(&g_log_running, 0)) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(g_log_wake_fd, &one, sizeof(one)) == -1) {
+        // the counter is already non-zero, the flusher wakes anyway
+    }
+    pthread_join(g_log_thread, NULL);
+    log_drain();   // lines queued while the flusher was leaving
+}
+
+int log_start(void) {
+    if (pthread_key_create(&g_log_key, log_ring_retire) != 0) {
+        return -1;
+    }
+    g_log_wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (g_log_wake_fd == -1) {
+        return -1;
+    }
+    atomic_store(&g_log_running, 1);
+    if (pthread_create(&g_log_thread, NULL, log_main, NULL) != 0) {
+        atomic_store(&g_log_running, 0);
+        close(g_log_wake_fd);
+        g_log_wake_fd = -1;
+        return -1;
+    }
+    atexit(log_stop);
+    return 0;
+}
@@ -0,0 +1,283 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "include/admission.h"
+#include "include/reactor.h"
+
+typedef struct {
+    uint32_t network;   // host byte order, already masked
+    uint32_t mask;
+    int allow;
+} cidr_rule_t;
+
+typedef struct rate_entry {
+    uint32_t ip;
+    double tokens;
+    uint64_t last_ns;
+    struct rate_entry *next;
+} rate_entry_t;
+
+static const server_config_t *g_config = NULL;
+
+static cidr_rule_t g_rules[ADMISSION_MAX_RULES];
+static int g_rule_count = 0;
+static int g_default_allow = 1;
+
+static rate_entry_t *g_rate_buckets[ADMISSION_RATE_BUCKETS];
+static pthread_mutex_t g_rate_locks[ADMISSION_RATE_LOCKS];
+
+static atomic_int g_sessions = 0;
+
+// Workers share the console, only one prompt may be on screen at a time
+static pthread_mutex_t g_prompt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Parse "a.b.c.d/len" (or a bare address, meaning /32)
+static int parse_cidr(const char *text, cidr_rule_t *rule) {
+    char addr_buf[INET_ADDRSTRLEN];
+    int prefix = 32;
+
+    const char *slash = strchr(text, '/');
+    size_t addr_len = slash ? (size_t)(slash - text) : strlen(text);
+    if (addr_len == 0 || addr_len >= sizeof(addr_buf)) return -1;
+    memcpy(addr_buf, text, addr_len);
+    addr_buf[addr_len] = '\0';
+
+    if (slash) {
+        char *end;
+        long value = strtol(slash + 1, &end, 10);
+        if (*end != '\0' || end == slash + 1 || value < 0 || value > 32) return -1;
+        prefix = (int)value;
+    }
+
+    struct in_addr in;
+    if (inet_pton(AF_INET, addr_buf, &in) != 1) return -1;
+
+    rule->mask = prefix == 0 ? 0 : 0xFFFFFFFFu << (32 - prefix);
+    rule->network = ntohl(in.s_addr) & rule->mask;
+    return 0;
+}
+
+// Policy file: one "allow|deny <cidr>" or "default allow|deny" per line, '#' starts a comment.
+// Rules are checked top to bottom and the first match wins.
+static int load_policy(const char *path) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    char line[SMALL_BUF_SIZE];
+    int line_no = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to open policy file '%s': %s", path, strerror(errno));
+        log_error(log_buf);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        line_no++;
+        line[strcspn(line, "#\r\n")] = '\0';
+
+        char action[16], target[64];
+        int fields = sscanf(line, "%15s %63s", action, target);
+        if (fields <= 0) continue;
+
+        if (fields == 2 && strcmp(action, "default") == 0
+            && (strcmp(target, "allow") == 0 || strcmp(target, "deny") == 0)) {
+            g_default_allow = strcmp(target, "allow") == 0;
+            continue;
+        }
+
+        cidr_rule_t rule;
+        if (fields != 2 || (strcmp(action, "allow") != 0 && strcmp(action, "deny") != 0)
+            || parse_cidr(target, &rule) == -1) {
+            snprintf(log_buf, sizeof(log_buf), "Policy file '%s' line %d is invalid.", path, line_no);
+            log_error(log_buf);
+            fclose(fp);
+            return -1;
+        }
+        if (g_rule_count == ADMISSION_MAX_RULES) {
+            log_error("Policy file has too many rules.");
+            fclose(fp);
+            return -1;
+        }
+        rule.allow = strcmp(action, "allow") == 0;
+        g_rules[g_rule_count++] = rule;
+    }
+    fclose(fp);
+
+    snprintf(log_buf, sizeof(log_buf), "Loaded %d admission rule(s) from '%s' (default %s).", g_rule_count, path, g_default_allow ? "allow" : "deny");
+    log_info(log_buf);
+    return 0;
+}
+
+int admission_init(const server_config_t *config) {
+    g_config = config;
+    g_rule_count = 0;
+    g_default_allow = 1;
+
+    for (int i = 0; i < ADMISSION_RATE_LOCKS; i++) {
+        pthread_mutex_init(&g_rate_locks[i], NULL);
+    }
+
+    if (config->policy_file && load_policy(config->policy_file) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static int policy_allows(uint32_t ip) {
+    for (int i = 0; i < g_rule_count; i++) {
+        if ((ip & g_rules[i].mask) == g_rules[i].network) {
+            return g_rules[i].allow;
+        }
+    }
+    return g_default_allow;
+}
+
+// Take one token from the source address bucket; 0 if it is empty
+static int rate_take(uint32_t ip) {
+    double rate = g_config->rate_per_ip;
+    double burst = g_config->rate_burst;
+    uint64_t now = monotonic_ns();
+    // A bucket untouched this long is full again and can be dropped
+    uint64_t idle_ns = (uint64_t)(burst / rate * 1e9);
+
+    uint32_t slot = (ip * 2654435761u) % ADMISSION_RATE_BUCKETS;
+    pthread_mutex_t *lock = &g_rate_locks[slot % ADMISSION_RATE_LOCKS];
+    int allowed = 0;
+
+    pthread_mutex_lock(lock);
+
+    rate_entry_t *found = NULL;
+    rate_entry_t **link = &g_rate_buckets[slot];
+    while (*link) {
+        rate_entry_t *entry = *link;
+        if (entry->ip == ip) {
+            found = entry;
+            link = &entry->next;
+        } else if (now - entry->last_ns > idle_ns) {
+            *link = entry->next;
+            free(entry);
+        } else {
+            link = &entry->next;
+        }
+    }
+
+    if (!found) {
+        found = malloc(sizeof(*found));
+        if (!found) {
+            pthread_mutex_unlock(lock);
+            return 1; // fail open rather than lock everyone out
+        }
+        found->ip = ip;
+        found->tokens = burst;
+        found->last_ns = now;
+        found->next = g_rate_buckets[slot];
+        g_rate_buckets[slot] = found;
+    }
+
+    found->tokens += (double)(now - found->last_ns) / 1e9 * rate;
+    if (found->tokens > burst) found->tokens = burst;
+    found->last_ns = now;
+    if (found->tokens >= 1.0) {
+        found->tokens -= 1.0;
+        allowed = 1;
+    }
+
+    pthread_mutex_unlock(lock);
+    return allowed;
+}
+
+// Ask the operator whether to accept the connection (blocks the calling worker)
+static int prompt_operator(const char *client_ip, int client_port) {
+    char response_char;
+    char prompt[SMALL_BUF_SIZE];
+    int accepted = 0;
+
+    pthread_mutex_lock(&g_prompt_lock);
+    snprintf(prompt, sizeof(prompt), "Incoming connection from %s:%d. Accept? (y/n): ", client_ip, client_port);
+    log_raw(prompt);
+
+    while (scanf(" %c", &response_char) != 1 || (response_char != 'y' && response_char != 'Y' && response_char != 'n' && response_char != 'N')) {
+        if (feof(stdin) || g_shutdown) {
+            goto out;
+        }
+        log_raw("Invalid input. Please enter 'y' or 'n': ");
+        int ch;
+        while ((ch = getchar()) != '\n' && ch != EOF);
+    }
+    int ch;
+    while ((ch = getchar()) != '\n' && ch != EOF);
+
+    accepted = response_char == 'y' || response_char == 'Y';
+out:
+    pthread_mutex_unlock(&g_prompt_lock);
+    return accepted;
+}
+
+admit_result_t admission_check(const struct sockaddr_in *addr) {
+    uint32_t ip = ntohl(addr->sin_addr.s_addr);
+
+    if (!policy_allows(ip)) {
+        return ADMIT_DENIED;
+    }
+    if (g_config->rate_per_ip > 0 && !rate_take(ip)) {
+        return ADMIT_RATE_LIMITED;
+    }
+
+    int sessions = atomic_fetch_add(&g_sessions, 1);
+    if (g_config->max_sessions > 0 && sessions >= g_config->max_sessions) {
+        atomic_fetch_sub(&g_sessions, 1);
+        return ADMIT_BUSY;
+    }
+
+    if (g_config->interactive) {
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr->sin_addr, client_ip, sizeof(client_ip));
+        if (!prompt_operator(client_ip, ntohs(addr->sin_port))) {
+            atomic_fetch_sub(&g_sessions, 1);
+            return ADMIT_REFUSED;
+        }
+    }
+    return ADMIT_OK;
+}
+
+void admission_release(void) {
+    atomic_fetch_sub(&g_sessions, 1);
+}
+
+const char *admission_reason(admit_result_t result) {
+    switch (result) {
+        case ADMIT_OK:           return "accepted";
+        case ADMIT_DENIED:       return "denied by policy";
+        case ADMIT_RATE_LIMITED: return "rate limited";
+        case ADMIT_BUSY:         return "too many sessions";
+        case ADMIT_REFUSED:      return "refused by operator";
+    }
+    return "unknown";
+}
+
+void admission_destroy(void) {
+    for (int i = 0; i < ADMISSION_RATE_BUCKETS; i++) {
+        while (g_rate_buckets[i]) {
+            rate_entry_t *entry = g_rate_buckets[i];
+            g_rate_buckets[i] = entry->next;
+            free(entry);
+        }
+    }
+    for (int i = 0; i < ADMISSION_RATE_LOCKS; i++) {
+        pthread_mutex_destroy(&g_rate_locks[i]);
+    }
+}
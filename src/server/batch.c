@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+
+#include "include/batch.h"
+#include "include/session.h"
+#include "include/reactor.h"
+#include "include/commit.h"
+#include "include/digest.h"
+#include "include/dedup.h"
+#include "include/metrics.h"
+#include "../../include/protocol.h"
+
+struct batch_job {
+    conn_t *conn;            // NULL once the session is gone; only touched on its loop
+    reactor_t *reactor;
+    uint32_t stream_id;
+    uint8_t *payload;        // a copy of the BATCH payload, its layout already checked
+    size_t len;
+    uint32_t count;
+    uint16_t *status;        // one per entry, filled in by the batch thread
+    uint64_t stored_bytes;
+    uint64_t queued_ns;      // when the BATCH frame was taken in
+    batch_job_t *next;
+};
+
+// A file of the batch between being written and being renamed into place
+typedef struct {
+    const uint8_t *name;
+    size_t name_len;
+    int fd;
+    char tmp_path[PATH_MAX];
+} batch_file_t;
+
+static const server_config_t *g_config;
+static pthread_t g_threads[MAX_WORKERS];
+static int g_thread_count = 0;
+static int g_stop = 0;
+
+// Guards the queue and every reactor's `batched` list
+static pthread_mutex_t g_batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_batch_cond = PTHREAD_COND_INITIALIZER;
+static batch_job_t *g_queue_head = NULL;
+static batch_job_t *g_queue_tail = NULL;
+
+static void job_free(batch_job_t *job) {
+    free(job->payload);
+    free(job->status);
+    free(job);
+}
+
+// --- Batch threads ---
+
+// Write one entry aside and check it against its digest; the file stays open for the rename
+static proto_status_t batch_write_file(batch_file_t *file, const uint8_t *data, size_t len, const uint8_t *expected) {
+    uint8_t digest[PROTO_HASH_SIZE];
+
+    if (memchr(file->name, '/', file->name_len) || memchr(file->name, '\0', file->name_len)) {
+        return PROTO_STATUS_BAD_REQUEST;
+    }
+    if (!EVP_Digest(data, len, digest, NULL, EVP_sha256(), NULL)) {
+        return PROTO_STATUS_IO_ERROR;
+    }
+    if (memcmp(digest, expected, PROTO_HASH_SIZE) != 0) {
+        return PROTO_STATUS_BAD_CHECKSUM;
+    }
+
+    file->tmp_path[0] = '\0';
+    file->fd = open(UPLOAD_DIR, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    if (file->fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+        commit_tmp_name(file->tmp_path, sizeof(file->tmp_path));
+        file->fd = open(file->tmp_path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+    }
+    if (file->fd == -1) {
+        return PROTO_STATUS_IO_ERROR;
+    }
+    while (len > 0) {
+        ssize_t written = write(file->fd, data, len);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return PROTO_STATUS_IO_ERROR;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    digest_store(file->fd, digest);
+    return PROTO_STATUS_OK;
+}
+
+static void batch_drop_file(batch_file_t *file) {
+    if (file->fd != -1) close(file->fd);
+    if (file->tmp_path[0]) unlink(file->tmp_path);
+    file->fd = -1;
+    file->tmp_path[0] = '\0';
+}
+
+// Rename a written file into UPLOAD_DIR
+static proto_status_t batch_link_file(batch_file_t *file) {
+    char full_path[PATH_MAX];
+    char name[PROTO_MAX_NAME + 1];
+
+    snprintf(name, sizeof(name), "%.*s", (int)file->name_len, (const char *)file->name);
+    snprintf(full_path, sizeof(full_path), "%s/%s", UPLOAD_DIR, name);
+    if (commit_link(file->fd, file->tmp_path, sizeof(file->tmp_path), full_path) == -1) {
+        batch_drop_file(file);
+        return PROTO_STATUS_IO_ERROR;
+    }
+    dedup_forget(name);   // the plain file replaces a deduplicated one of the same name
+    close(file->fd);
+    file->fd = -1;
+    return PROTO_STATUS_OK;
+}
+
+static void batch_run(batch_job_t *job) {
+    batch_file_t *files = calloc(job->count, sizeof(*files));
+    if (!files) {
+        for (uint32_t i = 0; i < job->count; i++) job->status[i] = PROTO_STATUS_IO_ERROR;
+        return;
+    }
+
+    const uint8_t *p = job->payload + PROTO_BATCH_META_SIZE;
+    int durable = g_config->durable;
+    int first_fd = -1;
+    for (uint32_t i = 0; i < job->count; i++) {
+        batch_file_t *file = &files[i];
+        uint32_t size = proto_get_u32(p);
+        file->name_len = proto_get_u16(p + 4);
+        file->name = p + PROTO_BATCH_ENTRY_META_SIZE;
+        file->fd = -1;
+        const uint8_t *data = file->name + file->name_len;
+        p = data + size + PROTO_HASH_SIZE;
+
+        job->status[i] = batch_write_file(file, data, size, data + size);
+        if (job->status[i] != PROTO_STATUS_OK) {
+            batch_drop_file(file);
+            continue;
+        }
+        job->stored_bytes += size;
+        if (!durable) {
+            job->status[i] = batch_link_file(file);
+        } else if (first_fd == -1) {
+            first_fd = file->fd;
+        }
+    }
+
+    if (durable && first_fd != -1) {
+        // The batch is its own group commit: data, then the names, then the directory once
+        int error = 0;
+        if (g_config->commit_sync == COMMIT_SYNC_SYNCFS && syncfs(first_fd) == -1) {
+            error = 1;
+        }
+        for (uint32_t i = 0; i < job->count; i++) {
+            if (files[i].fd == -1) continue;
+            if (error || (g_config->commit_sync == COMMIT_SYNC_FDATASYNC && fdatasync(files[i].fd) == -1)) {
+                batch_drop_file(&files[i]);
+                job->status[i] = PROTO_STATUS_IO_ERROR;
+            }
+        }
+        for (uint32_t i = 0; i < job->count; i++) {
+            if (files[i].fd != -1) job->status[i] = batch_link_file(&files[i]);
+        }
+        if (commit_sync_dir(UPLOAD_DIR) == -1) {
+            // Only the names just linked are in doubt, entries that failed keep their reason
+            for (uint32_t i = 0; i < job->count; i++) {
+                if (job->status[i] == PROTO_STATUS_OK) job->status[i] = PROTO_STATUS_IO_ERROR;
+            }
+        }
+    }
+    free(files);
+}
+
+static void *batch_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&g_batch_lock);
+    for (;;) {
+        while (!g_stop && !g_queue_head) {
+            pthread_cond_wait(&g_batch_cond, &g_batch_lock);
+        }
+        batch_job_t *job = g_queue_head;
+        if (!job) {
+            break;   // stopping and drained
+        }
+        g_queue_head = job->next;
+        if (!g_queue_head) g_queue_tail = NULL;
+        pthread_mutex_unlock(&g_batch_lock);
+
+        batch_run(job);
+
+        // Hand it back to the loop that owns the session
+        pthread_mutex_lock(&g_batch_lock);
+        job->next = job->reactor->batched;
+        job->reactor->batched = job;
+        if (!g_stop) {
+            uint64_t one = 1;
+            if (write(job->reactor->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                log_error("Failed to wake worker after batch.");
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_batch_lock);
+    return NULL;
+}
+
+int batch_start(const server_config_t *config) {
+    g_config = config;
+    for (int i = 0; i < config->workers; i++) {
+        if (pthread_create(&g_threads[i], NULL, batch_main, NULL) != 0) {
+            log_error("Failed to start a batch thread.");
+            batch_stop();
+            return -1;
+        }
+        g_thread_count++;
+    }
+    return 0;
+}
+
+void batch_stop(void) {
+    pthread_mutex_lock(&g_batch_lock);
+    g_stop = 1;
+    pthread_cond_broadcast(&g_batch_cond);
+    pthread_mutex_unlock(&g_batch_lock);
+    for (int i = 0; i < g_thread_count; i++) {
+        pthread_join(g_threads[i], NULL);
+    }
+    g_thread_count = 0;
+}
+
+// --- Worker side ---
+
+// Walk the entries: they must fill the payload exactly. Their number, 0 if malformed.
+static uint32_t batch_check_layout(const uint8_t *payload, size_t len) {
+    if (len < PROTO_BATCH_META_SIZE) {
+        return 0;
+    }
+    uint32_t count = proto_get_u32(payload);
+    if (count == 0 || count > PROTO_MAX_BATCH_FILES) {
+        return 0;
+    }
+    size_t off = PROTO_BATCH_META_SIZE;
+    for (uint32_t i = 0; i < count; i++) {
+        if (len - off < PROTO_BATCH_ENTRY_META_SIZE) {
+            return 0;
+        }
+        uint64_t size = proto_get_u32(payload + off);
+        size_t name_len = proto_get_u16(payload + off + 4);
+        if (name_len == 0 || name_len > PROTO_MAX_NAME) {
+            return 0;
+        }
+        uint64_t entry = PROTO_BATCH_ENTRY_META_SIZE + name_len + size + PROTO_HASH_SIZE;
+        if (entry > len - off) {
+            return 0;
+        }
+        off += (size_t)entry;
+    }
+    return off == len ? count : 0;
+}
+
+void batch_on_request(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len) {
+    char log_buf[SMALL_BUF_SIZE];
+
+    uint32_t count = batch_check_layout(payload, len);
+    if (count == 0) {
+        snprintf(log_buf, sizeof(log_buf), "Protocol error from %s:%d: malformed BATCH.", conn->peer_ip, conn->peer_port);
+        log_error(log_buf);
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid BATCH frame.");
+        conn->state = CONN_STATE_CLOSING;
+        return;
+    }
+
+    batch_job_t *job = calloc(1, sizeof(*job));
+    uint8_t *copy = job ? malloc(len) : NULL;
+    uint16_t *status = copy ? calloc(count, sizeof(*status)) : NULL;
+    if (!status) {
+        free(copy);
+        free(job);
+        log_error("Out of memory while queueing a batch.");
+        session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, "ERROR: Could not store the batch.");
+        return;
+    }
+    memcpy(copy, payload, len);   // in_buf moves on once this returns
+    job->conn = conn;
+    job->reactor = conn->reactor;
+    job->stream_id = stream_id;
+    job->payload = copy;
+    job->len = len;
+    job->count = count;
+    job->status = status;
+    job->queued_ns = metrics_now_ns();
+
+    // Later requests wait: their answers must not overtake this one
+    conn->batch = job;
+    conn->state = CONN_STATE_COMMIT;
+
+    pthread_mutex_lock(&g_batch_lock);
+    if (g_queue_tail) g_queue_tail->next = job;
+    else g_queue_head = job;
+    g_queue_tail = job;
+    pthread_cond_signal(&g_batch_cond);
+    pthread_mutex_unlock(&g_batch_lock);
+}
+
+void batch_reap(reactor_t *reactor) {
+    char log_buf[SMALL_BUF_SIZE];
+    uint8_t results[PROTO_RESULTS_META_SIZE + PROTO_MAX_BATCH_FILES * 2];
+
+    pthread_mutex_lock(&g_batch_lock);
+    batch_job_t *done = reactor->batched;
+    reactor->batched = NULL;
+    pthread_mutex_unlock(&g_batch_lock);
+
+    while (done) {
+        batch_job_t *job = done;
+        done = job->next;
+        conn_t *conn = job->conn;
+        if (conn) {
+            uint32_t stored = 0;
+            const uint8_t *p = job->payload + PROTO_BATCH_META_SIZE;
+            proto_put_u32(results, job->count);
+            for (uint32_t i = 0; i < job->count; i++) {
+                uint32_t size = proto_get_u32(p);
+                p += PROTO_BATCH_ENTRY_META_SIZE + proto_get_u16(p + 4) + size + PROTO_HASH_SIZE;
+                proto_put_u16(results + PROTO_RESULTS_META_SIZE + i * 2, job->status[i]);
+                if (job->status[i] == PROTO_STATUS_OK) {
+                    metrics_upload_ok(reactor, size, job->queued_ns);
+                    stored++;
+                }
+            }
+            STAT_ADD(reactor, uploads_failed, job->count - stored);
+            snprintf(log_buf, sizeof(log_buf), "Batch from %s:%d: %u of %u file(s) stored (%llu bytes).",
+                     conn->peer_ip, conn->peer_port, stored, job->count, (unsigned long long)job->stored_bytes);
+            log_info(log_buf);
+
+            conn->batch = NULL;
+            conn->state = CONN_STATE_COMMAND;
+            conn_send_frame(conn, PROTO_OP_RESULTS, job->stream_id, results, PROTO_RESULTS_META_SIZE + (size_t)job->count * 2);
+            reactor_conn_resume(conn);   // may close the session
+        }
+        job_free(job);
+    }
+}
+
+void batch_cancel(conn_t *conn) {
+    if (conn->batch) {
+        conn->batch->conn = NULL;
+        conn->batch = NULL;
+    }
+}
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "include/bufpool.h"
+
+// A cached buffer keeps the link to the next one of its class in its first bytes
+typedef struct free_buf {
+    struct free_buf *next;
+} free_buf_t;
+
+static size_t g_cap;                      // bytes the pool may map
+static size_t g_mapped;                   // bytes mapped: lent out plus cached
+static size_t g_in_use;                   // bytes lent out
+static size_t g_peak;
+static unsigned long g_paused;            // borrows refused, each one paused a session
+static free_buf_t *g_free[BUFPOOL_CLASSES];
+static reactor_t *g_waiters[MAX_WORKERS]; // loops with a paused session
+static int g_waiter_count = 0;
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int size_class(size_t size) {
+    int cls = 0;
+    while (cls < BUFPOOL_CLASSES - 1 && ((size_t)BUFPOOL_MIN_SIZE << cls) < size) cls++;
+    return cls;
+}
+
+void bufpool_init(const server_config_t *config) {
+    char log_buf[SMALL_BUF_SIZE];
+
+    g_cap = (size_t)config->buffer_pool_mb * 1024 * 1024;
+    snprintf(log_buf, sizeof(log_buf), "I/O buffer pool capped at %ld MiB (%d KiB to %d MiB buffers).",
+             config->buffer_pool_mb, BUFPOOL_MIN_SIZE / 1024, BUFPOOL_MAX_SIZE / (1024 * 1024));
+    log_info(log_buf);
+}
+
+// Give cached buffers back to the kernel, largest first, until size more bytes fit the cap
+static void trim_cache(size_t size) {
+    for (int cls = BUFPOOL_CLASSES - 1; cls >= 0 && g_mapped + size > g_cap; cls--) {
+        while (g_free[cls] && g_mapped + size > g_cap) {
+            free_buf_t *buf = g_free[cls];
+            g_free[cls] = buf->next;
+            munmap(buf, BUFPOOL_MIN_SIZE << cls);
+            g_mapped -= BUFPOOL_MIN_SIZE << cls;
+        }
+    }
+}
+
+void bufpool_destroy(void) {
+    pthread_mutex_lock(&g_pool_lock);
+    for (int cls = 0; cls < BUFPOOL_CLASSES; cls++) {
+        while (g_free[cls]) {
+            free_buf_t *buf = g_free[cls];
+            g_free[cls] = buf->next;
+            munmap(buf, BUFPOOL_MIN_SIZE << cls);
+            g_mapped -= BUFPOOL_MIN_SIZE << cls;
+        }
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+}
+
+void *bufpool_get(reactor_t *reactor, size_t size, int growing, size_t *cap) {
+    int cls = size_class(size);
+    size_t len = BUFPOOL_MIN_SIZE << cls;
+    void *buf = NULL;
+
+    if (size > BUFPOOL_MAX_SIZE) {
+        return NULL;
+    }
+    pthread_mutex_lock(&g_pool_lock);
+    size_t limit = growing ? g_cap : g_cap - BUFPOOL_MAX_SIZE;
+    if (g_in_use + len <= limit) {
+        if (g_free[cls]) {
+            buf = g_free[cls];
+            g_free[cls] = g_free[cls]->next;
+        } else {
+            trim_cache(len);
+            if (g_mapped + len <= g_cap) {
+                buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (buf == MAP_FAILED) buf = NULL;
+                else g_mapped += len;
+            }
+        }
+    }
+    if (buf) {
+        g_in_use += len;
+        if (g_in_use > g_peak) g_peak = g_in_use;
+        *cap = len;
+    } else {
+        g_paused++;
+        int known = 0;
+        for (int i = 0; i < g_waiter_count; i++) {
+            if (g_waiters[i] == reactor) known = 1;
+        }
+        if (!known && g_waiter_count < MAX_WORKERS) {
+            g_waiters[g_waiter_count++] = reactor;
+        }
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+    return buf;
+}
+
+void bufpool_put(void *buf, size_t cap) {
+    reactor_t *waiters[MAX_WORKERS];
+    int cls = size_class(cap);
+
+    pthread_mutex_lock(&g_pool_lock);
+    free_buf_t *node = buf;
+    node->next = g_free[cls];
+    g_free[cls] = node;
+    g_in_use -= cap;
+    int count = g_waiter_count;
+    memcpy(waiters, g_waiters, (size_t)count * sizeof(waiters[0]));
+    g_waiter_count = 0;
+    pthread_mutex_unlock(&g_pool_lock);
+
+    // The paused sessions try again on their own loops
+    for (int i = 0; i < count; i++) {
+        uint64_t one = 1;
+        if (waiters[i]->wake_fd != -1 && write(waiters[i]->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            log_error("Failed to wake worker after returning a buffer.");
+        }
+    }
+}
+
+void bufpool_log_stats(void) {
+    char log_buf[SMALL_BUF_SIZE];
+
+    pthread_mutex_lock(&g_pool_lock);
+    snprintf(log_buf, sizeof(log_buf), "Buffer pool: %.1f MiB in use, %.1f MiB mapped, peak %.1f MiB of %.1f MiB; %lu reads paused.",
+             g_in_use / 1048576.0, g_mapped / 1048576.0, g_peak / 1048576.0, g_cap / 1048576.0, g_paused);
+    pthread_mutex_unlock(&g_pool_lock);
+    log_info(log_buf);
+}
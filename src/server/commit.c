@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "include/commit.h"
+#include "include/session.h"
+#include "include/reactor.h"
+#include "include/resume.h"
+#include "include/dedup.h"
+#include "include/metrics.h"
+
+struct commit_job {
+    conn_t *conn;            // NULL once the session is gone; only touched on its loop
+    reactor_t *reactor;
+    uint32_t stream_id;
+    int fd;
+    int ckpt_fd;             // resumable upload: its checkpoint, locked until the commit settles; else -1
+    char tmp_path[PATH_MAX];
+    char full_path[PATH_MAX];
+    char part_path[PATH_MAX];  // resumable upload: its partial file (tmp_path), kept if the commit fails
+    char ckpt_path[PATH_MAX];
+    char name[PROTO_MAX_NAME + 1];
+    uint64_t size;
+    uint64_t start_ns;       // when the upload was requested
+    uint64_t queued_ns;
+    int error;               // errno of the failed step, 0 once durable
+    commit_job_t *next;
+};
+
+static const server_config_t *g_config;
+static pthread_t g_thread;
+static int g_running = 0;
+static int g_stop = 0;
+
+// Guards the queue and every reactor's `committed` list
+static pthread_mutex_t g_commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_commit_cond = PTHREAD_COND_INITIALIZER;
+static commit_job_t *g_queue_head = NULL;
+static commit_job_t *g_queue_tail = NULL;
+static int g_queue_len = 0;
+
+static atomic_uint g_tmp_seq;
+
+// Written by the commit thread only, read for the stats log
+static atomic_ulong g_batches;
+static atomic_ulong g_files;
+static atomic_ulong g_failed;
+static histogram_t g_latency_us;   // queued to durable, per file
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void commit_tmp_name(char *path, size_t cap) {
+    snprintf(path, cap, "%s/%d-%u.upload", RESUME_DIR, (int)getpid(), atomic_fetch_add(&g_tmp_seq, 1));
+}
+
+int commit_link(int fd, char *tmp_path, size_t cap, const char *full_path) {
+    char fd_path[64];
+
+    if (!tmp_path[0]) {
+        // linkat() cannot replace, so the O_TMPFILE gets a temp name first
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+        commit_tmp_name(tmp_path, cap);
+        if (linkat(AT_FDCWD, fd_path, AT_FDCWD, tmp_path, AT_SYMLINK_FOLLOW) == -1) {
+            tmp_path[0] = '\0';
+            return -1;
+        }
+    }
+    if (rename(tmp_path, full_path) == -1) {
+        return -1;
+    }
+    tmp_path[0] = '\0';
+    return 0;
+}
+
+int commit_sync_dir(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+// --- Commit thread ---
+
+// Make one batch durable: data first, then the names, then the directory holding them
+static void commit_batch(commit_job_t *batch, int count) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE];
+
+    if (g_config->commit_sync == COMMIT_SYNC_SYNCFS) {
+        // One barrier for the whole filesystem, however many files the batch holds
+        if (syncfs(batch->fd) == -1) {
+            int error = errno;
+            for (commit_job_t *job = batch; job; job = job->next) job->error = error;
+        }
+    } else {
+        for (commit_job_t *job = batch; job; job = job->next) {
+            if (fdatasync(job->fd) == -1) job->error = errno;
+        }
+    }
+
+    for (commit_job_t *job = batch; job; job = job->next) {
+        if (!job->error && commit_link(job->fd, job->tmp_path, sizeof(job->tmp_path), job->full_path) == -1) {
+            job->error = errno;
+        }
+        if (job->error) {
+            snprintf(log_buf, sizeof(log_buf), "Failed to commit '%s': %s", job->full_path, strerror(job->error));
+            log_error(log_buf);
+            if (job->tmp_path[0] && job->ckpt_fd == -1) unlink(job->tmp_path);
+        } else {
+            dedup_forget(job->name);   // the plain file replaces a deduplicated one of the same name
+        }
+        close(job->fd);
+        job->fd = -1;
+    }
+    if (commit_sync_dir(UPLOAD_DIR) == -1) {
+        int error = errno;
+        for (commit_job_t *job = batch; job; job = job->next) {
+            if (job->error) continue;
+            job->error = error;
+            // A resumable upload goes back to its partial file, so a new RESUME finds it
+            if (job->ckpt_fd != -1) rename(job->full_path, job->part_path);
+        }
+    }
+    // A resumable upload is over once durable; otherwise its partial file and checkpoint stay
+    for (commit_job_t *job = batch; job; job = job->next) {
+        if (job->ckpt_fd == -1) continue;
+        if (!job->error) unlink(job->ckpt_path);
+        close(job->ckpt_fd);   // drops the lock
+        job->ckpt_fd = -1;
+    }
+
+    uint64_t now = monotonic_ns();
+    atomic_fetch_add_explicit(&g_batches, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_files, (unsigned long)count, memory_order_relaxed);
+    for (commit_job_t *job = batch; job; job = job->next) {
+        if (job->error) atomic_fetch_add_explicit(&g_failed, 1, memory_order_relaxed);
+        histogram_record(&g_latency_us, (now - job->queued_ns) / 1000);
+    }
+}
+
+// Hand every job back to the loop that owns its session
+static void commit_deliver(commit_job_t *batch) {
+    pthread_mutex_lock(&g_commit_lock);
+    while (batch) {
+        commit_job_t *job = batch;
+        batch = job->next;
+        job->next = job->reactor->committed;
+        job->reactor->committed = job;
+        if (g_stop) {
+            continue;   // the loops are gone, the jobs are dropped with the process
+        }
+        uint64_t one = 1;
+        if (write(job->reactor->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            log_error("Failed to wake worker after commit.");
+        }
+    }
+    pthread_mutex_unlock(&g_commit_lock);
+}
+
+static void *commit_main(void *arg) {
+    (void)arg;
+    long window_ns = g_config->commit_window_us * 1000L;
+
+    pthread_mutex_lock(&g_commit_lock);
+    for (;;) {
+        while (!g_stop && !g_queue_head) {
+            pthread_cond_wait(&g_commit_cond, &g_commit_lock);
+        }
+        if (!g_queue_head) {
+            break;   // stopping and drained
+        }
+
+        // Give uploads finishing right behind the first one the chance to share its flush
+        uint64_t deadline = g_queue_head->queued_ns + (uint64_t)window_ns;
+        while (!g_stop && g_queue_len < g_config->commit_batch && monotonic_ns() < deadline) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            uint64_t left = deadline - monotonic_ns();
+            if ((int64_t)left <= 0) break;
+            until.tv_sec += (time_t)(left / 1000000000ULL);
+            until.tv_nsec += (long)(left % 1000000000ULL);
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&g_commit_cond, &g_commit_lock, &until);
+        }
+
+        commit_job_t *batch = g_queue_head;
+        commit_job_t *last = batch;
+        int count = 1;
+        while (count < g_config->commit_batch && last->next) {
+            last = last->next;
+            count++;
+        }
+        g_queue_head = last->next;
+        if (!g_queue_head) g_queue_tail = NULL;
+        g_queue_len -= count;
+        last->next = NULL;
+        pthread_mutex_unlock(&g_commit_lock);
+
+        commit_batch(batch, count);
+        commit_deliver(batch);
+
+        pthread_mutex_lock(&g_commit_lock);
+    }
+    pthread_mutex_unlock(&g_commit_lock);
+    return NULL;
+}
+
+int commit_start(const server_config_t *config) {
+    char log_buf[SMALL_BUF_SIZE];
+
+    g_config = config;
+    if (!config->durable) {
+        return 0;
+    }
+    if (pthread_create(&g_thread, NULL, commit_main, NULL) != 0) {
+        log_error("Failed to start the commit thread.");
+        return -1;
+    }
+    g_running = 1;
+    snprintf(log_buf, sizeof(log_buf), "Durable uploads: group commit with %s, window %ld us, up to %d files per flush.",
+             config->commit_sync == COMMIT_SYNC_SYNCFS ? "syncfs()" : "fdatasync()", config->commit_window_us, config->commit_batch);
+    log_info(log_buf);
+    return 0;
+}
+
+void commit_stop(void) {
+    if (!g_running) {
+        return;
+    }
+    pthread_mutex_lock(&g_commit_lock);
+    g_stop = 1;
+    pthread_cond_signal(&g_commit_cond);
+    pthread_mutex_unlock(&g_commit_lock);
+    pthread_join(g_thread, NULL);
+    g_running = 0;
+}
+
+// --- Worker side ---
+
+static void queue_upload(conn_t *conn, uint32_t stream_id, int fd, int ckpt_fd, const char *tmp_path, const char *ckpt_path,
+                         const char *full_path, const char *name, uint64_t size, uint64_t start_ns) {
+    commit_job_t *job = calloc(1, sizeof(*job));
+    if (!job) {
+        close(fd);
+        if (ckpt_fd != -1) close(ckpt_fd);
+        else if (tmp_path[0]) unlink(tmp_path);
+        STAT_ADD(conn->reactor, uploads_failed, 1);
+        session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, "UPLOAD_FAILED: Could not write file.");
+        return;
+    }
+    job->conn = conn;
+    job->reactor = conn->reactor;
+    job->stream_id = stream_id;
+    job->fd = fd;
+    job->ckpt_fd = ckpt_fd;
+    snprintf(job->tmp_path, sizeof(job->tmp_path), "%s", tmp_path);
+    if (ckpt_fd != -1) {
+        snprintf(job->part_path, sizeof(job->part_path), "%s", tmp_path);
+        snprintf(job->ckpt_path, sizeof(job->ckpt_path), "%s", ckpt_path);
+    }
+    snprintf(job->full_path, sizeof(job->full_path), "%s", full_path);
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    job->size = size;
+    job->start_ns = start_ns;
+    job->queued_ns = monotonic_ns();
+
+    // Later requests wait: their answers must not overtake this one
+    conn->commit = job;
+    conn->state = CONN_STATE_COMMIT;
+
+    pthread_mutex_lock(&g_commit_lock);
+    if (g_queue_tail) g_queue_tail->next = job;
+    else g_queue_head = job;
+    g_queue_tail = job;
+    g_queue_len++;
+    if (g_queue_len == 1 || g_queue_len >= g_config->commit_batch) {
+        pthread_cond_signal(&g_commit_cond);
+    }
+    pthread_mutex_unlock(&g_commit_lock);
+}
+
+void commit_submit(conn_t *conn, uint32_t stream_id, int fd, const char *tmp_path, const char *full_path, const char *name,
+                   uint64_t size, uint64_t start_ns) {
+    queue_upload(conn, stream_id, fd, -1, tmp_path, NULL, full_path, name, size, start_ns);
+}
+
+void commit_submit_resumable(conn_t *conn, uint32_t stream_id, int fd, int ckpt_fd, const char *part_path, const char *ckpt_path,
+                             const char *full_path, const char *name, uint64_t size, uint64_t start_ns) {
+    queue_upload(conn, stream_id, fd, ckpt_fd, part_path, ckpt_path, full_path, name, size, start_ns);
+}
+
+void commit_reap(reactor_t *reactor) {
+    char log_buf[PATH_MAX * 2 + SMALL_BUF_SIZE];
+
+    pthread_mutex_lock(&g_commit_lock);
+    commit_job_t *done = reactor->committed;
+    reactor->committed = NULL;
+    pthread_mutex_unlock(&g_commit_lock);
+
+    while (done) {
+        commit_job_t *job = done;
+        done = job->next;
+        conn_t *conn = job->conn;
+        if (conn) {
+            conn->commit = NULL;
+            conn->state = CONN_STATE_COMMAND;
+            if (job->error) {
+                STAT_ADD(reactor, uploads_failed, 1);
+                session_reply(conn, job->stream_id, PROTO_STATUS_IO_ERROR, "UPLOAD_FAILED: Could not write file.");
+            } else {
+                metrics_upload_ok(reactor, job->size, job->start_ns);
+                snprintf(log_buf, sizeof(log_buf), "File '%s' is durable at '%s' after %.1f ms.", job->name, job->full_path,
+                         (double)(monotonic_ns() - job->queued_ns) / 1e6);
+                log_info(log_buf);
+                session_reply(conn, job->stream_id, PROTO_STATUS_OK, "UPLOAD_SUCCESS");
+            }
+            reactor_conn_resume(conn);   // may close the session
+        }
+        free(job);
+    }
+}
+
+int commit_queue_depth(void) {
+    pthread_mutex_lock(&g_commit_lock);
+    int len = g_queue_len;
+    pthread_mutex_unlock(&g_commit_lock);
+    return len;
+}
+
+void commit_cancel(conn_t *conn) {
+    if (conn->commit) {
+        conn->commit->conn = NULL;
+        conn->commit = NULL;
+    }
+}
+
+void commit_latency(histogram_snapshot_t *snap) {
+    histogram_merge(snap, &g_latency_us);
+}
+
+void commit_log_stats(void) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    static histogram_snapshot_t latency;
+
+    // Also after commit_stop(), for the final line at shutdown
+    if (!g_config || !g_config->durable) {
+        return;
+    }
+    memset(&latency, 0, sizeof(latency));
+    histogram_merge(&latency, &g_latency_us);
+    unsigned long batches = atomic_load(&g_batches);
+    unsigned long files = atomic_load(&g_files);
+    snprintf(log_buf, sizeof(log_buf),
+             "Group commit: %lu files in %lu flushes (%.1f per flush), %lu failed, latency avg %.2f ms / p50 %.2f ms / p99 %.2f ms / max %.2f ms.",
+             files, batches, batches ? (double)files / batches : 0.0, atomic_load(&g_failed),
+             latency.total ? (double)latency.sum / 1000.0 / latency.total : 0.0,
+             histogram_quantile(&latency, 0.5) / 1000.0, histogram_quantile(&latency, 0.99) / 1000.0, latency.max / 1000.0);
+    log_info(log_buf);
+}
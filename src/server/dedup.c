@@ -0,0 +1,873 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <openssl/evp.h>
+
+#include "include/dedup.h"
+#include "include/session.h"
+#include "include/reactor.h"
+#include "include/metrics.h"
+#include "../../include/protocol.h"
+#include "../../include/cdc.h"
+
+// Manifest file: magic, u64 file_size, u32 chunk_count, then the entries as on the wire
+#define MANIFEST_MAGIC "MXMAN1\n"
+#define MANIFEST_MAGIC_LEN 7
+#define MANIFEST_HEADER_SIZE (MANIFEST_MAGIC_LEN + 12)
+
+typedef struct {
+    uint8_t hash[PROTO_HASH_SIZE];
+    uint32_t len;
+} dedup_entry_t;
+
+// One stored chunk. Open addressing keyed by the hash itself, it is uniform already.
+typedef struct {
+    uint8_t hash[PROTO_HASH_SIZE];
+    uint32_t refs;           // manifests naming it (and downloads reading it); BLOBs start at 0
+    int used;
+} dedup_slot_t;
+
+struct dedup_upload {
+    int from_manifest;
+    char name[PROTO_MAX_NAME + 1];
+    uint64_t file_size;       // MANIFEST: as announced, checked against the entries
+    uint64_t listed;          // bytes covered by the entries so far
+    dedup_entry_t *entries;   // every entry holds a reference until commit or abort
+    size_t count;
+    size_t cap;
+    size_t missing;           // MANIFEST entries naming chunks the server does not have
+    size_t new_chunks;
+    uint64_t new_bytes;
+    EVP_MD_CTX *digest;       // UPLOAD: SHA-256 of the whole content, the chunks are in hand anyway
+    cdc_t cdc;
+    uint8_t buf[CDC_MAX_SIZE]; // UPLOAD: the chunk being cut; MANIFEST: a partial entry
+    size_t buf_len;
+};
+
+struct dedup_manifest {
+    dedup_entry_t *entries;   // pinned: one reference each
+    uint64_t *starts;         // file offset of every entry
+    size_t count;
+};
+
+// The index is shared by every worker. It is never held across chunk data I/O, but
+// chunk files are linked and unlinked under it so none can vanish between a lookup
+// and the reference taken on it.
+static pthread_mutex_t g_dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+// Serializes replacing a manifest with reading the one it replaces
+static pthread_mutex_t g_manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+static dedup_slot_t *g_slots = NULL;
+static size_t g_slot_cap = 0;      // power of two
+static size_t g_slot_count = 0;
+static atomic_uint g_tmp_seq;
+static int g_dedup_enabled = 0;
+// Chunks nothing references any more are deleted at once; only while this process is the
+// only one using the store (guarded by g_dedup_lock)
+static int g_collect = 0;
+static int g_store_lock_fd = -1;  // DEDUP_DIR, flock()ed for as long as the process runs
+
+static void hash_hex(const uint8_t *hash, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < PROTO_HASH_SIZE; i++) {
+        hex[i * 2] = digits[hash[i] >> 4];
+        hex[i * 2 + 1] = digits[hash[i] & 15];
+    }
+    hex[PROTO_HASH_SIZE * 2] = '\0';
+}
+
+static int hex_hash(const char *hex, uint8_t *hash) {
+    for (int i = 0; i < PROTO_HASH_SIZE * 2; i++) {
+        char c = hex[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (v == -1) return -1;
+        if (i % 2 == 0) hash[i / 2] = (uint8_t)(v << 4);
+        else hash[i / 2] |= (uint8_t)v;
+    }
+    return hex[PROTO_HASH_SIZE * 2] == '\0' ? 0 : -1;
+}
+
+static void chunk_path(char *path, size_t cap, const uint8_t *hash) {
+    char hex[PROTO_HASH_SIZE * 2 + 1];
+    hash_hex(hash, hex);
+    snprintf(path, cap, "%s/%.2s/%s", DEDUP_DIR, hex, hex);
+}
+
+// Scratch files are written next to the chunks, then renamed into place
+static int open_tmp(char *path, size_t cap) {
+    snprintf(path, cap, "%s/tmp-%d-%u", DEDUP_DIR, (int)getpid(), atomic_fetch_add(&g_tmp_seq, 1));
+    return open(path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+// --- Index, caller holds g_dedup_lock ---
+
+static size_t slot_home(const uint8_t *hash) {
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key));
+    return (size_t)key & (g_slot_cap - 1);
+}
+
+static dedup_slot_t *index_find(const uint8_t *hash) {
+    if (g_slot_cap == 0) {
+        return NULL;
+    }
+    for (size_t i = slot_home(hash); g_slots[i].used; i = (i + 1) & (g_slot_cap - 1)) {
+        if (memcmp(g_slots[i].hash, hash, PROTO_HASH_SIZE) == 0) return &g_slots[i];
+    }
+    return NULL;
+}
+
+static void index_place(dedup_slot_t *slots, size_t cap, const dedup_slot_t *slot) {
+    uint64_t key;
+    memcpy(&key, slot->hash, sizeof(key));
+    size_t i = (size_t)key & (cap - 1);
+    while (slots[i].used) i = (i + 1) & (cap - 1);
+    slots[i] = *slot;
+}
+
+// Rehash into a table of cap slots, keeping only the slots whose `used` equals keep
+static int index_rebuild(size_t cap, int keep) {
+    dedup_slot_t *slots = calloc(cap, sizeof(*slots));
+    if (!slots) {
+        return -1;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < g_slot_cap; i++) {
+        if (g_slots[i].used == keep) {
+            dedup_slot_t slot = g_slots[i];
+            slot.used = 1;
+            index_place(slots, cap, &slot);
+            count++;
+        }
+    }
+    free(g_slots);
+    g_slots = slots;
+    g_slot_cap = cap;
+    g_slot_count = count;
+    return 0;
+}
+
+// A new slot with no references; NULL if out of memory
+static dedup_slot_t *index_insert(const uint8_t *hash) {
+    // At most three quarters full, probe chains stay short
+    if ((g_slot_count + 1) * 4 > g_slot_cap * 3 && index_rebuild(g_slot_cap ? g_slot_cap * 2 : 1024, 1) == -1) {
+        return NULL;
+    }
+    dedup_slot_t slot = { .used = 1 };
+    memcpy(slot.hash, hash, PROTO_HASH_SIZE);
+    index_place(g_slots, g_slot_cap, &slot);
+    g_slot_count++;
+    return index_find(hash);
+}
+
+// Backward shift deletion: later members of the probe chain move up, no tombstones needed
+static void index_remove(dedup_slot_t *slot) {
+    size_t mask = g_slot_cap - 1;
+    size_t hole = (size_t)(slot - g_slots);
+    for (size_t j = (hole + 1) & mask; g_slots[j].used; j = (j + 1) & mask) {
+        size_t home = slot_home(g_slots[j].hash);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            g_slots[hole] = g_slots[j];
+            hole = j;
+        }
+    }
+    g_slots[hole].used = 0;
+    g_slot_count--;
+}
+
+// --- Chunks ---
+
+// Drop one reference per entry. With `collect` chunks nothing refers to any more are
+// deleted; an abandoned upload keeps them, they may be BLOBs a MANIFEST is about to name.
+// A process sharing the store keeps them all: the other one may still reference them.
+// Unreferenced chunks are collected at the next start.
+static void release_entries(const dedup_entry_t *entries, size_t count, int collect) {
+    char path[PATH_MAX];
+
+    pthread_mutex_lock(&g_dedup_lock);
+    for (size_t i = 0; i < count; i++) {
+        dedup_slot_t *slot = index_find(entries[i].hash);
+        if (slot && slot->refs > 0 && --slot->refs == 0 && collect && g_collect) {
+            chunk_path(path, sizeof(path), slot->hash);
+            unlink(path);
+            index_remove(slot);
+        }
+    }
+    pthread_mutex_unlock(&g_dedup_lock);
+}
+
+// Store a chunk unless it is there already, taking `refs` references on it.
+// 1: written now; 0: was stored; -1: storage error, errno set.
+static int store_chunk(const uint8_t *hash, const uint8_t *data, size_t len, uint32_t refs) {
+    char tmp_path[PATH_MAX];
+    char path[PATH_MAX];
+
+    pthread_mutex_lock(&g_dedup_lock);
+    dedup_slot_t *slot = index_find(hash);
+    if (slot) {
+        slot->refs += refs;
+    }
+    pthread_mutex_unlock(&g_dedup_lock);
+    if (slot) {
+        return 0;
+    }
+
+    int fd = open_tmp(tmp_path, sizeof(tmp_path));
+    if (fd == -1) {
+        return -1;
+    }
+    if (write_all(fd, data, len) == -1) {
+        int saved = errno;
+        close(fd);
+        unlink(tmp_path);
+        errno = saved;
+        return -1;
+    }
+    close(fd);
+    chunk_path(path, sizeof(path), hash);
+
+    int rc = 1;
+    pthread_mutex_lock(&g_dedup_lock);
+    slot = index_find(hash);
+    if (slot) {
+        rc = 0;                     // another upload stored it meanwhile
+        unlink(tmp_path);
+    } else if ((slot = index_insert(hash)) == NULL) {
+        rc = -1;
+        unlink(tmp_path);
+        errno = ENOMEM;
+    } else if (rename(tmp_path, path) == -1) {
+        int saved = errno;
+        index_remove(slot);
+        slot = NULL;
+        unlink(tmp_path);
+        errno = saved;
+        rc = -1;
+    }
+    if (slot) {
+        slot->refs += refs;
+    }
+    pthread_mutex_unlock(&g_dedup_lock);
+    return rc;
+}
+
+// --- Manifests ---
+
+// Load a manifest file; -1 if there is none or it is damaged
+static int manifest_read(const char *path, dedup_entry_t **entries, size_t *count, uint64_t *file_size) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    uint8_t *raw = NULL;
+    if (fstat(fd, &st) == -1 || st.st_size < MANIFEST_HEADER_SIZE || (raw = malloc((size_t)st.st_size)) == NULL
+        || pread(fd, raw, (size_t)st.st_size, 0) != st.st_size) {
+        free(raw);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    uint64_t n = proto_get_u32(raw + MANIFEST_MAGIC_LEN + 8);
+    if (memcmp(raw, MANIFEST_MAGIC, MANIFEST_MAGIC_LEN) != 0
+        || (uint64_t)st.st_size != MANIFEST_HEADER_SIZE + n * PROTO_MANIFEST_ENTRY_SIZE) {
+        free(raw);
+        return -1;
+    }
+    *entries = malloc((size_t)(n ? n : 1) * sizeof(dedup_entry_t));
+    if (!*entries) {
+        free(raw);
+        return -1;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        const uint8_t *record = raw + MANIFEST_HEADER_SIZE + i * PROTO_MANIFEST_ENTRY_SIZE;
+        memcpy((*entries)[i].hash, record, PROTO_HASH_SIZE);
+        (*entries)[i].len = proto_get_u32(record + PROTO_HASH_SIZE);
+    }
+    *count = (size_t)n;
+    *file_size = proto_get_u64(raw + MANIFEST_MAGIC_LEN);
+    free(raw);
+    return 0;
+}
+
+// Replace (or remove, with tmp_path NULL) the manifest of `name` and release the old one's chunks
+static int manifest_replace(const char *name, const char *tmp_path) {
+    char path[PATH_MAX];
+    dedup_entry_t *old = NULL;
+    size_t old_count = 0;
+    uint64_t old_size;
+
+    snprintf(path, sizeof(path), "%s/%s", MANIFEST_DIR, name);
+    pthread_mutex_lock(&g_manifest_lock);
+    int had_old = manifest_read(path, &old, &old_count, &old_size) == 0;
+    int rc = tmp_path ? rename(tmp_path, path) : unlink(path);
+    if (rc == 0 && tmp_path) {
+        // A plain file of the same name is replaced as well
+        snprintf(path, sizeof(path), "%s/%s", UPLOAD_DIR, name);
+        unlink(path);
+    }
+    pthread_mutex_unlock(&g_manifest_lock);
+
+    if (had_old && rc == 0) {
+        release_entries(old, old_count, 1);
+    }
+    free(old);
+    return rc;
+}
+
+static int manifest_write(const dedup_upload_t *upload, uint64_t file_size) {
+    char tmp_path[PATH_MAX];
+    size_t len = MANIFEST_HEADER_SIZE + upload->count * PROTO_MANIFEST_ENTRY_SIZE;
+    uint8_t *raw = malloc(len);
+    if (!raw) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(raw, MANIFEST_MAGIC, MANIFEST_MAGIC_LEN);
+    proto_put_u64(raw + MANIFEST_MAGIC_LEN, file_size);
+    proto_put_u32(raw + MANIFEST_MAGIC_LEN + 8, (uint32_t)upload->count);
+    for (size_t i = 0; i < upload->count; i++) {
+        uint8_t *record = raw + MANIFEST_HEADER_SIZE + i * PROTO_MANIFEST_ENTRY_SIZE;
+        memcpy(record, upload->entries[i].hash, PROTO_HASH_SIZE);
+        proto_put_u32(record + PROTO_HASH_SIZE, upload->entries[i].len);
+    }
+
+    int fd = open_tmp(tmp_path, sizeof(tmp_path));
+    int rc = fd == -1 ? -1 : write_all(fd, raw, len);
+    int saved = errno;
+    free(raw);
+    if (fd != -1) close(fd);
+    if (rc == 0 && manifest_replace(upload->name, tmp_path) == 0) {
+        return 0;
+    }
+    saved = errno;
+    if (fd != -1) unlink(tmp_path);
+    errno = saved;
+    return -1;
+}
+
+// --- Uploads ---
+
+static int upload_add_entry(dedup_upload_t *upload, const uint8_t *hash, uint32_t len) {
+    if (upload->count == upload->cap) {
+        size_t cap = upload->cap ? upload->cap * 2 : 64;
+        dedup_entry_t *grown = realloc(upload->entries, cap * sizeof(*grown));
+        if (!grown) {
+            return -1;
+        }
+        upload->entries = grown;
+        upload->cap = cap;
+    }
+    memcpy(upload->entries[upload->count].hash, hash, PROTO_HASH_SIZE);
+    upload->entries[upload->count].len = len;
+    upload->count++;
+    return 0;
+}
+
+// The chunk in upload->buf is complete: store it and reference it
+static int upload_flush_chunk(dedup_upload_t *upload) {
+    dedup_entry_t entry = { .len = (uint32_t)upload->buf_len };
+    if (!EVP_Digest(upload->buf, upload->buf_len, entry.hash, NULL, EVP_sha256(), NULL)) {
+        errno = EIO;
+        return -1;
+    }
+
+    int rc = store_chunk(entry.hash, upload->buf, upload->buf_len, 1);
+    if (rc == -1) {
+        return -1;
+    }
+    if (upload_add_entry(upload, entry.hash, entry.len) == -1) {
+        release_entries(&entry, 1, 0);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (rc == 1) {
+        upload->new_chunks++;
+        upload->new_bytes += upload->buf_len;
+    }
+    upload->listed += upload->buf_len;
+    upload->buf_len = 0;
+    return 0;
+}
+
+// One MANIFEST entry: reference the chunk it names, or count it as missing
+static int upload_take_entry(dedup_upload_t *upload, const uint8_t *record) {
+    uint32_t len = proto_get_u32(record + PROTO_HASH_SIZE);
+    upload->listed += len;
+
+    pthread_mutex_lock(&g_dedup_lock);
+    dedup_slot_t *slot = len > 0 && len <= PROTO_MAX_BLOB ? index_find(record) : NULL;
+    if (slot) {
+        slot->refs++;
+    }
+    pthread_mutex_unlock(&g_dedup_lock);
+
+    if (!slot) {
+        upload->missing++;
+        return 0;
+    }
+    if (upload_add_entry(upload, record, len) == -1) {
+        dedup_entry_t entry = { .len = len };
+        memcpy(entry.hash, record, PROTO_HASH_SIZE);
+        release_entries(&entry, 1, 0);
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+static void upload_free(dedup_upload_t *upload) {
+    EVP_MD_CTX_free(upload->digest);
+    free(upload->entries);
+    free(upload);
+}
+
+void dedup_upload_begin(conn_t *conn, uint32_t stream_id, uint8_t opcode, const char *name, size_t name_len,
+                        uint64_t file_size, uint64_t content_len) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE * 2];
+    const char *reason = NULL;
+    proto_status_t status = PROTO_STATUS_IO_ERROR;
+
+    snprintf(conn->filename, sizeof(conn->filename), "%.*s", (int)name_len, name);
+    snprintf(conn->full_path, sizeof(conn->full_path), "%s/%s", MANIFEST_DIR, conn->filename);
+    conn->stream_id = stream_id;
+    conn->filesize = (long)content_len;
+    conn->received = 0;
+    conn->file_base = 0;
+    conn->recv_path = RECV_PATH_NONE;
+    conn->file_fd = -1;           // content goes through dedup_upload_data()
+    conn->upload_start_ns = metrics_now_ns();
+    conn->state = CONN_STATE_RECV_FILE;
+
+    snprintf(log_buf, sizeof(log_buf), "Client requested %s: file '%s', size %llu bytes (deduplicated).",
+             opcode == PROTO_OP_MANIFEST ? "MANIFEST" : "UPLOAD", conn->filename, (unsigned long long)file_size);
+    log_info(log_buf);
+
+    dedup_upload_t *upload = NULL;
+    if (!g_dedup_enabled) {
+        status = PROTO_STATUS_UNSUPPORTED;
+        reason = "ERROR: The server does not run the deduplicating store.";
+    } else if (memchr(name, '/', name_len) || memchr(name, '\0', name_len) || name[0] == '.') {
+        status = PROTO_STATUS_BAD_REQUEST;
+        reason = "ERROR: Invalid UPLOAD file name.";
+    } else if ((upload = calloc(1, sizeof(*upload))) == NULL
+               || (opcode == PROTO_OP_UPLOAD && ((upload->digest = EVP_MD_CTX_new()) == NULL
+                                                 || !EVP_DigestInit_ex(upload->digest, EVP_sha256(), NULL)))) {
+        reason = "ERROR: Could not create file on server.";
+        if (upload) upload_free(upload);
+        upload = NULL;
+    }
+    if (reason) {
+        session_reply(conn, stream_id, status, reason);
+    } else {
+        upload->from_manifest = opcode == PROTO_OP_MANIFEST;
+        upload->file_size = file_size;
+        memcpy(upload->name, name, name_len);
+        conn->dedup = upload;
+    }
+
+    // An empty file is complete as soon as it is announced
+    if (content_len == 0) {
+        session_on_file_data(conn, NULL, 0);
+    }
+}
+
+int dedup_upload_data(conn_t *conn, const char *data, size_t len) {
+    dedup_upload_t *upload = conn->dedup;
+    const uint8_t *p = (const uint8_t *)data;
+
+    while (len > 0) {
+        if (upload->from_manifest) {
+            size_t take = PROTO_MANIFEST_ENTRY_SIZE - upload->buf_len;
+            if (take > len) take = len;
+            memcpy(upload->buf + upload->buf_len, p, take);
+            upload->buf_len += take;
+            p += take;
+            len -= take;
+            if (upload->buf_len == PROTO_MANIFEST_ENTRY_SIZE) {
+                upload->buf_len = 0;
+                if (upload_take_entry(upload, upload->buf) == -1) return -1;
+            }
+            continue;
+        }
+
+        int cut;
+        size_t take = cdc_feed(&upload->cdc, p, len, &cut);
+        memcpy(upload->buf + upload->buf_len, p, take);  // a chunk never grows past CDC_MAX_SIZE
+        if (!EVP_DigestUpdate(upload->digest, p, take)) {
+            errno = EIO;
+            return -1;
+        }
+        upload->buf_len += take;
+        p += take;
+        len -= take;
+        if (cut && upload_flush_chunk(upload) == -1) return -1;
+    }
+    return 0;
+}
+
+void dedup_upload_abort(conn_t *conn) {
+    dedup_upload_t *upload = conn->dedup;
+    if (upload) {
+        release_entries(upload->entries, upload->count, 0);
+        upload_free(upload);
+        conn->dedup = NULL;
+    }
+}
+
+void dedup_upload_done(conn_t *conn, const uint8_t *expected) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE * 2];
+    char reply[SMALL_BUF_SIZE];
+    uint8_t digest[PROTO_HASH_SIZE];
+    dedup_upload_t *upload = conn->dedup;
+
+    if (!upload->from_manifest && upload->buf_len > 0 && upload_flush_chunk(upload) == -1) {
+        session_file_failed(conn, strerror(errno));
+        return;
+    }
+    if (expected && (!EVP_DigestFinal_ex(upload->digest, digest, NULL) || memcmp(digest, expected, PROTO_HASH_SIZE) != 0)) {
+        snprintf(log_buf, sizeof(log_buf), "Upload of '%s' does not match the client's SHA-256, discarded.", upload->name);
+        log_error(log_buf);
+        dedup_upload_abort(conn);
+        STAT_ADD(conn->reactor, uploads_failed, 1);
+        session_reply(conn, conn->stream_id, PROTO_STATUS_BAD_CHECKSUM, "UPLOAD_FAILED: Content does not match its SHA-256.");
+        return;
+    }
+    if (upload->missing > 0) {
+        snprintf(reply, sizeof(reply), "ERROR: %zu chunk(s) of the manifest are not stored, send them first.", upload->missing);
+        session_reply(conn, conn->stream_id, PROTO_STATUS_MISSING_CHUNK, reply);
+        dedup_upload_abort(conn);
+        STAT_ADD(conn->reactor, uploads_failed, 1);
+        return;
+    }
+    uint64_t file_size = upload->listed;
+    if (upload->from_manifest && file_size != upload->file_size) {
+        dedup_upload_abort(conn);
+        STAT_ADD(conn->reactor, uploads_failed, 1);
+        session_reply(conn, conn->stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Manifest chunks do not add up to the file size.");
+        conn->state = CONN_STATE_CLOSING;
+        return;
+    }
+    if (manifest_write(upload, file_size) == -1) {
+        session_file_failed(conn, strerror(errno));
+        return;
+    }
+
+    snprintf(log_buf, sizeof(log_buf), "File '%s' (%llu bytes) stored as %zu chunk(s), %zu new (%llu bytes written), manifest '%s'.",
+             upload->name, (unsigned long long)file_size, upload->count, upload->new_chunks,
+             (unsigned long long)upload->new_bytes, conn->full_path);
+    log_info(log_buf);
+    if (upload->from_manifest) {
+        snprintf(reply, sizeof(reply), "UPLOAD_SUCCESS (%zu chunks)", upload->count);
+    } else {
+        snprintf(reply, sizeof(reply), "UPLOAD_SUCCESS (%zu of %zu chunks new)", upload->new_chunks, upload->count);
+    }
+    session_reply(conn, conn->stream_id, PROTO_STATUS_OK, reply);
+    metrics_upload_ok(conn->reactor, file_size, conn->upload_start_ns);
+
+    upload_free(upload);   // its references now belong to the manifest
+    conn->dedup = NULL;
+}
+
+// --- Requests ---
+
+void dedup_on_have(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len) {
+    uint8_t present[PROTO_MAX_CONTROL / PROTO_HASH_SIZE / 8];
+
+    if (!g_dedup_enabled) {
+        session_reply(conn, stream_id, PROTO_STATUS_UNSUPPORTED, "ERROR: The server does not run the deduplicating store.");
+        return;
+    }
+    if (len == 0 || len % PROTO_HASH_SIZE != 0) {
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid HAVE frame.");
+        return;
+    }
+    size_t count = len / PROTO_HASH_SIZE;
+    memset(present, 0, sizeof(present));
+
+    pthread_mutex_lock(&g_dedup_lock);
+    for (size_t i = 0; i < count; i++) {
+        if (index_find(payload + i * PROTO_HASH_SIZE)) present[i / 8] |= (uint8_t)(0x80 >> (i % 8));
+    }
+    pthread_mutex_unlock(&g_dedup_lock);
+
+    conn_send_frame(conn, PROTO_OP_PRESENT, stream_id, present, (count + 7) / 8);
+}
+
+void dedup_on_blob(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len) {
+    char log_buf[SMALL_BUF_SIZE];
+    uint8_t hash[PROTO_HASH_SIZE];
+
+    if (!g_dedup_enabled) {
+        session_reply(conn, stream_id, PROTO_STATUS_UNSUPPORTED, "ERROR: The server does not run the deduplicating store.");
+        return;
+    }
+    if (len <= PROTO_HASH_SIZE || len > PROTO_HASH_SIZE + PROTO_MAX_BLOB) {
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid BLOB frame.");
+        return;
+    }
+    if (!EVP_Digest(payload + PROTO_HASH_SIZE, len - PROTO_HASH_SIZE, hash, NULL, EVP_sha256(), NULL)) {
+        session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, "ERROR: Could not store chunk.");
+        return;
+    }
+    if (memcmp(hash, payload, PROTO_HASH_SIZE) != 0) {
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_CHECKSUM, "ERROR: Chunk does not match its hash, send it again.");
+        return;
+    }
+    // Unreferenced until a manifest names it
+    if (store_chunk(hash, payload + PROTO_HASH_SIZE, len - PROTO_HASH_SIZE, 0) == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to store chunk: %s", strerror(errno));
+        log_error(log_buf);
+        session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, "ERROR: Could not store chunk.");
+        return;
+    }
+    session_reply(conn, stream_id, PROTO_STATUS_OK, "BLOB_STORED");
+}
+
+int dedup_enabled(void) {
+    return g_dedup_enabled;
+}
+
+void dedup_forget(const char *name) {
+    if (g_dedup_enabled) {
+        manifest_replace(name, NULL);
+    }
+}
+
+// --- Downloads ---
+
+dedup_manifest_t *dedup_manifest_open(const char *name, uint64_t *file_size) {
+    char path[PATH_MAX];
+    dedup_manifest_t *manifest;
+
+    if (!g_dedup_enabled || (manifest = calloc(1, sizeof(*manifest))) == NULL) {
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "%s/%s", MANIFEST_DIR, name);
+    pthread_mutex_lock(&g_manifest_lock);
+    int rc = manifest_read(path, &manifest->entries, &manifest->count, file_size);
+    if (rc == 0) {
+        // Pinned before the manifest lock is dropped: a replacement cannot delete them under us
+        pthread_mutex_lock(&g_dedup_lock);
+        for (size_t i = 0; i < manifest->count; i++) {
+            dedup_slot_t *slot = index_find(manifest->entries[i].hash);
+            if (slot) slot->refs++;
+        }
+        pthread_mutex_unlock(&g_dedup_lock);
+    }
+    pthread_mutex_unlock(&g_manifest_lock);
+
+    manifest->starts = rc == 0 ? malloc((manifest->count ? manifest->count : 1) * sizeof(uint64_t)) : NULL;
+    if (!manifest->starts) {
+        if (rc == 0) release_entries(manifest->entries, manifest->count, 1);
+        free(manifest->entries);
+        free(manifest);
+        return NULL;
+    }
+    uint64_t start = 0;
+    for (size_t i = 0; i < manifest->count; i++) {
+        manifest->starts[i] = start;
+        start += manifest->entries[i].len;
+    }
+    return manifest;
+}
+
+int dedup_manifest_read_at(dedup_manifest_t *manifest, uint64_t pos, int *fd, off_t *off, uint64_t *run) {
+    char path[PATH_MAX];
+    size_t lo = 0, hi = manifest->count;
+
+    // Last chunk starting at or before pos
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (manifest->starts[mid] <= pos) lo = mid;
+        else hi = mid;
+    }
+    if (manifest->count == 0 || pos - manifest->starts[lo] >= manifest->entries[lo].len) {
+        return -1;
+    }
+    chunk_path(path, sizeof(path), manifest->entries[lo].hash);
+    *fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (*fd == -1) {
+        return -1;
+    }
+    *off = (off_t)(pos - manifest->starts[lo]);
+    *run = manifest->entries[lo].len - (uint64_t)*off;
+    return 0;
+}
+
+void dedup_manifest_close(dedup_manifest_t *manifest) {
+    release_entries(manifest->entries, manifest->count, 1);
+    free(manifest->entries);
+    free(manifest->starts);
+    free(manifest);
+}
+
+// --- Startup ---
+
+static int make_dir(const char *path) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE];
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to create directory %s: %s", path, strerror(errno));
+        log_error(log_buf);
+        return -1;
+    }
+    return 0;
+}
+
+// Count a reference for every entry of every manifest
+static size_t load_manifests(void) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE];
+    char path[PATH_MAX];
+    size_t manifests = 0;
+    struct dirent *ent;
+
+    DIR *dir = opendir(MANIFEST_DIR);
+    if (!dir) {
+        return 0;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        dedup_entry_t *entries;
+        size_t count;
+        uint64_t file_size;
+        if (ent->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", MANIFEST_DIR, ent->d_name);
+        if (manifest_read(path, &entries, &count, &file_size) == -1) {
+            snprintf(log_buf, sizeof(log_buf), "Ignoring damaged manifest '%s'.", path);
+            log_error(log_buf);
+            continue;
+        }
+        for (size_t i = 0; i < count; i++) {
+            dedup_slot_t *slot = index_find(entries[i].hash);
+            if (!slot) slot = index_insert(entries[i].hash);
+            if (slot) slot->refs++;
+        }
+        free(entries);
+        manifests++;
+    }
+    closedir(dir);
+    return manifests;
+}
+
+// Mark referenced chunks that exist (used = 2) and, when collecting, delete the ones
+// nothing references
+static size_t scan_chunks(int collect, size_t *removed) {
+    char path[PATH_MAX];
+    uint8_t hash[PROTO_HASH_SIZE];
+    size_t found = 0;
+    struct dirent *ent;
+
+    for (int prefix = 0; prefix < 256; prefix++) {
+        snprintf(path, sizeof(path), "%s/%02x", DEDUP_DIR, prefix);
+        DIR *dir = opendir(path);
+        if (!dir) continue;
+        while ((ent = readdir(dir)) != NULL) {
+            if (ent->d_name[0] == '.') continue;
+            dedup_slot_t *slot = hex_hash(ent->d_name, hash) == 0 ? index_find(hash) : NULL;
+            if (slot) {
+                slot->used = 2;
+                found++;
+            } else if (collect) {
+                snprintf(path, sizeof(path), "%s/%02x/%s", DEDUP_DIR, prefix, ent->d_name);
+                unlink(path);
+                (*removed)++;
+            }
+        }
+        closedir(dir);
+    }
+
+    // Scratch files of an earlier run
+    DIR *dir = collect ? opendir(DEDUP_DIR) : NULL;
+    if (dir) {
+        while ((ent = readdir(dir)) != NULL) {
+            if (strncmp(ent->d_name, "tmp-", 4) == 0) {
+                snprintf(path, sizeof(path), "%s/%s", DEDUP_DIR, ent->d_name);
+                unlink(path);
+            }
+        }
+        closedir(dir);
+    }
+    return found;
+}
+
+int dedup_init(void) {
+    char log_buf[SMALL_BUF_SIZE];
+    char path[PATH_MAX];
+    size_t removed = 0;
+
+    if (make_dir(DEDUP_DIR) == -1 || make_dir(MANIFEST_DIR) == -1) {
+        return -1;
+    }
+    for (int prefix = 0; prefix < 256; prefix++) {
+        snprintf(path, sizeof(path), "%s/%02x", DEDUP_DIR, prefix);
+        if (make_dir(path) == -1) return -1;
+    }
+
+    // Every server using the store holds a shared lock on it while it runs. One that gets
+    // the lock exclusively is alone and may collect; one started next to another (the
+    // server it takes over from) leaves every chunk in place.
+    g_store_lock_fd = open(DEDUP_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (g_store_lock_fd == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to open %s: %s", DEDUP_DIR, strerror(errno));
+        log_error(log_buf);
+        return -1;
+    }
+    int alone = flock(g_store_lock_fd, LOCK_EX | LOCK_NB) == 0;
+
+    size_t manifests = load_manifests();
+    size_t referenced = g_slot_count;
+    size_t found = scan_chunks(alone, &removed);
+    if (flock(g_store_lock_fd, LOCK_SH) == -1) {
+        log_error("Failed to lock the dedup store.");
+        return -1;
+    }
+    g_collect = alone;
+    // Chunks a manifest names but the disk lost are forgotten: HAVE reports them missing
+    if (index_rebuild(g_slot_cap ? g_slot_cap : 1024, 2) == -1) {
+        log_error("Out of memory while loading the dedup store.");
+        return -1;
+    }
+    if (found < referenced) {
+        snprintf(log_buf, sizeof(log_buf), "Dedup store: %zu chunk(s) named by manifests are missing.", referenced - found);
+        log_error(log_buf);
+    }
+
+    if (alone) {
+        snprintf(log_buf, sizeof(log_buf), "Dedup store: %zu manifest(s), %zu chunk(s), %zu unreferenced chunk(s) removed.",
+                 manifests, found, removed);
+    } else {
+        snprintf(log_buf, sizeof(log_buf), "Dedup store: %zu manifest(s), %zu chunk(s); shared with another server, no chunk is removed.",
+                 manifests, found);
+    }
+    log_info(log_buf);
+    g_dedup_enabled = 1;
+    return 0;
+}
+
+void dedup_keep_chunks(void) {
+    pthread_mutex_lock(&g_dedup_lock);
+    g_collect = 0;
+    pthread_mutex_unlock(&g_dedup_lock);
+}
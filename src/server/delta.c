@@ -0,0 +1,638 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+#include "include/delta.h"
+#include "include/session.h"
+#include "include/reactor.h"
+#include "include/commit.h"
+#include "include/digest.h"
+#include "include/dedup.h"
+#include "include/metrics.h"
+#include "../../include/protocol.h"
+
+typedef enum {
+    DELTA_JOB_SUMS,          // checksum the stored copy for a SIGNATURE
+    DELTA_JOB_APPLY,         // apply the instructions of one DELTA frame
+} delta_job_kind_t;
+
+struct delta_job {
+    conn_t *conn;            // NULL once the session is gone; only touched on its loop
+    reactor_t *reactor;
+    delta_job_kind_t kind;
+    uint32_t stream_id;
+    proto_status_t status;   // filled in by the delta thread
+
+    // DELTA_JOB_SUMS
+    char name[PROTO_MAX_NAME + 1];
+    uint32_t block_size;     // asked for, then the one used
+    uint64_t file_size;      // of the stored copy
+    uint32_t block_count;
+    uint8_t *sums;           // PROTO_SUMS_ENTRY_SIZE per block
+
+    // DELTA_JOB_APPLY
+    delta_upload_t *upload;
+    uint8_t *payload;        // a copy of the frame's instructions
+    size_t len;
+    int last;
+    uint8_t expected[PROTO_HASH_SIZE]; // last frame: SHA-256 of the whole new file
+
+    delta_job_t *next;
+};
+
+// A delta upload between its first and its last DELTA frame
+struct delta_upload {
+    uint32_t stream_id;
+    int failed;              // answered already, its remaining frames are skipped
+    char name[PROTO_MAX_NAME + 1];
+    uint64_t file_size;
+    uint32_t block_size;
+    uint64_t start_ns;
+
+    // Touched by a delta thread while a frame is applied, by the loop otherwise
+    int base_fd;             // the stored copy the blocks are taken from
+    uint64_t base_size;
+    int fd;                  // the new version, written aside
+    char tmp_path[PATH_MAX]; // its temp name, empty while it is an O_TMPFILE
+    uint64_t written;
+    uint64_t copied;         // bytes of it taken from the stored copy
+    EVP_MD_CTX *ctx;
+};
+
+static pthread_t g_threads[MAX_WORKERS];
+static int g_thread_count = 0;
+static int g_stop = 0;
+
+// Guards the queue and every reactor's `delta_done` list
+static pthread_mutex_t g_delta_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_delta_cond = PTHREAD_COND_INITIALIZER;
+static delta_job_t *g_queue_head = NULL;
+static delta_job_t *g_queue_tail = NULL;
+
+static void job_free(delta_job_t *job) {
+    free(job->sums);
+    free(job->payload);
+    free(job);
+}
+
+// Close what the upload holds and remove the file written so far
+static void upload_release(delta_upload_t *upload) {
+    if (upload->base_fd != -1) close(upload->base_fd);
+    if (upload->fd != -1) close(upload->fd);   // an O_TMPFILE vanishes with its last descriptor
+    if (upload->tmp_path[0]) unlink(upload->tmp_path);
+    EVP_MD_CTX_free(upload->ctx);
+    upload->base_fd = upload->fd = -1;
+    upload->tmp_path[0] = '\0';
+    upload->ctx = NULL;
+}
+
+static void upload_free(delta_upload_t *upload) {
+    upload_release(upload);
+    free(upload);
+}
+
+// --- Delta threads ---
+
+// pread() exactly len bytes; 0, or the errno of the failure (EIO if the file ends first)
+static int read_at(int fd, uint8_t *buf, size_t len, uint64_t off) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, (off_t)off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            return n == 0 ? EIO : errno;
+        }
+        buf += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_at(int fd, const uint8_t *data, size_t len, uint64_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, (off_t)off);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        data += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Checksum every block of the stored copy of job->name
+static proto_status_t delta_sums(delta_job_t *job, uint8_t *buf) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", UPLOAD_DIR, job->name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return errno == ENOENT ? PROTO_STATUS_NOT_FOUND : PROTO_STATUS_IO_ERROR;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return PROTO_STATUS_NOT_FOUND;
+    }
+
+    // A large copy gets larger blocks, its sums stay bounded
+    uint64_t size = (uint64_t)st.st_size;
+    uint64_t min_block = (size + PROTO_MAX_DELTA_BLOCKS - 1) / PROTO_MAX_DELTA_BLOCKS;
+    if (job->block_size < min_block) {
+        if (min_block > PROTO_MAX_DELTA_BLOCK) {
+            close(fd);
+            return PROTO_STATUS_BAD_RANGE;
+        }
+        job->block_size = (uint32_t)min_block;
+    }
+    job->file_size = size;
+    job->block_count = (uint32_t)((size + job->block_size - 1) / job->block_size);
+    job->sums = malloc(job->block_count ? (size_t)job->block_count * PROTO_SUMS_ENTRY_SIZE : 1);
+    if (!job->sums) {
+        close(fd);
+        return PROTO_STATUS_IO_ERROR;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (uint32_t i = 0; i < job->block_count; i++) {
+        uint64_t off = (uint64_t)i * job->block_size;
+        size_t n = size - off < job->block_size ? (size_t)(size - off) : job->block_size;
+        uint8_t *entry = job->sums + (size_t)i * PROTO_SUMS_ENTRY_SIZE;
+        if (read_at(fd, buf, n, off) != 0 || !EVP_Digest(buf, n, entry + 4, NULL, EVP_sha256(), NULL)) {
+            close(fd);
+            return PROTO_STATUS_IO_ERROR;
+        }
+        proto_put_u32(entry, proto_rolling_sum(buf, n));
+    }
+    close(fd);
+    return PROTO_STATUS_OK;
+}
+
+// Take len bytes of the stored copy from off: they are hashed on the way through
+// and the kernel copies them, sharing the blocks where the filesystem can
+static proto_status_t delta_copy(delta_upload_t *upload, uint64_t off, uint64_t len, uint8_t *buf) {
+    while (len > 0) {
+        size_t n = len > DELTA_READ_SIZE ? DELTA_READ_SIZE : (size_t)len;
+        if (read_at(upload->base_fd, buf, n, off) != 0 || !EVP_DigestUpdate(upload->ctx, buf, n)) {
+            return PROTO_STATUS_IO_ERROR;
+        }
+        loff_t in = (loff_t)off, out = (loff_t)upload->written;
+        ssize_t copied = copy_file_range(upload->base_fd, &in, upload->fd, &out, n, 0);
+        // Short or unsupported: write what was read instead
+        if (copied != (ssize_t)n && write_at(upload->fd, buf, n, upload->written) != 0) {
+            return PROTO_STATUS_IO_ERROR;
+        }
+        upload->written += n;
+        upload->copied += n;
+        off += n;
+        len -= n;
+    }
+    return PROTO_STATUS_OK;
+}
+
+// Run the instructions of one DELTA frame; the last one also checks the whole file
+static proto_status_t delta_apply(delta_job_t *job, uint8_t *buf) {
+    delta_upload_t *upload = job->upload;
+    const uint8_t *p = job->payload;
+    const uint8_t *end = job->payload + job->len;
+    uint64_t base_blocks = (upload->base_size + upload->block_size - 1) / upload->block_size;
+
+    while (p < end) {
+        if (p[0] == PROTO_DELTA_COPY && end - p >= 9) {
+            uint64_t first = proto_get_u32(p + 1);
+            uint64_t count = proto_get_u32(p + 5);
+            p += 9;
+            // Blocks the stored copy does not have: it changed since its sums were sent
+            if (count == 0 || first + count > base_blocks) {
+                return PROTO_STATUS_BAD_CHECKSUM;
+            }
+            uint64_t off = first * upload->block_size;
+            uint64_t len = count * upload->block_size;
+            if (len > upload->base_size - off) len = upload->base_size - off;
+            if (len > upload->file_size - upload->written) {
+                return PROTO_STATUS_BAD_REQUEST;
+            }
+            proto_status_t status = delta_copy(upload, off, len, buf);
+            if (status != PROTO_STATUS_OK) {
+                return status;
+            }
+        } else if (p[0] == PROTO_DELTA_DATA && end - p >= 5) {
+            uint32_t len = proto_get_u32(p + 1);
+            p += 5;
+            if (len > (size_t)(end - p) || len > upload->file_size - upload->written) {
+                return PROTO_STATUS_BAD_REQUEST;
+            }
+            if (!EVP_DigestUpdate(upload->ctx, p, len) || write_at(upload->fd, p, len, upload->written) != 0) {
+                return PROTO_STATUS_IO_ERROR;
+            }
+            upload->written += len;
+            p += len;
+        } else {
+            return PROTO_STATUS_BAD_REQUEST;
+        }
+    }
+    if (!job->last) {
+        return PROTO_STATUS_OK;
+    }
+
+    uint8_t digest[PROTO_HASH_SIZE];
+    if (upload->written != upload->file_size) {
+        return PROTO_STATUS_BAD_REQUEST;
+    }
+    if (!EVP_DigestFinal_ex(upload->ctx, digest, NULL)) {
+        return PROTO_STATUS_IO_ERROR;
+    }
+    if (memcmp(digest, job->expected, PROTO_HASH_SIZE) != 0) {
+        return PROTO_STATUS_BAD_CHECKSUM;
+    }
+    digest_store(upload->fd, digest);
+    return PROTO_STATUS_OK;
+}
+
+static void *delta_main(void *arg) {
+    (void)arg;
+    uint8_t *buf = malloc(PROTO_MAX_DELTA_BLOCK);   // a whole block, DELTA_READ_SIZE for copies
+
+    pthread_mutex_lock(&g_delta_lock);
+    for (;;) {
+        while (!g_stop && !g_queue_head) {
+            pthread_cond_wait(&g_delta_cond, &g_delta_lock);
+        }
+        delta_job_t *job = g_queue_head;
+        if (!job) {
+            break;   // stopping and drained
+        }
+        g_queue_head = job->next;
+        if (!g_queue_head) g_queue_tail = NULL;
+        pthread_mutex_unlock(&g_delta_lock);
+
+        if (!buf) job->status = PROTO_STATUS_IO_ERROR;
+        else if (job->kind == DELTA_JOB_SUMS) job->status = delta_sums(job, buf);
+        else job->status = delta_apply(job, buf);
+
+        // Hand it back to the loop that owns the session
+        pthread_mutex_lock(&g_delta_lock);
+        job->next = job->reactor->delta_done;
+        job->reactor->delta_done = job;
+        if (!g_stop) {
+            uint64_t one = 1;
+            if (write(job->reactor->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                log_error("Failed to wake worker after delta.");
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_delta_lock);
+    if (!buf) {
+        log_error("Delta thread could not allocate its buffer.");
+    }
+    free(buf);
+    return NULL;
+}
+
+int delta_start(const server_config_t *config) {
+    for (int i = 0; i < config->workers; i++) {
+        if (pthread_create(&g_threads[i], NULL, delta_main, NULL) != 0) {
+            log_error("Failed to start a delta thread.");
+            delta_stop();
+            return -1;
+        }
+        g_thread_count++;
+    }
+    return 0;
+}
+
+void delta_stop(void) {
+    pthread_mutex_lock(&g_delta_lock);
+    g_stop = 1;
+    pthread_cond_broadcast(&g_delta_cond);
+    pthread_mutex_unlock(&g_delta_lock);
+    for (int i = 0; i < g_thread_count; i++) {
+        pthread_join(g_threads[i], NULL);
+    }
+    g_thread_count = 0;
+}
+
+// --- Worker side ---
+
+static void delta_protocol_error(conn_t *conn, uint32_t stream_id, const char *what) {
+    char log_buf[SMALL_BUF_SIZE];
+    snprintf(log_buf, sizeof(log_buf), "Protocol error from %s:%d: malformed %s.", conn->peer_ip, conn->peer_port, what);
+    log_error(log_buf);
+    session_reply(conn, stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid DELTA frame.");
+    conn->state = CONN_STATE_CLOSING;
+}
+
+// Later requests wait: their answers must not overtake this one
+static void delta_queue(conn_t *conn, delta_job_t *job) {
+    job->conn = conn;
+    job->reactor = conn->reactor;
+    conn->delta_job = job;
+    conn->state = CONN_STATE_COMMIT;
+
+    pthread_mutex_lock(&g_delta_lock);
+    if (g_queue_tail) g_queue_tail->next = job;
+    else g_queue_head = job;
+    g_queue_tail = job;
+    pthread_cond_signal(&g_delta_cond);
+    pthread_mutex_unlock(&g_delta_lock);
+}
+
+// Answer the upload with an error; its remaining frames are skipped
+static void delta_fail(conn_t *conn, delta_upload_t *upload, proto_status_t status, const char *text) {
+    upload_release(upload);
+    upload->failed = 1;
+    STAT_ADD(conn->reactor, uploads_failed, 1);
+    session_reply(conn, upload->stream_id, status, text);
+}
+
+void delta_on_signature(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len) {
+    if (len < PROTO_SIGNATURE_META_SIZE) {
+        delta_protocol_error(conn, stream_id, "SIGNATURE");
+        return;
+    }
+    uint32_t block_size = proto_get_u32(payload);
+    size_t name_len = proto_get_u16(payload + 4);
+    const uint8_t *name = payload + PROTO_SIGNATURE_META_SIZE;
+    if (block_size == 0 || block_size > PROTO_MAX_DELTA_BLOCK || name_len == 0 || name_len > PROTO_MAX_NAME
+        || len != PROTO_SIGNATURE_META_SIZE + name_len) {
+        delta_protocol_error(conn, stream_id, "SIGNATURE");
+        return;
+    }
+    if (memchr(name, '/', name_len) || memchr(name, '\0', name_len)) {
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid file name.");
+        return;
+    }
+    // Files in the dedup store are chunks already, dedup uploads send only the new ones
+    if (dedup_enabled()) {
+        session_reply(conn, stream_id, PROTO_STATUS_UNSUPPORTED, "ERROR: The server keeps files in the deduplicating store.");
+        return;
+    }
+
+    delta_job_t *job = calloc(1, sizeof(*job));
+    if (!job) {
+        log_error("Out of memory while queueing a signature.");
+        session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, "ERROR: Could not read file.");
+        return;
+    }
+    job->kind = DELTA_JOB_SUMS;
+    job->stream_id = stream_id;
+    job->block_size = block_size;
+    snprintf(job->name, sizeof(job->name), "%.*s", (int)name_len, (const char *)name);
+    delta_queue(conn, job);
+}
+
+// First DELTA frame of an upload: open the stored copy and the file the new version is
+// written to. A failure is answered here and leaves the upload bound as failed.
+static delta_upload_t *delta_bind(conn_t *conn, uint32_t stream_id, const uint8_t *name, size_t name_len,
+                                  uint64_t file_size, uint32_t block_size) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE];
+    char path[PATH_MAX];
+    struct stat st;
+
+    delta_upload_t *upload = calloc(1, sizeof(*upload));
+    if (!upload) {
+        log_error("Out of memory while starting a delta upload.");
+        session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, "UPLOAD_FAILED: Could not write file.");
+        return NULL;
+    }
+    upload->stream_id = stream_id;
+    upload->file_size = file_size;
+    upload->block_size = block_size;
+    upload->start_ns = metrics_now_ns();
+    upload->base_fd = upload->fd = -1;
+    snprintf(upload->name, sizeof(upload->name), "%.*s", (int)name_len, (const char *)name);
+    conn->delta = upload;
+
+    snprintf(log_buf, sizeof(log_buf), "Client requested DELTA: file '%s', size %llu bytes.", upload->name, (unsigned long long)file_size);
+    log_info(log_buf);
+
+    if (memchr(name, '/', name_len) || memchr(name, '\0', name_len)) {
+        log_error("Invalid DELTA file name received.");
+        delta_fail(conn, upload, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid UPLOAD file name.");
+        return upload;
+    }
+    if (dedup_enabled()) {
+        delta_fail(conn, upload, PROTO_STATUS_UNSUPPORTED, "ERROR: The server keeps files in the deduplicating store.");
+        return upload;
+    }
+    snprintf(path, sizeof(path), "%s/%s", UPLOAD_DIR, upload->name);
+    upload->base_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (upload->base_fd == -1 || fstat(upload->base_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        delta_fail(conn, upload, PROTO_STATUS_NOT_FOUND, "UPLOAD_FAILED: No stored copy to take blocks from.");
+        return upload;
+    }
+    upload->base_size = (uint64_t)st.st_size;
+
+    // Written aside and moved into place once complete, like an UPLOAD
+    upload->fd = open(UPLOAD_DIR, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    if (upload->fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+        commit_tmp_name(upload->tmp_path, sizeof(upload->tmp_path));
+        upload->fd = open(upload->tmp_path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+    }
+    upload->ctx = EVP_MD_CTX_new();
+    if (upload->fd == -1 || !upload->ctx || !EVP_DigestInit_ex(upload->ctx, EVP_sha256(), NULL)
+        || (file_size > 0 && fallocate(upload->fd, 0, 0, (off_t)file_size) == -1 && errno != EOPNOTSUPP && errno != ENOSYS)) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to create file for delta upload of '%s': %s", upload->name, strerror(errno));
+        log_error(log_buf);
+        delta_fail(conn, upload, PROTO_STATUS_IO_ERROR, "UPLOAD_FAILED: Could not write file.");
+    }
+    return upload;
+}
+
+void delta_on_frame(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len) {
+    if (len < PROTO_DELTA_META_SIZE) {
+        delta_protocol_error(conn, stream_id, "DELTA");
+        return;
+    }
+    uint64_t file_size = proto_get_u64(payload);
+    uint32_t block_size = proto_get_u32(payload + 8);
+    size_t name_len = proto_get_u16(payload + 12);
+    uint8_t flags = payload[14];
+    int last = flags & PROTO_DELTA_LAST;
+    size_t trailer = last ? PROTO_HASH_SIZE : 0;
+    if (block_size == 0 || block_size > PROTO_MAX_DELTA_BLOCK || name_len == 0 || name_len > PROTO_MAX_NAME
+        || (flags & ~PROTO_DELTA_LAST) || file_size > (uint64_t)LONG_MAX || len < PROTO_DELTA_META_SIZE + name_len + trailer) {
+        delta_protocol_error(conn, stream_id, "DELTA");
+        return;
+    }
+    const uint8_t *name = payload + PROTO_DELTA_META_SIZE;
+    const uint8_t *instructions = name + name_len;
+    size_t instructions_len = len - PROTO_DELTA_META_SIZE - name_len - trailer;
+
+    delta_upload_t *upload = conn->delta;
+    if (upload && (upload->stream_id != stream_id || upload->file_size != file_size || upload->block_size != block_size)) {
+        delta_protocol_error(conn, stream_id, "DELTA (another upload is unfinished)");
+        return;
+    }
+    if (!upload && !(upload = delta_bind(conn, stream_id, name, name_len, file_size, block_size))) {
+        return;
+    }
+
+    delta_job_t *job = upload->failed ? NULL : calloc(1, sizeof(*job));
+    uint8_t *copy = job ? malloc(instructions_len ? instructions_len : 1) : NULL;
+    if (!upload->failed && !copy) {
+        free(job);
+        log_error("Out of memory while queueing a delta frame.");
+        delta_fail(conn, upload, PROTO_STATUS_IO_ERROR, "UPLOAD_FAILED: Could not write file.");
+    }
+    if (upload->failed) {
+        if (last) {
+            upload_free(upload);
+            conn->delta = NULL;
+        }
+        return;
+    }
+    memcpy(copy, instructions, instructions_len);   // in_buf moves on once this returns
+    job->kind = DELTA_JOB_APPLY;
+    job->stream_id = stream_id;
+    job->upload = upload;
+    job->payload = copy;
+    job->len = instructions_len;
+    job->last = last;
+    if (last) {
+        memcpy(job->expected, instructions + instructions_len, PROTO_HASH_SIZE);
+    }
+    delta_queue(conn, job);
+}
+
+// Answer a SIGNATURE with the sums of every block, as many SUMS frames as they need
+static void delta_send_sums(conn_t *conn, const delta_job_t *job) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    uint8_t frame[PROTO_MAX_CONTROL];
+    const uint32_t per_frame = (PROTO_MAX_CONTROL - PROTO_SUMS_META_SIZE) / PROTO_SUMS_ENTRY_SIZE;
+
+    switch (job->status) {
+        case PROTO_STATUS_OK:
+            break;
+        case PROTO_STATUS_NOT_FOUND:
+            session_reply(conn, job->stream_id, job->status, "ERROR: No such file on server.");
+            return;
+        case PROTO_STATUS_BAD_RANGE:
+            session_reply(conn, job->stream_id, job->status, "ERROR: File too large for a delta upload.");
+            return;
+        default:
+            session_reply(conn, job->stream_id, job->status, "ERROR: Could not read file.");
+            return;
+    }
+
+    uint32_t first = 0;
+    do {
+        uint32_t count = job->block_count - first < per_frame ? job->block_count - first : per_frame;
+        proto_put_u64(frame, job->file_size);
+        proto_put_u32(frame + 8, job->block_size);
+        proto_put_u32(frame + 12, first);
+        proto_put_u32(frame + 16, count);
+        memcpy(frame + PROTO_SUMS_META_SIZE, job->sums + (size_t)first * PROTO_SUMS_ENTRY_SIZE, (size_t)count * PROTO_SUMS_ENTRY_SIZE);
+        if (conn_send_frame(conn, PROTO_OP_SUMS, job->stream_id, frame, PROTO_SUMS_META_SIZE + (size_t)count * PROTO_SUMS_ENTRY_SIZE) == -1) {
+            return;
+        }
+        first += count;
+    } while (first < job->block_count);
+
+    snprintf(log_buf, sizeof(log_buf), "Sent the checksums of '%s' (%u block(s) of %u bytes) to %s:%d.",
+             job->name, job->block_count, job->block_size, conn->peer_ip, conn->peer_port);
+    log_info(log_buf);
+}
+
+// A DELTA frame was applied: answer a failure, or store the file after the last frame
+static void delta_applied(conn_t *conn, delta_job_t *job) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE * 2];
+    delta_upload_t *upload = job->upload;
+
+    if (job->status != PROTO_STATUS_OK) {
+        snprintf(log_buf, sizeof(log_buf), "Delta upload of '%s' failed (status %d).", upload->name, (int)job->status);
+        log_error(log_buf);
+        delta_fail(conn, upload, job->status,
+                   job->status == PROTO_STATUS_BAD_CHECKSUM ? "UPLOAD_FAILED: The stored copy changed or the content does not match its SHA-256."
+                   : job->status == PROTO_STATUS_BAD_REQUEST ? "ERROR: Invalid DELTA instructions."
+                   : "UPLOAD_FAILED: Could not write file.");
+        if (job->status == PROTO_STATUS_BAD_REQUEST) {
+            conn->state = CONN_STATE_CLOSING;
+        }
+        if (job->last) {
+            upload_free(upload);
+            conn->delta = NULL;
+        }
+        return;
+    }
+    if (!job->last) {
+        return;
+    }
+
+    snprintf(log_buf, sizeof(log_buf), "Delta upload of '%s': %llu of %llu bytes taken from the stored copy.",
+             upload->name, (unsigned long long)upload->copied, (unsigned long long)upload->file_size);
+    log_info(log_buf);
+
+    // Stored like a plain upload from here on
+    snprintf(conn->filename, sizeof(conn->filename), "%s", upload->name);
+    snprintf(conn->full_path, sizeof(conn->full_path), "%s/%s", UPLOAD_DIR, conn->filename);
+    snprintf(conn->tmp_path, sizeof(conn->tmp_path), "%s", upload->tmp_path);
+    conn->stream_id = upload->stream_id;
+    conn->file_fd = upload->fd;
+    conn->filesize = (long)upload->file_size;
+    conn->upload_start_ns = upload->start_ns;
+    upload->fd = -1;
+    upload->tmp_path[0] = '\0';
+    upload_free(upload);
+    conn->delta = NULL;
+    session_upload_store(conn);
+}
+
+void delta_reap(reactor_t *reactor) {
+    pthread_mutex_lock(&g_delta_lock);
+    delta_job_t *done = reactor->delta_done;
+    reactor->delta_done = NULL;
+    pthread_mutex_unlock(&g_delta_lock);
+
+    while (done) {
+        delta_job_t *job = done;
+        done = job->next;
+        conn_t *conn = job->conn;
+        if (!conn) {
+            if (job->upload) upload_free(job->upload);   // left to the job by delta_close()
+            job_free(job);
+            continue;
+        }
+        conn->delta_job = NULL;
+        conn->state = CONN_STATE_COMMAND;
+        if (job->kind == DELTA_JOB_SUMS) {
+            delta_send_sums(conn, job);
+        } else {
+            delta_applied(conn, job);
+        }
+        if (conn->state != CONN_STATE_COMMIT) {
+            reactor_conn_resume(conn);   // may close the session
+        }
+        job_free(job);
+    }
+}
+
+void delta_close(conn_t *conn) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    delta_upload_t *upload = conn->delta;
+
+    if (upload && !upload->failed) {
+        snprintf(log_buf, sizeof(log_buf), "Incomplete delta upload of '%s'.", upload->name);
+        log_error(log_buf);
+        STAT_ADD(conn->reactor, uploads_failed, 1);
+    }
+    // A delta thread may be applying a frame of the upload: it is freed with the job
+    if (conn->delta_job) {
+        if (conn->delta_job->upload == upload) upload = NULL;
+        conn->delta_job->conn = NULL;
+        conn->delta_job = NULL;
+    }
+    if (upload) {
+        upload_free(upload);
+    }
+    conn->delta = NULL;
+}
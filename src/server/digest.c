@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/xattr.h>
+#include <openssl/evp.h>
+
+#include "include/digest.h"
+#include "include/session.h"
+#include "include/reactor.h"
+#include "../../include/protocol.h"
+
+struct digest_job {
+    conn_t *conn;            // NULL once the session is gone
+    reactor_t *reactor;
+    int fd;                  // own descriptor of the upload file
+    uint64_t size;
+    uint64_t filled;         // content the session has placed in the file
+    uint64_t hashed;         // content hashed so far
+    int sealed;              // digest_finish() was called
+    int busy;                // a digest thread is reading this job
+    int has_expected;
+    uint8_t expected[PROTO_HASH_SIZE];
+    int mismatch;
+    int error;               // errno of a failed read back
+    EVP_MD_CTX *ctx;
+    digest_job_t *next;
+};
+
+static pthread_t g_threads[MAX_WORKERS];
+static int g_thread_count = 0;
+static int g_stop = 0;
+
+// Guards every job field above except ctx, the active list and every reactor's `digested` list
+static pthread_mutex_t g_digest_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_digest_cond = PTHREAD_COND_INITIALIZER;
+static digest_job_t *g_active_head = NULL;  // uploads still being received or hashed
+static digest_job_t *g_active_tail = NULL;
+static atomic_int g_xattr_warned;
+
+static void job_free(digest_job_t *job) {
+    if (job->fd != -1) close(job->fd);
+    EVP_MD_CTX_free(job->ctx);
+    free(job);
+}
+
+// --- Digest threads ---
+
+static int job_ready(const digest_job_t *job) {
+    return !job->conn || (!job->error && job->hashed < job->filled)
+        || (job->sealed && (job->error || job->hashed == job->size));
+}
+
+// First job with something to do, unlinked from the active list; NULL if none
+static digest_job_t *take_ready_job(void) {
+    digest_job_t *prev = NULL;
+    for (digest_job_t *job = g_active_head; job; prev = job, job = job->next) {
+        if (job->busy || !job_ready(job)) continue;
+        if (prev) prev->next = job->next;
+        else g_active_head = job->next;
+        if (g_active_tail == job) g_active_tail = prev;
+        job->next = NULL;
+        return job;
+    }
+    return NULL;
+}
+
+// Put a job back behind the others, so concurrent uploads take turns
+static void requeue_job(digest_job_t *job) {
+    if (g_active_tail) g_active_tail->next = job;
+    else g_active_head = job;
+    g_active_tail = job;
+}
+
+static void hash_hex(const uint8_t *hash, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < PROTO_HASH_SIZE; i++) {
+        hex[i * 2] = digits[hash[i] >> 4];
+        hex[i * 2 + 1] = digits[hash[i] & 15];
+    }
+    hex[PROTO_HASH_SIZE * 2] = '\0';
+}
+
+void digest_store(int fd, const uint8_t *digest) {
+    char log_buf[SMALL_BUF_SIZE];
+    char hex[PROTO_HASH_SIZE * 2 + 1];
+
+    // The attribute travels with the inode, so it is renamed into place together with the content
+    hash_hex(digest, hex);
+    if (fsetxattr(fd, DIGEST_XATTR, hex, PROTO_HASH_SIZE * 2, 0) == -1 && !atomic_exchange(&g_xattr_warned, 1)) {
+        snprintf(log_buf, sizeof(log_buf), "Upload digests are verified but not stored: %s", strerror(errno));
+        log_error(log_buf);
+    }
+}
+
+// All content is hashed: check it against the client's digest and keep it on the file
+static void job_complete(digest_job_t *job) {
+    uint8_t digest[PROTO_HASH_SIZE];
+    unsigned int digest_len = 0;
+
+    if (!EVP_DigestFinal_ex(job->ctx, digest, &digest_len)) {
+        job->error = EIO;
+        return;
+    }
+    if (job->has_expected && memcmp(digest, job->expected, PROTO_HASH_SIZE) != 0) {
+        job->mismatch = 1;
+        return;
+    }
+    digest_store(job->fd, digest);
+}
+
+// Read len bytes of content from `from` on back and hash them; called without the lock
+// while the job is busy. 0, or the errno of the failure.
+static int job_hash(digest_job_t *job, uint64_t from, size_t len, uint8_t *buf) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = pread(job->fd, buf + done, len - done, (off_t)(from + done));
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            return n == 0 ? EIO : errno;
+        }
+        done += (size_t)n;
+    }
+    return EVP_DigestUpdate(job->ctx, buf, len) ? 0 : EIO;
+}
+
+// Hand a finished job back to the loop that owns its session
+static void job_deliver(digest_job_t *job) {
+    if (!job->conn) {
+        job_free(job);
+        return;
+    }
+    job->next = job->reactor->digested;
+    job->reactor->digested = job;
+    uint64_t one = 1;
+    if (write(job->reactor->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        log_error("Failed to wake worker after digest.");
+    }
+}
+
+static void *digest_main(void *arg) {
+    (void)arg;
+    uint8_t *buf = malloc(DIGEST_READ_SIZE);
+
+    pthread_mutex_lock(&g_digest_lock);
+    for (;;) {
+        digest_job_t *job = buf ? take_ready_job() : NULL;
+        if (!job) {
+            if (g_stop || !buf) break;
+            pthread_cond_wait(&g_digest_cond, &g_digest_lock);
+            continue;
+        }
+        if (!job->conn) {
+            job_free(job);   // the session is gone
+            continue;
+        }
+
+        if (!job->error && job->hashed < job->filled) {
+            uint64_t from = job->hashed;
+            size_t len = job->filled - from > DIGEST_READ_SIZE ? DIGEST_READ_SIZE : (size_t)(job->filled - from);
+            job->busy = 1;
+            requeue_job(job);  // stays reachable for digest_feed() and digest_cancel()
+            pthread_mutex_unlock(&g_digest_lock);
+            int error = job_hash(job, from, len, buf);
+            pthread_mutex_lock(&g_digest_lock);
+            job->busy = 0;
+            if (error) job->error = error;
+            else job->hashed = from + len;
+            continue;
+        }
+
+        // Sealed and either fully hashed or failed: off the list for good
+        pthread_mutex_unlock(&g_digest_lock);
+        if (!job->error) {
+            job_complete(job);
+        }
+        close(job->fd);
+        job->fd = -1;
+        pthread_mutex_lock(&g_digest_lock);
+        job_deliver(job);
+    }
+    pthread_mutex_unlock(&g_digest_lock);
+    if (!buf) {
+        log_error("Digest thread could not allocate its buffer.");
+    }
+    free(buf);
+    return NULL;
+}
+
+int digest_start(const server_config_t *config) {
+    for (int i = 0; i < config->workers; i++) {
+        if (pthread_create(&g_threads[i], NULL, digest_main, NULL) != 0) {
+            log_error("Failed to start a digest thread.");
+            digest_stop();
+            return -1;
+        }
+        g_thread_count++;
+    }
+    return 0;
+}
+
+void digest_stop(void) {
+    pthread_mutex_lock(&g_digest_lock);
+    g_stop = 1;
+    pthread_cond_broadcast(&g_digest_cond);
+    pthread_mutex_unlock(&g_digest_lock);
+    for (int i = 0; i < g_thread_count; i++) {
+        pthread_join(g_threads[i], NULL);
+    }
+    g_thread_count = 0;
+}
+
+// --- Worker side ---
+
+int digest_begin(conn_t *conn) {
+    digest_job_t *job = calloc(1, sizeof(*job));
+    if (!job) {
+        return -1;
+    }
+    job->fd = -1;
+    job->ctx = EVP_MD_CTX_new();
+    if (!job->ctx || !EVP_DigestInit_ex(job->ctx, EVP_sha256(), NULL)) {
+        job_free(job);
+        errno = ENOMEM;
+        return -1;
+    }
+    job->fd = fcntl(conn->file_fd, F_DUPFD_CLOEXEC, 0);
+    if (job->fd == -1) {
+        int saved = errno;
+        job_free(job);
+        errno = saved;
+        return -1;
+    }
+    job->conn = conn;
+    job->reactor = conn->reactor;
+    job->size = (uint64_t)conn->filesize;
+    conn->digest = job;
+
+    pthread_mutex_lock(&g_digest_lock);
+    requeue_job(job);
+    pthread_mutex_unlock(&g_digest_lock);
+    return 0;
+}
+
+void digest_feed(conn_t *conn) {
+    digest_job_t *job = conn->digest;
+
+    pthread_mutex_lock(&g_digest_lock);
+    int idle = job->hashed == job->filled && !job->busy;
+    job->filled = (uint64_t)conn->received;
+    // A job already being hashed picks up the new range on its next turn
+    if (idle) {
+        pthread_cond_signal(&g_digest_cond);
+    }
+    pthread_mutex_unlock(&g_digest_lock);
+}
+
+void digest_finish(conn_t *conn, const uint8_t *expected) {
+    digest_job_t *job = conn->digest;
+
+    // Later requests wait: their answers must not overtake this one
+    conn->state = CONN_STATE_COMMIT;
+
+    pthread_mutex_lock(&g_digest_lock);
+    if (expected) {
+        memcpy(job->expected, expected, PROTO_HASH_SIZE);
+        job->has_expected = 1;
+    }
+    job->sealed = 1;
+    pthread_cond_signal(&g_digest_cond);
+    pthread_mutex_unlock(&g_digest_lock);
+}
+
+void digest_reap(reactor_t *reactor) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE];
+
+    pthread_mutex_lock(&g_digest_lock);
+    digest_job_t *done = reactor->digested;
+    reactor->digested = NULL;
+    pthread_mutex_unlock(&g_digest_lock);
+
+    while (done) {
+        digest_job_t *job = done;
+        done = job->next;
+        conn_t *conn = job->conn;
+        if (conn) {
+            conn->digest = NULL;
+            conn->state = CONN_STATE_COMMAND;
+            if (job->error || job->mismatch) {
+                if (job->mismatch) {
+                    snprintf(log_buf, sizeof(log_buf), "Upload of '%s' does not match the client's SHA-256, discarded.", conn->filename);
+                } else {
+                    snprintf(log_buf, sizeof(log_buf), "Failed to hash upload of '%s': %s", conn->filename, strerror(job->error));
+                }
+                log_error(log_buf);
+                session_discard_file(conn);
+                STAT_ADD(reactor, uploads_failed, 1);
+                session_reply(conn, conn->stream_id, job->mismatch ? PROTO_STATUS_BAD_CHECKSUM : PROTO_STATUS_IO_ERROR,
+                              job->mismatch ? "UPLOAD_FAILED: Content does not match its SHA-256." : "UPLOAD_FAILED: Could not write file.");
+            } else {
+                session_upload_store(conn);
+            }
+            if (conn->state != CONN_STATE_COMMIT) {
+                reactor_conn_resume(conn);   // may close the session
+            }
+        }
+        job_free(job);
+    }
+}
+
+void digest_cancel(conn_t *conn) {
+    if (!conn->digest) {
+        return;
+    }
+    pthread_mutex_lock(&g_digest_lock);
+    conn->digest->conn = NULL;   // freed by whoever holds it next
+    pthread_cond_signal(&g_digest_cond);
+    pthread_mutex_unlock(&g_digest_lock);
+    conn->digest = NULL;
+}
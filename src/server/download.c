@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "include/download.h"
+#include "include/session.h"
+#include "include/reactor.h"
+#include "include/dedup.h"
+#include "include/secure.h"
+
+// sendfile() has no MSG_DONTWAIT. The io_uring backend keeps its sockets blocking, so they
+// are switched to non-blocking while a download is sent; no payload reads are in flight then.
+static void download_set_nonblock(conn_t *conn, int on) {
+    if (!conn->reactor->ring) {
+        return;
+    }
+    int flags = fcntl(conn->fd, F_GETFL);
+    if (flags != -1) {
+        fcntl(conn->fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+    }
+}
+
+void download_on_request(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE * 2];
+    char path[PATH_MAX];
+    uint8_t head[PROTO_HEADER_SIZE + PROTO_DATA_META_SIZE];
+    struct stat file_stat;
+
+    if (len < PROTO_DOWNLOAD_META_SIZE) {
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid DOWNLOAD frame.");
+        return;
+    }
+    uint64_t offset = proto_get_u64(payload);
+    uint64_t length = proto_get_u64(payload + 8);
+    size_t name_len = proto_get_u16(payload + 16);
+    const char *name = (const char *)payload + PROTO_DOWNLOAD_META_SIZE;
+
+    // Same rule as uploads: a plain name inside UPLOAD_DIR, dot files (the partial area) excluded
+    if (name_len == 0 || name_len > PROTO_MAX_NAME || len != PROTO_DOWNLOAD_META_SIZE + name_len
+        || memchr(name, '/', name_len) || memchr(name, '\0', name_len) || name[0] == '.') {
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid DOWNLOAD file name.");
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/%.*s", UPLOAD_DIR, (int)name_len, name);
+
+    // A file of the dedup store is sent chunk by chunk, the same way
+    dedup_manifest_t *manifest = NULL;
+    uint64_t size = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT) {
+        char plain_name[PROTO_MAX_NAME + 1];
+        snprintf(plain_name, sizeof(plain_name), "%.*s", (int)name_len, name);
+        manifest = dedup_manifest_open(plain_name, &size);
+    }
+    if (!manifest && (fd == -1 || fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode))) {
+        if (fd != -1) close(fd);
+        snprintf(log_buf, sizeof(log_buf), "DOWNLOAD of '%s' refused: no such file.", path);
+        log_info(log_buf);
+        session_reply(conn, stream_id, PROTO_STATUS_NOT_FOUND, "ERROR: No such file on server.");
+        return;
+    }
+    if (!manifest) {
+        size = (uint64_t)file_stat.st_size;
+    }
+    if (offset > size) {
+        if (manifest) dedup_manifest_close(manifest);
+        else close(fd);
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_RANGE, "ERROR: Offset past the end of the file.");
+        return;
+    }
+    if (length > size - offset) length = size - offset;
+
+    snprintf(log_buf, sizeof(log_buf), "Client %s:%d requested DOWNLOAD: file '%s', bytes %llu-%llu of %llu.",
+             conn->peer_ip, conn->peer_port, path, (unsigned long long)offset,
+             (unsigned long long)(offset + length), (unsigned long long)size);
+    log_info(log_buf);
+
+    // The head goes out through out_buf; conn_flush() continues with the content
+    // straight from the page cache once it is written
+    conn->send_fd = fd;
+    conn->send_off = (off_t)offset;
+    conn->send_left = length;
+    conn->send_manifest = manifest;
+    conn->send_pos = offset;
+    conn->send_run = 0;
+    conn->state = CONN_STATE_SEND_FILE;
+    download_set_nonblock(conn, 1);
+
+    // One conn_send(): the content must not start before the whole head is queued
+    proto_header_encode(head, PROTO_OP_DATA, stream_id, PROTO_DATA_META_SIZE + length);
+    proto_put_u64(head + PROTO_HEADER_SIZE, size);
+    proto_put_u64(head + PROTO_HEADER_SIZE + 8, offset);
+    conn_send(conn, head, sizeof(head));
+}
+
+static void download_finish(conn_t *conn) {
+    download_close(conn);
+    download_set_nonblock(conn, 0);
+    STAT_ADD(conn->reactor, downloads, 1);
+    if (conn->state == CONN_STATE_SEND_FILE) {
+        conn->state = CONN_STATE_COMMAND;
+    }
+}
+
+int download_pump(conn_t *conn) {
+    char log_buf[SMALL_BUF_SIZE];
+
+    while (conn->send_left > 0) {
+        if (conn->send_manifest && conn->send_run == 0) {
+            // Next chunk of a deduplicated file
+            if (conn->send_fd != -1) close(conn->send_fd);
+            conn->send_fd = -1;
+            if (dedup_manifest_read_at(conn->send_manifest, conn->send_pos, &conn->send_fd, &conn->send_off, &conn->send_run) == -1) {
+                snprintf(log_buf, sizeof(log_buf), "Chunk of a stored file is missing, download to %s:%d aborted.", conn->peer_ip, conn->peer_port);
+                log_error(log_buf);
+                return -1;
+            }
+        }
+        size_t chunk = conn->send_left > SENDFILE_CHUNK ? SENDFILE_CHUNK : (size_t)conn->send_left;
+        if (conn->send_manifest && chunk > conn->send_run) chunk = (size_t)conn->send_run;
+        ssize_t sent;
+        if (conn->sec) {
+            // Sealed content goes through userspace one record at a time, each written as soon
+            // as it is sealed: the kernel transmits it while the next one is being sealed
+            if (conn->out_len > 0) return 0; // resumed once writable
+            sent = secure_queue_file(conn, conn->send_fd, conn->send_off, chunk);
+            if (sent > 0) {
+                conn->send_off += sent;
+                if (conn_write_out(conn) == -1) return -1;
+            }
+        } else {
+            sent = sendfile(conn->fd, conn->send_fd, &conn->send_off, chunk);
+        }
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0; // resumed once writable
+            snprintf(log_buf, sizeof(log_buf), "Sending file content to %s:%d failed: %s", conn->peer_ip, conn->peer_port, strerror(errno));
+            log_error(log_buf);
+            return -1;
+        }
+        if (sent == 0) {
+            // The file shrank after the head announced its length, the frame cannot be completed
+            snprintf(log_buf, sizeof(log_buf), "File shrank while being sent to %s:%d.", conn->peer_ip, conn->peer_port);
+            log_error(log_buf);
+            return -1;
+        }
+        conn->send_left -= (uint64_t)sent;
+        conn->send_pos += (uint64_t)sent;
+        if (conn->send_manifest) conn->send_run -= (uint64_t)sent;
+        STAT_ADD(conn->reactor, bytes_out, (unsigned long)sent);
+    }
+    download_finish(conn);
+    return 0;
+}
+
+void download_close(conn_t *conn) {
+    if (conn->send_fd != -1) {
+        close(conn->send_fd);
+        conn->send_fd = -1;
+    }
+    if (conn->send_manifest) {
+        dedup_manifest_close(conn->send_manifest);
+        conn->send_manifest = NULL;
+    }
+}
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+
+#include "include/handoff.h"
+#include "include/dedup.h"
+
+static const server_config_t *g_config;
+static worker_t *g_workers;
+static pthread_t g_thread;
+static int g_running = 0;
+static int g_listen_fd = -1;
+static int g_stop_fd = -1;
+static int g_handed_off = 0;   // a new process took the sockets, the path is its own now
+
+// Taking over: sockets received from the old server, and the connection to it until ready
+static int g_inherited[MAX_WORKERS];
+static int g_inherited_count = 0;
+static int g_peer_fd = -1;
+
+static int unix_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        log_error("Handoff socket path is too long.");
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// The inherited socket must listen on the port we were asked to serve
+static int inherited_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listening = 0;
+    socklen_t optlen = sizeof(listening);
+
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) == -1 || addr.sin_family != AF_INET
+        || getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optlen) == -1 || !listening) {
+        return -1;
+    }
+    return ntohs(addr.sin_port);
+}
+
+int handoff_take(const server_config_t *config) {
+    char log_buf[SMALL_BUF_SIZE + PATH_MAX];
+    struct sockaddr_un addr;
+    uint32_t count = 0;
+    char control[CMSG_SPACE(sizeof(int) * MAX_WORKERS)];
+    struct iovec iov = { .iov_base = &count, .iov_len = sizeof(count) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control),
+    };
+
+    if (!config->take_over) {
+        return 0;
+    }
+    if (unix_address(config->handoff_socket, &addr) == -1) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct timeval timeout = { .tv_sec = 5, .tv_usec = 0 };
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+        || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        snprintf(log_buf, sizeof(log_buf), "No server to take over on %s: %s", config->handoff_socket, strerror(errno));
+        log_error(log_buf);
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    struct cmsghdr *cmsg = n == (ssize_t)sizeof(count) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        snprintf(log_buf, sizeof(log_buf), "The server on %s did not hand over its sockets.", config->handoff_socket);
+        log_error(log_buf);
+        close(fd);
+        return -1;
+    }
+    int received = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    memcpy(g_inherited, CMSG_DATA(cmsg), (size_t)received * sizeof(int));
+    g_inherited_count = received;
+
+    for (int i = 0; i < received; i++) {
+        if ((uint32_t)received != count || (msg.msg_flags & MSG_CTRUNC) || inherited_port(g_inherited[i]) != config->port) {
+            snprintf(log_buf, sizeof(log_buf), "The sockets handed over on %s do not listen on port %d.", config->handoff_socket, config->port);
+            log_error(log_buf);
+            for (int j = 0; j < received; j++) close(g_inherited[j]);
+            g_inherited_count = 0;
+            close(fd);
+            return -1;
+        }
+    }
+    g_peer_fd = fd;
+    snprintf(log_buf, sizeof(log_buf), "Took over %d listening socket(s) from the server on %s.", received, config->handoff_socket);
+    log_info(log_buf);
+    return 0;
+}
+
+int handoff_listen_fd(int index) {
+    if (index >= g_inherited_count) {
+        return -1;
+    }
+    int fd = g_inherited[index];
+    g_inherited[index] = -1;   // owned by the worker now
+    return fd;
+}
+
+// Send the listening sockets of every worker to a new server and wait until it accepts;
+// 1 when it took over, 0 when it gave up and this process carries on
+static int hand_over(int fd) {
+    char log_buf[SMALL_BUF_SIZE];
+    uint32_t count = (uint32_t)g_config->workers;
+    char control[CMSG_SPACE(sizeof(int) * MAX_WORKERS)];
+    struct iovec iov = { .iov_base = &count, .iov_len = sizeof(count) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+    };
+
+    memset(control, 0, sizeof(control));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    int *fds = (int *)CMSG_DATA(cmsg);
+    int copies[MAX_WORKERS];
+    uint32_t copied = 0;
+
+    // Copies taken under the lock: a loop that starts draining closes its own descriptor
+    pthread_mutex_lock(&g_listen_lock);
+    if (!atomic_load(&g_drain)) {
+        for (; copied < count; copied++) {
+            copies[copied] = fcntl(g_workers[copied].reactor.listen_fd, F_DUPFD_CLOEXEC, 0);
+            if (copies[copied] == -1) break;
+        }
+    }
+    pthread_mutex_unlock(&g_listen_lock);
+    if (copied < count) {
+        for (uint32_t i = 0; i < copied; i++) close(copies[i]);
+        if (!atomic_load(&g_drain)) log_error("Failed to copy the listening sockets for a handoff.");
+        return 0;
+    }
+    memcpy(fds, copies, sizeof(int) * count);
+
+    // From now on two processes may share the dedup store
+    dedup_keep_chunks();
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    for (uint32_t i = 0; i < count; i++) close(copies[i]);
+    if (sent != (ssize_t)sizeof(count)) {
+        log_error("Failed to hand the listening sockets over.");
+        return 0;
+    }
+    snprintf(log_buf, sizeof(log_buf), "Handed %u listening socket(s) to a new server, waiting for it to accept.", count);
+    log_info(log_buf);
+
+    // Both processes accept until the new one reports that its loops run
+    struct pollfd fds_wait[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = g_stop_fd, .events = POLLIN },
+    };
+    char ready;
+    int n;
+    do {
+        n = poll(fds_wait, 2, HANDOFF_READY_TIMEOUT_MS);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0 || fds_wait[1].revents || recv(fd, &ready, 1, 0) != 1) {
+        log_error("The new server did not start, still accepting here.");
+        return 0;
+    }
+    return 1;
+}
+
+static void *handoff_main(void *arg) {
+    (void)arg;
+    struct pollfd fds[2] = {
+        { .fd = g_listen_fd, .events = POLLIN },
+        { .fd = g_stop_fd, .events = POLLIN },
+    };
+
+    while (!g_handed_off) {
+        int n = poll(fds, 2, -1);
+        if (n == -1 && errno != EINTR) {
+            log_error("Handoff socket poll failed.");
+            break;
+        }
+        if (n <= 0) {
+            continue;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        int fd = accept4(g_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        // A drain already started (SIGINT) leaves no sockets to give
+        if (!atomic_load(&g_drain) && !g_shutdown && hand_over(fd)) {
+            g_handed_off = 1;
+            log_info("The new server is accepting, draining sessions here.");
+            atomic_store(&g_drain, 1);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+int handoff_start(worker_t *workers, const server_config_t *config) {
+    char log_buf[SMALL_BUF_SIZE + PATH_MAX];
+    struct sockaddr_un addr;
+
+    // Our loops run: the old server can stop accepting
+    if (g_peer_fd != -1) {
+        char ready = 1;
+        if (send(g_peer_fd, &ready, 1, MSG_NOSIGNAL) != 1) {
+            log_error("Failed to tell the old server that this one accepts.");
+        }
+        close(g_peer_fd);
+        g_peer_fd = -1;
+    }
+    // Fewer workers than the old server: the spare sockets stay with it until it exits
+    for (int i = 0; i < g_inherited_count; i++) {
+        if (g_inherited[i] != -1) {
+            close(g_inherited[i]);
+            g_inherited[i] = -1;
+        }
+    }
+
+    if (!config->handoff_socket) {
+        return 0;
+    }
+    g_config = config;
+    g_workers = workers;
+    if (unix_address(config->handoff_socket, &addr) == -1) {
+        return -1;
+    }
+    unlink(config->handoff_socket);   // left behind by an earlier run, or bound by the server we replaced
+
+    g_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (g_listen_fd == -1 || bind(g_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+        || listen(g_listen_fd, 1) == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to open handoff socket %s: %s", config->handoff_socket, strerror(errno));
+        log_error(log_buf);
+        if (g_listen_fd != -1) close(g_listen_fd);
+        g_listen_fd = -1;
+        return -1;
+    }
+    g_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (g_stop_fd == -1 || pthread_create(&g_thread, NULL, handoff_main, NULL) != 0) {
+        log_error("Failed to start the handoff thread.");
+        if (g_stop_fd != -1) close(g_stop_fd);
+        close(g_listen_fd);
+        unlink(config->handoff_socket);
+        g_stop_fd = g_listen_fd = -1;
+        return -1;
+    }
+    g_running = 1;
+    snprintf(log_buf, sizeof(log_buf), "Accepting upgrades on %s.", config->handoff_socket);
+    log_info(log_buf);
+    return 0;
+}
+
+void handoff_stop(void) {
+    uint64_t one = 1;
+
+    if (!g_running) {
+        return;
+    }
+    if (write(g_stop_fd, &one, sizeof(one)) == -1) {
+        log_error("Failed to wake the handoff thread.");
+    }
+    pthread_join(g_thread, NULL);
+    close(g_stop_fd);
+    close(g_listen_fd);
+    if (!g_handed_off) {
+        unlink(g_config->handoff_socket);
+    }
+    g_stop_fd = g_listen_fd = -1;
+    g_running = 0;
+}
@@ -0,0 +1,62 @@
+#include <stdint.h>
+
+#include "include/histogram.h"
+
+// Values below 2^HISTOGRAM_SUB_BITS get a bucket each; above, every power of two is
+// split into 2^HISTOGRAM_SUB_BITS equal buckets
+static int bucket_of(uint64_t value) {
+    if (value < (1u << HISTOGRAM_SUB_BITS)) {
+        return (int)value;
+    }
+    int exp = 63 - __builtin_clzll(value);
+    int shift = exp - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int)((value >> shift) & ((1u << HISTOGRAM_SUB_BITS) - 1));
+}
+
+// Largest value that lands in bucket
+static uint64_t bucket_top(int bucket) {
+    if (bucket < (1 << HISTOGRAM_SUB_BITS)) {
+        return (uint64_t)bucket;
+    }
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t low = ((uint64_t)(1u << HISTOGRAM_SUB_BITS) + (uint64_t)(bucket & ((1 << HISTOGRAM_SUB_BITS) - 1))) << shift;
+    return low + ((1ULL << shift) - 1);
+}
+
+void histogram_record(histogram_t *hist, uint64_t value) {
+    atomic_fetch_add_explicit(&hist->counts[bucket_of(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum, value, memory_order_relaxed);
+    if (value > atomic_load_explicit(&hist->max, memory_order_relaxed)) {
+        atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+    }
+}
+
+void histogram_merge(histogram_snapshot_t *snap, const histogram_t *hist) {
+    // total is recomputed from the buckets so a record racing the copy cannot skew quantiles
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        unsigned long n = atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+        snap->counts[i] += n;
+        snap->total += n;
+    }
+    snap->sum += atomic_load_explicit(&hist->sum, memory_order_relaxed);
+    unsigned long max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+    if (max > snap->max) snap->max = max;
+}
+
+uint64_t histogram_quantile(const histogram_snapshot_t *snap, double q) {
+    if (snap->total == 0) {
+        return 0;
+    }
+    unsigned long rank = (unsigned long)(q * (double)snap->total + 0.5);
+    if (rank == 0) rank = 1;
+    unsigned long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += snap->counts[i];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(i);
+            return top < snap->max ? top : snap->max;
+        }
+    }
+    return snap->max;
+}
@@ -0,0 +1,35 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <netinet/in.h>
+
+#include "server.h"
+
+#define ADMISSION_MAX_RULES 1024
+#define ADMISSION_RATE_BUCKETS 4096   // per-IP token bucket hash chains
+#define ADMISSION_RATE_LOCKS 64       // chains are striped over this many mutexes
+
+typedef enum {
+    ADMIT_OK,
+    ADMIT_DENIED,        // matched a deny rule in the policy file
+    ADMIT_RATE_LIMITED,  // per-IP token bucket is empty
+    ADMIT_BUSY,          // global concurrent session cap reached
+    ADMIT_REFUSED,       // operator answered 'n' in --interactive mode
+} admit_result_t;
+
+// Load the CIDR policy file and size the rate limiter from config
+int admission_init(const server_config_t *config);
+
+// Decide on a new connection; ADMIT_OK holds a session slot until admission_release()
+admit_result_t admission_check(const struct sockaddr_in *addr);
+
+// Return the session slot taken by a successful admission_check()
+void admission_release(void);
+
+// Short human-readable reason for a rejection
+const char *admission_reason(admit_result_t result);
+
+// Free the rule table and rate limiter state
+void admission_destroy(void);
+
+#endif
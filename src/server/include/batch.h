@@ -0,0 +1,32 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server.h"
+#include "conn.h"
+
+// BATCH requests are stored by batch threads, one per worker: every file is written,
+// checked against its SHA-256 and renamed into UPLOAD_DIR off the event loop, and in
+// durable mode the whole batch shares one data flush and one directory sync. The
+// session waits in CONN_STATE_COMMIT and gets one RESULTS frame for the batch.
+
+typedef struct batch_job batch_job_t;
+
+// Start the batch threads
+int batch_start(const server_config_t *config);
+
+// Stop the threads (after the workers are gone)
+void batch_stop(void);
+
+// Handle a BATCH frame: check its layout and queue it; a malformed one ends the session
+void batch_on_request(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len);
+
+// On the loop of `reactor` after its wake_fd fired: answer the batches that are stored
+void batch_reap(reactor_t *reactor);
+
+// The session goes away: its batch is still stored, unanswered
+void batch_cancel(conn_t *conn);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+#include "server.h"
+#include "reactor.h"
+
+#define BUFPOOL_DEFAULT_MB 256           // memory cap of the pool, override with --buffer-pool-mb
+#define BUFPOOL_MIN_SIZE (64 * 1024)     // smallest buffer handed out
+#define BUFPOOL_CLASSES 8                // power of two size classes from BUFPOOL_MIN_SIZE on
+#define BUFPOOL_MAX_SIZE (BUFPOOL_MIN_SIZE << (BUFPOOL_CLASSES - 1)) // 8 MiB, holds a whole BATCH frame
+#define BUFPOOL_IO_SIZE (256 * 1024)     // receive buffer of each loop's copy path
+
+// Sessions borrow their input buffers from one pool shared by all workers, only while
+// request bytes are waiting in them, so idle sessions hold none. Buffers are page aligned
+// and cached per size class; the pool never maps more than its cap. When it runs dry a
+// session stops reading, leaving the data in the socket (and the client blocked by TCP),
+// and its loop is woken through wake_fd as soon as buffers come back. The last
+// BUFPOOL_MAX_SIZE of the cap is kept for sessions growing a buffer with a partial
+// frame in it, so those always finish their frame and give the memory back.
+
+// Set the cap; call before the workers start
+void bufpool_init(const server_config_t *config);
+
+// Unmap every cached buffer (after the workers are gone)
+void bufpool_destroy(void);
+
+// Borrow a buffer of at least size bytes; its real size is stored in *cap. growing: the
+// caller holds a partial frame and may use the reserve. NULL when the pool is exhausted:
+// the wake_fd of reactor is then written once buffers are returned.
+void *bufpool_get(reactor_t *reactor, size_t size, int growing, size_t *cap);
+
+// Return a buffer obtained from bufpool_get()
+void bufpool_put(void *buf, size_t cap);
+
+// Log memory in use, the peak and how often reads were paused
+void bufpool_log_stats(void);
+
+#endif
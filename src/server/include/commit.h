@@ -0,0 +1,64 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server.h"
+#include "conn.h"
+#include "histogram.h"
+
+#define COMMIT_DEFAULT_WINDOW_US 2000  // how long the first finished upload waits for others to share its flush
+#define COMMIT_DEFAULT_BATCH 64        // a batch is flushed at once when this many uploads are waiting
+
+// Finished uploads are moved into UPLOAD_DIR here. In durable mode (--durable) they
+// are handed to one commit thread instead: uploads finishing close together share one
+// data flush (fdatasync of each file or one syncfs), are renamed into place and the
+// directory is synced once. Their sessions are answered only after that.
+
+typedef struct commit_job commit_job_t;
+
+// Name for a temp file under RESUME_DIR; the server start removes leftovers
+void commit_tmp_name(char *path, size_t cap);
+
+// Give the upload written to fd its final name, replacing an older file atomically.
+// tmp_path names fd's file, or is empty for an O_TMPFILE (linked to a temp name first).
+int commit_link(int fd, char *tmp_path, size_t cap, const char *full_path);
+
+// fsync() a directory so the names linked into it are durable
+int commit_sync_dir(const char *path);
+
+// Start the commit thread when config->durable is set
+int commit_start(const server_config_t *config);
+
+// Flush what is still queued and stop the thread (after the workers are gone)
+void commit_stop(void);
+
+// Durable mode: queue the finished file of conn (fd is taken over) and park the session
+// in CONN_STATE_COMMIT; stream_id is answered once the file is durable under full_path.
+// size and start_ns (when the upload was requested) feed the upload histograms.
+void commit_submit(conn_t *conn, uint32_t stream_id, int fd, const char *tmp_path, const char *full_path, const char *name,
+                   uint64_t size, uint64_t start_ns);
+
+// The same for a finished resumable upload: its partial file is renamed into place and its
+// checkpoint (ckpt_fd, taken over with its lock) removed only once the file is durable.
+// If the commit fails both stay where they are, so the client can resume the upload.
+void commit_submit_resumable(conn_t *conn, uint32_t stream_id, int fd, int ckpt_fd, const char *part_path, const char *ckpt_path,
+                             const char *full_path, const char *name, uint64_t size, uint64_t start_ns);
+
+// On the loop of `reactor` after its wake_fd fired: answer the sessions whose files are durable
+void commit_reap(reactor_t *reactor);
+
+// The session goes away while its file is being committed: the commit still happens, unanswered
+void commit_cancel(conn_t *conn);
+
+// Uploads waiting for the next flush
+int commit_queue_depth(void);
+
+// Add the commit latency (queued to durable, in microseconds) to snap
+void commit_latency(histogram_snapshot_t *snap);
+
+// Log the batch and latency counters
+void commit_log_stats(void);
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include "server.h"
+
+typedef struct reactor reactor_t;
+typedef struct conn conn_t;
+typedef struct resume_upload resume_upload_t;
+typedef struct stripe_upload stripe_upload_t;
+typedef struct dedup_upload dedup_upload_t;
+typedef struct dedup_manifest dedup_manifest_t;
+typedef struct commit_job commit_job_t;
+typedef struct secure secure_t;
+typedef struct digest_job digest_job_t;
+typedef struct batch_job batch_job_t;
+typedef struct delta_job delta_job_t;
+typedef struct delta_upload delta_upload_t;
+
+// Per-connection session state
+typedef enum {
+    CONN_STATE_COMMAND,    // reading request frames into in_buf
+    CONN_STATE_RECV_FILE,  // streaming the content of an UPLOAD frame into file_fd
+    CONN_STATE_SEND_FILE,  // streaming the content of a DATA reply from send_fd, requests wait
+    CONN_STATE_COMMIT,     // the finished upload or batch waits for its digest or its flush, requests wait
+    CONN_STATE_CLOSING,    // flush pending output, then close
+} conn_state_t;
+
+// How upload payload travels from the socket to the file
+typedef enum {
+    RECV_PATH_NONE,    // not chosen yet for the current upload
+    RECV_PATH_COPY,    // recv() into the loop buffer, then write()
+    RECV_PATH_SPLICE,  // splice() socket -> pipe -> file, no userspace copy
+    RECV_PATH_URING,   // io_uring reads into registered buffers, written straight from them
+} recv_path_t;
+
+#define URING_READ_DEPTH 4   // payload reads kept in flight per connection
+
+// io_uring backend bookkeeping, unused by the epoll loop
+typedef struct {
+    unsigned ops;              // requests in flight that reference this conn
+    unsigned reads;            // reads in flight (one linked chain at a time)
+    size_t requested;          // payload bytes asked for by in-flight reads
+    unsigned seq_next;         // sequence number of the next read submitted
+    unsigned seq_done;         // sequence number of the next read to deliver
+    void *done[URING_READ_DEPTH]; // completed reads waiting for their turn
+    void *writes;              // payload writes in file order, retired from the front once done
+    void *writes_tail;
+    long file_off;             // file offset for the next payload write
+    int poll_in;               // POLLIN armed while waiting for a command
+    int poll_out;              // POLLOUT armed for pending output
+    int starved;               // waiting for a registered buffer
+    int dying;                 // shut down, freed when ops reaches 0
+} conn_ring_t;
+
+// Fair share of the loop's ingest (ingest.c)
+typedef struct {
+    long deficit;              // bytes the session may still read in this round
+    long tokens;               // its --session-rate bucket, negative while in debt
+    uint64_t refill_ns;        // last refill of tokens, 0 while the bucket is untouched
+    uint64_t wake_ns;          // parked: when its buckets allow reading again
+    int queued;                // waiting for its next turn
+    int parked;                // waiting for a rate cap
+    conn_t *next;              // in the run queue or the parked list of the loop
+} conn_ingest_t;
+
+struct conn {
+    int fd;
+    conn_state_t state;
+    reactor_t *reactor;
+
+    char peer_ip[INET_ADDRSTRLEN];
+    int peer_port;
+
+    // Request bytes not yet parsed into a complete frame, in a buffer borrowed from the pool
+    char *in_buf;
+    size_t in_len;
+    size_t in_cap;
+    int buf_wait;         // reading paused until the buffer pool has room
+
+    // Pending outbound bytes, flushed on EPOLLOUT
+    char *out_buf;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+
+    // Active upload
+    uint32_t stream_id;   // stream of the UPLOAD frame, echoed in its reply
+    int file_fd;          // -1 while the content of a refused upload is skipped
+    char filename[256];
+    char full_path[PATH_MAX];
+    long filesize;
+    long received;
+    long file_base;       // file offset of the first byte (non-zero for stripes)
+    long flushed;         // bytes of the content already handed to writeback
+    uint64_t upload_start_ns; // when the request of the upload arrived, for the duration histogram
+    char tmp_path[PATH_MAX]; // named temp file of a plain upload, empty while it is an O_TMPFILE
+    recv_path_t recv_path;
+    int pipe_fds[2];      // splice staging pipe, created on first use
+
+    digest_job_t *digest;     // SHA-256 of the plain upload, computed by a digest thread
+    int digest_trailer;       // the UPLOAD frame ends with the client's SHA-256, not read yet
+    batch_job_t *batch;       // BATCH being stored by a batch thread, NULL if none
+    delta_upload_t *delta;    // delta upload bound by its first DELTA frame, NULL if none
+    delta_job_t *delta_job;   // SIGNATURE or DELTA frame with a delta thread, NULL if none
+    uint32_t text_ack;        // stream id of the last TEXT taken and not acknowledged yet, 0 if none
+
+    resume_upload_t *resume;  // resumable upload bound by RESUME, NULL if none
+    commit_job_t *commit;     // upload in the group commit, answered when durable
+
+    // Stripe being received, NULL for a plain upload
+    stripe_upload_t *stripe;
+    uint32_t stripe_index;
+    uint64_t stripe_start_ns;
+
+    dedup_upload_t *dedup;    // upload into the dedup store, NULL for a plain upload
+
+    // Active download: the DATA head goes through out_buf, the content follows with sendfile()
+    int send_fd;          // -1 when no download is in progress
+    off_t send_off;
+    uint64_t send_left;
+    dedup_manifest_t *send_manifest; // the file is stored as chunks: send_fd is the current one
+    uint64_t send_pos;    // file position of send_off
+    uint64_t send_run;    // bytes left in the current chunk
+
+    secure_t *sec;        // keys of an encrypted session, NULL while it is plain
+
+    conn_ring_t ring;
+    conn_ingest_t ingest;
+
+    conn_t *prev;
+    conn_t *next;
+};
+
+// Queue bytes for the peer (sealed on an encrypted session); they are written as soon as the socket allows
+int conn_send(conn_t *conn, const void *data, size_t len);
+
+// Queue one protocol frame
+int conn_send_frame(conn_t *conn, uint8_t opcode, uint32_t stream_id, const void *payload, size_t len);
+
+// Write as much pending output as the socket takes, then download content; -1 if the peer is gone
+int conn_flush(conn_t *conn);
+
+// Write pending output only: 1 once all of it is out, 0 when the socket is full, -1 if the peer is gone
+int conn_write_out(conn_t *conn);
+
+// Room for len more bytes at the end of out_buf (out_len is left to the caller); NULL when out of memory
+char *conn_out_space(conn_t *conn, size_t len);
+
+// Borrow a buffer for the session from the pool (include/bufpool.h). NULL when it is
+// exhausted: the session stops reading and is resumed once buffers come back.
+void *conn_buf_get(conn_t *conn, size_t size, int growing, size_t *cap);
+
+// Room for need request bytes in in_buf, borrowed from the pool or grown there; -1 with
+// the session paused when the pool is exhausted
+int conn_in_reserve(conn_t *conn, size_t need);
+
+// Return in_buf to the pool once every byte in it has been parsed
+void conn_in_release(conn_t *conn);
+
+// Command state: read what the socket has into in_buf and run every complete frame.
+// 1: progress, call again; 0: socket drained; -1: session over
+int conn_read_frames(conn_t *conn);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "conn.h"
+
+// With --store dedup every unique chunk is kept once under DEDUP_DIR/<2 hex>/<sha256 hex>
+// and a stored file is a manifest under MANIFEST_DIR listing its chunks. Chunks are
+// reference counted by the manifests that name them (and downloads in progress).
+#define DEDUP_DIR UPLOAD_DIR "/.chunks"
+#define MANIFEST_DIR UPLOAD_DIR "/.manifests"
+
+typedef struct dedup_upload dedup_upload_t;
+typedef struct dedup_manifest dedup_manifest_t;
+
+// Create the store and rebuild the reference counts from the manifests. When no other
+// server uses the store (flock on DEDUP_DIR) unreferenced chunks are dropped now and as
+// they appear. Enables the store for the rest of the process.
+int dedup_init(void);
+
+// Another server is about to share the store (a handoff): chunks are no longer deleted
+// at runtime, whatever this process thinks of their references
+void dedup_keep_chunks(void);
+
+// 1 once dedup_init() succeeded: plain UPLOADs are stored as chunks too
+int dedup_enabled(void);
+
+// Start receiving a file on conn (state becomes CONN_STATE_RECV_FILE). From a
+// plain UPLOAD the content is cut into chunks here; from a MANIFEST it is the list
+// of chunk entries. A request that cannot be accepted is answered and skipped.
+void dedup_upload_begin(conn_t *conn, uint32_t stream_id, uint8_t opcode, const char *name, size_t name_len,
+                        uint64_t file_size, uint64_t content_len);
+
+// Consume received content of the upload on conn; -1 with errno set on a storage error
+int dedup_upload_data(conn_t *conn, const char *data, size_t len);
+
+// All content is in: check it against the client's SHA-256 (expected, NULL if the UPLOAD
+// carried none), write the manifest and answer
+void dedup_upload_done(conn_t *conn, const uint8_t *expected);
+
+// The upload on conn will not complete; release what it referenced
+void dedup_upload_abort(conn_t *conn);
+
+// Handle a HAVE frame: answer which of the hashes are stored
+void dedup_on_have(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len);
+
+// Handle a BLOB frame: verify the chunk against its hash and store it
+void dedup_on_blob(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len);
+
+// A plain file now holds `name`: drop the manifest it replaces, if any
+void dedup_forget(const char *name);
+
+// Open the manifest of a stored file for reading, pinning its chunks; NULL if there is none
+dedup_manifest_t *dedup_manifest_open(const char *name, uint64_t *file_size);
+
+// Open the chunk holding byte `pos` of the file: *fd positioned by *off, *run bytes readable there
+int dedup_manifest_read_at(dedup_manifest_t *manifest, uint64_t pos, int *fd, off_t *off, uint64_t *run);
+
+// Unpin and free
+void dedup_manifest_close(dedup_manifest_t *manifest);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server.h"
+#include "conn.h"
+
+#define DELTA_READ_SIZE (256 * 1024)  // bytes of the stored copy a delta thread reads at a time
+
+// Delta uploads (SIGNATURE, SUMS, DELTA in include/protocol.h) run on delta threads, one
+// per worker: they checksum the stored copy of a file and rebuild the new version from
+// its blocks and the literal bytes of the DELTA frames, hashing it as they go. The
+// rebuilt file is written aside and stored like a plain upload. The session waits in
+// CONN_STATE_COMMIT while one of its requests is with a thread, so the DELTA frames of
+// an upload are applied in order; between them the upload stays bound to the session.
+
+typedef struct delta_job delta_job_t;
+typedef struct delta_upload delta_upload_t;
+
+// Start the delta threads
+int delta_start(const server_config_t *config);
+
+// Stop the threads (after the workers are gone)
+void delta_stop(void);
+
+// Handle a SIGNATURE frame: checksum the stored file off the loop, answered with SUMS
+void delta_on_signature(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len);
+
+// Handle a DELTA frame: bind the upload on its first frame and queue the instructions
+void delta_on_frame(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len);
+
+// On the loop of `reactor` after its wake_fd fired: send the sums and answer the
+// uploads whose frames were applied
+void delta_reap(reactor_t *reactor);
+
+// The session goes away: its unfinished upload is removed
+void delta_close(conn_t *conn);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server.h"
+#include "conn.h"
+
+#define DIGEST_XATTR "user.meshexchange.sha256" // hex SHA-256 of the content, kept on every plain upload
+#define DIGEST_READ_SIZE (256 * 1024)           // bytes a digest thread hashes of one upload per turn
+
+// Plain uploads are hashed with SHA-256 while they are received. The loop only tells the
+// digest threads how far the file has been filled; they read that range back from the page
+// cache, so no receive path (copy, splice or io_uring) waits for the hash. Once the content
+// and the client's digest are in, the session waits in CONN_STATE_COMMIT for the hash to
+// catch up; a match is stored with its digest beside the content, a mismatch is discarded.
+
+typedef struct digest_job digest_job_t;
+
+// Keep the SHA-256 of the content of fd on the file as DIGEST_XATTR (best effort)
+void digest_store(int fd, const uint8_t *digest);
+
+// Start one digest thread per worker
+int digest_start(const server_config_t *config);
+
+// Stop the threads (after the workers are gone)
+void digest_stop(void);
+
+// Start hashing the upload whose file conn->file_fd was just created; -1 with errno set
+int digest_begin(conn_t *conn);
+
+// conn->received bytes of the upload are in its file now
+void digest_feed(conn_t *conn);
+
+// All content is in: park the session until the digest is ready. expected is the
+// client's SHA-256 of the content, NULL if it sent none.
+void digest_finish(conn_t *conn, const uint8_t *expected);
+
+// On the loop of `reactor` after its wake_fd fired: store or refuse the uploads whose digest is ready
+void digest_reap(reactor_t *reactor);
+
+// The session goes away: its upload is no longer hashed
+void digest_cancel(conn_t *conn);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conn.h"
+
+// Handle a DOWNLOAD frame: answer with the DATA head and switch conn to
+// CONN_STATE_SEND_FILE until the requested range has been sent
+void download_on_request(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len);
+
+// Send download content with sendfile() (sealed records on an encrypted session) until the
+// socket is full; called by conn_flush()
+// once out_buf is empty. Back in CONN_STATE_COMMAND when done, -1 if the session is over.
+int download_pump(conn_t *conn);
+
+// Drop a download that will not complete
+void download_close(conn_t *conn);
+
+#endif
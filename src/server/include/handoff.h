@@ -0,0 +1,35 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "server.h"
+#include "worker.h"
+
+#define HANDOFF_READY_TIMEOUT_MS 30000 // the new server has this long to start accepting
+#define DEFAULT_DRAIN_TIMEOUT_S 30     // sessions still open after this long are cut
+
+// Restart without refusing connections. With --handoff-socket PATH a thread listens on a
+// Unix socket for the next build of the server. A new process started with --take-over
+// and the same PATH connects there, receives the listening sockets of every worker with
+// SCM_RIGHTS and serves them right away; once it reports that its loops run, the old
+// process stops accepting and drains its sessions like after SIGINT. Connections queued
+// on the sockets meanwhile are accepted by whichever process gets to them first. If the
+// new process fails before it is ready, the old one carries on; it only keeps the dedup
+// chunks it would have deleted (dedup_keep_chunks()) until its next start.
+//
+// Handoff message: u32 worker count (native byte order) with that many descriptors
+// attached. Reply: one byte once the new process accepts.
+
+// --take-over: fetch the listening sockets from the server on config->handoff_socket
+int handoff_take(const server_config_t *config);
+
+// Inherited listening socket for worker index, -1 when a new one must be bound
+int handoff_listen_fd(int index);
+
+// Tell the old server that the loops run (it starts draining), then serve
+// config->handoff_socket for the next upgrade
+int handoff_start(worker_t *workers, const server_config_t *config);
+
+// Stop the thread; the socket path is left to the process that took over, if any
+void handoff_stop(void);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define HISTOGRAM_SUB_BITS 4   // 16 linear buckets per power of two: recorded values are kept within 1/16
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) // covers every uint64_t
+
+// Log-linear (HDR-style) histogram of non-negative integers. Each one has a single
+// writer, the loop owning it; recording is a few relaxed atomic adds, so other threads
+// can read it at any time without a lock.
+typedef struct {
+    atomic_ulong counts[HISTOGRAM_BUCKETS];
+    atomic_ulong total;
+    atomic_ulong sum;
+    atomic_ulong max;
+} histogram_t;
+
+// Plain copy of one or more histograms, merged by the reader
+typedef struct {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long total;
+    unsigned long sum;
+    unsigned long max;
+} histogram_snapshot_t;
+
+// Count one value; only from the thread owning hist
+void histogram_record(histogram_t *hist, uint64_t value);
+
+// Add the current counts of hist to snap (zero it first for a single histogram)
+void histogram_merge(histogram_snapshot_t *snap, const histogram_t *hist);
+
+// Smallest recorded value that q (0..1) of all values do not exceed, to bucket precision
+uint64_t histogram_quantile(const histogram_snapshot_t *snap, double q);
+
+#endif
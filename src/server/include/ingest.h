@@ -0,0 +1,48 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stddef.h>
+
+#include "server.h"
+#include "conn.h"
+
+#define INGEST_QUANTUM (256 * 1024)  // bytes a session may receive per round while others wait
+#define INGEST_VISITS 64             // backlogged sessions served before the loop polls again
+#define INGEST_MIN_GRANT (16 * 1024) // a rate-capped session waits until it may read this much
+#define INGEST_BURST_MS 100          // token buckets hold this much time worth of their rate
+
+// Ingest is shared between sessions by deficit round robin. Every read from a client
+// socket asks for a grant first: a session may take its quantum, after that it queues
+// behind the others that still have input and gets another quantum when its turn comes.
+// A session whose socket runs dry leaves the round. With --session-rate and --ingest-rate
+// reads also draw from token buckets (per session, and one for the whole server); an
+// empty bucket parks the session until it has refilled, the loop sleeps no longer than that.
+
+// Set the rate caps; call before the workers start
+void ingest_init(const server_config_t *config);
+
+// How many bytes conn may read now, at most want. 0: it is queued for its next turn
+// or parked by a rate cap, the loop reads it again then.
+size_t ingest_grant(conn_t *conn, size_t want);
+
+// n bytes were read from the socket of conn
+void ingest_charge(conn_t *conn, size_t n);
+
+// The socket of conn is drained: its next input starts a fresh quantum
+void ingest_idle(conn_t *conn);
+
+// conn is queued or parked and must not read before its turn
+int ingest_waiting(const conn_t *conn);
+
+// Next backlogged session of the loop, with a new quantum; parked sessions whose rate
+// allows reading again join the queue first. NULL if none.
+conn_t *ingest_next(reactor_t *reactor);
+
+// How long the loop may block: 0 with sessions queued, else until the first parked one
+// may read again, at most REACTOR_TICK_MS
+int ingest_timeout_ms(reactor_t *reactor);
+
+// The session goes away: take it off the queue
+void ingest_forget(conn_t *conn);
+
+#endif
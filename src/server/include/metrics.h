@@ -0,0 +1,32 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "server.h"
+#include "reactor.h"
+#include "worker.h"
+
+#define METRICS_SAMPLE_MS 1000   // per-second rates are measured over this interval
+#define METRICS_REPORT_SIZE (128 * 1024) // a report with MAX_WORKERS workers fits
+#define METRICS_SEND_TIMEOUT_MS 1000 // a reader that takes longer for the whole report is dropped
+
+// With --stats-socket PATH one thread listens on a Unix socket and answers every
+// connection with a snapshot in the Prometheus text format, then closes it
+// (e.g. `nc -U PATH`). It only reads the per-worker counters and histograms, which
+// their loops update with relaxed atomics, so scraping never slows the loops down.
+
+// Monotonic clock in nanoseconds, for upload start times
+uint64_t metrics_now_ns(void);
+
+// An upload of size bytes that started at start_ns was stored: count it and record
+// its size and duration. Loop thread of reactor only.
+void metrics_upload_ok(reactor_t *reactor, uint64_t size, uint64_t start_ns);
+
+// Start the stats thread when config->stats_socket is set
+int metrics_start(worker_t *workers, const server_config_t *config);
+
+// Stop the thread and remove the socket
+void metrics_stop(void);
+
+#endif
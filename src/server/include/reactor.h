@@ -0,0 +1,132 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stddef.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "server.h"
+#include "conn.h"
+#include "histogram.h"
+
+#define REACTOR_MAX_EVENTS 256
+#define REACTOR_TICK_MS 250     // epoll_wait timeout, bounds shutdown latency
+#define SPLICE_PIPE_SIZE (1 << 20)  // requested per-connection pipe capacity
+#define SPLICE_CHUNK (1 << 20)      // max bytes moved per splice() call
+#define SENDFILE_CHUNK (1 << 20)    // max bytes sent per sendfile() call, keeps other sessions served
+#define WRITEBEHIND_CHUNK (8 << 20) // upload bytes handed to writeback at a time, bounds dirty pages per upload
+
+// Counters owned by one loop, readable from any thread
+typedef struct {
+    atomic_ulong accepted;
+    atomic_ulong rejected;   // turned away by admission control
+    atomic_ulong active;
+    atomic_ulong bytes_in;
+    atomic_ulong uploads_ok;
+    atomic_ulong uploads_failed;
+    atomic_ulong downloads;
+    atomic_ulong bytes_out;    // DOWNLOAD content sent
+
+    // Upload payload per receive path and, with --recv-bench, thread CPU spent on it
+    atomic_ulong copy_bytes;
+    atomic_ulong copy_cpu_ns;
+    atomic_ulong splice_bytes;
+    atomic_ulong splice_cpu_ns;
+
+    // io_uring backend: io_uring_enter() calls and payload bytes it received
+    atomic_ulong uring_enters;
+    atomic_ulong uring_bytes;
+
+    // Reads held back until a --session-rate or --ingest-rate bucket refilled
+    atomic_ulong throttled;
+
+    // Queue depths: sessions waiting for their ingest turn, for a rate cap, for the buffer pool
+    atomic_ulong ingest_queued;
+    atomic_ulong ingest_parked;
+    atomic_ulong buf_paused;
+
+    // Stored uploads: size in bytes, and microseconds from the request to the reply
+    histogram_t upload_bytes;
+    histogram_t upload_us;
+} reactor_stats_t;
+
+#define STAT_ADD(reactor, field, n) \
+    atomic_fetch_add_explicit(&(reactor)->stats.field, (n), memory_order_relaxed)
+#define STAT_SUB(reactor, field, n) \
+    atomic_fetch_sub_explicit(&(reactor)->stats.field, (n), memory_order_relaxed)
+#define STAT_GET(reactor, field) \
+    atomic_load_explicit(&(reactor)->stats.field, memory_order_relaxed)
+
+// Edge-triggered epoll loop owning one listening socket and its sessions
+struct reactor {
+    int epoll_fd;
+    int listen_fd;
+    int id;                  // worker index, used in logs
+    const server_config_t *config;
+    reactor_stats_t stats;
+
+    conn_t *conns;           // live sessions
+    size_t conn_count;
+    unsigned long bench_seq;  // upload counter used to alternate paths in --recv-bench
+    struct uring *ring;       // set while the io_uring backend drives this loop
+
+    int wake_fd;              // eventfd other threads signal to hand work back to this loop
+    commit_job_t *committed;  // durable uploads to answer, guarded by the commit lock
+    digest_job_t *digested;   // uploads whose digest is ready, guarded by the digest lock
+    batch_job_t *batched;     // batches stored, guarded by the batch lock
+    delta_job_t *delta_done;  // sums computed and delta frames applied, guarded by the delta lock
+    int buf_waiting;          // sessions paused until the buffer pool has room again
+    conn_t *ingest_head;      // sessions with input left over after their quantum, in turn order
+    conn_t *ingest_tail;
+    conn_t *parked;           // sessions waiting for a rate cap
+
+    uint64_t drain_deadline_ns; // draining: sessions still open then are cut; 0 while accepting
+    uint64_t drain_sweep_ns;    // last look for idle sessions to close
+
+    char *io_buf;             // copy path receive buffer shared by all sessions of this loop, BUFPOOL_IO_SIZE
+    size_t io_cap;
+};
+
+// Set by the SIGINT handler, polled by the loop every tick
+extern volatile sig_atomic_t g_shutdown;
+
+// Set by the first SIGINT or a handoff: the loops stop accepting, let their sessions
+// finish for up to --drain-timeout seconds, then stop. Lock-free, so the signal handler
+// may touch it too.
+extern atomic_int g_drain;
+
+// Held while a loop closes its listening socket and while the handoff thread copies them
+extern pthread_mutex_t g_listen_lock;
+
+// Create a non-blocking listening socket bound to config->port;
+// with several workers (or a handoff socket) each one joins the same SO_REUSEPORT group
+int reactor_listen(const server_config_t *config);
+
+// Prepare the loop around an already listening socket
+int reactor_init(reactor_t *reactor, int listen_fd, const server_config_t *config);
+
+// Run until g_shutdown is set or a drain is over
+int reactor_run(reactor_t *reactor);
+
+// Called by both backends every pass. Once g_drain is set: stop accepting, close the
+// sessions with nothing in flight; 1 when none is left or the deadline passed.
+int reactor_drain(reactor_t *reactor);
+
+// Admit and register an accepted socket (shared by both backends); NULL if it was turned away
+conn_t *reactor_conn_open(reactor_t *reactor, int fd, const struct sockaddr_in *client_addr);
+
+// End a session and free it
+void reactor_conn_close(conn_t *conn);
+
+// A session that waited on another thread carries on: run the requests queued behind
+// the wait and read again. May close the session.
+void reactor_conn_resume(conn_t *conn);
+
+// wake_fd fired: take back what other threads finished for this loop's sessions
+void reactor_on_wake(reactor_t *reactor);
+
+// Close every session and the listening socket
+void reactor_destroy(reactor_t *reactor);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conn.h"
+
+// Partial files and their checkpoints live here until the upload completes:
+// <id>.part holds the content, <id>.ckpt the committed offset
+#define RESUME_DIR UPLOAD_DIR "/.partial"
+#define RESUME_MIN_CHUNK 4096
+
+// Handle a RESUME frame: bind the upload to conn (creating it if it is new)
+// and answer with the offset committed so far
+void resume_on_request(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len);
+
+// Handle a CHUNK frame: verify its CRC, store it and advance the checkpoint
+void resume_on_chunk(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len);
+
+// Unbind the upload from conn; the partial file and its checkpoint stay for a later RESUME
+void resume_close(conn_t *conn);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef SECURE_H
+#define SECURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "conn.h"
+
+// Encrypted sessions. After KEY every byte is sealed (include/record.h): input is read
+// into a record buffer and opened there, its plaintext goes on to the session as if it
+// had come off the socket; output is sealed into out_buf. Zero-copy receive (splice,
+// io_uring fixed buffers) and sendfile() do not apply to such sessions.
+
+#define SECURE_IN_RECORDS 4   // sealed records one read can take in at least
+
+// Handle a KEY frame: answer SERVER_KEY and seal everything after it
+void secure_on_key(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len);
+
+// conn_read_frames() of a sealed session: read, open every complete record, run its plaintext
+int secure_read(conn_t *conn);
+
+// Seal the concatenation of iov into records appended to out_buf, 0 on success
+int secure_queue(conn_t *conn, const struct iovec *iov, int count);
+
+// Read up to len (at most PROTO_RECORD_MAX) bytes at off of fd and queue them as one record.
+// Returns the bytes taken from the file, 0 at its end, -1 on error.
+ssize_t secure_queue_file(conn_t *conn, int fd, off_t off, size_t len);
+
+// Release the session keys
+void secure_close(conn_t *conn);
+
+#endif
@@ -1,16 +1,100 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <limits.h>   // PATH_MAX must agree in every file that sees struct conn
+
 #define DEFAULT_PORT 1231
 #define DEFAULT_IP "127.0.0.1"
 
-// error 
+#define BUFFER_SIZE 4096    // Increased buffer size for file transfer efficiency
+#define SMALL_BUF_SIZE 256  // For regular messages and log_buf
+#define DEFAULT_BACKLOG 1024 // listen() backlog, override with --backlog
+#define MAX_WORKERS 256
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
+
+// Define the directory where uploaded files will be saved
+#define UPLOAD_DIR "uploaded_files"
+
+// error
 typedef enum {
     NET_SUCCESS,
     ERROR_NETWORK,
     ERROR_MEMORY,
     ERROR_SERVER,
     ERROR_FROM_CLIENT,
-} error_t;
+} error_srv_t;
+
+// Upload receive path selected with --recv-mode
+typedef enum {
+    RECV_MODE_SPLICE,  // splice() socket -> pipe -> file, falls back to copy when unsupported
+    RECV_MODE_COPY,    // recv() + write() through a userspace buffer
+} recv_mode_t;
+
+// Event loop implementation selected with --backend
+typedef enum {
+    BACKEND_EPOLL,
+    BACKEND_URING,     // falls back to epoll if io_uring is unavailable
+} backend_t;
+
+// How finished uploads are kept, selected with --store
+typedef enum {
+    STORE_PLAIN,       // one file per upload under UPLOAD_DIR
+    STORE_DEDUP,       // content-defined chunks stored once, one manifest per file
+} store_mode_t;
+
+// Durability barrier of a group commit, selected with --commit-sync
+typedef enum {
+    COMMIT_SYNC_FDATASYNC, // fdatasync() every file of the batch
+    COMMIT_SYNC_SYNCFS,    // one syncfs() of the upload filesystem per batch
+} commit_sync_t;
+
+// Runtime options parsed from the command line
+typedef struct {
+    int port;
+    int backlog;
+    int workers;      // event loops, each with its own SO_REUSEPORT socket
+    int pin_cpus;     // pin worker N to CPU N
+
+    // Admission control
+    int interactive;          // ask the operator y/n for every connection
+    const char *policy_file;  // CIDR allow/deny rules
+    double rate_per_ip;       // new connections per second per source IP, 0 = unlimited
+    double rate_burst;        // token bucket depth for rate_per_ip
+    int max_sessions;         // concurrent sessions across all workers, 0 = unlimited
+
+    backend_t backend;
+    recv_mode_t recv_mode;
+    int recv_bench;           // alternate receive paths per upload and report CPU per GiB
+    store_mode_t store;
+
+    // Durable uploads: UPLOAD_SUCCESS only once the file survives a crash
+    int durable;
+    long commit_window_us;    // group commit: wait this long for more uploads to share a flush
+    int commit_batch;         // ... or until this many are waiting
+    commit_sync_t commit_sync;
+
+    int require_encryption;   // refuse requests of sessions that did not run the KEY handshake
+
+    long buffer_pool_mb;      // memory cap of the shared I/O buffer pool
+
+    long session_rate;        // bytes/s each session may send, 0 = unlimited
+    long ingest_rate;         // bytes/s all sessions together may send, 0 = unlimited
+
+    const char *stats_socket; // Unix socket serving the metrics, NULL = none
+
+    // Restarts: sessions get drain_timeout seconds to finish on SIGINT or after a handoff
+    const char *handoff_socket; // Unix socket a new server takes the listening sockets from, NULL = none
+    int take_over;              // take them from the server on handoff_socket at startup
+    int drain_timeout;
+} server_config_t;
+
+// Timestamped messages to stdout / errors to stderr
+void log_info(const char *message);
+void log_error(const char *message);
+// perror() and untimestamped output (prompts) through the same queue
+void log_perror(const char *message);
+void log_raw(const char *text);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,46 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conn.h"
+#include "../../../include/protocol.h"
+
+// Greet a freshly accepted client
+void session_open(conn_t *conn);
+
+// Answer a request with a STATUS frame on its stream
+void session_reply(conn_t *conn, uint32_t stream_id, proto_status_t status, const char *text);
+
+// Run every complete request frame in conn->in_buf and keep the unparsed rest;
+// an emptied in_buf goes back to the buffer pool
+void session_on_input(conn_t *conn);
+
+// Close the file of an unfinished plain upload, stop hashing it and remove what was written
+void session_discard_file(conn_t *conn);
+
+// Number of payload bytes still expected in CONN_STATE_RECV_FILE
+size_t session_file_remaining(const conn_t *conn);
+
+// Append received upload content to the file (or skip it for a refused upload), 0 on success
+int session_on_file_data(conn_t *conn, const char *data, size_t len);
+
+// Account for len bytes already placed in file_fd (zero-copy paths)
+void session_file_advance(conn_t *conn, size_t len);
+
+// The content of the current upload is complete and, for an UPLOAD that carries one, its
+// SHA-256 (expected, else NULL) has been read: verify and store it, or finish the stripe
+void session_upload_done(conn_t *conn, const uint8_t *expected);
+
+// The plain upload was verified against its digest: move it into place (or hand it to
+// the group commit in durable mode) and answer
+void session_upload_store(conn_t *conn);
+
+// Abort the current upload after an I/O error on the file
+void session_file_failed(conn_t *conn, const char *reason);
+
+// Release session resources; an unfinished upload is removed
+void session_close(conn_t *conn);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conn.h"
+
+#define STRIPE_IDLE_SEC 300   // an unfinished striped upload nobody is sending to is dropped after this
+
+// Stripes of one upload may arrive on any connection of any worker; they are written
+// into one preallocated file under RESUME_DIR, renamed into UPLOAD_DIR once all are in.
+
+// Start receiving one stripe on conn (state becomes CONN_STATE_RECV_FILE).
+// A stripe that cannot be accepted is answered at once and its content skipped.
+void stripe_begin(conn_t *conn, uint32_t stream_id, uint64_t upload_id, uint64_t file_size,
+                  uint64_t stripe_size, uint32_t stripe_index, const char *name, size_t name_len);
+
+// The stripe on conn is fully written: account for it, answer, and commit the file if it was the last
+void stripe_file_done(conn_t *conn);
+
+// The stripe on conn will not complete; the whole striped upload fails
+void stripe_release(conn_t *conn);
+
+#endif
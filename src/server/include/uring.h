@@ -0,0 +1,26 @@
+#ifndef URING_H
+#define URING_H
+
+#include "reactor.h"
+
+#define URING_ENTRIES 1024          // submission queue size per worker
+#define URING_BUF_COUNT 128         // registered payload buffers per worker
+#define URING_BUF_SIZE (64 * 1024)
+#define URING_ACCEPTS 8             // accept requests kept armed on the listening socket
+
+#define URING_UNAVAILABLE -2        // uring_run(): kernel lacks what we need, use epoll
+
+// Drive the worker with io_uring instead of epoll until g_shutdown is set.
+// Returns URING_UNAVAILABLE before touching any connection if io_uring cannot be used.
+int uring_run(reactor_t *reactor);
+
+// reactor_conn_resume() on the io_uring backend: rearm what the session needs next
+void uring_conn_resume(conn_t *conn);
+
+// Draining: cancel the accepts armed on the listening socket
+void uring_stop_accepting(reactor_t *reactor);
+
+// Close an idle session from outside the completion handlers
+void uring_conn_close(conn_t *conn);
+
+#endif
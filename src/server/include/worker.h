@@ -0,0 +1,32 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "server.h"
+#include "reactor.h"
+
+// One event loop thread with its own listening socket and buffers
+typedef struct {
+    int id;
+    int cpu;           // CPU the thread is pinned to, -1 if not pinned
+    pthread_t thread;
+    int started;
+    atomic_int finished; // left its loop
+    reactor_t reactor;
+} worker_t;
+
+// Bind one SO_REUSEPORT socket per worker (or adopt one taken over) and start the threads
+int workers_start(worker_t *workers, const server_config_t *config);
+
+// 1 once every started worker left its loop, i.e. a drain is over
+int workers_finished(worker_t *workers, const server_config_t *config);
+
+// Wait for every started worker to leave its loop and tear it down
+void workers_join(worker_t *workers, const server_config_t *config);
+
+// Log per-worker counters so the connection balance is visible
+void workers_log_stats(worker_t *workers, const server_config_t *config);
+
+#endif
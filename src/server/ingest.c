@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "include/ingest.h"
+#include "include/reactor.h"
+
+static long g_session_rate;   // bytes per second per session, 0 = unlimited
+static long g_session_burst;
+static long g_ingest_rate;    // bytes per second for the whole server, 0 = unlimited
+static long g_ingest_burst;
+
+// Guards the server-wide bucket, shared by every worker
+static pthread_mutex_t g_ingest_lock = PTHREAD_MUTEX_INITIALIZER;
+static long g_ingest_tokens;
+static uint64_t g_ingest_refill_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static long burst_of(long rate) {
+    long burst = rate / (1000 / INGEST_BURST_MS);
+    return burst < INGEST_QUANTUM ? INGEST_QUANTUM : burst;
+}
+
+void ingest_init(const server_config_t *config) {
+    char log_buf[SMALL_BUF_SIZE];
+
+    g_session_rate = config->session_rate;
+    g_session_burst = burst_of(g_session_rate);
+    g_ingest_rate = config->ingest_rate;
+    g_ingest_burst = burst_of(g_ingest_rate);
+    if (g_session_rate || g_ingest_rate) {
+        snprintf(log_buf, sizeof(log_buf), "Ingest capped at %ld bytes/s per session, %ld bytes/s in total (0 = unlimited).",
+                 g_session_rate, g_ingest_rate);
+        log_info(log_buf);
+    }
+}
+
+// Add what accrued since the last refill; a fresh bucket starts full
+static void bucket_refill(long *tokens, uint64_t *refill_ns, long rate, long burst, uint64_t now) {
+    if (*refill_ns == 0) {
+        *tokens = burst;
+    } else if (now > *refill_ns) {
+        uint64_t accrued = (now - *refill_ns) * (uint64_t)rate / 1000000000ULL;
+        *tokens = *tokens + (long)accrued > burst ? burst : *tokens + (long)accrued;
+        if (accrued == 0) return;   // keep the fraction for the next refill
+    }
+    *refill_ns = now;
+}
+
+// Nanoseconds until the bucket holds need tokens, 0 if it does
+static uint64_t bucket_wait(long tokens, long rate, long need) {
+    return tokens >= need ? 0 : (uint64_t)(need - tokens) * 1000000000ULL / (uint64_t)rate + 1;
+}
+
+static void ingest_queue(conn_t *conn) {
+    reactor_t *reactor = conn->reactor;
+
+    if (conn->ingest.queued) {
+        return;
+    }
+    conn->ingest.queued = 1;
+    conn->ingest.next = NULL;
+    STAT_ADD(reactor, ingest_queued, 1);
+    if (reactor->ingest_tail) reactor->ingest_tail->ingest.next = conn;
+    else reactor->ingest_head = conn;
+    reactor->ingest_tail = conn;
+}
+
+static void ingest_park(conn_t *conn, uint64_t wake_ns) {
+    reactor_t *reactor = conn->reactor;
+
+    conn->ingest.parked = 1;
+    conn->ingest.wake_ns = wake_ns;
+    conn->ingest.next = reactor->parked;
+    reactor->parked = conn;
+    STAT_ADD(reactor, throttled, 1);
+    STAT_ADD(reactor, ingest_parked, 1);
+}
+
+size_t ingest_grant(conn_t *conn, size_t want) {
+    conn_ingest_t *s = &conn->ingest;
+
+    if (s->queued || s->parked) {
+        return 0;
+    }
+    if (s->deficit <= 0) {
+        ingest_queue(conn);
+        return 0;
+    }
+    size_t grant = want < (size_t)s->deficit ? want : (size_t)s->deficit;
+    if (!g_session_rate && !g_ingest_rate) {
+        return grant;
+    }
+
+    // Small reads are not worth a wakeup each: wait until a useful amount is allowed
+    long need = want < INGEST_MIN_GRANT ? (long)want : INGEST_MIN_GRANT;
+    uint64_t now = now_ns();
+    uint64_t wait = 0;
+    if (g_session_rate) {
+        bucket_refill(&s->tokens, &s->refill_ns, g_session_rate, g_session_burst, now);
+        wait = bucket_wait(s->tokens, g_session_rate, need);
+        if (!wait && (size_t)s->tokens < grant) grant = (size_t)s->tokens;
+    }
+    if (!wait && g_ingest_rate) {
+        pthread_mutex_lock(&g_ingest_lock);
+        bucket_refill(&g_ingest_tokens, &g_ingest_refill_ns, g_ingest_rate, g_ingest_burst, now);
+        wait = bucket_wait(g_ingest_tokens, g_ingest_rate, need);
+        if (!wait && (size_t)g_ingest_tokens < grant) grant = (size_t)g_ingest_tokens;
+        pthread_mutex_unlock(&g_ingest_lock);
+    }
+    if (wait) {
+        ingest_park(conn, now + wait);
+        return 0;
+    }
+    return grant;
+}
+
+void ingest_charge(conn_t *conn, size_t n) {
+    conn_ingest_t *s = &conn->ingest;
+
+    // Reads the io_uring backend queued ahead may overshoot a grant; the debt is paid next round
+    s->deficit -= (long)n;
+    if (g_session_rate) {
+        s->tokens -= (long)n;
+    }
+    if (g_ingest_rate) {
+        pthread_mutex_lock(&g_ingest_lock);
+        g_ingest_tokens -= (long)n;
+        pthread_mutex_unlock(&g_ingest_lock);
+    }
+}
+
+void ingest_idle(conn_t *conn) {
+    conn->ingest.deficit = INGEST_QUANTUM;
+}
+
+int ingest_waiting(const conn_t *conn) {
+    return conn->ingest.queued || conn->ingest.parked;
+}
+
+conn_t *ingest_next(reactor_t *reactor) {
+    // Parked sessions whose buckets have refilled line up behind the others
+    if (reactor->parked) {
+        uint64_t now = now_ns();
+        conn_t **link = &reactor->parked;
+        while (*link) {
+            conn_t *conn = *link;
+            if (conn->ingest.wake_ns <= now) {
+                *link = conn->ingest.next;
+                conn->ingest.parked = 0;
+                STAT_SUB(reactor, ingest_parked, 1);
+                ingest_queue(conn);
+            } else {
+                link = &conn->ingest.next;
+            }
+        }
+    }
+
+    conn_t *conn = reactor->ingest_head;
+    if (!conn) {
+        return NULL;
+    }
+    reactor->ingest_head = conn->ingest.next;
+    if (!reactor->ingest_head) reactor->ingest_tail = NULL;
+    conn->ingest.queued = 0;
+    conn->ingest.next = NULL;
+    STAT_SUB(reactor, ingest_queued, 1);
+    conn->ingest.deficit = conn->ingest.deficit < 0 ? conn->ingest.deficit + INGEST_QUANTUM : INGEST_QUANTUM;
+    return conn;
+}
+
+int ingest_timeout_ms(reactor_t *reactor) {
+    if (reactor->ingest_head) {
+        return 0;
+    }
+    int timeout = REACTOR_TICK_MS;
+    if (reactor->parked) {
+        uint64_t now = now_ns();
+        for (conn_t *conn = reactor->parked; conn; conn = conn->ingest.next) {
+            uint64_t left = conn->ingest.wake_ns > now ? conn->ingest.wake_ns - now : 0;
+            int ms = (int)((left + 999999) / 1000000);
+            if (ms < timeout) timeout = ms;
+        }
+    }
+    return timeout;
+}
+
+void ingest_forget(conn_t *conn) {
+    reactor_t *reactor = conn->reactor;
+
+    if (conn->ingest.queued) {
+        conn_t *prev = NULL;
+        for (conn_t *c = reactor->ingest_head; c; prev = c, c = c->ingest.next) {
+            if (c != conn) continue;
+            if (prev) prev->ingest.next = c->ingest.next;
+            else reactor->ingest_head = c->ingest.next;
+            if (reactor->ingest_tail == c) reactor->ingest_tail = prev;
+            STAT_SUB(reactor, ingest_queued, 1);
+            break;
+        }
+    } else if (conn->ingest.parked) {
+        for (conn_t **link = &reactor->parked; *link; link = &(*link)->ingest.next) {
+            if (*link == conn) {
+                *link = conn->ingest.next;
+                STAT_SUB(reactor, ingest_parked, 1);
+                break;
+            }
+        }
+    }
+    conn->ingest.queued = 0;
+    conn->ingest.parked = 0;
+}
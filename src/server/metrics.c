@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "include/metrics.h"
+#include "include/commit.h"
+
+static const server_config_t *g_config;
+static worker_t *g_workers;
+static pthread_t g_thread;
+static int g_running = 0;
+static int g_listen_fd = -1;
+static int g_stop_fd = -1;
+static ino_t g_socket_ino;   // of the path we bound; a server that took over binds its own
+static uint64_t g_start_ns;
+
+// Rates of the last complete sample, owned by the stats thread
+static unsigned long g_prev_bytes_in[MAX_WORKERS];
+static unsigned long g_prev_accepted;
+static unsigned long g_prev_rejected;
+static uint64_t g_prev_ns;
+static double g_bytes_in_rate[MAX_WORKERS];
+static double g_accept_rate;
+static double g_reject_rate;
+
+static const double g_quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_upload_ok(reactor_t *reactor, uint64_t size, uint64_t start_ns) {
+    STAT_ADD(reactor, uploads_ok, 1);
+    histogram_record(&reactor->stats.upload_bytes, size);
+    if (start_ns) {
+        histogram_record(&reactor->stats.upload_us, (metrics_now_ns() - start_ns) / 1000);
+    }
+}
+
+// Turn the counters into per-second rates over the interval since the previous sample
+static void metrics_sample(void) {
+    uint64_t now = metrics_now_ns();
+    double seconds = (double)(now - g_prev_ns) / 1e9;
+    unsigned long accepted = 0, rejected = 0;
+
+    for (int i = 0; i < g_config->workers; i++) {
+        reactor_t *reactor = &g_workers[i].reactor;
+        unsigned long bytes_in = STAT_GET(reactor, bytes_in);
+        g_bytes_in_rate[i] = (double)(bytes_in - g_prev_bytes_in[i]) / seconds;
+        g_prev_bytes_in[i] = bytes_in;
+        accepted += STAT_GET(reactor, accepted);
+        rejected += STAT_GET(reactor, rejected);
+    }
+    g_accept_rate = (double)(accepted - g_prev_accepted) / seconds;
+    g_reject_rate = (double)(rejected - g_prev_rejected) / seconds;
+    g_prev_accepted = accepted;
+    g_prev_rejected = rejected;
+    g_prev_ns = now;
+}
+
+// printf() at the end of the report; keeps failing once the buffer is full
+static int append(char *buf, int len, const char *fmt, ...) {
+    va_list ap;
+    if (len < 0 || len >= METRICS_REPORT_SIZE) {
+        return len;
+    }
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + len, METRICS_REPORT_SIZE - (size_t)len, fmt, ap);
+    va_end(ap);
+    return n < 0 ? -1 : len + n;
+}
+
+static int report_summary(char *buf, int len, const char *name, const histogram_snapshot_t *snap, double scale) {
+    len = append(buf, len, "# TYPE %s summary\n", name);
+    for (size_t i = 0; i < sizeof(g_quantiles) / sizeof(g_quantiles[0]); i++) {
+        len = append(buf, len, "%s{quantile=\"%g\"} %.9g\n", name, g_quantiles[i],
+                     (double)histogram_quantile(snap, g_quantiles[i]) * scale);
+    }
+    len = append(buf, len, "%s_sum %.9g\n%s_count %lu\n", name, (double)snap->sum * scale, name, snap->total);
+    return len;
+}
+
+// Write the whole report into buf; its length, or -1 if it did not fit
+static int metrics_report(char *buf) {
+    static histogram_snapshot_t sizes, durations, commits;
+    unsigned long totals[7] = {0};
+    double bytes_in_rate = 0.0;
+
+    memset(&sizes, 0, sizeof(sizes));
+    memset(&durations, 0, sizeof(durations));
+    memset(&commits, 0, sizeof(commits));
+    for (int i = 0; i < g_config->workers; i++) {
+        reactor_t *reactor = &g_workers[i].reactor;
+        totals[0] += STAT_GET(reactor, active);
+        totals[1] += STAT_GET(reactor, accepted);
+        totals[2] += STAT_GET(reactor, rejected);
+        totals[3] += STAT_GET(reactor, bytes_in);
+        totals[4] += STAT_GET(reactor, uploads_ok);
+        totals[5] += STAT_GET(reactor, uploads_failed);
+        totals[6] += STAT_GET(reactor, bytes_out);
+        bytes_in_rate += g_bytes_in_rate[i];
+        histogram_merge(&sizes, &reactor->stats.upload_bytes);
+        histogram_merge(&durations, &reactor->stats.upload_us);
+    }
+
+    int len = append(buf, 0, "mx_uptime_seconds %.1f\n", (double)(metrics_now_ns() - g_start_ns) / 1e9);
+    len = append(buf, len, "mx_sessions_active %lu\n", totals[0]);
+    len = append(buf, len, "mx_accepted_total %lu\nmx_accepts_per_second %.1f\n", totals[1], g_accept_rate);
+    len = append(buf, len, "mx_rejected_total %lu\nmx_rejects_per_second %.1f\n", totals[2], g_reject_rate);
+    len = append(buf, len, "mx_bytes_in_total %lu\nmx_bytes_in_per_second %.0f\n", totals[3], bytes_in_rate);
+    len = append(buf, len, "mx_bytes_out_total %lu\n", totals[6]);
+    len = append(buf, len, "mx_uploads_ok_total %lu\nmx_uploads_failed_total %lu\n", totals[4], totals[5]);
+    len = append(buf, len, "mx_commit_queue_depth %d\n", commit_queue_depth());
+
+    // Queue depths of each loop: sessions waiting for their ingest turn, for a rate
+    // cap, and for the buffer pool
+    for (int i = 0; i < g_config->workers; i++) {
+        reactor_t *reactor = &g_workers[i].reactor;
+        len = append(buf, len, "mx_worker_sessions{worker=\"%d\"} %lu\n", i, STAT_GET(reactor, active));
+        len = append(buf, len, "mx_worker_bytes_in_per_second{worker=\"%d\"} %.0f\n", i, g_bytes_in_rate[i]);
+        len = append(buf, len, "mx_worker_ingest_queued{worker=\"%d\"} %lu\n", i, STAT_GET(reactor, ingest_queued));
+        len = append(buf, len, "mx_worker_ingest_parked{worker=\"%d\"} %lu\n", i, STAT_GET(reactor, ingest_parked));
+        len = append(buf, len, "mx_worker_buffer_paused{worker=\"%d\"} %lu\n", i, STAT_GET(reactor, buf_paused));
+    }
+
+    len = report_summary(buf, len, "mx_upload_bytes", &sizes, 1.0);
+    len = report_summary(buf, len, "mx_upload_seconds", &durations, 1e-6);
+    if (g_config->durable) {
+        commit_latency(&commits);
+        len = report_summary(buf, len, "mx_commit_seconds", &commits, 1e-6);
+    }
+    return len < METRICS_REPORT_SIZE ? len : -1;
+}
+
+static void metrics_serve(int fd, char *buf) {
+    int len = metrics_report(buf);
+    if (len == -1) {
+        log_error("Stats report does not fit its buffer.");
+        return;
+    }
+    // A large report may not fit the socket buffer: wait for the reader, but only so long,
+    // and not past the server stopping
+    struct pollfd fds[2] = {
+        { .fd = fd, .events = POLLOUT },
+        { .fd = g_stop_fd, .events = POLLIN },
+    };
+    uint64_t deadline = metrics_now_ns() + METRICS_SEND_TIMEOUT_MS * 1000000ULL;
+    size_t off = 0;
+    while (off < (size_t)len) {
+        ssize_t sent = send(fd, buf + off, (size_t)len - off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent > 0) {
+            off += (size_t)sent;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        uint64_t now = metrics_now_ns();
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && now < deadline) {
+            int n = poll(fds, 2, (int)((deadline - now + 999999) / 1000000));
+            if (n > 0 && !fds[1].revents) continue;
+            if (n == -1 && errno == EINTR) continue;
+        }
+        log_error("Failed to send stats report.");
+        return;
+    }
+}
+
+static void *metrics_main(void *arg) {
+    (void)arg;
+    char *buf = malloc(METRICS_REPORT_SIZE);
+    struct pollfd fds[2] = {
+        { .fd = g_listen_fd, .events = POLLIN },
+        { .fd = g_stop_fd, .events = POLLIN },
+    };
+
+    g_prev_ns = metrics_now_ns();
+    while (buf) {
+        uint64_t next = g_prev_ns + METRICS_SAMPLE_MS * 1000000ULL;
+        uint64_t now = metrics_now_ns();
+        if (now >= next) {
+            metrics_sample();
+            continue;
+        }
+        int n = poll(fds, 2, (int)((next - now + 999999) / 1000000));
+        if (n == -1 && errno != EINTR) {
+            log_error("Stats socket poll failed.");
+            break;
+        }
+        if (n <= 0) {
+            continue;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        int fd = accept4(g_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd != -1) {
+            metrics_serve(fd, buf);
+            close(fd);
+        }
+    }
+    if (!buf) {
+        log_error("Stats thread could not allocate its buffer.");
+    }
+    free(buf);
+    return NULL;
+}
+
+int metrics_start(worker_t *workers, const server_config_t *config) {
+    char log_buf[SMALL_BUF_SIZE + PATH_MAX];
+    struct sockaddr_un addr;
+
+    if (!config->stats_socket) {
+        return 0;
+    }
+    g_config = config;
+    g_workers = workers;
+    g_start_ns = metrics_now_ns();
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(config->stats_socket) >= sizeof(addr.sun_path)) {
+        log_error("Stats socket path is too long.");
+        return -1;
+    }
+    strcpy(addr.sun_path, config->stats_socket);
+    unlink(config->stats_socket);   // left behind by an earlier run
+
+    g_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (g_listen_fd == -1 || bind(g_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+        || listen(g_listen_fd, 16) == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to open stats socket %s: %s", config->stats_socket, strerror(errno));
+        log_error(log_buf);
+        if (g_listen_fd != -1) close(g_listen_fd);
+        g_listen_fd = -1;
+        return -1;
+    }
+    struct stat st;
+    g_socket_ino = stat(config->stats_socket, &st) == 0 ? st.st_ino : 0;
+    g_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (g_stop_fd == -1 || pthread_create(&g_thread, NULL, metrics_main, NULL) != 0) {
+        log_error("Failed to start the stats thread.");
+        if (g_stop_fd != -1) close(g_stop_fd);
+        close(g_listen_fd);
+        unlink(config->stats_socket);
+        g_stop_fd = g_listen_fd = -1;
+        return -1;
+    }
+    g_running = 1;
+    snprintf(log_buf, sizeof(log_buf), "Serving stats on %s.", config->stats_socket);
+    log_info(log_buf);
+    return 0;
+}
+
+void metrics_stop(void) {
+    uint64_t one = 1;
+
+    if (!g_running) {
+        return;
+    }
+    if (write(g_stop_fd, &one, sizeof(one)) == -1) {
+        log_error("Failed to wake the stats thread.");
+    }
+    pthread_join(g_thread, NULL);
+    close(g_stop_fd);
+    close(g_listen_fd);
+    struct stat st;
+    if (stat(g_config->stats_socket, &st) == 0 && st.st_ino == g_socket_ino) {
+        unlink(g_config->stats_socket);
+    }
+    g_stop_fd = g_listen_fd = -1;
+    g_running = 0;
+}
@@ -0,0 +1,797 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "include/reactor.h"
+#include "include/session.h"
+#include "include/admission.h"
+#include "include/download.h"
+#include "include/commit.h"
+#include "include/digest.h"
+#include "include/batch.h"
+#include "include/delta.h"
+#include "include/bufpool.h"
+#include "include/ingest.h"
+#include "include/uring.h"
+#include "include/secure.h"
+#include "include/metrics.h"
+#include "../../include/protocol.h"
+
+volatile sig_atomic_t g_shutdown = 0;
+atomic_int g_drain = 0;
+pthread_mutex_t g_listen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set once splice() turns out to be unusable here, every later upload copies
+static atomic_int g_splice_unsupported = 0;
+
+int reactor_listen(const server_config_t *config) {
+    struct sockaddr_in server_addr;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log_error("Socket creation failed.");
+        log_perror("socket");
+        return -1;
+    }
+
+    int optval = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
+        log_error("setsockopt(SO_REUSEADDR) failed (non-critical).");
+        log_perror("setsockopt");
+    }
+
+    // Every worker binds its own socket to the port, the kernel spreads connections between them;
+    // a server taking over may run more workers than this one and add sockets to the group
+    if ((config->workers > 1 || config->handoff_socket) && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == -1) {
+        log_error("setsockopt(SO_REUSEPORT) failed.");
+        log_perror("setsockopt");
+        close(fd);
+        return -1;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(config->port);
+
+    if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        log_error("Socket binding failed.");
+        log_perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, config->backlog) == -1) {
+        log_error("Could not listen on socket.");
+        log_perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int reactor_init(reactor_t *reactor, int listen_fd, const server_config_t *config) {
+    memset(reactor, 0, sizeof(*reactor));
+    reactor->listen_fd = listen_fd;
+    reactor->config = config;
+    reactor->wake_fd = -1;
+
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd == -1) {
+        log_error("epoll_create1 failed.");
+        log_perror("epoll_create1");
+        return -1;
+    }
+    reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->wake_fd == -1) {
+        log_error("eventfd failed.");
+        log_perror("eventfd");
+        close(reactor->epoll_fd);
+        reactor->epoll_fd = -1;
+        return -1;
+    }
+
+    // The listening socket is tagged with a NULL pointer, the wake eventfd with its own
+    // address, sessions with their conn_t
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+    struct epoll_event wake_ev = { .events = EPOLLIN, .data.ptr = &reactor->wake_fd };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1
+        || epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &wake_ev) == -1) {
+        log_error("Failed to register listening socket with epoll.");
+        log_perror("epoll_ctl");
+        close(reactor->wake_fd);
+        reactor->wake_fd = -1;
+        close(reactor->epoll_fd);
+        reactor->epoll_fd = -1;
+        return -1;
+    }
+    reactor->io_buf = bufpool_get(reactor, BUFPOOL_IO_SIZE, 1, &reactor->io_cap);
+    if (!reactor->io_buf) {
+        log_error("The buffer pool has no room for the worker's receive buffer.");
+        close(reactor->wake_fd);
+        reactor->wake_fd = -1;
+        close(reactor->epoll_fd);
+        reactor->epoll_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void reactor_conn_close(conn_t *conn) {
+    reactor_t *reactor = conn->reactor;
+
+    session_close(conn);
+    close(conn->fd);
+    if (conn->pipe_fds[0] != -1) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+    }
+
+    if (conn->prev) conn->prev->next = conn->next;
+    else reactor->conns = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    reactor->conn_count--;
+    STAT_SUB(reactor, active, 1);
+    admission_release();
+
+    if (conn->buf_wait) {
+        reactor->buf_waiting--;
+        STAT_SUB(reactor, buf_paused, 1);
+    }
+    ingest_forget(conn);
+    if (conn->in_buf) bufpool_put(conn->in_buf, conn->in_cap);
+    free(conn->out_buf);
+    free(conn);
+}
+
+int conn_write_out(conn_t *conn) {
+    while (conn->out_off < conn->out_len) {
+        // MSG_DONTWAIT: the io_uring backend keeps its sockets in blocking mode
+        ssize_t sent = send(conn->fd, conn->out_buf + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0; // resumed once writable
+            log_error("Failed to send response to client.");
+            log_perror("send");
+            return -1;
+        }
+        conn->out_off += (size_t)sent;
+    }
+    conn->out_off = 0;
+    conn->out_len = 0;
+    // What a burst of replies grew goes back, an idle session keeps a small buffer at most
+    if (conn->out_cap > BUFFER_SIZE) {
+        free(conn->out_buf);
+        conn->out_buf = NULL;
+        conn->out_cap = 0;
+    }
+    return 1;
+}
+
+int conn_flush(conn_t *conn) {
+    int rc = conn_write_out(conn);
+    if (rc != 1) {
+        return rc;
+    }
+    // A DATA head is followed by its content
+    return conn->state == CONN_STATE_SEND_FILE ? download_pump(conn) : 0;
+}
+
+char *conn_out_space(conn_t *conn, size_t len) {
+    if (conn->out_len + len > conn->out_cap) {
+        size_t new_cap = conn->out_cap ? conn->out_cap : SMALL_BUF_SIZE;
+        while (new_cap < conn->out_len + len) new_cap *= 2;
+        char *grown = realloc(conn->out_buf, new_cap);
+        if (!grown) {
+            log_error("Out of memory while queueing response.");
+            return NULL;
+        }
+        conn->out_buf = grown;
+        conn->out_cap = new_cap;
+    }
+    return conn->out_buf + conn->out_len;
+}
+
+// Queue the concatenation of iov, then write what the socket takes
+static int conn_queue(conn_t *conn, const struct iovec *iov, int count) {
+    if (conn->sec) {
+        if (secure_queue(conn, iov, count) == -1) {
+            conn->state = CONN_STATE_CLOSING;
+            return -1;
+        }
+    } else {
+        for (int i = 0; i < count; i++) {
+            char *space = conn_out_space(conn, iov[i].iov_len);
+            if (!space) {
+                conn->state = CONN_STATE_CLOSING;
+                return -1;
+            }
+            memcpy(space, iov[i].iov_base, iov[i].iov_len);
+            conn->out_len += iov[i].iov_len;
+        }
+    }
+
+    // Most responses fit in the socket buffer right away
+    if (conn_flush(conn) == -1) {
+        conn->state = CONN_STATE_CLOSING;
+        return -1;
+    }
+    return 0;
+}
+
+int conn_send(conn_t *conn, const void *data, size_t len) {
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    return conn_queue(conn, &iov, 1);
+}
+
+int conn_send_frame(conn_t *conn, uint8_t opcode, uint32_t stream_id, const void *payload, size_t len) {
+    uint8_t header[PROTO_HEADER_SIZE];
+    proto_header_encode(header, opcode, stream_id, len);
+    // One queueing: on an encrypted session header and payload share a record
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = sizeof(header) },
+        { .iov_base = (void *)payload, .iov_len = len },
+    };
+    return conn_queue(conn, iov, len > 0 ? 2 : 1);
+}
+
+void *conn_buf_get(conn_t *conn, size_t size, int growing, size_t *cap) {
+    reactor_t *reactor = conn->reactor;
+
+    void *buf = bufpool_get(reactor, size, growing, cap);
+    if (!buf && !conn->buf_wait) {
+        conn->buf_wait = 1;
+        reactor->buf_waiting++;
+        STAT_ADD(reactor, buf_paused, 1);
+    } else if (buf && conn->buf_wait) {
+        conn->buf_wait = 0;
+        reactor->buf_waiting--;
+        STAT_SUB(reactor, buf_paused, 1);
+    }
+    return buf;
+}
+
+int conn_in_reserve(conn_t *conn, size_t need) {
+    size_t cap;
+
+    if (conn->in_buf && need <= conn->in_cap) {
+        return 0;
+    }
+    // A session growing its buffer holds a partial frame, it may use the pool's reserve
+    char *buf = conn_buf_get(conn, need, conn->in_buf != NULL, &cap);
+    if (!buf) {
+        return -1;
+    }
+    if (conn->in_buf) {
+        memcpy(buf, conn->in_buf, conn->in_len);
+        bufpool_put(conn->in_buf, conn->in_cap);
+    }
+    conn->in_buf = buf;
+    conn->in_cap = cap;
+    return 0;
+}
+
+void conn_in_release(conn_t *conn) {
+    if (conn->in_buf && conn->in_len == 0) {
+        bufpool_put(conn->in_buf, conn->in_cap);
+        conn->in_buf = NULL;
+        conn->in_cap = 0;
+    }
+}
+
+int conn_read_frames(conn_t *conn) {
+    reactor_t *reactor = conn->reactor;
+
+    if (conn->sec) {
+        return secure_read(conn);
+    }
+
+    // session_on_input() bounds what has to be buffered: a BATCH frame at most.
+    // Without a buffer the request stays in the socket until the pool has room.
+    if (conn_in_reserve(conn, conn->in_len + 1) == -1) {
+        return 0;
+    }
+    size_t grant = ingest_grant(conn, conn->in_cap - conn->in_len);
+    if (grant == 0) {
+        conn_in_release(conn);
+        return 0;   // read again on its next turn
+    }
+
+    // MSG_DONTWAIT: the io_uring backend keeps its sockets in blocking mode
+    ssize_t bytes_received = recv(conn->fd, conn->in_buf + conn->in_len, grant, MSG_DONTWAIT);
+    if (bytes_received == -1) {
+        if (errno == EINTR) return 1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            conn_in_release(conn);
+            ingest_idle(conn);
+            return 0;
+        }
+        log_error("Failed to read from client socket during session.");
+        log_perror("recv");
+        return -1;
+    }
+    if (bytes_received == 0) {
+        log_info("Client disconnected.");
+        return -1;
+    }
+    STAT_ADD(reactor, bytes_in, (unsigned long)bytes_received);
+    ingest_charge(conn, (size_t)bytes_received);
+
+    conn->in_len += (size_t)bytes_received;
+    session_on_input(conn);
+    return 1;
+}
+
+conn_t *reactor_conn_open(reactor_t *reactor, int fd, const struct sockaddr_in *client_addr) {
+    char log_buf[SMALL_BUF_SIZE];
+    STAT_ADD(reactor, accepted, 1);
+
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(client_addr->sin_addr), client_ip, INET_ADDRSTRLEN);
+    int client_port = ntohs(client_addr->sin_port);
+
+    admit_result_t verdict = admission_check(client_addr);
+    if (verdict != ADMIT_OK) {
+        STAT_ADD(reactor, rejected, 1);
+        snprintf(log_buf, sizeof(log_buf), "Connection from %s:%d rejected: %s.", client_ip, client_port, admission_reason(verdict));
+        log_info(log_buf);
+        uint8_t rejected[PROTO_HEADER_SIZE + PROTO_STATUS_META_SIZE + SMALL_BUF_SIZE];
+        int len = snprintf((char *)rejected + PROTO_HEADER_SIZE + PROTO_STATUS_META_SIZE, SMALL_BUF_SIZE,
+                           "Connection rejected by server: %s.", admission_reason(verdict));
+        proto_header_encode(rejected, PROTO_OP_STATUS, 0, PROTO_STATUS_META_SIZE + (size_t)len);
+        proto_put_u16(rejected + PROTO_HEADER_SIZE, PROTO_STATUS_REJECTED);
+        send(fd, rejected, PROTO_HEADER_SIZE + PROTO_STATUS_META_SIZE + (size_t)len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(fd);
+        return NULL;
+    }
+
+    conn_t *conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        log_error("Out of memory while accepting connection.");
+        admission_release();
+        close(fd);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->file_fd = -1;
+    conn->send_fd = -1;
+    conn->send_manifest = NULL;
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    conn->state = CONN_STATE_COMMAND;
+    conn->reactor = reactor;
+    snprintf(conn->peer_ip, sizeof(conn->peer_ip), "%s", client_ip);
+    conn->peer_port = client_port;
+    ingest_idle(conn);
+
+    conn->next = reactor->conns;
+    if (reactor->conns) reactor->conns->prev = conn;
+    reactor->conns = conn;
+    reactor->conn_count++;
+    STAT_ADD(reactor, active, 1);
+
+    session_open(conn);
+    return conn;
+}
+
+static void reactor_accept(reactor_t *reactor) {
+    while (!g_shutdown) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int fd = accept4(reactor->listen_fd, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            log_error("Failed to accept client connection.");
+            log_perror("accept");
+            return; // EMFILE and friends: retried on the next edge
+        }
+
+        conn_t *conn = reactor_conn_open(reactor, fd, &client_addr);
+        if (!conn) {
+            continue;
+        }
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            log_error("Failed to register client socket with epoll.");
+            log_perror("epoll_ctl");
+            reactor_conn_close(conn);
+        }
+    }
+}
+
+static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void splice_disable(const char *reason) {
+    char log_buf[SMALL_BUF_SIZE];
+    if (atomic_exchange(&g_splice_unsupported, 1) == 0) {
+        snprintf(log_buf, sizeof(log_buf), "splice() unavailable (%s), falling back to the copy receive path.", reason);
+        log_error(log_buf);
+    }
+}
+
+static recv_path_t choose_recv_path(conn_t *conn) {
+    reactor_t *reactor = conn->reactor;
+
+    // A refused upload is only read to skip it, there is no file to splice into
+    if (conn->file_fd == -1 || reactor->config->recv_mode == RECV_MODE_COPY || atomic_load(&g_splice_unsupported)) {
+        return RECV_PATH_COPY;
+    }
+    if (conn->pipe_fds[0] == -1) {
+        if (pipe2(conn->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+            return RECV_PATH_COPY;
+        }
+        // Best effort, the kernel caps it at /proc/sys/fs/pipe-max-size
+        fcntl(conn->pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    }
+    // The benchmark alternates paths so both are measured under the same load
+    if (reactor->config->recv_bench && (reactor->bench_seq++ & 1)) {
+        return RECV_PATH_COPY;
+    }
+    return RECV_PATH_SPLICE;
+}
+
+// Move len bytes sitting in the pipe into the upload file with read()+write()
+static int pipe_drain_copy(conn_t *conn, size_t len) {
+    reactor_t *reactor = conn->reactor;
+    while (len > 0) {
+        ssize_t n = read(conn->pipe_fds[0], reactor->io_buf, len > reactor->io_cap ? reactor->io_cap : len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t written = write(conn->file_fd, reactor->io_buf + off, (size_t)(n - off));
+            if (written == -1) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            off += written;
+        }
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// One splice round trip socket -> pipe -> file.
+// 1: progress, keep going; 0: socket drained; -1: session over; 2: retry with the copy path
+static int conn_recv_splice(conn_t *conn) {
+    reactor_t *reactor = conn->reactor;
+    size_t remaining = session_file_remaining(conn);
+    size_t grant = ingest_grant(conn, remaining > SPLICE_CHUNK ? SPLICE_CHUNK : remaining);
+    if (grant == 0) {
+        return 0;
+    }
+
+    ssize_t moved = splice(conn->fd, NULL, conn->pipe_fds[1], NULL, grant, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved == -1) {
+        if (errno == EINTR) return 1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            ingest_idle(conn);
+            return 0;
+        }
+        if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+            splice_disable(strerror(errno));
+            conn->recv_path = RECV_PATH_COPY;
+            return 2;
+        }
+        log_error("Failed to splice upload data from client socket.");
+        log_perror("splice");
+        return -1;
+    }
+    if (moved == 0) {
+        log_info("Client disconnected during file transfer.");
+        return -1;
+    }
+    STAT_ADD(reactor, bytes_in, (unsigned long)moved);
+    STAT_ADD(reactor, splice_bytes, (unsigned long)moved);
+    ingest_charge(conn, (size_t)moved);
+
+    size_t drained = 0;
+    while (drained < (size_t)moved) {
+        ssize_t out = splice(conn->pipe_fds[0], NULL, conn->file_fd, NULL, (size_t)moved - drained, SPLICE_F_MOVE);
+        if (out == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+                // The upload filesystem cannot take spliced pages, empty the pipe by hand
+                splice_disable(strerror(errno));
+                conn->recv_path = RECV_PATH_COPY;
+                if (pipe_drain_copy(conn, (size_t)moved - drained) == 0) {
+                    drained = (size_t)moved;
+                    break;
+                }
+            }
+            session_file_failed(conn, strerror(errno));
+            return 1;
+        }
+        drained += (size_t)out;
+    }
+
+    session_file_advance(conn, (size_t)moved);
+    return 1;
+}
+
+// Drain the socket until EAGAIN (edge-triggered) or the end of the session's turn; -1 when the session is over
+static int conn_on_readable(conn_t *conn) {
+    reactor_t *reactor = conn->reactor;
+
+    while (conn->state != CONN_STATE_CLOSING) {
+        // Requests behind a download or a commit stay in the socket until it is done
+        if (conn->state == CONN_STATE_SEND_FILE || conn->state == CONN_STATE_COMMIT) {
+            return 0;
+        }
+        // Sealed input is opened in userspace whatever it carries
+        if (conn->state == CONN_STATE_COMMAND || conn->sec) {
+            int rc = conn_read_frames(conn);
+            if (rc == 0 || rc == -1) return rc;
+            continue;
+        }
+
+        if (conn->recv_path == RECV_PATH_NONE) {
+            conn->recv_path = choose_recv_path(conn);
+        }
+        if (conn->recv_path == RECV_PATH_SPLICE) {
+            int rc = conn_recv_splice(conn);
+            if (rc == 0 || rc == -1) return rc;
+            continue;
+        }
+        // Never read past the announced payload, the next frame may follow it
+        size_t remaining = session_file_remaining(conn);
+        size_t to_read = ingest_grant(conn, remaining > reactor->io_cap ? reactor->io_cap : remaining);
+        if (to_read == 0) {
+            return 0;   // read again on its next turn
+        }
+
+        ssize_t bytes_received = recv(conn->fd, reactor->io_buf, to_read, 0);
+        if (bytes_received == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ingest_idle(conn);
+                return 0;
+            }
+            log_error("Failed to read from client socket during session.");
+            log_perror("recv");
+            return -1;
+        }
+        if (bytes_received == 0) {
+            log_info("Client disconnected.");
+            return -1;
+        }
+        STAT_ADD(reactor, bytes_in, (unsigned long)bytes_received);
+        STAT_ADD(reactor, copy_bytes, (unsigned long)bytes_received);
+        ingest_charge(conn, (size_t)bytes_received);
+        session_on_file_data(conn, reactor->io_buf, (size_t)bytes_received);
+    }
+    return 0;
+}
+
+// Readable handler with CPU accounting per receive path for --recv-bench
+static int conn_on_readable_bench(conn_t *conn) {
+    reactor_t *reactor = conn->reactor;
+    if (conn->state != CONN_STATE_RECV_FILE) {
+        return conn_on_readable(conn);
+    }
+
+    uint64_t start = thread_cpu_ns();
+    int rc = conn_on_readable(conn);
+    unsigned long spent = (unsigned long)(thread_cpu_ns() - start);
+
+    if (conn->recv_path == RECV_PATH_SPLICE) {
+        STAT_ADD(reactor, splice_cpu_ns, spent);
+    } else {
+        STAT_ADD(reactor, copy_cpu_ns, spent);
+    }
+    return rc;
+}
+
+void reactor_conn_resume(conn_t *conn) {
+    reactor_t *reactor = conn->reactor;
+
+    session_on_input(conn);
+    if (reactor->ring) {
+        uring_conn_resume(conn);
+        return;
+    }
+    // Input that arrived during the wait raised no new edge
+    int dead = conn_on_readable(conn) == -1;
+    if (!dead && conn->state == CONN_STATE_CLOSING && conn->out_len == 0) {
+        dead = 1;
+    }
+    if (dead) {
+        reactor_conn_close(conn);
+    }
+}
+
+void reactor_on_wake(reactor_t *reactor) {
+    uint64_t count;
+
+    if (read(reactor->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        log_error("Failed to read worker wake counter.");
+    }
+    commit_reap(reactor);
+    digest_reap(reactor);
+    batch_reap(reactor);
+    delta_reap(reactor);
+
+    // Buffers came back to the pool: paused sessions read again until one finds it empty
+    for (conn_t *conn = reactor->conns; conn && reactor->buf_waiting > 0; ) {
+        conn_t *next = conn->next;
+        if (conn->buf_wait) {
+            conn->buf_wait = 0;
+            int waiting = --reactor->buf_waiting;
+            STAT_SUB(reactor, buf_paused, 1);
+            reactor_conn_resume(conn);   // may close the session
+            if (reactor->buf_waiting > waiting) break;
+        }
+        conn = next;
+    }
+}
+
+// Nothing in flight: no request half read or waiting in the socket, no response pending,
+// no upload or thread to wait for
+static int conn_idle(const conn_t *conn) {
+    char byte;
+    if (conn->state != CONN_STATE_COMMAND || conn->in_len > 0 || conn->out_len > 0 || conn->buf_wait
+        || conn->ingest.queued || conn->ingest.parked || conn->delta) {
+        return 0;
+    }
+    return recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int reactor_drain(reactor_t *reactor) {
+    char log_buf[SMALL_BUF_SIZE];
+
+    if (!atomic_load(&g_drain)) {
+        return 0;
+    }
+    uint64_t now = metrics_now_ns();
+    if (!reactor->drain_deadline_ns) {
+        reactor->drain_deadline_ns = now + (uint64_t)reactor->config->drain_timeout * 1000000000ULL;
+        reactor->drain_sweep_ns = 0;
+        // A server that took over holds the same sockets: closing ours only stops this loop accepting
+        if (reactor->ring) {
+            uring_stop_accepting(reactor);
+        } else {
+            epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, reactor->listen_fd, NULL);
+        }
+        pthread_mutex_lock(&g_listen_lock);
+        close(reactor->listen_fd);
+        reactor->listen_fd = -1;
+        pthread_mutex_unlock(&g_listen_lock);
+        snprintf(log_buf, sizeof(log_buf), "Worker %d: stopped accepting, draining %zu session(s).", reactor->id, reactor->conn_count);
+        log_info(log_buf);
+    }
+
+    if (now - reactor->drain_sweep_ns >= REACTOR_TICK_MS * 1000000ULL) {
+        reactor->drain_sweep_ns = now;
+        for (conn_t *conn = reactor->conns; conn; ) {
+            conn_t *next = conn->next;
+            if (conn_idle(conn)) {
+                if (reactor->ring) uring_conn_close(conn);
+                else reactor_conn_close(conn);
+            }
+            conn = next;
+        }
+    }
+    if (reactor->conn_count == 0) {
+        return 1;
+    }
+    if (now >= reactor->drain_deadline_ns) {
+        snprintf(log_buf, sizeof(log_buf), "Worker %d: drain timeout, closing %zu session(s) still in flight.", reactor->id, reactor->conn_count);
+        log_error(log_buf);
+        return 1;
+    }
+    return 0;
+}
+
+int reactor_run(reactor_t *reactor) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (!g_shutdown) {
+        int n = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, ingest_timeout_ms(reactor));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            log_error("epoll_wait failed.");
+            log_perror("epoll_wait");
+            return -1;
+        }
+
+        // The wake is handled after the batch: what it reaps may close sessions whose
+        // events are still further down the list
+        int woken = 0;
+        for (int i = 0; i < n; i++) {
+            conn_t *conn = events[i].data.ptr;
+            if (!conn) {
+                reactor_accept(reactor);
+                continue;
+            }
+            if (events[i].data.ptr == &reactor->wake_fd) {
+                woken = 1;
+                continue;
+            }
+
+            int dead = 0;
+            int sending = conn->state == CONN_STATE_SEND_FILE;
+            if (events[i].events & EPOLLOUT) {
+                dead = conn_flush(conn) == -1;
+            }
+            // A finished download releases the requests queued behind it; their
+            // edge may have fired while it was sent, so look for them now
+            int resumed = sending && conn->state == CONN_STATE_COMMAND;
+            if (!dead && resumed) {
+                session_on_input(conn);
+            }
+            if (!dead && (resumed || (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))) {
+                dead = (reactor->config->recv_bench ? conn_on_readable_bench(conn) : conn_on_readable(conn)) == -1;
+            }
+            // A closing session goes away once its last response is out
+            if (!dead && conn->state == CONN_STATE_CLOSING && conn->out_len == 0) {
+                dead = 1;
+            }
+            if (dead) {
+                reactor_conn_close(conn);
+            }
+        }
+        if (woken) {
+            reactor_on_wake(reactor);
+        }
+
+        // Sessions that used up their quantum take turns with what their sockets still hold
+        for (int visits = 0; visits < INGEST_VISITS; visits++) {
+            conn_t *conn = ingest_next(reactor);
+            if (!conn) break;
+            int dead = (reactor->config->recv_bench ? conn_on_readable_bench(conn) : conn_on_readable(conn)) == -1;
+            if (!dead && conn->state == CONN_STATE_CLOSING && conn->out_len == 0) {
+                dead = 1;
+            }
+            if (dead) {
+                reactor_conn_close(conn);
+            }
+        }
+
+        if (reactor_drain(reactor)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+void reactor_destroy(reactor_t *reactor) {
+    while (reactor->conns) {
+        reactor_conn_close(reactor->conns);
+    }
+    if (reactor->epoll_fd != -1) {
+        close(reactor->epoll_fd);
+        reactor->epoll_fd = -1;
+    }
+    if (reactor->wake_fd != -1) {
+        close(reactor->wake_fd);
+        reactor->wake_fd = -1;
+    }
+    if (reactor->listen_fd != -1) {
+        pthread_mutex_lock(&g_listen_lock);
+        close(reactor->listen_fd);
+        reactor->listen_fd = -1;
+        pthread_mutex_unlock(&g_listen_lock);
+    }
+    if (reactor->io_buf) {
+        bufpool_put(reactor->io_buf, reactor->io_cap);
+        reactor->io_buf = NULL;
+    }
+}
@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/file.h>
+
+#include "include/resume.h"
+#include "include/session.h"
+#include "include/reactor.h"
+#include "include/dedup.h"
+#include "include/commit.h"
+#include "include/metrics.h"
+#include "../../include/protocol.h"
+
+// Checkpoint layout, fixed width so rewriting it in place never leaves stale bytes
+#define CKPT_FORMAT "MXCKPT1 %020llu %010u %020llu\n"
+#define CKPT_HEADER_LEN 61
+
+struct resume_upload {
+    uint64_t id;
+    char name[PROTO_MAX_NAME + 1];
+    uint64_t size;
+    uint32_t chunk_size;
+    uint64_t committed;      // every byte below this is verified and written
+    uint8_t *stored;         // one bit per chunk already verified and written
+    int part_fd;
+    int ckpt_fd;             // holds the flock() that binds the upload to one connection
+    char part_path[PATH_MAX];
+    char ckpt_path[PATH_MAX];
+    uint64_t start_ns;       // when this session bound the upload
+};
+
+static uint64_t chunk_count(const resume_upload_t *upload) {
+    return (upload->size + upload->chunk_size - 1) / upload->chunk_size;
+}
+
+static size_t chunk_len(const resume_upload_t *upload, uint64_t index) {
+    uint64_t offset = index * upload->chunk_size;
+    uint64_t left = upload->size - offset;
+    return left < upload->chunk_size ? (size_t)left : upload->chunk_size;
+}
+
+static int chunk_stored(const resume_upload_t *upload, uint64_t index) {
+    return (upload->stored[index / 8] >> (index % 8)) & 1;
+}
+
+static void free_upload(resume_upload_t *upload) {
+    if (upload->part_fd != -1) close(upload->part_fd);
+    if (upload->ckpt_fd != -1) close(upload->ckpt_fd); // drops the lock
+    free(upload->stored);
+    free(upload);
+}
+
+// Durable mode: hand the finished file to the group commit, answered from there. The
+// checkpoint lock goes with it, so a RESUME of the same id is turned away until the
+// commit settles and finds the partial file again if it failed.
+static void submit_upload(conn_t *conn, uint32_t stream_id, resume_upload_t *upload) {
+    char final_path[PATH_MAX];
+
+    snprintf(final_path, sizeof(final_path), "%s/%s", UPLOAD_DIR, upload->name);
+    commit_submit_resumable(conn, stream_id, upload->part_fd, upload->ckpt_fd, upload->part_path, upload->ckpt_path,
+                            final_path, upload->name, upload->size, upload->start_ns);
+    upload->part_fd = upload->ckpt_fd = -1;
+}
+
+// Record the committed offset; without an fsync this survives a lost connection
+// or a server restart, not a power cut
+static int write_checkpoint(resume_upload_t *upload) {
+    char record[CKPT_HEADER_LEN + PROTO_MAX_NAME + 2];
+    int len = snprintf(record, sizeof(record), CKPT_FORMAT "%s\n",
+                       (unsigned long long)upload->size, upload->chunk_size,
+                       (unsigned long long)upload->committed, upload->name);
+    return pwrite(upload->ckpt_fd, record, (size_t)len, 0) == len ? 0 : -1;
+}
+
+// Offset the checkpoint vouches for, 0 if it belongs to a different file
+static uint64_t read_checkpoint(const resume_upload_t *upload) {
+    char record[CKPT_HEADER_LEN + PROTO_MAX_NAME + 2];
+    ssize_t len = pread(upload->ckpt_fd, record, sizeof(record) - 1, 0);
+    if (len < CKPT_HEADER_LEN) {
+        return 0;
+    }
+    record[len] = '\0';
+
+    unsigned long long size, committed;
+    unsigned chunk_size;
+    if (sscanf(record, "MXCKPT1 %llu %u %llu", &size, &chunk_size, &committed) != 3
+        || size != upload->size || chunk_size != upload->chunk_size || committed > size
+        || strncmp(record + CKPT_HEADER_LEN, upload->name, strlen(upload->name)) != 0
+        || record[CKPT_HEADER_LEN + strlen(upload->name)] != '\n') {
+        return 0;
+    }
+    // The partial file must still hold what the checkpoint claims
+    off_t part_size = lseek(upload->part_fd, 0, SEEK_END);
+    if (part_size < 0 || (uint64_t)part_size < committed) {
+        return 0;
+    }
+    return committed;
+}
+
+// Move the finished file into UPLOAD_DIR and drop its checkpoint
+static int finish_upload(conn_t *conn, resume_upload_t *upload) {
+    char log_buf[PATH_MAX * 2 + SMALL_BUF_SIZE];
+    char final_path[PATH_MAX];
+
+    snprintf(final_path, sizeof(final_path), "%s/%s", UPLOAD_DIR, upload->name);
+    if (rename(upload->part_path, final_path) == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to move '%s' to '%s': %s", upload->part_path, final_path, strerror(errno));
+        log_error(log_buf);
+        return -1;
+    }
+    unlink(upload->ckpt_path);
+    dedup_forget(upload->name);   // the plain file replaces a deduplicated one of the same name
+    metrics_upload_ok(conn->reactor, upload->size, upload->start_ns);
+
+    snprintf(log_buf, sizeof(log_buf), "Resumable upload %016llx: file '%s' (%llu bytes) successfully received and saved to '%s'.",
+             (unsigned long long)upload->id, upload->name, (unsigned long long)upload->size, final_path);
+    log_info(log_buf);
+    return 0;
+}
+
+// Open (or create) the partial file and checkpoint for an upload and lock them to this connection
+static int open_upload(conn_t *conn, uint32_t stream_id, resume_upload_t *upload) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE];
+
+    snprintf(upload->part_path, sizeof(upload->part_path), "%s/%016llx.part", RESUME_DIR, (unsigned long long)upload->id);
+    snprintf(upload->ckpt_path, sizeof(upload->ckpt_path), "%s/%016llx.ckpt", RESUME_DIR, (unsigned long long)upload->id);
+
+    upload->ckpt_fd = open(upload->ckpt_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (upload->ckpt_fd == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to open checkpoint '%s': %s", upload->ckpt_path, strerror(errno));
+        log_error(log_buf);
+        session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, "ERROR: Could not create file on server.");
+        return -1;
+    }
+    if (flock(upload->ckpt_fd, LOCK_EX | LOCK_NB) == -1) {
+        session_reply(conn, stream_id, PROTO_STATUS_BUSY, "ERROR: Upload is in progress on another connection.");
+        return -1;
+    }
+
+    upload->part_fd = open(upload->part_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (upload->part_fd == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to open partial file '%s': %s", upload->part_path, strerror(errno));
+        log_error(log_buf);
+        session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, "ERROR: Could not create file on server.");
+        return -1;
+    }
+    return 0;
+}
+
+void resume_on_request(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE];
+
+    if (len < PROTO_RESUME_META_SIZE) {
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid RESUME frame.");
+        conn->state = CONN_STATE_CLOSING;
+        return;
+    }
+    uint64_t id = proto_get_u64(payload);
+    uint64_t size = proto_get_u64(payload + 8);
+    uint32_t chunk_size = proto_get_u32(payload + 16);
+    size_t name_len = proto_get_u16(payload + 20);
+    const char *name = (const char *)payload + PROTO_RESUME_META_SIZE;
+
+    if (name_len == 0 || name_len > PROTO_MAX_NAME || len != PROTO_RESUME_META_SIZE + name_len
+        || size > (uint64_t)LONG_MAX || chunk_size < RESUME_MIN_CHUNK || chunk_size > PROTO_MAX_CHUNK
+        || memchr(name, '/', name_len) || memchr(name, '\0', name_len)) {
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid RESUME frame.");
+        conn->state = CONN_STATE_CLOSING;
+        return;
+    }
+
+    // One resumable upload per connection at a time
+    resume_close(conn);
+
+    resume_upload_t *upload = calloc(1, sizeof(*upload));
+    if (upload) {
+        upload->part_fd = upload->ckpt_fd = -1;
+        upload->id = id;
+        upload->size = size;
+        upload->chunk_size = chunk_size;
+        upload->start_ns = metrics_now_ns();
+        memcpy(upload->name, name, name_len);
+        upload->stored = calloc((size_t)(chunk_count(upload) / 8 + 1), 1);
+    }
+    if (!upload || !upload->stored) {
+        log_error("Out of memory while resuming upload.");
+        session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, "ERROR: Out of memory.");
+        if (upload) free_upload(upload);
+        return;
+    }
+    if (open_upload(conn, stream_id, upload) == -1) {
+        free_upload(upload);
+        return;
+    }
+
+    upload->committed = read_checkpoint(upload);
+    if (upload->committed == 0) {
+        // New upload (or a stale checkpoint for another file): start from scratch
+        if (ftruncate(upload->part_fd, 0) == -1 || write_checkpoint(upload) == -1) {
+            log_error("Failed to initialise resumable upload.");
+            session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, "ERROR: Could not create file on server.");
+            free_upload(upload);
+            return;
+        }
+    }
+    for (uint64_t i = 0; i < upload->committed / chunk_size; i++) {
+        upload->stored[i / 8] |= (uint8_t)(1u << (i % 8));
+    }
+
+    snprintf(log_buf, sizeof(log_buf), "Client %s:%d resumes upload %016llx: file '%s', %llu of %llu bytes committed.",
+             conn->peer_ip, conn->peer_port, (unsigned long long)id, upload->name,
+             (unsigned long long)upload->committed, (unsigned long long)size);
+    log_info(log_buf);
+
+    // An empty file has nothing to wait for
+    if (size == 0) {
+        if (finish_upload(conn, upload) == -1) {
+            session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, "UPLOAD_FAILED: Could not write file.");
+            free_upload(upload);
+            return;
+        }
+    }
+
+    uint8_t offset[8];
+    proto_put_u64(offset, upload->committed);
+    conn_send_frame(conn, PROTO_OP_OFFSET, stream_id, offset, sizeof(offset));
+
+    if (size == 0) {
+        free_upload(upload);
+        return;
+    }
+    conn->resume = upload;
+}
+
+void resume_on_chunk(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE];
+    resume_upload_t *upload = conn->resume;
+
+    if (len < PROTO_CHUNK_META_SIZE) {
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid CHUNK frame.");
+        conn->state = CONN_STATE_CLOSING;
+        return;
+    }
+    uint64_t id = proto_get_u64(payload);
+    uint64_t offset = proto_get_u64(payload + 8);
+    uint32_t crc = proto_get_u32(payload + 16);
+    const uint8_t *data = payload + PROTO_CHUNK_META_SIZE;
+    size_t data_len = len - PROTO_CHUNK_META_SIZE;
+
+    if (!upload || upload->id != id) {
+        session_reply(conn, stream_id, PROTO_STATUS_NO_UPLOAD, "ERROR: Upload was not resumed on this connection.");
+        return;
+    }
+    uint64_t index = offset / upload->chunk_size;
+    if (offset % upload->chunk_size != 0 || offset >= upload->size || data_len != chunk_len(upload, index)) {
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: CHUNK does not match the upload layout.");
+        conn->state = CONN_STATE_CLOSING;
+        return;
+    }
+
+    if (chunk_stored(upload, index)) {
+        session_reply(conn, stream_id, PROTO_STATUS_OK, "CHUNK_OK"); // a resend that crossed our answer
+        return;
+    }
+    if (proto_crc32c(data, data_len) != crc) {
+        snprintf(log_buf, sizeof(log_buf), "Upload %016llx: chunk at offset %llu failed its checksum.", (unsigned long long)id, (unsigned long long)offset);
+        log_error(log_buf);
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_CHECKSUM, "CHUNK_CORRUPT");
+        return;
+    }
+
+    for (size_t done = 0; done < data_len; ) {
+        ssize_t written = pwrite(upload->part_fd, data + done, data_len - done, (off_t)(offset + done));
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            snprintf(log_buf, sizeof(log_buf), "Error writing file data to disk for '%s': %s", upload->name, strerror(errno));
+            log_error(log_buf);
+            session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, "UPLOAD_FAILED: Could not write file.");
+            return;
+        }
+        done += (size_t)written;
+    }
+    upload->stored[index / 8] |= (uint8_t)(1u << (index % 8));
+
+    // The checkpoint only moves over a gap-free prefix of stored chunks
+    uint64_t before = upload->committed;
+    while (upload->committed < upload->size && chunk_stored(upload, upload->committed / upload->chunk_size)) {
+        upload->committed += chunk_len(upload, upload->committed / upload->chunk_size);
+    }
+    if (upload->committed == upload->size) {
+        conn->resume = NULL;
+        if (conn->reactor->config->durable) {
+            submit_upload(conn, stream_id, upload);
+            free_upload(upload);
+            return;
+        }
+        if (finish_upload(conn, upload) == -1) {
+            STAT_ADD(conn->reactor, uploads_failed, 1);
+            session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, "UPLOAD_FAILED: Could not write file.");
+        } else {
+            session_reply(conn, stream_id, PROTO_STATUS_OK, "UPLOAD_SUCCESS");
+        }
+        free_upload(upload);
+        return;
+    }
+    if (upload->committed != before && write_checkpoint(upload) == -1) {
+        log_error("Failed to update upload checkpoint.");
+    }
+    session_reply(conn, stream_id, PROTO_STATUS_OK, "CHUNK_OK");
+}
+
+void resume_close(conn_t *conn) {
+    char log_buf[SMALL_BUF_SIZE];
+    resume_upload_t *upload = conn->resume;
+    if (!upload) {
+        return;
+    }
+    snprintf(log_buf, sizeof(log_buf), "Upload %016llx paused at %llu of %llu bytes, it can be resumed.",
+             (unsigned long long)upload->id, (unsigned long long)upload->committed, (unsigned long long)upload->size);
+    log_info(log_buf);
+    conn->resume = NULL;
+    free_upload(upload);
+}
@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "include/secure.h"
+#include "include/session.h"
+#include "include/reactor.h"
+#include "include/bufpool.h"
+#include "include/ingest.h"
+#include "../../include/record.h"
+
+struct secure {
+    record_keys_t keys;
+    uint8_t *in;          // sealed input borrowed from the pool, at most one incomplete record after each read
+    size_t in_len;
+    size_t in_cap;
+};
+
+void secure_on_key(conn_t *conn, uint32_t stream_id, const uint8_t *payload, size_t len) {
+    char log_buf[SMALL_BUF_SIZE];
+    uint8_t server_pub[PROTO_KEY_SIZE];
+
+    if (conn->sec || len != PROTO_KEY_SIZE) {
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid KEY frame.");
+        return;
+    }
+    secure_t *sec = calloc(1, sizeof(*sec));
+    EVP_PKEY *key = sec ? record_keygen(server_pub) : NULL;
+    if (!key || record_keys_derive(&sec->keys, key, payload, payload, server_pub, 1) == -1) {
+        EVP_PKEY_free(key);
+        free(sec);
+        log_error("Key exchange failed.");
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Key exchange failed.");
+        return;
+    }
+    EVP_PKEY_free(key);
+
+    // The answer is the last plain frame, the client seals everything once it has it
+    conn_send_frame(conn, PROTO_OP_SERVER_KEY, stream_id, server_pub, sizeof(server_pub));
+    conn->sec = sec;
+
+    snprintf(log_buf, sizeof(log_buf), "Session with %s:%d is encrypted now (X25519, AES-256-GCM).", conn->peer_ip, conn->peer_port);
+    log_info(log_buf);
+}
+
+// Keep request bytes for the session; they wait in in_buf like unparsed socket input.
+// secure_open_input() made room before it opened their record.
+static int secure_buffer_input(conn_t *conn, const uint8_t *data, size_t len) {
+    if (conn_in_reserve(conn, conn->in_len + len) == -1) {
+        log_error("No buffer left for an opened record.");
+        return -1;
+    }
+    memcpy(conn->in_buf + conn->in_len, data, len);
+    conn->in_len += len;
+    return 0;
+}
+
+// Hand opened plaintext to the session: upload content to its file, everything else to in_buf
+static void secure_deliver(conn_t *conn, const uint8_t *data, size_t len) {
+    while (len > 0 && conn->state != CONN_STATE_CLOSING) {
+        if (conn->state == CONN_STATE_RECV_FILE) {
+            size_t take = session_file_remaining(conn);
+            if (take > len) take = len;
+            session_on_file_data(conn, (const char *)data, take);
+            data += take;
+            len -= take;
+            continue;
+        }
+        // Requests behind a download or a commit wait there until it is done
+        if (secure_buffer_input(conn, data, len) == -1) {
+            conn->state = CONN_STATE_CLOSING;
+            return;
+        }
+        len = 0;
+        if (conn->state == CONN_STATE_COMMAND) {
+            session_on_input(conn);
+        }
+    }
+}
+
+// Open every complete record in the input buffer; -1 if the stream was tampered with
+static int secure_open_input(conn_t *conn) {
+    char log_buf[SMALL_BUF_SIZE];
+    secure_t *sec = conn->sec;
+    size_t off = 0;
+
+    while (sec->in_len - off >= PROTO_RECORD_HEAD && conn->state != CONN_STATE_CLOSING) {
+        uint8_t *rec = sec->in + off;
+        size_t len = record_length(rec);
+        if (len > PROTO_RECORD_MAX) {
+            snprintf(log_buf, sizeof(log_buf), "Oversized record from %s:%d, closing the session.", conn->peer_ip, conn->peer_port);
+            log_error(log_buf);
+            return -1;
+        }
+        if (sec->in_len - off < RECORD_SIZE(len)) {
+            break;
+        }
+        // A record can only be opened once: what it holds beyond upload content needs
+        // room in in_buf first, or the record stays sealed until the pool has some
+        size_t spill = len;
+        if (conn->state == CONN_STATE_RECV_FILE) {
+            size_t remaining = session_file_remaining(conn);
+            spill = len > remaining ? len - remaining : 0;
+        }
+        if (spill > 0 && conn_in_reserve(conn, conn->in_len + spill) == -1) {
+            break;
+        }
+        if (record_open(&sec->keys.rx, rec) == -1) {
+            // Nothing can be answered over a stream that cannot be trusted
+            snprintf(log_buf, sizeof(log_buf), "Record from %s:%d failed authentication, closing the session.", conn->peer_ip, conn->peer_port);
+            log_error(log_buf);
+            return -1;
+        }
+        off += RECORD_SIZE(len);
+        secure_deliver(conn, rec + PROTO_RECORD_HEAD, len);
+    }
+
+    if (conn->state == CONN_STATE_CLOSING) {
+        sec->in_len = 0;
+    } else if (off > 0) {
+        memmove(sec->in, sec->in + off, sec->in_len - off);
+        sec->in_len -= off;
+    }
+    return 0;
+}
+
+// Give the record buffer back to the pool once nothing is left in it
+static void secure_release_input(secure_t *sec) {
+    if (sec->in && sec->in_len == 0) {
+        bufpool_put(sec->in, sec->in_cap);
+        sec->in = NULL;
+        sec->in_cap = 0;
+    }
+}
+
+int secure_read(conn_t *conn) {
+    secure_t *sec = conn->sec;
+
+    // Records left sealed while the session was paused go first
+    if (sec->in_len > 0) {
+        if (secure_open_input(conn) == -1) return -1;
+        if (conn->buf_wait) return 0;
+    }
+    if (!sec->in) {
+        sec->in = conn_buf_get(conn, SECURE_IN_RECORDS * RECORD_SIZE(PROTO_RECORD_MAX), 0, &sec->in_cap);
+        if (!sec->in) {
+            return 0;   // the records stay in the socket until the pool has room
+        }
+    }
+
+    size_t grant = ingest_grant(conn, sec->in_cap - sec->in_len);
+    if (grant == 0) {
+        secure_release_input(sec);
+        return 0;   // read again on its next turn
+    }
+
+    // MSG_DONTWAIT: the io_uring backend keeps its sockets in blocking mode
+    ssize_t bytes_received = recv(conn->fd, sec->in + sec->in_len, grant, MSG_DONTWAIT);
+    if (bytes_received == -1) {
+        if (errno == EINTR) return 1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            secure_release_input(sec);
+            ingest_idle(conn);
+            return 0;
+        }
+        log_error("Failed to read from client socket during session.");
+        log_perror("recv");
+        return -1;
+    }
+    if (bytes_received == 0) {
+        log_info("Client disconnected.");
+        return -1;
+    }
+    STAT_ADD(conn->reactor, bytes_in, (unsigned long)bytes_received);
+    ingest_charge(conn, (size_t)bytes_received);
+
+    sec->in_len += (size_t)bytes_received;
+    if (secure_open_input(conn) == -1) {
+        return -1;
+    }
+    secure_release_input(sec);
+    return 1;
+}
+
+int secure_queue(conn_t *conn, const struct iovec *iov, int count) {
+    secure_t *sec = conn->sec;
+    size_t total = 0;
+    for (int i = 0; i < count; i++) total += iov[i].iov_len;
+
+    int i = 0;
+    size_t iov_off = 0;
+    while (total > 0) {
+        size_t len = total > PROTO_RECORD_MAX ? PROTO_RECORD_MAX : total;
+        uint8_t *rec = (uint8_t *)conn_out_space(conn, RECORD_SIZE(len));
+        if (!rec) {
+            return -1;
+        }
+        // Gather the plaintext into the record, then seal it where it is
+        for (size_t filled = 0; filled < len; ) {
+            size_t n = iov[i].iov_len - iov_off;
+            if (n > len - filled) n = len - filled;
+            memcpy(rec + PROTO_RECORD_HEAD + filled, (const uint8_t *)iov[i].iov_base + iov_off, n);
+            filled += n;
+            iov_off += n;
+            if (iov_off == iov[i].iov_len) {
+                i++;
+                iov_off = 0;
+            }
+        }
+        if (record_seal(&sec->keys.tx, rec, rec + PROTO_RECORD_HEAD, len) == -1) {
+            log_error("Failed to seal response.");
+            return -1;
+        }
+        conn->out_len += RECORD_SIZE(len);
+        total -= len;
+    }
+    return 0;
+}
+
+ssize_t secure_queue_file(conn_t *conn, int fd, off_t off, size_t len) {
+    secure_t *sec = conn->sec;
+    if (len > PROTO_RECORD_MAX) len = PROTO_RECORD_MAX;
+
+    uint8_t *rec = (uint8_t *)conn_out_space(conn, RECORD_SIZE(len));
+    if (!rec) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ssize_t n;
+    do {
+        n = pread(fd, rec + PROTO_RECORD_HEAD, len, off);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        return n;
+    }
+    if (record_seal(&sec->keys.tx, rec, rec + PROTO_RECORD_HEAD, (size_t)n) == -1) {
+        errno = EPROTO;
+        return -1;
+    }
+    conn->out_len += RECORD_SIZE((size_t)n);
+    return n;
+}
+
+void secure_close(conn_t *conn) {
+    if (!conn->sec) {
+        return;
+    }
+    record_keys_free(&conn->sec->keys);
+    if (conn->sec->in) bufpool_put(conn->sec->in, conn->sec->in_cap);
+    free(conn->sec);
+    conn->sec = NULL;
+}
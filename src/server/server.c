@@ -1,88 +1,307 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
 #include <signal.h>
 #include <time.h>
 #include <errno.h>
+#include <dirent.h>
 #include <sys/stat.h> // For mkdir
-#include <fcntl.h>    // For file operations
-
-#define BUFFER_SIZE 4096    // Increased buffer size for file transfer efficiency
-#define SMALL_BUF_SIZE 256  // For regular messages and log_buf
-#define MAX_PENDING_CONN 5
-#define PATH_MAX 1024
-
-// Define the directory where uploaded files will be saved
-#define UPLOAD_DIR "uploaded_files"
-
-// Global socket descriptors for cleaning up on exit
-int server_socket_fd = -1;
-int client_socket_fd_global = -1; // To track the currently active client socket
+#include <sys/resource.h>
+
+#include "include/server.h"
+#include "include/reactor.h"
+#include "include/worker.h"
+#include "include/admission.h"
+#include "include/resume.h"
+#include "include/dedup.h"
+#include "include/commit.h"
+#include "include/digest.h"
+#include "include/batch.h"
+#include "include/delta.h"
+#include "include/bufpool.h"
+#include "include/ingest.h"
+#include "include/metrics.h"
+#include "include/handoff.h"
+#include "../../include/log.h"
 
 // Function to print timestamped messages to stdout
 void log_info(const char *message) {
-    time_t now = time(NULL);
-    char time_buf[64];
-    strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    fprintf(stdout, "[%s] %s\n", time_buf, message);
-    fflush(stdout);
+    log_put(1, 1, "", message);
 }
 
 // Function to print timestamped errors to stderr
 void log_error(const char *message) {
-    time_t now = time(NULL);
-    char time_buf[64];
-    strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    fprintf(stderr, "[%s] Error: %s\n", time_buf, message);
-    fflush(stderr);
+    log_put(2, 1, "Error: ", message);
 }
 
-// Signal handler for graceful shutdown (e.g., Ctrl+C)
+// perror() through the log, so it keeps its place among the other lines
+void log_perror(const char *message) {
+    char err_buf[SMALL_BUF_SIZE];
+    char line[SMALL_BUF_SIZE * 2];
+    snprintf(line, sizeof(line), "%s: %s\n", message, strerror_r(errno, err_buf, sizeof(err_buf)));
+    log_put(2, 0, "", line);
+}
+
+// Untimestamped text such as a prompt, in order with the log lines
+void log_raw(const char *text) {
+    log_put(1, 0, "", text);
+}
+
+static volatile sig_atomic_t g_dump_stats = 0;
+
+// Signal handler for graceful shutdown (e.g., Ctrl+C): the event loops notice within one
+// tick, stop accepting and let their sessions finish; a second SIGINT stops them at once
 void handle_sigint(int sig) {
-    log_info("Received SIGINT. Shutting down server...");
-    if (client_socket_fd_global != -1) {
-        close(client_socket_fd_global);
-        client_socket_fd_global = -1;
+    (void)sig;
+    if (atomic_exchange(&g_drain, 1)) {
+        g_shutdown = 1;
     }
-    if (server_socket_fd != -1) {
-        close(server_socket_fd);
-        server_socket_fd = -1;
+}
+
+// SIGUSR1 prints the per-worker counters
+static void handle_sigusr1(int sig) {
+    (void)sig;
+    g_dump_stats = 1;
+}
+
+// Every session costs a descriptor, lift the soft limit as far as allowed
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
-    exit(EXIT_SUCCESS);
 }
 
-// Helper to send a simple response to the client
-void send_response(int sock_fd, const char* response) {
-    if (write(sock_fd, response, strlen(response)) == -1) {
-        log_error("Failed to send response to client.");
-        perror("write");
+// Temp files of plain uploads a previous run was still receiving (resumable ones are kept).
+// Their names start with the pid of the server that wrote them: the files of a server
+// still draining after a handoff are left alone.
+static void remove_stale_uploads(void) {
+    char path[PATH_MAX];
+    struct dirent *ent;
+
+    DIR *dir = opendir(RESUME_DIR);
+    if (!dir) {
+        return;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        pid_t pid = (pid_t)atoi(ent->d_name);
+        if (pid > 0 && pid != getpid() && (kill(pid, 0) == 0 || errno == EPERM)) {
+            continue;
+        }
+        if (len > 7 && strcmp(ent->d_name + len - 7, ".upload") == 0) {
+            snprintf(path, sizeof(path), "%s/%s", RESUME_DIR, ent->d_name);
+            unlink(path);
+        }
     }
+    closedir(dir);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        log_error("Usage: <server_port>");
-        exit(EXIT_FAILURE);
+static void usage(void) {
+    log_error("Usage: <server_port> [--backlog N] [--workers N] [--pin-cpus] [--interactive] "
+              "[--policy FILE] [--rate-per-ip R] [--rate-burst B] [--max-sessions N] "
+              "[--recv-mode splice|copy] [--recv-bench] [--backend epoll|uring] [--store plain|dedup] "
+              "[--durable] [--commit-window-us N] [--commit-batch N] [--commit-sync fdatasync|syncfs] "
+              "[--require-encryption] [--buffer-pool-mb N] [--session-rate BYTES] [--ingest-rate BYTES] "
+              "[--stats-socket PATH] [--handoff-socket PATH] [--take-over] [--drain-timeout SECONDS]");
+}
+
+static int parse_args(int argc, char *argv[], server_config_t *config) {
+    memset(config, 0, sizeof(*config));
+    config->backlog = DEFAULT_BACKLOG;
+    config->workers = 1;
+    config->commit_window_us = COMMIT_DEFAULT_WINDOW_US;
+    config->commit_batch = COMMIT_DEFAULT_BATCH;
+    config->buffer_pool_mb = BUFPOOL_DEFAULT_MB;
+    config->drain_timeout = DEFAULT_DRAIN_TIMEOUT_S;
+
+    if (argc < 2) {
+        usage();
+        return -1;
     }
 
-    int server_port = atoi(argv[1]);
-    if (server_port <= 0 || server_port > 65535) {
+    config->port = atoi(argv[1]);
+    if (config->port <= 0 || config->port > 65535) {
         log_error("Invalid port number. Must be between 1 and 65535.");
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            config->backlog = atoi(argv[++i]);
+            if (config->backlog <= 0) {
+                log_error("Invalid backlog. Must be a positive number.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            config->workers = atoi(argv[++i]);
+            if (config->workers <= 0 || config->workers > MAX_WORKERS) {
+                log_error("Invalid worker count. Must be between 1 and 256.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--pin-cpus") == 0) {
+            config->pin_cpus = 1;
+        } else if (strcmp(argv[i], "--interactive") == 0) {
+            config->interactive = 1;
+        } else if (strcmp(argv[i], "--policy") == 0 && i + 1 < argc) {
+            config->policy_file = argv[++i];
+        } else if (strcmp(argv[i], "--rate-per-ip") == 0 && i + 1 < argc) {
+            config->rate_per_ip = atof(argv[++i]);
+            if (config->rate_per_ip < 0) {
+                log_error("Invalid --rate-per-ip. Must not be negative.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--rate-burst") == 0 && i + 1 < argc) {
+            config->rate_burst = atof(argv[++i]);
+            if (config->rate_burst < 1) {
+                log_error("Invalid --rate-burst. Must be at least 1.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--max-sessions") == 0 && i + 1 < argc) {
+            config->max_sessions = atoi(argv[++i]);
+            if (config->max_sessions < 0) {
+                log_error("Invalid --max-sessions. Must not be negative.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--recv-mode") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "splice") == 0) {
+                config->recv_mode = RECV_MODE_SPLICE;
+            } else if (strcmp(argv[i], "copy") == 0) {
+                config->recv_mode = RECV_MODE_COPY;
+            } else {
+                log_error("Invalid --recv-mode. Use 'splice' or 'copy'.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "epoll") == 0) {
+                config->backend = BACKEND_EPOLL;
+            } else if (strcmp(argv[i], "uring") == 0) {
+                config->backend = BACKEND_URING;
+            } else {
+                log_error("Invalid --backend. Use 'epoll' or 'uring'.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--store") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "plain") == 0) {
+                config->store = STORE_PLAIN;
+            } else if (strcmp(argv[i], "dedup") == 0) {
+                config->store = STORE_DEDUP;
+            } else {
+                log_error("Invalid --store. Use 'plain' or 'dedup'.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--durable") == 0) {
+            config->durable = 1;
+        } else if (strcmp(argv[i], "--commit-window-us") == 0 && i + 1 < argc) {
+            config->commit_window_us = atol(argv[++i]);
+            if (config->commit_window_us < 0) {
+                log_error("Invalid --commit-window-us. Must not be negative.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--commit-batch") == 0 && i + 1 < argc) {
+            config->commit_batch = atoi(argv[++i]);
+            if (config->commit_batch < 1) {
+                log_error("Invalid --commit-batch. Must be at least 1.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--commit-sync") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "fdatasync") == 0) {
+                config->commit_sync = COMMIT_SYNC_FDATASYNC;
+            } else if (strcmp(argv[i], "syncfs") == 0) {
+                config->commit_sync = COMMIT_SYNC_SYNCFS;
+            } else {
+                log_error("Invalid --commit-sync. Use 'fdatasync' or 'syncfs'.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--buffer-pool-mb") == 0 && i + 1 < argc) {
+            config->buffer_pool_mb = atol(argv[++i]);
+            if (config->buffer_pool_mb < 16) {
+                log_error("Invalid --buffer-pool-mb. Must be at least 16.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--session-rate") == 0 && i + 1 < argc) {
+            config->session_rate = atol(argv[++i]);
+            if (config->session_rate <= 0) {
+                log_error("Invalid --session-rate. Must be a positive number of bytes per second.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--ingest-rate") == 0 && i + 1 < argc) {
+            config->ingest_rate = atol(argv[++i]);
+            if (config->ingest_rate <= 0) {
+                log_error("Invalid --ingest-rate. Must be a positive number of bytes per second.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--stats-socket") == 0 && i + 1 < argc) {
+            config->stats_socket = argv[++i];
+        } else if (strcmp(argv[i], "--handoff-socket") == 0 && i + 1 < argc) {
+            config->handoff_socket = argv[++i];
+        } else if (strcmp(argv[i], "--take-over") == 0) {
+            config->take_over = 1;
+        } else if (strcmp(argv[i], "--drain-timeout") == 0 && i + 1 < argc) {
+            config->drain_timeout = atoi(argv[++i]);
+            if (config->drain_timeout < 0) {
+                log_error("Invalid --drain-timeout. Must be a number of seconds, 0 to cut sessions at once.");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--require-encryption") == 0) {
+            config->require_encryption = 1;
+        } else if (strcmp(argv[i], "--recv-bench") == 0) {
+            config->recv_bench = 1;
+        } else {
+            usage();
+            return -1;
         }
+    }
+
+    if (config->take_over && !config->handoff_socket) {
+        log_error("--take-over needs the --handoff-socket of the running server.");
+        return -1;
+    }
+    // The chunk store writes and renames outside the group commit, nothing there is flushed
+    if (config->durable && config->store == STORE_DEDUP) {
+        log_error("--durable does not cover the deduplicating store, use --store plain.");
+        return -1;
+    }
+
+    // Without an explicit burst allow one second worth of connections
+    if (config->rate_burst == 0) {
+        config->rate_burst = config->rate_per_ip > 1 ? config->rate_per_ip : 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    server_config_t config;
+    if (parse_args(argc, argv, &config) == -1) {
+        exit(EXIT_FAILURE);
+    }
 
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    char message_buffer[BUFFER_SIZE]; // Use BUFFER_SIZE for network ops
     char log_buf[SMALL_BUF_SIZE];     // Use SMALL_BUF_SIZE for logs
 
-    snprintf(log_buf, sizeof(log_buf), "Starting server on port %d", server_port);
+    snprintf(log_buf, sizeof(log_buf), "Starting server on port %d", config.port);
     log_info(log_buf);
 
-    signal(SIGINT, handle_sigint);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = handle_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // From here on the loops queue their log lines instead of writing them
+    if (log_start() == -1) {
+        log_error("Failed to start the log flusher, writing log lines directly.");
+    }
+    raise_fd_limit();
 
     // Create UPLOAD_DIR if it doesn't exist
     if (mkdir(UPLOAD_DIR, 0755) == -1 && errno != EEXIST) {
@@ -90,182 +309,78 @@ int main(int argc, char *argv[]) {
         log_error(log_buf);
         exit(EXIT_FAILURE);
     }
+    if (mkdir(RESUME_DIR, 0755) == -1 && errno != EEXIST) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to create partial upload directory %s: %s", RESUME_DIR, strerror(errno));
+        log_error(log_buf);
+        exit(EXIT_FAILURE);
+    }
+    remove_stale_uploads();
     snprintf(log_buf, sizeof(log_buf), "Upload directory set to: %s", UPLOAD_DIR);
     log_info(log_buf);
 
-    server_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket_fd == -1) {
-        log_error("Socket creation failed.");
-        perror("socket");
+    bufpool_init(&config);
+    ingest_init(&config);
+    if (admission_init(&config) == -1 || commit_start(&config) == -1 || digest_start(&config) == -1
+        || batch_start(&config) == -1 || delta_start(&config) == -1) {
         exit(EXIT_FAILURE);
     }
 
-    int optval = 1;
-    if (setsockopt(server_socket_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
-        log_error("setsockopt(SO_REUSEADDR) failed (non-critical).");
-        perror("setsockopt");
+    if (handoff_take(&config) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    // After the takeover: the server being replaced stopped deleting chunks before it
+    // handed the sockets over, the index loaded now stays true
+    if (config.store == STORE_DEDUP && dedup_init() == -1) {
+        exit(EXIT_FAILURE);
     }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(server_port);
-
-    if (bind(server_socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        log_error("Socket binding failed.");
-        perror("bind");
-        close(server_socket_fd);
+    static worker_t workers[MAX_WORKERS];
+    if (workers_start(workers, &config) == -1) {
+        g_shutdown = 1;
+        workers_join(workers, &config);
         exit(EXIT_FAILURE);
     }
-    
-    if (listen(server_socket_fd, MAX_PENDING_CONN) == -1) {
-        log_error("Could not listen on socket.");
-        perror("listen");
-        close(server_socket_fd);
+    if (metrics_start(workers, &config) == -1 || handoff_start(workers, &config) == -1) {
+        g_shutdown = 1;
+        metrics_stop();
+        workers_join(workers, &config);
         exit(EXIT_FAILURE);
     }
 
-    snprintf(log_buf, sizeof(log_buf), "Server listening on port %d. Waiting for connections...", server_port);
+    snprintf(log_buf, sizeof(log_buf), "Server listening on port %d with %d worker(s) (backlog %d). Waiting for connections...", config.port, config.workers, config.backlog);
     log_info(log_buf);
 
-    while (1) {
-        log_info("Waiting for a client connection request...");
-        client_socket_fd_global = accept(server_socket_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-        if (client_socket_fd_global == -1) {
-            if (errno == EINTR) { 
-                log_info("Accept interrupted by signal. Exiting accept loop.");
-                break;
-            }
-            log_error("Failed to accept client connection.");
-            perror("accept");
-            continue;
-        }
-
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
-        int client_port = ntohs(client_addr.sin_port);
-
-        char response_char;
-        fprintf(stdout, "Incoming connection from %s:%d. Accept? (y/n): ", client_ip, client_port);
-        fflush(stdout);
-
-        while (scanf(" %c", &response_char) != 1 || (response_char != 'y' && response_char != 'Y' && response_char != 'n' && response_char != 'N')) {
-            fprintf(stdout, "Invalid input. Please enter 'y' or 'n': ");
-            fflush(stdout);
-            while (getchar() != '\n');
-        }
-        while (getchar() != '\n'); 
-
-        if (response_char == 'y' || response_char == 'Y') {
-            snprintf(log_buf, sizeof(log_buf), "Accepted connection from %s:%d. Starting session.", client_ip, client_port);
-            log_info(log_buf);
-            send_response(client_socket_fd_global, "Connection accepted. You can send messages now (or 'upload <file>').");
-
-            while (1) {
-                memset(message_buffer, 0, BUFFER_SIZE);
-                ssize_t bytes_received = recv(client_socket_fd_global, message_buffer, BUFFER_SIZE - 1, 0); // Using recv
-
-                if (bytes_received == -1) {
-                    if (errno == EINTR) {
-                        log_info("Read from client interrupted by signal. Ending session.");
-                    } else {
-                        log_error("Failed to read from client socket during session.");
-                        perror("read");
-                    }
-                    break;
-                }else if (bytes_received == 0) {
-                    log_info("Client disconnected.");
-                    break;
-                } else {
-                    message_buffer[bytes_received] = '\0';
-                    
-                    // --- Command Parsing: Check for UPLOAD command ---
-                    if (strncmp(message_buffer, "UPLOAD ", 7) == 0) {
-                        char filename[256];
-                        long filesize;
-                        char *ptr = message_buffer + 7; // Skip "UPLOAD "
-
-                        // Parse filename and filesize
-                        if (sscanf(ptr, "%255s %ld", filename, &filesize) == 2) {
-                            snprintf(log_buf, sizeof(log_buf), "Client requested UPLOAD: file '%s', size %ld bytes.", filename, filesize);
-                            log_info(log_buf);
-
-                            char full_path[PATH_MAX];
-                            snprintf(full_path, sizeof(full_path), "%s/%s", UPLOAD_DIR, filename);
-
-                            // Open file for writing
-                            int file_fd = open(full_path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-                            if (file_fd == -1) {
-                                snprintf(log_buf, sizeof(log_buf), "Failed to open file '%s' for writing: %s", full_path, strerror(errno));
-                                log_error(log_buf);
-                                send_response(client_socket_fd_global, "ERROR: Could not create file on server.");
-                            } else {
-                                send_response(client_socket_fd_global, "READY_FOR_FILE"); // Tell client to start sending file data
-                                
-                                long total_received = 0;
-                                ssize_t segment_bytes;
-                                // Loop to receive file data
-                                while (total_received < filesize) {
-                                    size_t to_read = (filesize - total_received > BUFFER_SIZE) ? BUFFER_SIZE : (filesize - total_received);
-                                    
-                                    segment_bytes = recv(client_socket_fd_global, message_buffer, to_read, 0);
-                                    if (segment_bytes == -1) {
-                                        log_error("Error receiving file data from client.");
-                                        perror("recv");
-                                        break;
-                                    }
-                                    if (segment_bytes == 0) {
-                                        log_info("Client disconnected during file transfer.");
-                                        break;
-                                    }
-
-                                    if (write(file_fd, message_buffer, segment_bytes) == -1) {
-                                        log_error("Error writing file data to disk.");
-                                        perror("write");
-                                        break;
-                                    }
-                                    total_received += segment_bytes;
-                                }
-                                close(file_fd);
-
-                                if (total_received == filesize) {
-                                    snprintf(log_buf, sizeof(log_buf), "File '%s' (%ld bytes) successfully received and saved to '%s'.", filename, filesize, full_path);
-                                    log_info(log_buf);
-                                    send_response(client_socket_fd_global, "UPLOAD_SUCCESS");
-                                } else {
-                                    snprintf(log_buf, sizeof(log_buf), "Incomplete file transfer for '%s'. Expected %ld, received %ld.", filename, filesize, total_received);
-                                    log_error(log_buf);
-                                    send_response(client_socket_fd_global, "UPLOAD_FAILED: Incomplete transfer.");
-                                    remove(full_path); // Clean up incomplete file
-                                }
-                            }
-                        } else {
-                            log_error("Invalid UPLOAD command format received.");
-                            send_response(client_socket_fd_global, "ERROR: Invalid UPLOAD command format.");
-                        }
-                    } else { // It's a regular message
-                        snprintf(log_buf, sizeof(log_buf), "Received from %s:%d: \"%s\"", client_ip, client_port, message_buffer);
-                        log_info(log_buf);
-                        send_response(client_socket_fd_global, "MESSAGE_RECEIVED"); // Acknowledge regular message
-                    }
-                }
-            } // End of client session loop
-
-            log_info("Client session ended. Closing client socket.");
-            close(client_socket_fd_global);
-            client_socket_fd_global = -1;
-        } else {
-            snprintf(log_buf, sizeof(log_buf), "Connection from %s:%d rejected.", client_ip, client_port);
+    // The workers do all the I/O, this thread only waits for signals
+    struct timespec tick = { .tv_sec = 0, .tv_nsec = REACTOR_TICK_MS * 1000000L };
+    int draining = 0;
+    while (!g_shutdown && !workers_finished(workers, &config)) {
+        nanosleep(&tick, NULL);
+        if (atomic_load(&g_drain) && !draining) {
+            draining = 1;
+            snprintf(log_buf, sizeof(log_buf), "Letting sessions finish for up to %d s (SIGINT again to close them now)...", config.drain_timeout);
             log_info(log_buf);
-            send_response(client_socket_fd_global, "Connection rejected by server.");
-            close(client_socket_fd_global);
-            client_socket_fd_global = -1;
         }
-    } // End of main server loop
+        if (g_dump_stats) {
+            g_dump_stats = 0;
+            workers_log_stats(workers, &config);
+            commit_log_stats();
+            bufpool_log_stats();
+        }
+    }
 
+    log_info("Received shutdown request. Closing sessions...");
+    handoff_stop();
+    metrics_stop();   // reads the workers' counters, gone before them
+    workers_join(workers, &config);
+    digest_stop();
+    batch_stop();
+    delta_stop();
+    commit_stop();   // uploads already queued are still made durable
+    workers_log_stats(workers, &config);
+    commit_log_stats();
+    bufpool_log_stats();
+    bufpool_destroy();
+    admission_destroy();
     log_info("Server shutdown complete.");
-    if (server_socket_fd != -1) {
-        close(server_socket_fd);
-    }
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,475 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>    // For file operations
+#include <limits.h>
+
+#include "include/server.h"
+#include "include/session.h"
+#include "include/reactor.h"
+#include "include/resume.h"
+#include "include/stripe.h"
+#include "include/download.h"
+#include "include/dedup.h"
+#include "include/commit.h"
+#include "include/secure.h"
+#include "include/digest.h"
+#include "include/batch.h"
+#include "include/delta.h"
+#include "include/metrics.h"
+
+void session_open(conn_t *conn) {
+    static const char greeting[] = "Connection accepted. You can send messages now (or 'upload <file>', 'dedup <file>', 'download <file>').";
+    char log_buf[SMALL_BUF_SIZE];
+    snprintf(log_buf, sizeof(log_buf), "Accepted connection from %s:%d. Starting session.", conn->peer_ip, conn->peer_port);
+    log_info(log_buf);
+    conn_send_frame(conn, PROTO_OP_HELLO, 0, greeting, sizeof(greeting) - 1);
+}
+
+void session_reply(conn_t *conn, uint32_t stream_id, proto_status_t status, const char *text) {
+    uint8_t payload[PROTO_STATUS_META_SIZE + SMALL_BUF_SIZE];
+    size_t text_len = strlen(text);
+    if (text_len > SMALL_BUF_SIZE) text_len = SMALL_BUF_SIZE;
+
+    proto_put_u16(payload, (uint16_t)status);
+    memcpy(payload + PROTO_STATUS_META_SIZE, text, text_len);
+    conn_send_frame(conn, PROTO_OP_STATUS, stream_id, payload, PROTO_STATUS_META_SIZE + text_len);
+}
+
+// The byte stream can no longer be trusted: report it and close once the reply is out
+static void session_protocol_error(conn_t *conn, uint32_t stream_id, proto_status_t status, const char *text) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    snprintf(log_buf, sizeof(log_buf), "Protocol error from %s:%d: %s", conn->peer_ip, conn->peer_port, text);
+    log_error(log_buf);
+    session_reply(conn, stream_id, status, text);
+    conn->state = CONN_STATE_CLOSING;
+}
+
+// Create the file an upload is written to: an anonymous O_TMPFILE inside UPLOAD_DIR, or
+// a named temp file where the filesystem lacks it. Readers never see it before it is
+// complete. The blocks for the whole announced size are reserved up front. Readable,
+// the digest threads hash the content back from it.
+static int session_open_upload_file(conn_t *conn) {
+    conn->tmp_path[0] = '\0';
+    conn->file_fd = open(UPLOAD_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+    if (conn->file_fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+        commit_tmp_name(conn->tmp_path, sizeof(conn->tmp_path));
+        conn->file_fd = open(conn->tmp_path, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+    }
+    if (conn->file_fd == -1) {
+        return -1;
+    }
+    if ((conn->filesize > 0 && fallocate(conn->file_fd, 0, 0, (off_t)conn->filesize) == -1
+         && errno != EOPNOTSUPP && errno != ENOSYS) || digest_begin(conn) == -1) {
+        int saved = errno;
+        session_discard_file(conn);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+// Switch the session to file receive for an UPLOAD frame. If the file cannot be
+// created the client is told right away and the content is skipped.
+static void session_begin_upload(conn_t *conn, uint32_t stream_id, const char *name, size_t name_len, long filesize) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE * 2];
+
+    snprintf(conn->filename, sizeof(conn->filename), "%.*s", (int)name_len, name);
+    snprintf(conn->full_path, sizeof(conn->full_path), "%s/%s", UPLOAD_DIR, conn->filename);
+    conn->stream_id = stream_id;
+    conn->filesize = filesize;
+    conn->received = 0;
+    conn->file_base = 0;
+    conn->flushed = 0;
+    conn->recv_path = RECV_PATH_NONE;
+    conn->upload_start_ns = metrics_now_ns();
+
+    snprintf(log_buf, sizeof(log_buf), "Client requested UPLOAD: file '%s', size %ld bytes.", conn->filename, filesize);
+    log_info(log_buf);
+
+    // Only plain names, uploads stay inside UPLOAD_DIR
+    if (memchr(name, '/', name_len) || memchr(name, '\0', name_len)) {
+        log_error("Invalid UPLOAD file name received.");
+        session_reply(conn, stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid UPLOAD file name.");
+        conn->file_fd = -1;
+    } else {
+        // Written aside and moved into place once complete
+        if (session_open_upload_file(conn) == -1) {
+            snprintf(log_buf, sizeof(log_buf), "Failed to create file for '%s': %s", conn->full_path, strerror(errno));
+            log_error(log_buf);
+            session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, "ERROR: Could not create file on server.");
+        }
+    }
+
+    conn->state = CONN_STATE_RECV_FILE;
+    // An empty file is complete as soon as it is announced
+    if (filesize == 0) {
+        session_on_file_data(conn, NULL, 0);
+    }
+}
+
+static void session_on_message(conn_t *conn, uint32_t stream_id, const char *message, size_t len, int acked) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    snprintf(log_buf, sizeof(log_buf), "Received from %s:%d: \"%.*s\"", conn->peer_ip, conn->peer_port, (int)(len > 200 ? 200 : len), message);
+    log_info(log_buf);
+    if (acked) {
+        conn->text_ack = stream_id;   // covered by the ACK sent before the next other frame
+    } else {
+        session_reply(conn, stream_id, PROTO_STATUS_OK, "MESSAGE_RECEIVED"); // Acknowledge regular message
+    }
+}
+
+// One cumulative ACK for the TEXTs taken since the last one
+static void session_send_ack(conn_t *conn) {
+    if (conn->text_ack) {
+        conn_send_frame(conn, PROTO_OP_ACK, conn->text_ack, NULL, 0);
+        conn->text_ack = 0;
+    }
+}
+
+// Handle the frame at the start of data; returns the bytes it consumed, 0 if more input is needed
+static size_t session_on_frame(conn_t *conn, const uint8_t *data, size_t avail) {
+    proto_header_t header;
+
+    if (proto_header_decode(data, &header) == -1) {
+        session_protocol_error(conn, 0, PROTO_STATUS_BAD_REQUEST, "ERROR: Not a MeshExchange frame.");
+        return 0;
+    }
+    // Out before anything else is handled: a download or an upload answer may start a
+    // body that no frame can be put into
+    if (header.opcode != PROTO_OP_TEXT) {
+        session_send_ack(conn);
+    }
+    if (header.version != PROTO_VERSION) {
+        session_protocol_error(conn, header.stream_id, PROTO_STATUS_BAD_VERSION, "ERROR: Unsupported protocol version.");
+        return 0;
+    }
+    if (!conn->sec && header.opcode != PROTO_OP_KEY && conn->reactor->config->require_encryption) {
+        session_protocol_error(conn, header.stream_id, PROTO_STATUS_ENCRYPTION_REQUIRED, "ERROR: This server only accepts encrypted sessions.");
+        return 0;
+    }
+
+    if (header.opcode == PROTO_OP_UPLOAD || header.opcode == PROTO_OP_STRIPE || header.opcode == PROTO_OP_MANIFEST) {
+        // Only the meta and name are buffered, the content is streamed into the file
+        size_t meta_size = header.opcode == PROTO_OP_UPLOAD ? PROTO_UPLOAD_META_SIZE
+                         : header.opcode == PROTO_OP_STRIPE ? PROTO_STRIPE_META_SIZE : PROTO_MANIFEST_META_SIZE;
+        if (header.length < meta_size) {
+            session_protocol_error(conn, header.stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid UPLOAD frame.");
+            return 0;
+        }
+        if (avail < PROTO_HEADER_SIZE + meta_size) {
+            return 0;
+        }
+        const uint8_t *meta = data + PROTO_HEADER_SIZE;
+        uint64_t filesize, content_len, stripe_size = 0;
+        uint32_t stripe_index = 0;
+        size_t name_len;
+        if (header.opcode == PROTO_OP_UPLOAD) {
+            filesize = content_len = proto_get_u64(meta);
+            name_len = proto_get_u16(meta + 8);
+        } else if (header.opcode == PROTO_OP_MANIFEST) {
+            filesize = proto_get_u64(meta);
+            content_len = (uint64_t)proto_get_u32(meta + 8) * PROTO_MANIFEST_ENTRY_SIZE;
+            name_len = proto_get_u16(meta + 12);
+        } else {
+            filesize = proto_get_u64(meta + 8);
+            stripe_size = proto_get_u64(meta + 16);
+            stripe_index = proto_get_u32(meta + 24);
+            name_len = proto_get_u16(meta + 28);
+            if (stripe_size == 0 || filesize == 0 || (filesize - 1) / stripe_size >= PROTO_MAX_STRIPES
+                || (uint64_t)stripe_index * stripe_size >= filesize) {
+                session_protocol_error(conn, header.stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid STRIPE frame.");
+                return 0;
+            }
+            content_len = filesize - (uint64_t)stripe_index * stripe_size;
+            if (content_len > stripe_size) content_len = stripe_size;
+        }
+        // An UPLOAD may close with the SHA-256 of its content
+        int trailer = header.opcode == PROTO_OP_UPLOAD && header.length == meta_size + name_len + content_len + PROTO_HASH_SIZE;
+        if (name_len == 0 || name_len > PROTO_MAX_NAME || filesize > (uint64_t)LONG_MAX
+            || (header.length != meta_size + name_len + content_len && !trailer)) {
+            session_protocol_error(conn, header.stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Invalid UPLOAD frame.");
+            return 0;
+        }
+        size_t head = PROTO_HEADER_SIZE + meta_size + name_len;
+        if (avail < head) {
+            return 0;
+        }
+
+        const char *name = (const char *)meta + meta_size;
+        conn->digest_trailer = trailer;   // before an empty file completes in *_begin()
+        if (header.opcode == PROTO_OP_MANIFEST || (header.opcode == PROTO_OP_UPLOAD && dedup_enabled())) {
+            dedup_upload_begin(conn, header.stream_id, header.opcode, name, name_len, filesize, content_len);
+        } else if (header.opcode == PROTO_OP_UPLOAD) {
+            session_begin_upload(conn, header.stream_id, name, name_len, (long)filesize);
+        } else if (memchr(name, '/', name_len) || memchr(name, '\0', name_len)) {
+            session_begin_upload(conn, header.stream_id, name, name_len, (long)content_len); // refused, content skipped
+        } else {
+            stripe_begin(conn, header.stream_id, proto_get_u64(meta), filesize, stripe_size, stripe_index, name, name_len);
+        }
+
+        // Content that arrived together with the head
+        size_t take = avail - head;
+        if (take > content_len) take = (size_t)content_len;
+        if (take > 0 && conn->state == CONN_STATE_RECV_FILE) {
+            session_on_file_data(conn, (const char *)data + head, take);
+        }
+        return head + take;
+    }
+
+    // Everything else is buffered whole, batches of small files are the largest
+    uint64_t max_length = header.opcode == PROTO_OP_CHUNK ? PROTO_CHUNK_META_SIZE + PROTO_MAX_CHUNK
+                        : header.opcode == PROTO_OP_BLOB ? PROTO_HASH_SIZE + PROTO_MAX_BLOB
+                        : header.opcode == PROTO_OP_BATCH ? PROTO_MAX_BATCH
+                        : header.opcode == PROTO_OP_DELTA ? PROTO_MAX_DELTA : PROTO_MAX_CONTROL;
+    if (header.length > max_length) {
+        session_protocol_error(conn, header.stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Frame too large.");
+        return 0;
+    }
+    if (avail < PROTO_HEADER_SIZE + header.length) {
+        return 0;
+    }
+
+    const char *payload = (const char *)data + PROTO_HEADER_SIZE;
+    switch (header.opcode) {
+        case PROTO_OP_MESSAGE:
+        case PROTO_OP_TEXT:
+            session_on_message(conn, header.stream_id, payload, (size_t)header.length, header.opcode == PROTO_OP_TEXT);
+            break;
+        case PROTO_OP_RESUME:
+            resume_on_request(conn, header.stream_id, (const uint8_t *)payload, (size_t)header.length);
+            break;
+        case PROTO_OP_CHUNK:
+            resume_on_chunk(conn, header.stream_id, (const uint8_t *)payload, (size_t)header.length);
+            break;
+        case PROTO_OP_DOWNLOAD:
+            download_on_request(conn, header.stream_id, (const uint8_t *)payload, (size_t)header.length);
+            break;
+        case PROTO_OP_HAVE:
+            dedup_on_have(conn, header.stream_id, (const uint8_t *)payload, (size_t)header.length);
+            break;
+        case PROTO_OP_BLOB:
+            dedup_on_blob(conn, header.stream_id, (const uint8_t *)payload, (size_t)header.length);
+            break;
+        case PROTO_OP_BATCH:
+            batch_on_request(conn, header.stream_id, (const uint8_t *)payload, (size_t)header.length);
+            break;
+        case PROTO_OP_SIGNATURE:
+            delta_on_signature(conn, header.stream_id, (const uint8_t *)payload, (size_t)header.length);
+            break;
+        case PROTO_OP_DELTA:
+            delta_on_frame(conn, header.stream_id, (const uint8_t *)payload, (size_t)header.length);
+            break;
+        case PROTO_OP_KEY:
+            // The client seals what follows only once it has SERVER_KEY, nothing may be queued behind KEY
+            if (avail != PROTO_HEADER_SIZE + header.length) {
+                session_protocol_error(conn, header.stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Request sent before the key exchange completed.");
+                return 0;
+            }
+            secure_on_key(conn, header.stream_id, (const uint8_t *)payload, (size_t)header.length);
+            break;
+        default:
+            session_protocol_error(conn, header.stream_id, PROTO_STATUS_BAD_REQUEST, "ERROR: Unknown request.");
+            return 0;
+    }
+    return PROTO_HEADER_SIZE + (size_t)header.length;
+}
+
+void session_on_input(conn_t *conn) {
+    size_t off = 0;
+
+    // Pipelined requests are run back to back; an upload whose content is still
+    // on the wire stops the loop until it has been received, a download until it is sent
+    while (conn->state == CONN_STATE_COMMAND) {
+        if (conn->digest_trailer) {
+            // The SHA-256 closing the UPLOAD whose content just ended
+            if (conn->in_len - off < PROTO_HASH_SIZE) break;
+            conn->digest_trailer = 0;
+            session_upload_done(conn, (const uint8_t *)conn->in_buf + off);
+            off += PROTO_HASH_SIZE;
+            continue;
+        }
+        if (conn->in_len - off < PROTO_HEADER_SIZE) break;
+        size_t used = session_on_frame(conn, (const uint8_t *)conn->in_buf + off, conn->in_len - off);
+        if (used == 0) break;
+        off += used;
+    }
+    // The TEXTs at the end of this input; only they can still be unacknowledged here
+    if (conn->state == CONN_STATE_COMMAND) {
+        session_send_ack(conn);
+    }
+
+    if (conn->state == CONN_STATE_CLOSING) {
+        conn->in_len = 0;
+    } else if (off > 0) {
+        memmove(conn->in_buf, conn->in_buf + off, conn->in_len - off);
+        conn->in_len -= off;
+    }
+    conn_in_release(conn);
+}
+
+size_t session_file_remaining(const conn_t *conn) {
+    return (size_t)(conn->filesize - conn->received);
+}
+
+void session_discard_file(conn_t *conn) {
+    digest_cancel(conn);
+    if (conn->file_fd != -1) {
+        close(conn->file_fd);   // an O_TMPFILE vanishes with its last descriptor
+        conn->file_fd = -1;
+    }
+    if (conn->tmp_path[0]) {
+        unlink(conn->tmp_path);
+        conn->tmp_path[0] = '\0';
+    }
+}
+
+// Start writeback of every full WRITEBEHIND_CHUNK received and wait for the one before it,
+// so an upload never leaves more than two windows of dirty pages behind
+static void session_write_behind(conn_t *conn) {
+    while (conn->received - conn->flushed >= WRITEBEHIND_CHUNK) {
+        off_t start = (off_t)(conn->file_base + conn->flushed);
+        sync_file_range(conn->file_fd, start, WRITEBEHIND_CHUNK, SYNC_FILE_RANGE_WRITE);
+        if (conn->flushed >= WRITEBEHIND_CHUNK) {
+            sync_file_range(conn->file_fd, start - WRITEBEHIND_CHUNK, WRITEBEHIND_CHUNK,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        }
+        conn->flushed += WRITEBEHIND_CHUNK;
+    }
+}
+
+void session_file_failed(conn_t *conn, const char *reason) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE * 2];
+    snprintf(log_buf, sizeof(log_buf), "Error writing file data to disk for '%s': %s", conn->filename, reason);
+    log_error(log_buf);
+    if (conn->stripe) {
+        stripe_release(conn);
+    } else if (conn->dedup) {
+        dedup_upload_abort(conn);
+    } else {
+        session_discard_file(conn); // Clean up incomplete file
+    }
+    STAT_ADD(conn->reactor, uploads_failed, 1);
+    // The rest of the content is still on the wire, the stream cannot be resynchronised cheaply
+    session_reply(conn, conn->stream_id, PROTO_STATUS_IO_ERROR, "UPLOAD_FAILED: Could not write file.");
+    conn->state = CONN_STATE_CLOSING;
+}
+
+void session_file_advance(conn_t *conn, size_t len) {
+    conn->received += (long)len;
+    if (conn->file_fd != -1) {
+        session_write_behind(conn);
+    }
+    if (conn->digest) {
+        digest_feed(conn);
+    }
+    if (conn->received < conn->filesize) {
+        return;
+    }
+
+    conn->state = CONN_STATE_COMMAND;
+    if (!conn->digest_trailer) {
+        session_upload_done(conn, NULL);
+    }
+    // else session_on_input() reads the digest first
+}
+
+void session_upload_done(conn_t *conn, const uint8_t *expected) {
+    if (conn->stripe) {
+        stripe_file_done(conn);
+        return;
+    }
+    if (conn->dedup) {
+        dedup_upload_done(conn, expected);
+        return;
+    }
+    if (conn->file_fd == -1) {
+        STAT_ADD(conn->reactor, uploads_failed, 1); // refused upload, already answered
+        return;
+    }
+    // Stored once the digest threads have caught up with the file
+    digest_finish(conn, expected);
+}
+
+void session_upload_store(conn_t *conn) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE * 2];
+
+    if (conn->reactor->config->durable) {
+        // Answered by the commit thread's batch
+        commit_submit(conn, conn->stream_id, conn->file_fd, conn->tmp_path, conn->full_path, conn->filename,
+                      (uint64_t)conn->filesize, conn->upload_start_ns);
+        conn->file_fd = -1;
+        conn->tmp_path[0] = '\0';
+        return;
+    }
+    if (commit_link(conn->file_fd, conn->tmp_path, sizeof(conn->tmp_path), conn->full_path) == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to move upload into '%s': %s", conn->full_path, strerror(errno));
+        log_error(log_buf);
+        session_discard_file(conn);
+        STAT_ADD(conn->reactor, uploads_failed, 1);
+        session_reply(conn, conn->stream_id, PROTO_STATUS_IO_ERROR, "UPLOAD_FAILED: Could not write file.");
+        return;
+    }
+    close(conn->file_fd);
+    conn->file_fd = -1;
+    metrics_upload_ok(conn->reactor, (uint64_t)conn->filesize, conn->upload_start_ns);
+
+    snprintf(log_buf, sizeof(log_buf), "File '%s' (%ld bytes) successfully received and saved to '%s'.", conn->filename, conn->filesize, conn->full_path);
+    log_info(log_buf);
+    session_reply(conn, conn->stream_id, PROTO_STATUS_OK, "UPLOAD_SUCCESS");
+}
+
+int session_on_file_data(conn_t *conn, const char *data, size_t len) {
+    size_t total = len;
+
+    if (conn->dedup && dedup_upload_data(conn, data, len) == -1) {
+        session_file_failed(conn, strerror(errno));
+        return -1;
+    }
+    while (conn->file_fd != -1 && len > 0) {
+        ssize_t written = write(conn->file_fd, data, len);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            session_file_failed(conn, strerror(errno));
+            return -1;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+
+    session_file_advance(conn, total);
+    return 0;
+}
+
+void session_close(conn_t *conn) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE * 2];
+
+    resume_close(conn);
+    download_close(conn);
+    commit_cancel(conn);
+    digest_cancel(conn);
+    batch_cancel(conn);
+    delta_close(conn);
+    secure_close(conn);
+
+    if (conn->stripe) {
+        stripe_release(conn);
+        STAT_ADD(conn->reactor, uploads_failed, 1);
+    } else if (conn->dedup) {
+        snprintf(log_buf, sizeof(log_buf), "Incomplete file transfer for '%s'. Expected %ld, received %ld.", conn->filename, conn->filesize, conn->received);
+        log_error(log_buf);
+        dedup_upload_abort(conn);
+        STAT_ADD(conn->reactor, uploads_failed, 1);
+    } else if (conn->file_fd != -1) {
+        snprintf(log_buf, sizeof(log_buf), "Incomplete file transfer for '%s'. Expected %ld, received %ld.", conn->filename, conn->filesize, conn->received);
+        log_error(log_buf);
+        session_discard_file(conn); // Clean up incomplete file
+        STAT_ADD(conn->reactor, uploads_failed, 1);
+    }
+
+    snprintf(log_buf, sizeof(log_buf), "Client session with %s:%d ended. Closing client socket.", conn->peer_ip, conn->peer_port);
+    log_info(log_buf);
+}
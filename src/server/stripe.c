@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "include/stripe.h"
+#include "include/session.h"
+#include "include/reactor.h"
+#include "include/resume.h"
+#include "include/dedup.h"
+#include "include/commit.h"
+#include "include/metrics.h"
+
+struct stripe_upload {
+    uint64_t id;
+    char name[PROTO_MAX_NAME + 1];
+    uint64_t size;
+    uint64_t stripe_size;
+    uint32_t stripe_count;
+    uint32_t stripes_done;
+    uint8_t *done;           // one bit per stripe received completely
+    int refs;                // connections currently receiving a stripe
+    int failed;
+    uint64_t start_ns;       // first stripe began
+    uint64_t last_ns;        // last stripe began or ended, for the idle sweep
+    char tmp_path[PATH_MAX];
+    struct stripe_upload *next;
+};
+
+// Shared by every worker; held only around bookkeeping, never around I/O
+static pthread_mutex_t g_stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+static stripe_upload_t *g_stripes = NULL;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static double mib_per_sec(uint64_t bytes, uint64_t ns) {
+    return ns ? (double)bytes / (1024.0 * 1024.0) / ((double)ns / 1e9) : 0.0;
+}
+
+// Caller holds g_stripe_lock
+static void unlink_upload(stripe_upload_t *upload) {
+    for (stripe_upload_t **link = &g_stripes; *link; link = &(*link)->next) {
+        if (*link == upload) {
+            *link = upload->next;
+            break;
+        }
+    }
+}
+
+static void free_upload(stripe_upload_t *upload) {
+    free(upload->done);
+    free(upload);
+}
+
+// Drop uploads whose client went away between stripes. Caller holds g_stripe_lock.
+static void sweep_idle(uint64_t now) {
+    stripe_upload_t **link = &g_stripes;
+    while (*link) {
+        stripe_upload_t *upload = *link;
+        if (upload->refs == 0 && now - upload->last_ns > (uint64_t)STRIPE_IDLE_SEC * 1000000000ULL) {
+            *link = upload->next;
+            unlink(upload->tmp_path);
+            free_upload(upload);
+        } else {
+            link = &upload->next;
+        }
+    }
+}
+
+// Create the shared file at its final size so stripes can land anywhere in it.
+// Caller holds g_stripe_lock.
+static stripe_upload_t *create_upload(uint64_t id, uint64_t size, uint64_t stripe_size, const char *name, size_t name_len) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE];
+
+    stripe_upload_t *upload = calloc(1, sizeof(*upload));
+    if (!upload) {
+        return NULL;
+    }
+    upload->id = id;
+    upload->size = size;
+    upload->stripe_size = stripe_size;
+    upload->stripe_count = (uint32_t)((size + stripe_size - 1) / stripe_size);
+    memcpy(upload->name, name, name_len);
+    upload->done = calloc(upload->stripe_count / 8 + 1, 1);
+    snprintf(upload->tmp_path, sizeof(upload->tmp_path), "%s/%016llx.stripes", RESUME_DIR, (unsigned long long)id);
+
+    int fd = upload->done ? open(upload->tmp_path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644) : -1;
+    if (fd == -1) {
+        free_upload(upload);
+        return NULL;
+    }
+    // Reserve the blocks up front: stripes written out of order do not fragment the file
+    int rc = fallocate(fd, 0, 0, (off_t)size);
+    if (rc == -1 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+        rc = ftruncate(fd, (off_t)size);
+    }
+    close(fd);
+    if (rc == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to preallocate '%s': %s", upload->tmp_path, strerror(errno));
+        log_error(log_buf);
+        unlink(upload->tmp_path);
+        free_upload(upload);
+        return NULL;
+    }
+
+    upload->start_ns = monotonic_ns();
+    upload->next = g_stripes;
+    g_stripes = upload;
+
+    snprintf(log_buf, sizeof(log_buf), "Striped upload %016llx: file '%s', %llu bytes in %u stripe(s) of %llu bytes.",
+             (unsigned long long)id, upload->name, (unsigned long long)size, upload->stripe_count, (unsigned long long)stripe_size);
+    log_info(log_buf);
+    return upload;
+}
+
+// Find or create the upload a stripe belongs to and take a reference; NULL with *reason set if refused
+static stripe_upload_t *acquire_upload(uint64_t id, uint64_t size, uint64_t stripe_size, uint32_t index,
+                                       const char *name, size_t name_len, const char **reason) {
+    uint64_t now = monotonic_ns();
+    stripe_upload_t *upload;
+
+    pthread_mutex_lock(&g_stripe_lock);
+    sweep_idle(now);
+
+    for (upload = g_stripes; upload && upload->id != id; upload = upload->next);
+    if (!upload) {
+        upload = create_upload(id, size, stripe_size, name, name_len);
+        if (!upload) *reason = "ERROR: Could not create file on server.";
+    } else if (upload->size != size || upload->stripe_size != stripe_size
+               || strlen(upload->name) != name_len || memcmp(upload->name, name, name_len) != 0) {
+        *reason = "ERROR: Stripe does not match the upload it names.";
+        upload = NULL;
+    } else if (upload->failed) {
+        *reason = "UPLOAD_FAILED: Another stripe of this upload failed.";
+        upload = NULL;
+    }
+    if (upload && (index >= upload->stripe_count || (upload->done[index / 8] >> (index % 8)) & 1)) {
+        *reason = "ERROR: Stripe index out of range or already received.";
+        upload = NULL;
+    }
+    if (upload) {
+        upload->refs++;
+        upload->last_ns = now;
+    }
+
+    pthread_mutex_unlock(&g_stripe_lock);
+    return upload;
+}
+
+void stripe_begin(conn_t *conn, uint32_t stream_id, uint64_t upload_id, uint64_t file_size,
+                  uint64_t stripe_size, uint32_t stripe_index, const char *name, size_t name_len) {
+    char log_buf[PATH_MAX + SMALL_BUF_SIZE];
+    const char *reason = NULL;
+
+    uint64_t offset = (uint64_t)stripe_index * stripe_size;
+    uint64_t len = file_size - offset; // validated by the caller: offset < file_size
+    if (len > stripe_size) len = stripe_size;
+
+    snprintf(conn->filename, sizeof(conn->filename), "%.*s", (int)name_len, name);
+    conn->stream_id = stream_id;
+    conn->filesize = (long)len;
+    conn->received = 0;
+    conn->flushed = 0;
+    conn->recv_path = RECV_PATH_NONE;
+    conn->file_fd = -1;
+    conn->file_base = (long)offset;
+    conn->state = CONN_STATE_RECV_FILE;
+
+    stripe_upload_t *upload = acquire_upload(upload_id, file_size, stripe_size, stripe_index, name, name_len, &reason);
+    if (upload) {
+        conn->stripe = upload;
+        conn->stripe_index = stripe_index;
+        conn->stripe_start_ns = monotonic_ns();
+        snprintf(conn->full_path, sizeof(conn->full_path), "%s", upload->tmp_path);
+
+        // Each stripe has its own descriptor, positioned at the stripe, so the
+        // copy, splice and io_uring paths all write it like a plain upload
+        conn->file_fd = open(upload->tmp_path, O_WRONLY | O_CLOEXEC);
+        if (conn->file_fd == -1 || lseek(conn->file_fd, (off_t)offset, SEEK_SET) == -1) {
+            snprintf(log_buf, sizeof(log_buf), "Failed to open '%s' for stripe %u: %s", upload->tmp_path, stripe_index, strerror(errno));
+            log_error(log_buf);
+            stripe_release(conn);
+            reason = "ERROR: Could not create file on server.";
+        }
+    }
+    if (reason) {
+        session_reply(conn, stream_id, PROTO_STATUS_IO_ERROR, reason);
+    }
+}
+
+// Drop conn's reference; caller holds g_stripe_lock. Returns the upload if conn was the last one of a failed upload.
+static stripe_upload_t *put_upload(conn_t *conn) {
+    stripe_upload_t *upload = conn->stripe;
+    conn->stripe = NULL;
+    upload->refs--;
+    upload->last_ns = monotonic_ns();
+    if (upload->failed && upload->refs == 0) {
+        unlink_upload(upload);
+        return upload;
+    }
+    return NULL;
+}
+
+void stripe_release(conn_t *conn) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    stripe_upload_t *upload = conn->stripe;
+
+    if (conn->file_fd != -1) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    snprintf(log_buf, sizeof(log_buf), "Striped upload %016llx: stripe %u failed after %ld of %ld bytes, the upload is abandoned.",
+             (unsigned long long)upload->id, conn->stripe_index, conn->received, conn->filesize);
+    log_error(log_buf);
+
+    pthread_mutex_lock(&g_stripe_lock);
+    upload->failed = 1;
+    stripe_upload_t *dead = put_upload(conn);
+    pthread_mutex_unlock(&g_stripe_lock);
+
+    if (dead) {
+        unlink(dead->tmp_path);
+        free_upload(dead);
+    }
+}
+
+void stripe_file_done(conn_t *conn) {
+    char log_buf[PATH_MAX * 2 + SMALL_BUF_SIZE];
+    char final_path[PATH_MAX];
+    char reply[SMALL_BUF_SIZE];
+    stripe_upload_t *upload = conn->stripe;
+    uint64_t now = monotonic_ns();
+
+    close(conn->file_fd);
+    conn->file_fd = -1;
+
+    double stripe_rate = mib_per_sec((uint64_t)conn->filesize, now - conn->stripe_start_ns);
+    snprintf(log_buf, sizeof(log_buf), "Striped upload %016llx: stripe %u/%u (%ld bytes) from %s:%d in %.1f ms, %.1f MiB/s.",
+             (unsigned long long)upload->id, conn->stripe_index + 1, upload->stripe_count, conn->filesize,
+             conn->peer_ip, conn->peer_port, (double)(now - conn->stripe_start_ns) / 1e6, stripe_rate);
+    log_info(log_buf);
+
+    pthread_mutex_lock(&g_stripe_lock);
+    int complete = 0;
+    if (!upload->failed) {
+        upload->done[conn->stripe_index / 8] |= (uint8_t)(1u << (conn->stripe_index % 8));
+        upload->stripes_done++;
+        complete = upload->stripes_done == upload->stripe_count;
+        if (complete) unlink_upload(upload);
+    }
+    int failed = upload->failed;
+    stripe_upload_t *dead = put_upload(conn);
+    pthread_mutex_unlock(&g_stripe_lock);
+
+    if (dead) {
+        unlink(dead->tmp_path);
+        free_upload(dead);
+    }
+    if (failed) {
+        STAT_ADD(conn->reactor, uploads_failed, 1);
+        session_reply(conn, conn->stream_id, PROTO_STATUS_IO_ERROR, "UPLOAD_FAILED: Another stripe of this upload failed.");
+        return;
+    }
+    if (!complete) {
+        snprintf(reply, sizeof(reply), "STRIPE_OK %.1f MiB/s", stripe_rate);
+        session_reply(conn, conn->stream_id, PROTO_STATUS_OK, reply);
+        return;
+    }
+
+    // Last stripe in: nobody else references the upload any more
+    snprintf(final_path, sizeof(final_path), "%s/%s", UPLOAD_DIR, upload->name);
+    if (conn->reactor->config->durable) {
+        int fd = open(upload->tmp_path, O_WRONLY | O_CLOEXEC);
+        if (fd == -1) {
+            // Without a descriptor the file cannot be flushed, so it is not acknowledged
+            snprintf(log_buf, sizeof(log_buf), "Failed to reopen '%s' for the commit: %s", upload->tmp_path, strerror(errno));
+            log_error(log_buf);
+            unlink(upload->tmp_path);
+            STAT_ADD(conn->reactor, uploads_failed, 1);
+            session_reply(conn, conn->stream_id, PROTO_STATUS_IO_ERROR, "UPLOAD_FAILED: Could not write file.");
+            free_upload(upload);
+            return;
+        }
+        snprintf(log_buf, sizeof(log_buf), "Striped upload %016llx: all %u stripes of '%s' received, committing.",
+                 (unsigned long long)upload->id, upload->stripe_count, upload->name);
+        log_info(log_buf);
+        commit_submit(conn, conn->stream_id, fd, upload->tmp_path, final_path, upload->name, upload->size, upload->start_ns);
+        free_upload(upload);
+        return;
+    }
+    if (rename(upload->tmp_path, final_path) == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Failed to move '%s' to '%s': %s", upload->tmp_path, final_path, strerror(errno));
+        log_error(log_buf);
+        unlink(upload->tmp_path);
+        STAT_ADD(conn->reactor, uploads_failed, 1);
+        session_reply(conn, conn->stream_id, PROTO_STATUS_IO_ERROR, "UPLOAD_FAILED: Could not write file.");
+        free_upload(upload);
+        return;
+    }
+    dedup_forget(upload->name);
+    metrics_upload_ok(conn->reactor, upload->size, upload->start_ns);
+
+    snprintf(log_buf, sizeof(log_buf), "Striped upload %016llx: file '%s' (%llu bytes, %u stripes) saved to '%s', %.1f MiB/s overall.",
+             (unsigned long long)upload->id, upload->name, (unsigned long long)upload->size, upload->stripe_count,
+             final_path, mib_per_sec(upload->size, now - upload->start_ns));
+    log_info(log_buf);
+    session_reply(conn, conn->stream_id, PROTO_STATUS_OK, "UPLOAD_SUCCESS");
+    free_upload(upload);
+}
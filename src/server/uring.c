@@ -0,0 +1,763 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "include/uring.h"
+#include "include/session.h"
+#include "include/ingest.h"
+
+typedef enum {
+    OP_ACCEPT,
+    OP_READ,       // READ_FIXED of upload payload into a registered buffer
+    OP_WRITE,      // WRITE_FIXED of that buffer into the upload file
+    OP_POLL_IN,    // command state: wait for the next message
+    OP_POLL_OUT,   // pending response output
+    OP_TIMEOUT,    // periodic wakeup so g_shutdown is noticed
+    OP_PACE,       // one-shot wakeup when a session parked by a rate cap may read again
+    OP_WAKE,       // the worker's wake eventfd became readable
+    OP_CANCEL,     // draining: cancel one of the armed accepts
+} uring_op_t;
+
+typedef struct uring_req {
+    uring_op_t op;
+    conn_t *conn;
+    int buf;                      // registered buffer index, -1 if none
+    unsigned seq;                 // OP_READ: position in the connection's read chain
+    int res;                      // OP_READ: result kept until the read is delivered
+    size_t len;                   // OP_READ: bytes requested / OP_WRITE: bytes left
+    size_t buf_off;               // OP_WRITE: progress inside the buffer
+    long file_off;                // OP_WRITE: where the remaining bytes go
+    int written;                  // OP_WRITE: 1 written, -1 failed, waiting for the writes before it
+    struct uring_req *next_write; // OP_WRITE: the next payload write of the connection
+    struct sockaddr_in addr;      // OP_ACCEPT
+    socklen_t addr_len;
+    struct __kernel_timespec ts;  // OP_TIMEOUT
+    struct uring_req *next_free;
+    struct uring_req *next_all;
+} uring_req_t;
+
+typedef struct uring {
+    int fd;
+    reactor_t *reactor;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;       // SQEs filled locally, published on enter
+    unsigned pending;             // filled but not yet submitted
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring_mem;
+    size_t ring_size;
+    size_t sqes_size;
+
+    char *buf_mem;
+    int free_bufs[URING_BUF_COUNT];
+    int free_buf_count;
+    int starved;                  // a connection is waiting for a buffer
+    int pacing;                   // an OP_PACE timeout is armed
+    uring_req_t *accepts[URING_ACCEPTS]; // armed accepts, cancelled when the loop drains
+
+    uring_req_t *free_reqs;
+    uring_req_t *all_reqs;
+} uring_t;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Check that the kernel implements every opcode the loop relies on
+static int ring_probe(int fd) {
+    static const int needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+        IORING_OP_POLL_ADD, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL,
+    };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe) return -1;
+
+    int ok = sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok ? 0 : -1;
+}
+
+static void ring_teardown(uring_t *ring) {
+    if (ring->fd != -1) close(ring->fd);   // cancels whatever is still in flight
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->ring_mem) munmap(ring->ring_mem, ring->ring_size);
+    if (ring->buf_mem) munmap(ring->buf_mem, (size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    while (ring->all_reqs) {
+        uring_req_t *req = ring->all_reqs;
+        ring->all_reqs = req->next_all;
+        free(req);
+    }
+}
+
+static int ring_setup(uring_t *ring, reactor_t *reactor) {
+    char log_buf[SMALL_BUF_SIZE];
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    ring->reactor = reactor;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;
+    ring->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ring->fd == -1) {
+        snprintf(log_buf, sizeof(log_buf), "io_uring_setup failed: %s", strerror(errno));
+        log_error(log_buf);
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) || ring_probe(ring->fd) == -1) {
+        log_error("io_uring is too old for this server (needs single mmap, nodrop and accept/fixed I/O opcodes).");
+        ring_teardown(ring);
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_mem = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_mem == MAP_FAILED) {
+        ring->ring_mem = NULL;
+        log_error("Failed to map io_uring rings.");
+        ring_teardown(ring);
+        return -1;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        log_error("Failed to map io_uring submission entries.");
+        ring_teardown(ring);
+        return -1;
+    }
+
+    char *base = ring->ring_mem;
+    ring->sq_head = (unsigned *)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(base + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(base + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+    // Payload buffers are registered once so the kernel skips page pinning per request
+    ring->buf_mem = mmap(NULL, (size_t)URING_BUF_COUNT * URING_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_mem == MAP_FAILED) {
+        ring->buf_mem = NULL;
+        log_error("Failed to allocate io_uring buffers.");
+        ring_teardown(ring);
+        return -1;
+    }
+    struct iovec iov[URING_BUF_COUNT];
+    for (int i = 0; i < URING_BUF_COUNT; i++) {
+        iov[i].iov_base = ring->buf_mem + (size_t)i * URING_BUF_SIZE;
+        iov[i].iov_len = URING_BUF_SIZE;
+        ring->free_bufs[i] = URING_BUF_COUNT - 1 - i;
+    }
+    ring->free_buf_count = URING_BUF_COUNT;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, URING_BUF_COUNT) == -1) {
+        snprintf(log_buf, sizeof(log_buf), "io_uring buffer registration failed: %s", strerror(errno));
+        log_error(log_buf);
+        ring_teardown(ring);
+        return -1;
+    }
+    return 0;
+}
+
+static uring_req_t *req_get(uring_t *ring, uring_op_t op, conn_t *conn) {
+    uring_req_t *req = ring->free_reqs;
+    if (req) {
+        ring->free_reqs = req->next_free;
+    } else {
+        req = malloc(sizeof(*req));
+        if (!req) return NULL;
+        req->next_all = ring->all_reqs;
+        ring->all_reqs = req;
+    }
+    uring_req_t *next_all = req->next_all;
+    memset(req, 0, sizeof(*req));
+    req->next_all = next_all;
+    req->op = op;
+    req->conn = conn;
+    req->buf = -1;
+    return req;
+}
+
+static void req_put(uring_t *ring, uring_req_t *req) {
+    if (req->buf != -1) {
+        ring->free_bufs[ring->free_buf_count++] = req->buf;
+        req->buf = -1;
+    }
+    req->next_free = ring->free_reqs;
+    ring->free_reqs = req;
+}
+
+// Publish filled SQEs and optionally wait for completions
+static int ring_enter(uring_t *ring, unsigned min_complete) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    int submitted = sys_io_uring_enter(ring->fd, ring->pending, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0);
+    STAT_ADD(ring->reactor, uring_enters, 1);
+    if (submitted == -1) {
+        return -1;
+    }
+    ring->pending -= (unsigned)submitted;
+    return 0;
+}
+
+// Make sure n SQEs can be filled without an implicit submit in between (keeps link chains whole)
+static int ring_reserve(uring_t *ring, unsigned n) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head + n <= ring->sq_entries) {
+        return 0;
+    }
+    if (ring_enter(ring, 0) == -1) {
+        return -1;
+    }
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return ring->sq_local_tail - head + n <= ring->sq_entries ? 0 : -1;
+}
+
+static struct io_uring_sqe *ring_sqe(uring_t *ring, uring_req_t *req) {
+    if (ring_reserve(ring, 1) == -1) {
+        return NULL;
+    }
+    unsigned idx = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (unsigned long long)(uintptr_t)req;
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+    ring->pending++;
+    if (req->conn) {
+        req->conn->ring.ops++;
+    }
+    return sqe;
+}
+
+// An accept request left the loop: it is no longer one to cancel
+static void accept_forget(uring_t *ring, uring_req_t *req) {
+    for (int i = 0; i < URING_ACCEPTS; i++) {
+        if (ring->accepts[i] == req) ring->accepts[i] = NULL;
+    }
+    req_put(ring, req);
+}
+
+static void submit_accept(uring_t *ring, uring_req_t *req) {
+    req->addr_len = sizeof(req->addr);
+    struct io_uring_sqe *sqe = ring_sqe(ring, req);
+    if (!sqe) {
+        accept_forget(ring, req);
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->reactor->listen_fd;
+    sqe->addr = (unsigned long long)(uintptr_t)&req->addr;
+    sqe->addr2 = (unsigned long long)(uintptr_t)&req->addr_len;
+    // Blocking sockets: a READ on an O_NONBLOCK socket would complete with -EAGAIN instead of waiting
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static void submit_timeout(uring_t *ring, uring_req_t *req, int ms) {
+    req->ts.tv_sec = ms / 1000;
+    req->ts.tv_nsec = (ms % 1000) * 1000000LL;
+    struct io_uring_sqe *sqe = ring_sqe(ring, req);
+    if (!sqe) {
+        if (req->op == OP_PACE) ring->pacing = 0;
+        req_put(ring, req);
+        return;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long long)(uintptr_t)&req->ts;
+    sqe->len = 1;
+}
+
+static void submit_wake(uring_t *ring, uring_req_t *req) {
+    struct io_uring_sqe *sqe = ring_sqe(ring, req);
+    if (!sqe) {
+        req_put(ring, req);
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ring->reactor->wake_fd;
+    sqe->poll32_events = POLLIN;
+}
+
+static int submit_poll(uring_t *ring, conn_t *conn, uring_op_t op) {
+    uring_req_t *req = req_get(ring, op, conn);
+    if (!req) return -1;
+    struct io_uring_sqe *sqe = ring_sqe(ring, req);
+    if (!sqe) {
+        req_put(ring, req);
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = op == OP_POLL_IN ? (POLLIN | POLLRDHUP) : POLLOUT;
+    return 0;
+}
+
+// Retire the finished writes at the front of the connection's queue, moving the upload
+// over the bytes they wrote: conn->received only covers a written prefix of the file,
+// which is what the digest threads read back
+static void retire_writes(uring_t *ring, conn_t *conn) {
+    while (conn->ring.writes && ((uring_req_t *)conn->ring.writes)->written) {
+        uring_req_t *req = conn->ring.writes;
+        conn->ring.writes = req->next_write;
+        if (!conn->ring.writes) conn->ring.writes_tail = NULL;
+        if (req->written == 1 && conn->state == CONN_STATE_RECV_FILE && conn->file_fd != -1) {
+            session_file_advance(conn, req->buf_off);
+        }
+        req_put(ring, req);
+    }
+}
+
+static void submit_write(uring_t *ring, uring_req_t *req) {
+    conn_t *conn = req->conn;
+    struct io_uring_sqe *sqe = ring_sqe(ring, req);
+    if (!sqe) {
+        session_file_failed(conn, "io_uring submission queue exhausted");
+        req->written = -1;
+        retire_writes(ring, conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = conn->file_fd;
+    sqe->addr = (unsigned long long)(uintptr_t)(ring->buf_mem + (size_t)req->buf * URING_BUF_SIZE + req->buf_off);
+    sqe->len = (unsigned)req->len;
+    sqe->off = (unsigned long long)req->file_off;
+    sqe->buf_index = (unsigned short)req->buf;
+}
+
+// Queue a linked chain of payload reads; links make the kernel run them in order
+static void submit_payload_reads(uring_t *ring, conn_t *conn) {
+    size_t remaining = (size_t)(conn->filesize - conn->ring.file_off);
+    unsigned chain = 0;
+    struct io_uring_sqe *prev = NULL;
+
+    if (remaining == 0 || ring_reserve(ring, URING_READ_DEPTH) == -1) {
+        return;
+    }
+    // The chain asks for no more than the session's share; the rest waits for its next turn
+    if (remaining > (size_t)URING_READ_DEPTH * URING_BUF_SIZE) {
+        remaining = (size_t)URING_READ_DEPTH * URING_BUF_SIZE;
+    }
+    remaining = ingest_grant(conn, remaining);
+
+    while (chain < URING_READ_DEPTH && remaining > conn->ring.requested) {
+        if (ring->free_buf_count == 0) {
+            if (chain == 0) {
+                conn->ring.starved = 1;
+                ring->starved = 1;
+            }
+            break;
+        }
+        uring_req_t *req = req_get(ring, OP_READ, conn);
+        if (!req) break;
+        req->buf = ring->free_bufs[--ring->free_buf_count];
+
+        size_t want = remaining - conn->ring.requested;
+        req->len = want > URING_BUF_SIZE ? URING_BUF_SIZE : want;
+        req->seq = conn->ring.seq_next++;
+
+        struct io_uring_sqe *sqe = ring_sqe(ring, req);
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = conn->fd;
+        sqe->addr = (unsigned long long)(uintptr_t)(ring->buf_mem + (size_t)req->buf * URING_BUF_SIZE);
+        sqe->len = (unsigned)req->len;
+        sqe->off = (unsigned long long)-1;   // sockets have no position
+        sqe->buf_index = (unsigned short)req->buf;
+        if (prev) prev->flags |= IOSQE_IO_LINK;
+        prev = sqe;
+
+        conn->ring.requested += req->len;
+        conn->ring.reads++;
+        chain++;
+    }
+}
+
+// Start tearing the session down; conn_pump() frees it once nothing references it
+static void conn_kill(conn_t *conn) {
+    if (!conn->ring.dying) {
+        conn->ring.dying = 1;
+        // Wakes every pending read and poll on the socket so their completions drain
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+}
+
+// Decide what the connection needs next; may free it, so callers must not touch conn afterwards
+static void conn_pump(uring_t *ring, conn_t *conn) {
+    if (conn->state == CONN_STATE_CLOSING && conn->out_len == 0) {
+        conn_kill(conn);
+    }
+    if (conn->ring.dying) {
+        if (conn->ring.ops == 0) {
+            reactor_conn_close(conn);
+        }
+        return;
+    }
+
+    if ((conn->out_len > 0 || conn->state == CONN_STATE_SEND_FILE) && !conn->ring.poll_out) {
+        if (submit_poll(ring, conn, OP_POLL_OUT) == 0) conn->ring.poll_out = 1;
+    }
+    if (conn->ring.reads > 0 || conn->state == CONN_STATE_CLOSING || conn->state == CONN_STATE_SEND_FILE
+        || conn->state == CONN_STATE_COMMIT) {
+        return;
+    }
+
+    // Sealed upload content is read and opened like requests, not through fixed buffers;
+    // a session paused by the buffer pool is polled again once it was resumed, one waiting
+    // for its ingest turn once that comes
+    if (conn->state == CONN_STATE_COMMAND || conn->sec) {
+        if (!conn->ring.poll_in && !conn->buf_wait && !ingest_waiting(conn)) {
+            if (submit_poll(ring, conn, OP_POLL_IN) == 0) conn->ring.poll_in = 1;
+        }
+        return;
+    }
+
+    // CONN_STATE_RECV_FILE
+    if (conn->recv_path == RECV_PATH_NONE) {
+        conn->recv_path = RECV_PATH_URING;
+        conn->ring.file_off = conn->file_base + conn->received;   // content that came with the frame head is already written
+    }
+    conn->ring.starved = 0;
+    if (!ingest_waiting(conn)) {
+        submit_payload_reads(ring, conn);
+    }
+}
+
+// Command state (any state reading input on an encrypted session): read request frames
+// synchronously like the epoll loop does
+static void on_poll_in(conn_t *conn, int res) {
+    if (res < 0) {
+        conn_kill(conn);
+        return;
+    }
+    while (conn->state == CONN_STATE_COMMAND || (conn->sec && conn->state == CONN_STATE_RECV_FILE)) {
+        int rc = conn_read_frames(conn);
+        if (rc == 0) return;
+        if (rc == -1) {
+            conn_kill(conn);
+            return;
+        }
+    }
+}
+
+// Hand one completed read to the file, in the order the reads were queued
+static void deliver_read(uring_t *ring, conn_t *conn, uring_req_t *req) {
+    reactor_t *reactor = ring->reactor;
+
+    if (conn->ring.dying || conn->state != CONN_STATE_RECV_FILE) {
+        req_put(ring, req);
+        return;
+    }
+    if (req->res == -ECANCELED || req->res == -EAGAIN || req->res == -EINTR) {
+        req_put(ring, req);   // an earlier link came up short, nothing was read
+        return;
+    }
+    if (req->res == 0) {
+        log_info("Client disconnected during file transfer.");
+        req_put(ring, req);
+        conn_kill(conn);
+        return;
+    }
+    if (req->res < 0) {
+        log_error("Failed to read upload data from client socket.");
+        req_put(ring, req);
+        conn_kill(conn);
+        return;
+    }
+
+    STAT_ADD(reactor, bytes_in, (unsigned long)req->res);
+    STAT_ADD(reactor, uring_bytes, (unsigned long)req->res);
+    ingest_charge(conn, (size_t)req->res);
+
+    if (conn->file_fd == -1) {
+        // Not written to a file: skipped content of a refused upload, or a dedup upload cut in memory
+        conn->ring.file_off += req->res;
+        session_on_file_data(conn, ring->buf_mem + (size_t)req->buf * URING_BUF_SIZE, (size_t)req->res);
+        req_put(ring, req);
+        return;
+    }
+
+    // Reuse the request and its buffer for the file write, no copy in between
+    req->op = OP_WRITE;
+    req->len = (size_t)req->res;
+    req->buf_off = 0;
+    req->file_off = conn->ring.file_off;
+    req->written = 0;
+    req->next_write = NULL;
+    conn->ring.file_off += req->res;
+    if (conn->ring.writes_tail) ((uring_req_t *)conn->ring.writes_tail)->next_write = req;
+    else conn->ring.writes = req;
+    conn->ring.writes_tail = req;
+    submit_write(ring, req);
+}
+
+static void on_read(uring_t *ring, uring_req_t *req, int res) {
+    conn_t *conn = req->conn;
+    conn->ring.reads--;
+    conn->ring.requested -= req->len;
+    req->res = res;
+    conn->ring.done[req->seq % URING_READ_DEPTH] = req;
+
+    for (;;) {
+        uring_req_t *next = conn->ring.done[conn->ring.seq_done % URING_READ_DEPTH];
+        if (!next || next->seq != conn->ring.seq_done) break;
+        conn->ring.done[conn->ring.seq_done % URING_READ_DEPTH] = NULL;
+        conn->ring.seq_done++;
+        deliver_read(ring, conn, next);
+    }
+}
+
+// Writes of one upload complete in any order; they are retired in file order
+static void on_write(uring_t *ring, uring_req_t *req, int res) {
+    conn_t *conn = req->conn;
+    int upload_alive = conn->state == CONN_STATE_RECV_FILE && conn->file_fd != -1;
+
+    if (res <= 0) {
+        if (upload_alive) session_file_failed(conn, res < 0 ? strerror(-res) : "the file write made no progress");
+        req->written = -1;
+    } else {
+        req->buf_off += (size_t)res;
+        req->file_off += res;
+        req->len -= (size_t)res;
+        if (req->len > 0 && upload_alive) {
+            submit_write(ring, req);
+            return;
+        }
+        req->written = req->len == 0 ? 1 : -1;
+    }
+    retire_writes(ring, conn);
+}
+
+// Give buffers back to connections that ran out of them
+static void wake_starved(uring_t *ring) {
+    ring->starved = 0;
+    for (conn_t *conn = ring->reactor->conns; conn && ring->free_buf_count > 0; ) {
+        conn_t *next = conn->next;
+        if (conn->ring.starved) {
+            conn_pump(ring, conn);
+        }
+        conn = next;
+    }
+}
+
+static void on_completion(uring_t *ring, uring_req_t *req, int res) {
+    reactor_t *reactor = ring->reactor;
+    conn_t *conn = req->conn;
+    char log_buf[SMALL_BUF_SIZE];
+
+    if (conn) {
+        conn->ring.ops--;
+    }
+
+    switch (req->op) {
+        case OP_ACCEPT:
+            if (res >= 0) {
+                conn_t *accepted = reactor_conn_open(reactor, res, &req->addr);
+                if (accepted) conn_pump(ring, accepted);
+            } else if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED && res != -ECANCELED) {
+                snprintf(log_buf, sizeof(log_buf), "Failed to accept client connection: %s", strerror(-res));
+                log_error(log_buf);
+            }
+            if (!g_shutdown && !reactor->drain_deadline_ns) {
+                submit_accept(ring, req);
+            } else {
+                accept_forget(ring, req);
+            }
+            return;
+
+        case OP_CANCEL:
+            req_put(ring, req);
+            return;
+
+        case OP_TIMEOUT:
+            if (!g_shutdown) {
+                submit_timeout(ring, req, REACTOR_TICK_MS);
+            } else {
+                req_put(ring, req);
+            }
+            return;
+
+        case OP_PACE:
+            ring->pacing = 0;
+            req_put(ring, req);
+            return;
+
+        case OP_WAKE:
+            reactor_on_wake(reactor);
+            if (!g_shutdown) {
+                submit_wake(ring, req);
+            } else {
+                req_put(ring, req);
+            }
+            return;
+
+        case OP_POLL_IN:
+            req_put(ring, req);
+            conn->ring.poll_in = 0;
+            on_poll_in(conn, res);
+            break;
+
+        case OP_POLL_OUT: {
+            int sending = conn->state == CONN_STATE_SEND_FILE;
+            req_put(ring, req);
+            conn->ring.poll_out = 0;
+            if (res < 0 || conn_flush(conn) == -1) {
+                conn_kill(conn);
+            } else if (sending && conn->state == CONN_STATE_COMMAND) {
+                session_on_input(conn);   // requests that arrived during the download
+            }
+            break;
+        }
+
+        case OP_READ:
+            on_read(ring, req, res);
+            break;
+
+        case OP_WRITE:
+            on_write(ring, req, res);
+            break;
+    }
+
+    conn_pump(ring, conn);
+}
+
+void uring_conn_resume(conn_t *conn) {
+    conn_pump(conn->reactor->ring, conn);
+}
+
+void uring_stop_accepting(reactor_t *reactor) {
+    uring_t *ring = reactor->ring;
+
+    // An accept that completes before its cancel is served like any other session
+    for (int i = 0; i < URING_ACCEPTS; i++) {
+        if (!ring->accepts[i]) continue;
+        uring_req_t *req = req_get(ring, OP_CANCEL, NULL);
+        if (!req) continue;
+        struct io_uring_sqe *sqe = ring_sqe(ring, req);
+        if (!sqe) {
+            req_put(ring, req);
+            continue;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (unsigned long long)(uintptr_t)ring->accepts[i];
+    }
+}
+
+void uring_conn_close(conn_t *conn) {
+    conn_kill(conn);
+    conn_pump(conn->reactor->ring, conn);
+}
+
+int uring_run(reactor_t *reactor) {
+    uring_t ring;
+    char log_buf[SMALL_BUF_SIZE];
+
+    if (ring_setup(&ring, reactor) == -1) {
+        return URING_UNAVAILABLE;
+    }
+    reactor->ring = &ring;
+
+    for (int i = 0; i < URING_ACCEPTS; i++) {
+        uring_req_t *req = req_get(&ring, OP_ACCEPT, NULL);
+        ring.accepts[i] = req;
+        if (req) submit_accept(&ring, req);
+    }
+    uring_req_t *tick = req_get(&ring, OP_TIMEOUT, NULL);
+    if (tick) submit_timeout(&ring, tick, REACTOR_TICK_MS);
+    uring_req_t *wake = req_get(&ring, OP_WAKE, NULL);
+    if (wake) submit_wake(&ring, wake);
+
+    snprintf(log_buf, sizeof(log_buf), "Worker %d: io_uring backend active (%d x %d KiB registered buffers).", reactor->id, URING_BUF_COUNT, URING_BUF_SIZE / 1024);
+    log_info(log_buf);
+
+    int rc = 0;
+    while (!g_shutdown) {
+        // Sessions parked by a rate cap are picked up when their buckets have refilled
+        int timeout = ingest_timeout_ms(reactor);
+        if (timeout > 0 && timeout < REACTOR_TICK_MS && !ring.pacing) {
+            uring_req_t *pace = req_get(&ring, OP_PACE, NULL);
+            if (pace) {
+                ring.pacing = 1;
+                submit_timeout(&ring, pace, timeout);
+            }
+        }
+        // With sessions queued for their turn only submit, then serve them
+        if (ring_enter(&ring, timeout == 0 ? 0 : 1) == -1) {
+            if (errno == EINTR) continue;
+            log_error("io_uring_enter failed.");
+            log_perror("io_uring_enter");
+            rc = -1;
+            break;
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            uring_req_t *req = (uring_req_t *)(uintptr_t)cqe->user_data;
+            int res = cqe->res;
+            head++;
+            // Release the slot before handling: handlers may submit and wait
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+            on_completion(&ring, req, res);
+            tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        }
+
+        if (ring.starved && ring.free_buf_count > 0) {
+            wake_starved(&ring);
+        }
+
+        // Sessions that used up their quantum take turns with what their sockets still hold
+        for (int visits = 0; visits < INGEST_VISITS; visits++) {
+            conn_t *conn = ingest_next(reactor);
+            if (!conn) break;
+            conn_pump(&ring, conn);
+        }
+
+        if (reactor_drain(reactor)) {
+            break;
+        }
+    }
+
+    // Closing the ring cancels everything in flight; sessions are torn down by reactor_destroy()
+    for (conn_t *conn = reactor->conns; conn; conn = conn->next) {
+        conn->ring.ops = 0;
+    }
+    ring_teardown(&ring);
+    reactor->ring = NULL;
+    return rc;
+}
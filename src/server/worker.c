@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "include/worker.h"
+#include "include/uring.h"
+#include "include/handoff.h"
+
+static void *worker_main(void *arg) {
+    worker_t *worker = arg;
+    char log_buf[SMALL_BUF_SIZE];
+
+    if (worker->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            snprintf(log_buf, sizeof(log_buf), "Worker %d: could not pin to CPU %d, running unpinned.", worker->id, worker->cpu);
+            log_error(log_buf);
+            worker->cpu = -1;
+        }
+    }
+
+    snprintf(log_buf, sizeof(log_buf), "Worker %d started (cpu %d).", worker->id, worker->cpu);
+    log_info(log_buf);
+
+    int rc = URING_UNAVAILABLE;
+    if (worker->reactor.config->backend == BACKEND_URING) {
+        rc = uring_run(&worker->reactor);
+        if (rc == URING_UNAVAILABLE) {
+            snprintf(log_buf, sizeof(log_buf), "Worker %d: io_uring unavailable, falling back to epoll.", worker->id);
+            log_error(log_buf);
+        }
+    }
+    if (rc == URING_UNAVAILABLE) {
+        rc = reactor_run(&worker->reactor);
+    }
+
+    if (rc == -1) {
+        snprintf(log_buf, sizeof(log_buf), "Worker %d: event loop failed, shutting the server down.", worker->id);
+        log_error(log_buf);
+        g_shutdown = 1;
+    }
+    atomic_store(&worker->finished, 1);
+    return NULL;
+}
+
+int workers_start(worker_t *workers, const server_config_t *config) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1) ncpus = 1;
+
+    memset(workers, 0, sizeof(*workers) * (size_t)config->workers);
+
+    // Bind every socket first so a port conflict fails before any thread runs
+    for (int i = 0; i < config->workers; i++) {
+        worker_t *worker = &workers[i];
+        worker->id = i;
+        worker->cpu = config->pin_cpus ? (int)(i % ncpus) : -1;
+
+        int listen_fd = handoff_listen_fd(i);
+        if (listen_fd == -1) {
+            listen_fd = reactor_listen(config);
+        }
+        if (listen_fd == -1) {
+            return -1;
+        }
+        if (reactor_init(&worker->reactor, listen_fd, config) == -1) {
+            close(listen_fd);
+            worker->reactor.config = NULL;
+            return -1;
+        }
+        worker->reactor.id = i;
+    }
+
+    for (int i = 0; i < config->workers; i++) {
+        worker_t *worker = &workers[i];
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            log_error("Failed to start worker thread.");
+            return -1;
+        }
+        worker->started = 1;
+    }
+    return 0;
+}
+
+int workers_finished(worker_t *workers, const server_config_t *config) {
+    for (int i = 0; i < config->workers; i++) {
+        if (workers[i].started && !atomic_load(&workers[i].finished)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void workers_join(worker_t *workers, const server_config_t *config) {
+    for (int i = 0; i < config->workers; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+            workers[i].started = 0;
+        }
+        // Sockets of workers that never started still need closing
+        if (workers[i].reactor.config) {
+            reactor_destroy(&workers[i].reactor);
+            workers[i].reactor.config = NULL;
+        }
+    }
+}
+
+void workers_log_stats(worker_t *workers, const server_config_t *config) {
+    char log_buf[SMALL_BUF_SIZE * 2];
+    unsigned long total_accepted = 0;
+
+    for (int i = 0; i < config->workers; i++) {
+        total_accepted += STAT_GET(&workers[i].reactor, accepted);
+    }
+
+    for (int i = 0; i < config->workers; i++) {
+        reactor_t *reactor = &workers[i].reactor;
+        unsigned long accepted = STAT_GET(reactor, accepted);
+        snprintf(log_buf, sizeof(log_buf),
+                 "Worker %d: accepted %lu (%.1f%%), rejected %lu, active %lu, uploads ok %lu / failed %lu, %lu bytes in, downloads %lu, %lu bytes out",
+                 i, accepted, total_accepted ? 100.0 * accepted / total_accepted : 0.0,
+                 STAT_GET(reactor, rejected), STAT_GET(reactor, active), STAT_GET(reactor, uploads_ok),
+                 STAT_GET(reactor, uploads_failed), STAT_GET(reactor, bytes_in),
+                 STAT_GET(reactor, downloads), STAT_GET(reactor, bytes_out));
+        log_info(log_buf);
+    }
+
+    if (config->session_rate || config->ingest_rate) {
+        unsigned long throttled = 0;
+        for (int i = 0; i < config->workers; i++) {
+            throttled += STAT_GET(&workers[i].reactor, throttled);
+        }
+        snprintf(log_buf, sizeof(log_buf), "Rate caps: %lu reads held back until a bucket refilled", throttled);
+        log_info(log_buf);
+    }
+
+    if (config->backend == BACKEND_URING) {
+        unsigned long enters = 0, bytes = 0;
+        for (int i = 0; i < config->workers; i++) {
+            enters += STAT_GET(&workers[i].reactor, uring_enters);
+            bytes += STAT_GET(&workers[i].reactor, uring_bytes);
+        }
+        snprintf(log_buf, sizeof(log_buf), "io_uring: %lu io_uring_enter() calls for %lu MiB of payload (%.0f per GiB)",
+                 enters, bytes >> 20, bytes ? enters / (bytes / 1073741824.0) : 0.0);
+        log_info(log_buf);
+    }
+
+    if (!config->recv_bench) {
+        return;
+    }
+
+    unsigned long bytes[2] = {0, 0}, cpu_ns[2] = {0, 0};
+    for (int i = 0; i < config->workers; i++) {
+        reactor_t *reactor = &workers[i].reactor;
+        bytes[0] += STAT_GET(reactor, splice_bytes);
+        cpu_ns[0] += STAT_GET(reactor, splice_cpu_ns);
+        bytes[1] += STAT_GET(reactor, copy_bytes);
+        cpu_ns[1] += STAT_GET(reactor, copy_cpu_ns);
+    }
+    // CPU milliseconds per GiB of payload: cpu_ns / 1e6 / (bytes / 2^30)
+    snprintf(log_buf, sizeof(log_buf),
+             "Receive benchmark: splice %.1f CPU ms/GiB over %lu MiB, copy %.1f CPU ms/GiB over %lu MiB",
+             bytes[0] ? cpu_ns[0] / 1e6 / (bytes[0] / 1073741824.0) : 0.0, bytes[0] >> 20,
+             bytes[1] ? cpu_ns[1] / 1e6 / (bytes[1] / 1073741824.0) : 0.0, bytes[1] >> 20);
+    log_info(log_buf);
+}